@@ -584,17 +584,14 @@ private:
 
   void ReadSequential(ThreadState* thread) {
     int bytes = 0;
-    Slice value;
-    for (size_t i = 0; i < reads_; i++) {
-      uint64_t k = i;
-      char key[100];
-      snprintf(key, sizeof(key), "%016ld", k);
-      if (db_->get(key, value)) {
-        bytes += value.size() + strlen(key);
-        value.destroy();
-      }
+    size_t i = 0;
+    Iterator* iter = db_->new_iterator();
+    for (iter->seek_to_first(); i < reads_ && iter->valid(); iter->next()) {
+      bytes += iter->key().size() + iter->value().size();
       thread->stats.FinishedSingleOp();
+      ++i;
     }
+    delete iter;
     thread->stats.AddBytes(bytes);
   }
 
@@ -0,0 +1,43 @@
+# - Try to find LZ4
+# Once done, this will define
+#
+#  LZ4_FOUND - system has LZ4 installed
+#  LZ4_INCLUDE_DIR - the LZ4 include directories
+#  LZ4_LIBRARIES - link these to use LZ4
+#
+# The user may wish to set, in the CMake GUI or otherwise, this variable:
+#  LZ4_DIR - path to start searching for the module
+
+find_path(LZ4_INCLUDE_DIR
+    lz4.h
+    HINTS
+    PATH_SUFFIXES
+    include
+    )
+
+#IF(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .lib .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ELSE(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ENDIF(WIN32)
+
+
+find_library(LZ4_LIBRARY
+    lz4
+    HINTS
+    PATH_SUFFIXES
+    lib
+    )
+
+mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4
+    DEFAULT_MSG
+    LZ4_INCLUDE_DIR
+    LZ4_LIBRARY)
+
+if(LZ4_FOUND)
+    set(LZ4_LIBRARIES "${LZ4_LIBRARY}") # Add any dependencies here
+endif()
+
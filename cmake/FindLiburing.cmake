@@ -0,0 +1,65 @@
+# - Try to find Liburing
+# Once done, this will define
+#
+#  LIBURING_FOUND - system has Liburing installed
+#  LIBURING_INCLUDE_DIR - the Liburing include directories
+#  LIBURING_LIBRARIES - link these to use Liburing
+#
+# Sparse and tagged buffer registration is required, liburing older
+# than 2.2 lacks it and is treated as not found
+#
+# The user may wish to set, in the CMake GUI or otherwise, this variable:
+#  LIBURING_DIR - path to start searching for the module
+
+find_path(LIBURING_INCLUDE_DIR
+    liburing.h
+    HINTS
+    PATH_SUFFIXES
+    include
+    )
+
+#IF(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .lib .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ELSE(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ENDIF(WIN32)
+
+
+find_library(LIBURING_LIBRARY
+    uring
+    HINTS
+    PATH_SUFFIXES
+    lib
+    )
+
+mark_as_advanced(LIBURING_INCLUDE_DIR LIBURING_LIBRARY)
+
+if(LIBURING_INCLUDE_DIR AND LIBURING_LIBRARY)
+    include(CheckSymbolExists)
+    include(CMakePushCheckState)
+    cmake_push_check_state(RESET)
+    set(CMAKE_REQUIRED_INCLUDES ${LIBURING_INCLUDE_DIR})
+    set(CMAKE_REQUIRED_LIBRARIES ${LIBURING_LIBRARY})
+    check_symbol_exists(io_uring_register_buffers_sparse
+        liburing.h LIBURING_HAS_BUFFERS_SPARSE)
+    check_symbol_exists(io_uring_register_buffers_update_tag
+        liburing.h LIBURING_HAS_BUFFERS_UPDATE_TAG)
+    cmake_pop_check_state()
+
+    if(NOT LIBURING_HAS_BUFFERS_SPARSE OR NOT LIBURING_HAS_BUFFERS_UPDATE_TAG)
+        message(STATUS "liburing at ${LIBURING_LIBRARY} is older than 2.2")
+        set(LIBURING_INCLUDE_DIR LIBURING_INCLUDE_DIR-NOTFOUND)
+        set(LIBURING_LIBRARY LIBURING_LIBRARY-NOTFOUND)
+    endif()
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Liburing
+    DEFAULT_MSG
+    LIBURING_INCLUDE_DIR
+    LIBURING_LIBRARY)
+
+if(LIBURING_FOUND)
+    set(LIBURING_LIBRARIES "${LIBURING_LIBRARY}") # Add any dependencies here
+endif()
+
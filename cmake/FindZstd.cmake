@@ -0,0 +1,43 @@
+# - Try to find Zstd
+# Once done, this will define
+#
+#  ZSTD_FOUND - system has Zstd installed
+#  ZSTD_INCLUDE_DIR - the Zstd include directories
+#  ZSTD_LIBRARIES - link these to use Zstd
+#
+# The user may wish to set, in the CMake GUI or otherwise, this variable:
+#  ZSTD_DIR - path to start searching for the module
+
+find_path(ZSTD_INCLUDE_DIR
+    zstd.h
+    HINTS
+    PATH_SUFFIXES
+    include
+    )
+
+#IF(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .lib .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ELSE(WIN32)
+#    SET(CMAKE_FIND_LIBRARY_SUFFIXES .a ${CMAKE_FIND_LIBRARY_SUFFIXES})
+#ENDIF(WIN32)
+
+
+find_library(ZSTD_LIBRARY
+    zstd
+    HINTS
+    PATH_SUFFIXES
+    lib
+    )
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd
+    DEFAULT_MSG
+    ZSTD_INCLUDE_DIR
+    ZSTD_LIBRARY)
+
+if(ZSTD_FOUND)
+    set(ZSTD_LIBRARIES "${ZSTD_LIBRARY}") # Add any dependencies here
+endif()
+
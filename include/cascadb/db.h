@@ -8,35 +8,122 @@
 #include <ostream>
 
 #include "slice.h"
+#include "pinnable_slice.h"
 #include "comparator.h"
+#include "merge_operator.h"
 #include "options.h"
 #include "directory.h"
+#include "iterator.h"
+#include "write_batch.h"
 
 namespace cascadb {
 
-class DB {
-public:
-    virtual ~DB() {}
-
-    static DB* open(const std::string& name, const Options& options);
+// A consistent point-in-time view of table, acquired by
+// Table::get_snapshot() and released by Table::release_snapshot()
+class Snapshot {
+protected:
+    virtual ~Snapshot() {}
+};
 
+// A table is an independent key space inside DB, tables of a DB share
+// the data file, the log files and the cache of DB
+class Table {
+public:
+    // Write with the durability set in options
     virtual bool put(Slice key, Slice value) = 0;
 
+    virtual bool put(Slice key, Slice value, Durability durability) = 0;
+
     virtual bool del(Slice key) = 0;
 
+    virtual bool del(Slice key, Durability durability) = 0;
+
+    // Apply value to the existing one with Options::merge_operator,
+    // without reading it first. Fails if no merge operator is set
+    virtual bool upsert(Slice key, Slice value) = 0;
+
+    virtual bool upsert(Slice key, Slice value, Durability durability) = 0;
+
+    // Delete all keys in [begin, end) with a single write,
+    // covered keys're dropped lazily as it cascades down
+    virtual bool del_range(Slice begin, Slice end) = 0;
+
+    virtual bool del_range(Slice begin, Slice end, Durability durability) = 0;
+
+    // Apply all writes in batch atomically
+    virtual bool write(const WriteBatch& batch) = 0;
+
+    virtual bool write(const WriteBatch& batch, Durability durability) = 0;
+
     virtual bool get(Slice key, Slice& value) = 0;
 
-    inline bool get(Slice key, std::string& value)
+    // Read the latest version written before snapshot is acquired
+    virtual bool get(Slice key, Slice& value, const Snapshot* snapshot) = 0;
+
+    // Values stored in leaves're pinned rather than copied,
+    // see PinnableSlice
+    virtual bool get(Slice key, PinnableSlice& value) = 0;
+
+    virtual bool get(Slice key, PinnableSlice& value, const Snapshot* snapshot) = 0;
+
+    inline bool get(Slice key, std::string& value, const Snapshot* snapshot = NULL)
     {
-        Slice v;
-        if (!get(key, v)) {
+        PinnableSlice v;
+        if (!get(key, v, snapshot)) {
             return false;
         }
         value.assign(v.data(), v.size());
-        v.destroy();
         return true;
     }
 
+    // Create an iterator over the whole table, the iterator
+    // must be deleted before DB is deleted
+    virtual Iterator* new_iterator() = 0;
+
+    // Create an iterator over the view of snapshot,
+    // new_iterator() implicitly iterates over a snapshot taken
+    // at the time iterator is created
+    virtual Iterator* new_iterator(const Snapshot* snapshot) = 0;
+
+    // Acquire a snapshot of current table, writes afterwards're invisible
+    // to reads with the snapshot. Older versions of data're retained
+    // until snapshot is released. A snapshot can only be used with
+    // the table it's acquired from
+    virtual const Snapshot* get_snapshot() = 0;
+
+    virtual void release_snapshot(const Snapshot* snapshot) = 0;
+
+    // Statistics of table, counted since DB is opened, return false
+    // if property is unknown. Properties're
+    //  "cascadb.compressed-msgbufs", "cascadb.skipped-msgbufs",
+    //  "cascadb.compressed-buckets", "cascadb.skipped-buckets":
+    //      number of buffers and buckets written compressed or
+    //      stored raw since they don't compress well
+    //  "cascadb.compress-stats": summary of the above with skip rates
+    virtual bool get_property(const std::string& property, std::string& value) = 0;
+
+protected:
+    virtual ~Table() {}
+};
+
+// Operations inherited from Table're applied to the default table
+class DB : public Table {
+public:
+    virtual ~DB() {}
+
+    static DB* open(const std::string& name, const Options& options);
+
+    // Create a new table with options of DB, return NULL if table
+    // exists already, its name is longer than 64 bytes, or it can't
+    // be recorded in file. Tables're owned by DB and valid until
+    // DB is deleted
+    virtual Table* create_table(const std::string& name) = 0;
+
+    // Return NULL if table doesn't exist
+    virtual Table* open_table(const std::string& name) = 0;
+
+    // Write all dirty nodes out and make a checkpoint,
+    // log files before the checkpoint're deleted
     virtual void flush() = 0;
 
     virtual void debug_print(std::ostream& out) = 0;
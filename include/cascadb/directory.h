@@ -34,7 +34,21 @@ public:
 
 Directory* create_ram_directory();
 
-Directory* create_fs_directory(const std::string& path);
+// Engines of async IO used by file system directory
+enum AIOEngine {
+    kAutoAIO,       // The fastest one available
+    kPosixAIO,      // POSIX AIO in glibc
+    kLinuxAIO,      // Linux native AIO by libaio
+    kURingAIO       // Linux io_uring by liburing
+};
+
+// Engines not built in or not supported by the kernel're
+// skipped in the order above, from the bottom.
+// If sq_poll is set, io_uring submissions're polled by a
+// kernel thread, which saves syscalls but burns a CPU
+Directory* create_fs_directory(const std::string& path,
+                               AIOEngine engine = kAutoAIO,
+                               bool sq_poll = false);
 
 }
 
@@ -55,6 +55,14 @@ struct AIOStatus {
 
 typedef void (*aio_callback_t)(void* context, AIOStatus status);
 
+// A request submitted in batch
+struct AIORequest {
+    uint64_t        offset;
+    Slice           buf;
+    void*           context;
+    aio_callback_t  cb;
+};
+
 class AIOFile {
 public:
     AIOFile() {}
@@ -76,8 +84,25 @@ public:
     // The context parameter will be passed back into callback
     virtual void async_write(uint64_t offset, Slice buf, void* context, aio_callback_t cb) = 0;
 
+    // prepare to write a batch of requests at once, requests adjacent on
+    // disk may be merged into one, callback of each request will be
+    // invoked after it completes.
+    // The default implementation writes them one by one
+    virtual void async_writev(const AIORequest* reqs, size_t n);
+
+    // register a buffer reused by requests, so that it's not mapped
+    // again for each request into it, return false if unsupported
+    virtual bool register_buffer(Slice buf) { return false; }
+
+    virtual void unregister_buffer(Slice buf) {}
+
     virtual void truncate(uint64_t offset) {}
 
+    // flush data of completed writes to disk, even if file is opened
+    // with O_DIRECT, writes may be held in the device cache,
+    // Return true if synced successfully
+    virtual bool sync() { return true; }
+
     virtual void close() = 0;
 
 private:
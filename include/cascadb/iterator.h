@@ -0,0 +1,46 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_ITERATOR_H_
+#define CASCADB_ITERATOR_H_
+
+#include "slice.h"
+
+namespace cascadb {
+
+// Iterate over key value pairs in the order defined by
+// Options::comparator.
+// Slices returned by key() and value() remain valid until
+// the iterator is moved or destroyed.
+class Iterator {
+public:
+    virtual ~Iterator() {}
+
+    // Return true if the iterator is positioned at a key value pair
+    virtual bool valid() = 0;
+
+    // Position at the first key
+    virtual void seek_to_first() = 0;
+
+    // Position at the last key
+    virtual void seek_to_last() = 0;
+
+    // Position at the first key no less than target,
+    // an empty target positions at the first key
+    virtual void seek(Slice target) = 0;
+
+    // Move to the next key, valid() must be true
+    virtual void next() = 0;
+
+    // Move to the previous key, valid() must be true
+    virtual void prev() = 0;
+
+    virtual Slice key() = 0;
+
+    virtual Slice value() = 0;
+};
+
+}
+
+#endif
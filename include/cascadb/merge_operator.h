@@ -0,0 +1,40 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_MERGE_OPERATOR_H_
+#define CASCADB_MERGE_OPERATOR_H_
+
+#include <string>
+
+#include "slice.h"
+
+namespace cascadb {
+
+// Define how upserts're applied to existing values.
+// Upserts're buffered as messages and applied lazily when they
+// meet older versions of the key, while cascading or reading,
+// so the operator should be deterministic and thread safe.
+class MergeOperator {
+public:
+    virtual ~MergeOperator() {}
+
+    // Apply operand to the existing value of key,
+    // existing is NULL if key doesn't exist.
+    // Result should not be empty
+    virtual void merge(const Slice& key, const Slice* existing,
+                       const Slice& operand, std::string& result) const = 0;
+
+    // Combine two operands of key into one, which has the same
+    // effect as applying older and newer in turn.
+    // Return false if they can't be combined, then both're kept
+    virtual bool combine(const Slice& key, const Slice& older,
+                         const Slice& newer, std::string& result) const
+    {
+        return false;
+    }
+};
+
+}
+
+#endif
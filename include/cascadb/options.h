@@ -7,15 +7,30 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <map>
+#include <string>
 
 namespace cascadb {
 
 class Directory;
 class Comparator;
+class MergeOperator;
 
 enum Compress {
-    kNoCompress,   // No compression
-    kSnappyCompress  // Google's Snappy, used in leveldb
+    kNoCompress,     // No compression
+    kSnappyCompress, // Google's Snappy, used in leveldb
+    kLZ4Compress,    // LZ4, fastest to compress and decompress
+    kZstdCompress,   // Zstandard, better ratio, dictionary supported
+    kDefaultCompress // Follow Options::compress
+};
+
+// How durable a write is when it returns
+enum Durability {
+    kNoDurability,          // logged in background, the latest writes
+                            // may be lost if process crashes
+    kBufferedDurability,    // logged into OS buffer, survives process crash
+                            // but not OS crash or power failure
+    kSyncedDurability       // logged and synced to disk
 };
 
 class Options {
@@ -24,6 +39,7 @@ public:
     Options() {
         dir = NULL;
         comparator = NULL;
+        merge_operator = NULL;
 
         inner_node_page_size = 4<<20;       // 4M, bigger inner node improve write performance
                                             // but degrade read performance
@@ -39,16 +55,28 @@ public:
                                             // you should NOT use it
         leaf_node_record_count = -1;        // unlimited by default, leaved for writing unit test,
                                             // you should NOT use it
+        cascade_threads = 1;                // full buffers're cascaded in background
+        cascade_stall_factor = 2;           // writers wait at twice the page size of root
         cache_limit = 512 << 20;            // 512M, it's best to be set twice of the total size of inner nodes
         cache_dirty_high_watermark = 30;    // 30%
         cache_dirty_expire = 60000;         // 1 minute
         cache_writeback_ratio = 1;          // 1%
         cache_writeback_interval = 100;     // 100ms
+        cache_writeback_threads = 1;        // more threads serialize and compress
+                                            // dirty nodes in parallel
         cache_evict_ratio = 1;              // 1%
         cache_evict_high_watermark = 95;    //95%
 
         compress = kNoCompress;
+        inner_node_compress = kDefaultCompress;
+        leaf_node_compress = kDefaultCompress;
+        compress_max_ratio = 90;            // 90%
         check_crc = false;
+        buffer_pool_limit = 64 << 20;       // 64M
+
+        durability = kNoDurability;         // writes're logged in background
+        log_flush_interval = 10;            // 10ms
+        log_checkpoint_size = 64 << 20;     // 64M
     }
 
     /******************************
@@ -61,6 +89,9 @@ public:
     // Key comparator
     Comparator *comparator;
 
+    // Apply upserts to existing values, upsert is disabled if NULL
+    MergeOperator *merge_operator;
+
     /******************************
         Buffered BTree Parameters
     ******************************/
@@ -85,6 +116,15 @@ public:
     // For writing testcase
     size_t leaf_node_record_count;
 
+    // How many threads cascade full buffers of inner nodes to children,
+    // they're shared by all tables of a DB. 0 to cascade in writer threads
+    unsigned int cascade_threads;
+
+    // When root grows larger than this times of inner_node_page_size
+    // (or inner_node_msg_count), writers stall until cascade threads
+    // catch up
+    unsigned int cascade_stall_factor;
+
     /******************************
              Cache Parameters
     ******************************/
@@ -108,6 +148,10 @@ public:
     // in milliseconds
     unsigned int cache_writeback_interval;
 
+    // How many threads serialize and compress dirty nodes being written,
+    // the flusher thread or the thread making checkpoint is one of them
+    unsigned int cache_writeback_threads;
+
     // How many last used clean nodes're replaced out in a turn,
     // in percentage * 100
     unsigned int cache_evict_ratio;
@@ -120,9 +164,50 @@ public:
             Layout Parameters
     ********************************/
 
+    // Codec of both inner and leaf nodes, codecs not built in're
+    // replaced with kNoCompress. It's recorded with each compressed
+    // buffer and bucket, so it can be changed between opens
     Compress compress;
 
+    // Codec of inner nodes, e.g. LZ4 since they're hot
+    Compress inner_node_compress;
+
+    // Codec of leaf nodes, e.g. Zstd since ratio matters more
+    Compress leaf_node_compress;
+
+    // Zstd dictionaries trained on samples of data of each table,
+    // e.g. with `zstd --train`, indexed by table name, "" for the default
+    // table. Small buckets compress much better with a dictionary.
+    // The same dictionary should be given each time the DB is opened
+    std::map<std::string, std::string> compress_dictionaries;
+
+    // Msgbufs and buckets compressed to more than this percentage of
+    // their length're stored raw, and read without decompression.
+    // Large ones're sampled first, so already compressed data costs
+    // little CPU to detect
+    unsigned int compress_max_ratio;
+
     bool check_crc;
+
+    // Maximum size of idle IO buffers kept for reuse in a DB file,
+    // shared by all its tables, in bytes
+    size_t buffer_pool_limit;
+
+    /********************************
+              WAL Parameters
+    ********************************/
+
+    // Default durability of writes,
+    // can be overridden for each write
+    Durability durability;
+
+    // How often writes without durability're written to log,
+    // in milliseconds
+    unsigned int log_flush_interval;
+
+    // When log file grows larger than this, make a checkpoint
+    // so that older log files can be deleted, in bytes
+    size_t log_checkpoint_size;
 };
 
 }
@@ -0,0 +1,103 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_PINNABLE_SLICE_H_
+#define CASCADB_PINNABLE_SLICE_H_
+
+#include <string>
+
+#include "slice.h"
+
+namespace cascadb {
+
+// Value returned by reads, it references data pinned inside DB
+// without copying, or holds a copy of its own.
+// Pinned data stays valid until the value is reset or destroyed,
+// which should happen before DB is deleted. Don't hold it for long,
+// values replaced meanwhile can't be freed until it's released
+class PinnableSlice {
+public:
+    typedef void (*Releaser)(void *owner, uint64_t token);
+
+    PinnableSlice()
+    : owned_(false), releaser_(NULL), owner_(NULL), token_(0)
+    {
+    }
+
+    ~PinnableSlice() { reset(); }
+
+    const char* data() const { return slice_.data(); }
+
+    size_t size() const { return slice_.size(); }
+
+    bool empty() const { return slice_.empty(); }
+
+    const Slice& slice() const { return slice_; }
+
+    std::string to_string() const { return slice_.to_string(); }
+
+    bool pinned() const { return releaser_ != NULL; }
+
+    // Reference data valid until releaser is called with owner and token
+    void pin(Slice data, Releaser releaser, void *owner, uint64_t token)
+    {
+        reset();
+        slice_ = data;
+        releaser_ = releaser;
+        owner_ = owner;
+        token_ = token;
+    }
+
+    // Take over data allocated by Slice::alloc()
+    void own(Slice data)
+    {
+        reset();
+        slice_ = data;
+        owned_ = true;
+    }
+
+    // Return data owned by caller and reset,
+    // pinned data is copied
+    Slice detach()
+    {
+        Slice s;
+        if (owned_) {
+            s = slice_;
+            owned_ = false;
+        } else if (slice_.size()) {
+            s = slice_.clone();
+        }
+        reset();
+        return s;
+    }
+
+    void reset()
+    {
+        if (owned_) {
+            if (slice_.size()) {
+                slice_.destroy();
+            }
+            owned_ = false;
+        }
+        if (releaser_) {
+            releaser_(owner_, token_);
+            releaser_ = NULL;
+        }
+        slice_.clear();
+    }
+
+private:
+    PinnableSlice(const PinnableSlice&);
+    PinnableSlice& operator =(const PinnableSlice&);
+
+    Slice       slice_;
+    bool        owned_;
+    Releaser    releaser_;
+    void        *owner_;
+    uint64_t    token_;
+};
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_WRITE_BATCH_H_
+#define CASCADB_WRITE_BATCH_H_
+
+#include <assert.h>
+#include <string>
+#include <vector>
+
+#include "slice.h"
+
+namespace cascadb {
+
+// A batch of writes applied atomically by DB::write,
+// readers see either none or all of them.
+// Keys and values're copied into the batch, if a key is written
+// more than once, writes take effect in order.
+class WriteBatch {
+public:
+    enum OpType {
+        kPut,
+        kDel,
+        kUpsert
+    };
+
+    void put(Slice key, Slice value)
+    {
+        add(kPut, key, value);
+    }
+
+    void upsert(Slice key, Slice value)
+    {
+        add(kUpsert, key, value);
+    }
+
+    void del(Slice key)
+    {
+        Op op;
+        op.type = kDel;
+        op.key_offset = rep_.size();
+        op.key_size = key.size();
+        op.value_offset = rep_.size();
+        op.value_size = 0;
+        rep_.append(key.data(), key.size());
+        ops_.push_back(op);
+    }
+
+    void clear()
+    {
+        rep_.clear();
+        ops_.clear();
+    }
+
+    // Return the number of writes in batch
+    size_t count() const
+    {
+        return ops_.size();
+    }
+
+    OpType type(size_t idx) const
+    {
+        assert(idx < ops_.size());
+        return ops_[idx].type;
+    }
+
+    // Slices returned remain valid until the batch is modified
+    Slice key(size_t idx) const
+    {
+        assert(idx < ops_.size());
+        return Slice(rep_.data() + ops_[idx].key_offset, ops_[idx].key_size);
+    }
+
+    Slice value(size_t idx) const
+    {
+        assert(idx < ops_.size());
+        return Slice(rep_.data() + ops_[idx].value_offset, ops_[idx].value_size);
+    }
+
+private:
+    void add(OpType type, Slice key, Slice value)
+    {
+        Op op;
+        op.type = type;
+        op.key_offset = rep_.size();
+        op.key_size = key.size();
+        rep_.append(key.data(), key.size());
+        op.value_offset = rep_.size();
+        op.value_size = value.size();
+        rep_.append(value.data(), value.size());
+        ops_.push_back(op);
+    }
+
+    struct Op {
+        OpType  type;
+        size_t  key_offset;
+        size_t  key_size;
+        size_t  value_offset;
+        size_t  value_size;
+    };
+
+    // keys and values're stored contiguously
+    std::string         rep_;
+    std::vector<Op>     ops_;
+};
+
+}
+
+#endif
@@ -19,27 +19,28 @@ static void* flusher_main(void *arg)
     return NULL;
 }
 
-class LRUComparator {
-public:
-    bool operator() (Node* x, Node* y)
-    {
-        return x->get_last_used_timestamp() < y->get_last_used_timestamp();
-    }
-};
-
-class FirstWriteComparator {
-public:
-    bool operator() (Node* x, Node* y)
-    {
-        return x->get_first_write_timestamp() < y->get_first_write_timestamp();
-    }
-};
+static void* writer_main(void *arg)
+{
+    Cache *cache = (Cache*) arg;
+    cache->write_nodes();
+    return NULL;
+}
 
 Cache::Cache(const Options& options)
 : options_(options), 
+  next_tid_(0),
   size_(0),
+  dirty_queue_(&size_),
+  evict_shard_(0),
   alive_(false),
-  flusher_(NULL)
+  flusher_(NULL),
+  writer_cond_(&writer_mtx_),
+  group_cond_(&writer_mtx_),
+  writers_alive_(false),
+  flush_cond_(&flush_mtx_),
+  written_(0),
+  flusher_cond_(&flush_mtx_),
+  room_waiters_(0)
 {
 }
 
@@ -50,12 +51,29 @@ Cache::~Cache()
         flusher_->join();
         delete flusher_;
     }
+
+    ScopedMutex lock(&writer_mtx_);
+    writers_alive_ = false;
+    writer_cond_.notify_all();
+    lock.unlock();
+    for (size_t i = 0; i < writers_.size(); i++) {
+        writers_[i]->join();
+        delete writers_[i];
+    }
 }
 
 bool Cache::init()
 {
     assert(!alive_);
 
+    // the submitter is a writer too
+    writers_alive_ = true;
+    for (size_t i = 1; i < options_.cache_writeback_threads; i++) {
+        Thread *writer = new Thread(writer_main);
+        writer->start(this);
+        writers_.push_back(writer);
+    }
+
     alive_ = true;
     flusher_ = new Thread(flusher_main);
     if (flusher_) {
@@ -67,10 +85,11 @@ bool Cache::init()
     return false;
 }
 
-bool Cache::add_table(const std::string& tbn, NodeFactory *factory, Layout *layout)
+bool Cache::add_table(const std::string& tbn, NodeFactory *factory, Layout *layout,
+                      uint32_t& tid, bool checkpoint)
 {
     tables_lock_.write_lock();
-    if (tables_.find(tbn) != tables_.end()) {
+    if (table_ids_.find(tbn) != table_ids_.end()) {
         tables_lock_.unlock();
         LOG_ERROR("table " << tbn << " already registered in cache");
         return false;
@@ -79,17 +98,22 @@ bool Cache::add_table(const std::string& tbn, NodeFactory *factory, Layout *layo
     TableSettings tbs;
     tbs.factory = factory;
     tbs.layout = layout;
+    tbs.checkpoint = checkpoint;
     tbs.last_checkpoint_time = now();
 
-    tables_[tbn] = tbs;
+    // ids're not reused, nodes of a deleted table never hit
+    tid = next_tid_ ++;
+    tables_[tid] = tbs;
+    table_ids_[tbn] = tid;
     tables_lock_.unlock();
     return true;
 }
 
-void Cache::flush_table(const std::string& tbn)
+void Cache::write_table(const std::string& tbn)
 {
+    uint32_t tid;
     TableSettings tbs;
-    if(!get_table_settings(tbn, tbs)) {
+    if(!get_table_id(tbn, tid) || !get_table_settings(tid, tbs)) {
         assert(false);
     }
 
@@ -100,42 +124,89 @@ void Cache::flush_table(const std::string& tbn)
 
     ScopedMutex global_lock(&global_mtx_);
 
-    nodes_lock_.write_lock();
-    for(map<CacheKey, Node*>::iterator it = nodes_.begin();
-        it != nodes_.end(); it++ ) {
-        if (it->first.tbn  == tbn) {
-            Node *node = it->second;
-            if (node->is_dead()) {
-                zombies.push_back(node);
-                nodes_.erase(it);
-            } else {
-                size_t sz = node->size();
-                // TODO: flush all node
-                if (node->is_dirty() && !node->is_flushing() && node->pin() == 0) {
-                    node->write_lock();
-                    node->set_flushing(true);
+    for (size_t i = 0; i < CACHE_SHARD_NUM; i++) {
+        Shard& sd = shards_[i];
+        sd.lock.write_lock();
+        EntryList::iterator it = sd.entries.begin();
+        while (it != sd.entries.end()) {
+            if (it->key.tid == tid) {
+                Node *node = it->node;
+                if (node->is_dead()) {
+                    zombies.push_back(node);
+                    it = unlink_node(sd, it);
+                    continue;
+                } else if (node->is_dirty() || node->is_flushing()) {
+                    // keep node in cache until it's written
+                    node->inc_ref();
                     dirty_nodes.push_back(node);
-                    dirty_size += sz;
                 }
             }
+            it ++;
         }
+        sd.lock.unlock();
     }
-    nodes_lock_.unlock();
 
-    if (dirty_nodes.size()) {
-        LOG_INFO("flush table " << tbn << ", write " << dirty_nodes.size() << " nodes, "
+    // nodes're locked one by one rather than inside shard locks,
+    // otherwise we'd deadlock with readers waiting for shard locks
+    // while holding node locks.
+    // Nodes in group stay locked until they're serialized, so never
+    // block on a node lock while holding them
+    WriteGroup group;
+    size_t written_count = 0;
+    for (size_t i = 0; i < dirty_nodes.size(); i++) {
+        Node *node = dirty_nodes[i];
+
+        if (!node->try_write_lock()) {
+            wait_group(group);
+            node->write_lock();
+        }
+        // node might be modified again after the last write began,
+        // wait for it so that writes to the same block're ordered
+        while (node->is_flushing()) {
+            node->unlock();
+            flush_mtx_.lock();
+            while (node->is_flushing()) {
+                flush_cond_.wait();
+            }
+            flush_mtx_.unlock();
+            node->write_lock();
+        }
+
+        if (node->is_dirty() && !node->is_dead()) {
+            dirty_size += node->size();
+            written_count ++;
+            node->set_flushing(true);
+            submit_node(group, node, layout);
+        } else {
+            node->unlock();
+        }
+    }
+    wait_group(group);
+
+    for (size_t i = 0; i < dirty_nodes.size(); i++) {
+        dirty_nodes[i]->dec_ref();
+    }
+
+    if (written_count) {
+        LOG_INFO("flush table " << tbn << ", write " << written_count << " nodes, "
             << dirty_size << " bytes total");
-        flush_nodes(dirty_nodes);
     }
 
     if (zombies.size()) {
         LOG_INFO("flush table " << tbn << ", delete " << zombies.size() << " nodes");
         delete_nodes(zombies);
     }
+}
 
-    global_lock.unlock();
+void Cache::flush_table(const std::string& tbn)
+{
+    TableSettings tbs;
+    if(!get_table_settings(tbn, tbs)) {
+        assert(false);
+    }
 
-    layout->flush();
+    write_table(tbn);
+    tbs.layout->flush();
 }
 
 void Cache::del_table(const std::string& tbn, bool flush)
@@ -145,94 +216,81 @@ void Cache::del_table(const std::string& tbn, bool flush)
     }
 
     tables_lock_.write_lock();
-    map<string, TableSettings>::iterator it = tables_.find(tbn);
-    if (it == tables_.end()) {
+    map<string, uint32_t>::iterator it = table_ids_.find(tbn);
+    if (it == table_ids_.end()) {
         tables_lock_.unlock();
         return;
     }
-    tables_.erase(it);
+    uint32_t tid = it->second;
+    tables_.erase(tid);
+    table_ids_.erase(it);
     tables_lock_.unlock();
 
     size_t total_count = 0;
 
     ScopedMutex global_lock(&global_mtx_);
 
-    nodes_lock_.write_lock();
-    // TODO: improve me
-    for(map<CacheKey, Node*>::iterator it = nodes_.begin();
-        it != nodes_.end(); it++ ) {
-        if (it->first.tbn  == tbn) {
-            Node *node = it->second;
-            assert(node->ref() == 0);
-            delete node;
-            
-            nodes_.erase(it);
-            total_count ++;
+    for (size_t i = 0; i < CACHE_SHARD_NUM; i++) {
+        Shard& sd = shards_[i];
+        sd.lock.write_lock();
+        EntryList::iterator it = sd.entries.begin();
+        while (it != sd.entries.end()) {
+            if (it->key.tid == tid) {
+                Node *node = it->node;
+                assert(node->ref() == 0);
+                delete node;
+
+                it = unlink_node(sd, it);
+                total_count ++;
+            } else {
+                it ++;
+            }
         }
+        sd.lock.unlock();
     }
-    nodes_lock_.unlock();
 
     global_lock.unlock();
 
     LOG_INFO("release " << total_count << " nodes in table " << tbn);
 }
 
-void Cache::put(const std::string& tbn, bid_t nid, Node* node)
+void Cache::put(uint32_t tid, bid_t nid, Node* node)
 {
     assert(node->ref() == 0);
 
-    CacheKey key(tbn, nid);
-    TableSettings tbs;
-    if (!get_table_settings(tbn, tbs)) {
-        assert(false);
-    }
+    CacheKey key(tid, nid);
 
-    if (must_evict()) {
-        while (true) {
-            evict();
-            if (!must_evict()) {
-                break;
-            }
-            usleep(1000); // give up 1 millisecond
-        }
-    }
+    make_room();
 
-    nodes_lock_.write_lock();
-    assert(nodes_.find(key) == nodes_.end());
-    nodes_[key] = node;
+    Shard& sd = shard(key);
+    sd.lock.write_lock();
+    link_node(sd, key, node);
     node->inc_ref();
-    nodes_lock_.unlock();
+    sd.lock.unlock();
 }
 
-Node* Cache::get(const std::string& tbn, bid_t nid, bool skeleton_only)
+Node* Cache::get(uint32_t tid, bid_t nid, bool skeleton_only)
 {
-    CacheKey key(tbn, nid);
+    CacheKey key(tid, nid);
     Node *node;
 
-    TableSettings tbs;
-    if (!get_table_settings(tbn, tbs)) {
-        assert(false);
-    }
-
-    nodes_lock_.read_lock();
-    map<CacheKey, Node*>::iterator it = nodes_.find(key);
-    if (it != nodes_.end()) {
-        node = it->second;
+    Shard& sd = shard(key);
+    sd.lock.read_lock();
+    NodeMap::iterator it = sd.nodes.find(key);
+    if (it != sd.nodes.end()) {
+        node = it->second->node;
         node->inc_ref();
-        nodes_lock_.unlock();
+        sd.lock.unlock();
         return node;
     }
-    nodes_lock_.unlock();
+    sd.lock.unlock();
 
-    if (must_evict()) {
-        while (true) {
-            evict();
-            if (!must_evict()) {
-                break;
-            }
-            usleep(1000); // give up 1 millisecond
-        }
+    TableSettings tbs;
+    if (!get_table_settings(tid, tbs)) {
+        assert(false);
     }
+
+    make_room();
     
     Block* block = tbs.layout->read(nid, skeleton_only);
     if (block == NULL) return NULL;
@@ -244,25 +302,40 @@ Node* Cache::get(const std::string& tbn, bid_t nid, bool skeleton_only)
     }
     tbs.layout->destroy(block);
     
-    nodes_lock_.write_lock();
-    it = nodes_.find(key);
-    if (it != nodes_.end()) {
+    sd.lock.write_lock();
+    it = sd.nodes.find(key);
+    if (it != sd.nodes.end()) {
         LOG_WARN("detect multiple threads're loading node " << nid << " concurrently");
         delete node;
-        node = it->second;
-    } else {
-        nodes_[key] = node;
+        node = it->second->node;
+        node->inc_ref();
+        sd.lock.unlock();
+        return node;
     }
+    link_node(sd, key, node);
     node->inc_ref();
-    nodes_lock_.unlock();
+    sd.lock.unlock();
 
     return node;
 }
 
-bool Cache::get_table_settings(const std::string& tbn, TableSettings& tbs)
+bool Cache::get_table_id(const std::string& tbn, uint32_t& tid)
+{
+    tables_lock_.read_lock();
+    map<string, uint32_t>::iterator it = table_ids_.find(tbn);
+    if (it != table_ids_.end()) {
+        tid = it->second;
+        tables_lock_.unlock();
+        return true;
+    }
+    tables_lock_.unlock();
+    return false;
+}
+
+bool Cache::get_table_settings(uint32_t tid, TableSettings& tbs)
 {
     tables_lock_.read_lock();
-    map<string, TableSettings>::iterator it = tables_.find(tbn);
+    map<uint32_t, TableSettings>::iterator it = tables_.find(tid);
     if (it != tables_.end()) {
         tbs = it->second;
         tables_lock_.unlock();
@@ -272,231 +345,219 @@ bool Cache::get_table_settings(const std::string& tbn, TableSettings& tbs)
     return false;
 }
 
+bool Cache::get_table_settings(const std::string& tbn, TableSettings& tbs)
+{
+    uint32_t tid;
+    return get_table_id(tbn, tid) && get_table_settings(tid, tbs);
+}
+
 void Cache::update_last_checkpoint_time(const std::string& tbn, Time t)
 {
     tables_lock_.write_lock();
-    map<string, TableSettings>::iterator it = tables_.find(tbn);
-    if (it != tables_.end()) {
-        it->second.last_checkpoint_time = t;
+    map<string, uint32_t>::iterator it = table_ids_.find(tbn);
+    if (it != table_ids_.end()) {
+        tables_[it->second].last_checkpoint_time = t;
     }
     tables_lock_.unlock();
 }
 
-bool Cache::must_evict()
+void Cache::make_room()
 {
-    ScopedMutex lock(&size_mtx_);
+    // caller might hold locks of dirty nodes, which can't be evicted
+    // until they're written out, so don't wait for room here,
+    // it's waited by wait_for_room before any node is locked
+    if (must_evict()) {
+        evict();
+    }
+}
+
+void Cache::wait_for_room()
+{
+    while (must_evict()) {
+        flush_mtx_.lock();
+        uint64_t written = written_;
+        flush_mtx_.unlock();
+
+        size_t size = size_.get();
+        evict();
+        if (size_.get() < size) {
+            continue;
+        }
+        if (dirty_queue_.size() == 0) {
+            break;
+        }
 
-    return size_ >= options_.cache_limit;
+        // the flusher writes dirty nodes out once cache is full,
+        // they're evicted as soon as they're clean. Room might be
+        // made by others as well, so give up 1 millisecond at most
+        flush_mtx_.lock();
+        if (written_ == written) {
+            room_waiters_ ++;
+            flusher_cond_.notify();
+            flush_cond_.wait(1);
+            room_waiters_ --;
+        }
+        flush_mtx_.unlock();
+    }
 }
 
-bool Cache::need_evict()
+bool Cache::must_evict()
 {
-    ScopedMutex lock(&size_mtx_);
+    return size_.get() >= options_.cache_limit;
+}
 
+bool Cache::need_evict()
+{
     size_t threshold = (options_.cache_limit * 
         options_.cache_evict_high_watermark) / 100;
 
-    return size_ > threshold;
+    return size_.get() > threshold;
 }
 
 void Cache::evict()
 {
-    size_t total_size = 0;
-    size_t total_count = 0;
-
-    size_t active_size = 0;
-    size_t active_count = 0;
-
-    size_t dirty_size = 0;
-    size_t dirty_count = 0;
-
-    size_t flushing_size = 0;
-    size_t flushing_count = 0;
+    size_t goal = (options_.cache_limit * options_.cache_evict_ratio)/100;
+    // every shard takes a share, starting from where the last one ends
+    size_t share = goal / CACHE_SHARD_NUM + 1;
 
-    size_t clean_size = 0;
-    size_t clean_count = 0;
+    size_t start = evict_shard_.add(1) % CACHE_SHARD_NUM;
 
     vector<Node*> zombies;
-    vector<Node*> clean_nodes;
-
-    nodes_lock_.write_lock();
-
-    for(map<CacheKey, Node*>::iterator it = nodes_.begin();
-        it != nodes_.end(); it++ ) {
+    size_t evicted_size = 0;
 
-        Node *node = it->second;
-        assert(node->nid() == it->first.nid);
+    for (size_t i = 0; i < CACHE_SHARD_NUM && evicted_size < goal; i++) {
+        Shard& sd = shards_[(start + i) % CACHE_SHARD_NUM];
+        sd.lock.write_lock();
+        evicted_size += evict_shard(sd, share, zombies);
+        sd.lock.unlock();
+    }
 
-        if (node->is_dead()) {
-            if (node->ref() == 0) {
-                zombies.push_back(node);
-                nodes_.erase(it);
-            }
-        } else {
-            size_t size = node->size();
+    // clear zombies
+    if (zombies.size()) {
+        delete_nodes(zombies);
+    }
 
-            total_size += size;
-            total_count ++;
+#ifdef DEBUG_CACHE
+    LOG_TRACE("Evict " << evicted_size << " bytes, "
+        << "Delete " << zombies.size() << " zombie nodes");
+#endif
+}
 
-            if (node->ref()) {
-                active_size += size;
-                active_count ++;
-            }
+size_t Cache::evict_shard(Shard& sd, size_t goal, vector<Node*>& zombies)
+{
+    size_t evicted_size = 0;
+    size_t steps = sd.entries.size() * 2;
 
-            if (node->is_dirty()) {
-                dirty_size += size;
-                dirty_count ++;
-            }
+    while (evicted_size < goal && steps > 0 && !sd.entries.empty()) {
+        steps --;
+        if (sd.hand == sd.entries.end()) {
+            sd.hand = sd.entries.begin();
+        }
 
-            if (node->is_flushing()) {
-                flushing_size += size;
-                flushing_count ++;
-            }
+        Node *node = sd.hand->node;
+        assert(node->nid() == sd.hand->key.nid);
 
-            // check everything again after ensure reference is 0
-            if (node->ref() == 0 && !node->is_dead() 
-                    && !node->is_dirty() && !node->is_flushing()) {
-                clean_size += size;
-                clean_count ++;
-                clean_nodes.push_back(node);
-            }
+        // nodes can only be referenced through the shard, which is locked,
+        // or picked from the dirty queue by writeback
+        if (node->ref() || node->is_flushing()) {
+            sd.hand ++;
+            continue;
         }
-    }
-
-    ScopedMutex size_lock(&size_mtx_);
-    // update size
-    size_ = total_size;
-    size_lock.unlock();
-    
-    LRUComparator comp;
-    sort(clean_nodes.begin(), clean_nodes.end(), comp);
 
-    size_t goal = (options_.cache_limit * options_.cache_evict_ratio)/100;
-    size_t evicted_size = 0;
-    size_t evicted_count = 0;
-    
-    for(size_t i = 0; i < clean_nodes.size(); i++) {
-        if (evicted_size >= goal) break;
+        // size might change without being marked dirty,
+        // e.g. buffers of node're loaded after skeleton
+        size_t size = node->memory_usage();
+        dirty_queue_.charge(node, size);
+
+        // charge waits for the dirty queue, a pick that has seen
+        // the node alive may have referenced it meanwhile. Later
+        // picks skip it, since it's either dead or not queued
+        if (node->ref()) {
+            sd.hand ++;
+            continue;
+        }
 
-        Node *node = clean_nodes[i];
+        if (node->is_dead()) {
+            zombies.push_back(node);
+            sd.hand = unlink_node(sd, sd.hand);
+            continue;
+        }
 
-        // reference counting should keep zero when node map is locked,
-        // so nobody outside the cache can modify this node,
-        // so it is impossible to be flushed out
-        assert(node->ref() == 0 && !node->is_dirty() && !node->is_flushing());
+        if (node->is_dirty()) {
+            sd.hand ++;
+            continue;
+        }
 
-        // one and only one node is erased
-        if (nodes_.erase(CacheKey(node->table_name(), node->nid())) != 1) {
-            assert(false);
+        // second chance
+        if (node->clear_referenced()) {
+            sd.hand ++;
+            continue;
         }
 
-        evicted_size += node->size();
-        evicted_count ++;
+        evicted_size += size;
+        sd.hand = unlink_node(sd, sd.hand);
         delete node;
     }
+    return evicted_size;
+}
 
-    size_lock.lock();
-    // update size
-    assert(size_ >= evicted_size);
-    size_ -= evicted_size;
-    size_lock.unlock();
-
-    nodes_lock_.unlock();
+void Cache::link_node(Shard& sd, const CacheKey& key, Node *node)
+{
+    assert(sd.nodes.find(key) == sd.nodes.end());
+    sd.nodes[key] = sd.entries.insert(sd.hand, CacheEntry(key, node));
+    node->set_dirty_queue(&dirty_queue_);
+}
 
-    // clear zombies
-    if (zombies.size()) {
-        delete_nodes(zombies);
+Cache::EntryList::iterator Cache::unlink_node(Shard& sd, EntryList::iterator it)
+{
+    sd.nodes.erase(it->key);
+    EntryList::iterator next = sd.entries.erase(it);
+    if (sd.hand == it) {
+        sd.hand = next;
     }
-
-#ifdef DEBUG_CACHE
-    LOG_TRACE("Total " << total_count << " nodes (" 
-        << total_size << " bytes), " 
-        << active_count << " active nodes ("
-        << active_size << " bytes), "
-        << dirty_count << " dirty nodes ("
-        << dirty_size << " bytes), "
-        << flushing_count << " flushing nodes ("
-        << flushing_size << " bytes), "
-        << clean_count << " clean nodes ("
-        << clean_size << " bytes), "
-        << "Evict " << evicted_count << " nodes ("
-        << evicted_size << " bytes), "
-        << "Delete " << zombies.size() << " zombie nodes");
-#endif
+    return next;
 }
 
 void Cache::write_back()
 {
     while(alive_) {
-        Time current = now();
-        FirstWriteComparator comparator;
         size_t goal = (options_.cache_limit * 
             options_.cache_writeback_ratio)/100;
 
-        size_t total_size = 0;
-        size_t total_count = 0;
-
-        size_t active_size = 0;
-        size_t active_count = 0;
-
-        size_t dirty_size = 0;
-        size_t dirty_count = 0;
-
-        vector<Node*> expired_nodes;
-        size_t expired_size = 0;
-
-        nodes_lock_.read_lock();
-        for(map<CacheKey, Node*>::iterator it = nodes_.begin();
-            it != nodes_.end(); it++ ) {
-            Node *node = it->second;
-
-            if (!node->is_dead()) {
-                size_t sz = node->size();
-
-                total_size += sz;
-                total_count ++;
-                if (node->ref()) {
-                    active_size += sz;
-                    active_count ++;
-                }
-
-                if (node->is_dirty()) {
-                    dirty_size += sz;
-                    dirty_count ++;
-
-                    bool expired = interval_us(node->get_first_write_timestamp(),
-                        current) > options_.cache_dirty_expire * 1000;
-
-                    // do not write node until last write is completed
-                    if ( expired && !node->is_flushing() && node->pin() == 0) {
-                        expired_nodes.push_back(node);
-                        expired_size += sz;
-                    }
-                }
-            }
+        // nodes modified for the first time before this're expired
+        uint64_t expire = coarse_now_micros() -
+            (uint64_t)options_.cache_dirty_expire * 1000;
+
+        // flush more dirty pages than the expired ones
+        size_t dirty_size = dirty_queue_.size();
+        bool all = dirty_size >= (options_.cache_limit *
+            options_.cache_dirty_high_watermark)/100;
+
+        // dirty nodes can't be evicted, write enough of them out
+        // to get below high watermark, writers wait for room
+        // once cache is full
+        size_t size = size_.get();
+        size_t threshold = (options_.cache_limit *
+            options_.cache_evict_high_watermark) / 100;
+        if (size > threshold) {
+            all = true;
+            goal = max(goal, size - threshold);
         }
 
-        ScopedMutex size_lock(&size_mtx_);
-        // update size
-        size_ = total_size;
-        size_lock.unlock();
-
-        nodes_lock_.unlock();
+        vector<Node*> picked_nodes;
+        dirty_queue_.pick(expire, all, goal, picked_nodes);
 
         vector<Node*> flushed_nodes;
         size_t flushed_size = 0;
 
-        sort(expired_nodes.begin(), expired_nodes.end(), comparator);
-
-        for (size_t i = 0; i < expired_nodes.size(); i++ ) {
-            if (flushed_size >= goal) break;
-
-            Node *node = expired_nodes[i];
+        for (size_t i = 0; i < picked_nodes.size(); i++ ) {
+            Node *node = picked_nodes[i];
 
             // set write lock on node
             if (node->try_write_lock()) {
-                // check again
-                if (node->pin() == 0 && !node->is_dead()) {
+                // check again, it might be written by write_table
+                if (node->pin() == 0 && !node->is_dead() &&
+                    node->is_dirty() && !node->is_flushing()) {
                     node->set_flushing(true);
                     flushed_nodes.push_back(node);
                     flushed_size += node->size();
@@ -506,65 +567,37 @@ void Cache::write_back()
             }
         }
 
-        // need to flush more dirty pages
-        if ((dirty_size - flushed_size) >= (options_.cache_limit * 
-            options_.cache_dirty_high_watermark)/100 && flushed_size < goal) {
-
-            vector<Node*> candidates;
-
-            nodes_lock_.read_lock();
-            for (map<CacheKey, Node*>::iterator it = nodes_.begin();
-                it != nodes_.end(); it++ ) {
-                Node *node = it->second;
-
-                if (node->is_dirty() && node->pin() == 0 
-                    && !node->is_flushing() && !node->is_dead()) {
-                    candidates.push_back(node);
-                }
-            }
-            nodes_lock_.unlock();
-
-            sort(candidates.begin(), candidates.end(), comparator);
-
-            for (size_t i = 0; i < candidates.size(); i++ ) {
-                if (flushed_size >= goal) break;
-
-                Node *node = candidates[i];
-
-                // set write lock on node
-                if (node->try_write_lock()) {
-                    // check again
-                    if (node->pin() == 0 && !node->is_dead()) {
-                        node->set_flushing(true);
-                        flushed_nodes.push_back(node);
-                        flushed_size += node->size();
-                    } else {
-                        node->unlock();
-                    }
-                }
-            }
-        }
-        
         // flush
         if (flushed_nodes.size()) {
             flush_nodes(flushed_nodes);
         }
 
+        for (size_t i = 0; i < picked_nodes.size(); i++ ) {
+            picked_nodes[i]->dec_ref();
+        }
+
 #ifdef DEBUG_CACHE        
-        LOG_TRACE("Total " << total_count << " nodes (" 
-            << total_size << " bytes), " 
-            << active_count << " active nodes ("
-            << active_size << " bytes), "
-            << dirty_count << " dirty nodes ("
+        LOG_TRACE("Total " << size_.get() << " bytes, "
+            << dirty_queue_.count() << " dirty nodes ("
             << dirty_size << " bytes), "
             << "Flush " << flushed_nodes.size() << " nodes ("
             << flushed_size << " bytes)");
 #endif
         if (need_evict()) {
+            size = size_.get();
             evict();
-        } else {
-            usleep(options_.cache_writeback_interval * 1000);
+            // go on unless nothing can be evicted
+            // before nodes being written're done
+            if (size_.get() < size) {
+                continue;
+            }
         }
+
+        // nodes might be locked by others, retry soon
+        // if there're threads waiting for room
+        flush_mtx_.lock();
+        flusher_cond_.wait(room_waiters_ ? 1 : options_.cache_writeback_interval);
+        flush_mtx_.unlock();
     }
 }
 
@@ -573,44 +606,19 @@ void Cache::flush_nodes(vector<Node*>& nodes)
     LOG_TRACE("flush " << nodes.size() << " nodes");
     set<string> tables;
 
+    WriteGroup group;
     for (size_t i = 0 ; i < nodes.size(); i++) {
         Node* node = nodes[i];
-        bid_t nid = node->nid();
-
-        // TODO: test node is write locked
 
         TableSettings tbs;
         if (!get_table_settings(node->table_name(), tbs)) {
             assert(false);
         }
-        Layout *layout = tbs.layout;
-        assert(layout);
-
-        size_t estimated_buffer_size = node->estimated_buffer_size();
-        Block *block = layout->create(estimated_buffer_size);
-        assert(block);
-        
-        size_t skeleton_size;
-        BlockWriter writer(block);
-        if (!node->write_to(writer, skeleton_size)) {
-            assert(false);
-        }
-        assert(estimated_buffer_size >= block->size());
-        block->buffer().resize(PAGE_ROUND_UP(block->size()));
-        node->set_dirty(false);
-
-        // unlock node
-        node->unlock();
-        
-        WriteCompleteContext *context = new WriteCompleteContext();
-        context->node = node;
-        context->layout = layout;
-        context->block = block;
-        Callback *cb = new Callback(this, &Cache::write_complete, context);
-        layout->async_write(nid, block, skeleton_size, cb);
-
         tables.insert(node->table_name());
+
+        submit_node(group, node, tbs.layout);
     }
+    wait_group(group);
 
     Time current = now();
     for (set<string>::iterator it = tables.begin(); it != tables.end(); it++) {
@@ -620,7 +628,8 @@ void Cache::flush_nodes(vector<Node*>& nodes)
         }
 
         // 1 minute
-        if (interval_us(tbs.last_checkpoint_time, current) >= 60 * 1000000) {
+        if (tbs.checkpoint &&
+            interval_us(tbs.last_checkpoint_time, current) >= 60 * 1000000) {
             LOG_INFO("make checkpoint at table " << *it);
             tbs.layout->flush_meta();
             tbs.layout->truncate();
@@ -629,6 +638,126 @@ void Cache::flush_nodes(vector<Node*>& nodes)
     }
 }
 
+void Cache::serialize_node(WriteTask& task)
+{
+    Node *node = task.node;
+    Layout *layout = task.layout;
+    assert(layout);
+
+    // TODO: test node is write locked
+
+    size_t estimated_buffer_size = node->estimated_buffer_size();
+    Block *block = layout->create(estimated_buffer_size);
+    assert(block);
+
+    BlockWriter writer(block);
+    if (!node->write_to(writer, task.skeleton_size)) {
+        assert(false);
+    }
+    assert(estimated_buffer_size >= block->size());
+    block->buffer().resize(PAGE_ROUND_UP(block->size()));
+    node->set_dirty(false);
+
+    task.block = block;
+}
+
+BlockWrite Cache::prepare_write(WriteTask& task)
+{
+    Node *node = task.node;
+
+    BlockWrite write;
+    write.bid = node->nid();
+    write.block = task.block;
+    write.skeleton_size = task.skeleton_size;
+
+    // unlock node
+    node->unlock();
+
+    WriteCompleteContext *context = new WriteCompleteContext();
+    context->node = node;
+    context->layout = task.layout;
+    context->block = task.block;
+    write.cb = new Callback(this, &Cache::write_complete, context);
+    return write;
+}
+
+void Cache::submit_node(WriteGroup& group, Node *node, Layout *layout)
+{
+    WriteTask task;
+    task.node = node;
+    task.layout = layout;
+    task.group = &group;
+    task.block = NULL;
+    task.skeleton_size = 0;
+    group.tasks.push_back(task);
+
+    if (writers_.empty()) {
+        serialize_node(group.tasks.back());
+        return;
+    }
+
+    ScopedMutex lock(&writer_mtx_);
+    group.pending ++;
+    write_tasks_.push_back(&group.tasks.back());
+    writer_cond_.notify();
+}
+
+void Cache::wait_group(WriteGroup& group)
+{
+    ScopedMutex lock(&writer_mtx_);
+    while (group.pending) {
+        if (write_tasks_.empty()) {
+            group_cond_.wait();
+            continue;
+        }
+
+        // help writers, task might belong to other groups
+        WriteTask *task = write_tasks_.front();
+        write_tasks_.pop_front();
+        lock.unlock();
+        serialize_node(*task);
+        lock.lock();
+        if (-- task->group->pending == 0) {
+            group_cond_.notify_all();
+        }
+    }
+    lock.unlock();
+
+    map<Layout*, vector<BlockWrite> > writes;
+    for (list<WriteTask>::iterator it = group.tasks.begin();
+        it != group.tasks.end(); it++) {
+        writes[it->layout].push_back(prepare_write(*it));
+    }
+    group.tasks.clear();
+
+    for (map<Layout*, vector<BlockWrite> >::iterator it = writes.begin();
+        it != writes.end(); it++) {
+        it->first->async_write(it->second);
+    }
+}
+
+void Cache::write_nodes()
+{
+    ScopedMutex lock(&writer_mtx_);
+    while (true) {
+        while (writers_alive_ && write_tasks_.empty()) {
+            writer_cond_.wait();
+        }
+        if (write_tasks_.empty()) {
+            break;
+        }
+
+        WriteTask *task = write_tasks_.front();
+        write_tasks_.pop_front();
+        lock.unlock();
+        serialize_node(*task);
+        lock.lock();
+        if (-- task->group->pending == 0) {
+            group_cond_.notify_all();
+        }
+    }
+}
+
 void Cache::write_complete(WriteCompleteContext* context, bool succ)
 {
     Node *node = context->node;
@@ -645,7 +774,13 @@ void Cache::write_complete(WriteCompleteContext* context, bool succ)
         // TODO: handle the error
     }
 
+    // cleared under flush_mtx_ so that waiters can't miss it
+    flush_mtx_.lock();
     node->set_flushing(false);
+    written_ ++;
+    flush_cond_.notify_all();
+    flush_mtx_.unlock();
+
     layout->destroy(block);
     delete context;
 }
@@ -690,36 +825,37 @@ void Cache::debug_print(std::ostream& out)
     size_t clean_size = 0;
     size_t clean_count = 0;
 
-    nodes_lock_.read_lock();
-
-    for(map<CacheKey, Node*>::iterator it = nodes_.begin();
-        it != nodes_.end(); it++ ) {
-        Node *node = it->second;
-        if (!node->is_dead()) {
-            size_t size = node->size();
+    for (size_t i = 0; i < CACHE_SHARD_NUM; i++) {
+        Shard& sd = shards_[i];
+        sd.lock.read_lock();
+        for(EntryList::iterator it = sd.entries.begin();
+            it != sd.entries.end(); it++ ) {
+            Node *node = it->node;
+            if (!node->is_dead()) {
+                size_t size = node->size();
 
-            total_size += size;
-            total_count ++;
-            if (node->ref()) {
-                active_size += size;
-                active_count ++;
-            }
+                total_size += size;
+                total_count ++;
+                if (node->ref()) {
+                    active_size += size;
+                    active_count ++;
+                }
 
-            if (node->is_dirty()) {
-                dirty_size += size;
-                dirty_count ++;
-            } else if (node->is_flushing()) {
-                flushing_size += size;
-                flushing_count ++;
-            } else {
-                clean_size += size;
-                clean_count ++;
+                if (node->is_dirty()) {
+                    dirty_size += size;
+                    dirty_count ++;
+                } else if (node->is_flushing()) {
+                    flushing_size += size;
+                    flushing_count ++;
+                } else {
+                    clean_size += size;
+                    clean_count ++;
+                }
             }
         }
+        sd.lock.unlock();
     }
 
-    nodes_lock_.unlock();
-
     out << "### Dump Cache ###" << endl;
     out << "Total " << total_count << " nodes (" 
         << total_size << " bytes), " 
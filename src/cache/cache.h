@@ -11,6 +11,8 @@
 #include "serialize/layout.h"
 #include "sys/sys.h"
 
+#include <deque>
+#include <list>
 #include <map>
 #include <vector>
 
@@ -24,11 +26,18 @@ public:
 
 // Node cache of fixed size
 // When the percentage of dirty nodes reaches the high watermark, or get expired,
-// they're flushed out in the order of timestamp node is modified for the first time.
+// they're flushed out in the order of timestamp node is modified for the first time,
+// dirty nodes're queued in that order so the flusher doesn't scan the cache.
 // A reference count is maintained for each node, When cache is getting almost full,
 // clean nodes would be evicted if their reference count drops to 0.
-// Nodes're evicted in LRU order.
+// Nodes're evicted in CLOCK order, which approximates LRU: a hand sweeps
+// over nodes, nodes used since the hand passed last time're skipped once.
 // Cache can be shared among multiple tables.
+// Nodes're indexed by table id and nid, and partitioned into shards
+// by hash, each shard is protected by its own lock.
+
+#define CACHE_SHARD_BITS    6
+#define CACHE_SHARD_NUM     (1 << CACHE_SHARD_BITS)
 
 class Cache {
 public:
@@ -38,9 +47,17 @@ public:
     
     bool init();
     
-    // Add a table to cache
-    bool add_table(const std::string& tbn, NodeFactory *factory, Layout *layout);
+    // Add a table to cache, nodes of table're accessed with tid.
+    // Meta of layout is flushed every minute by the flusher if checkpoint
+    // is true, otherwise it's left to the owner, e.g. DB with WAL,
+    // which flushes it only when the tree is consistent with the log
+    bool add_table(const std::string& tbn, NodeFactory *factory, Layout *layout,
+                   uint32_t& tid, bool checkpoint = true);
     
+    // Initiate writes of all dirty nodes in a table,
+    // nodes being flushed're waited before written again
+    void write_table(const std::string& tbn);
+
     // Flush all dirty nodes in a table
     void flush_table(const std::string& tbn);
 
@@ -49,30 +66,48 @@ public:
     void del_table(const std::string& tbn, bool flush = true);
     
     // Put newly created node into cache
-    void put(const std::string& tbn, bid_t nid, Node* node);
+    void put(uint32_t tid, bid_t nid, Node* node);
     
     // Acquire node, if node doesn't exist in cache, load it from layout
-    Node* get(const std::string& tbn, bid_t nid, bool skeleton_only);
+    Node* get(uint32_t tid, bid_t nid, bool skeleton_only);
     
+    // Wait until cache is below its limit, dirty nodes taking the room
+    // are waited to be written out and evicted. Called at entry points
+    // of trees, where no node is locked, so that writers and readers
+    // can't grow cache beyond limit. It gives up if there's no dirty
+    // node, the room's taken by nodes referenced then
+    void wait_for_room();
+
     // Write back dirty nodes if any condition satisfied,
     // Sweep out dead nodes
     void write_back();
 
+    // Loop of writer threads in pool
+    void write_nodes();
+
     void debug_print(std::ostream& out);
 
 protected:
     struct TableSettings {
         NodeFactory     *factory;
         Layout          *layout;
+        bool            checkpoint;
         Time            last_checkpoint_time;
     };
 
+    bool get_table_id(const std::string& tbn, uint32_t& tid);
+
+    bool get_table_settings(uint32_t tid, TableSettings& tbs);
+
     bool get_table_settings(const std::string& tbn, TableSettings& tbs);
 
     void update_last_checkpoint_time(const std::string& tbn, Time t);
 
     bool must_evict();
 
+    // Evict nodes if cache is full
+    void make_room();
+
     // Test whether the cache grows larger than high watermark
     bool need_evict();
 
@@ -81,6 +116,41 @@ protected:
 
     void flush_nodes(std::vector<Node*>& nodes);
 
+    struct WriteGroup;
+
+    struct WriteTask {
+        Node            *node;
+        Layout          *layout;
+        WriteGroup      *group;
+        Block           *block;
+        size_t          skeleton_size;
+    };
+
+    // Nodes submitted together to writer threads
+    struct WriteGroup {
+        WriteGroup() : pending(0) {}
+        size_t                  pending;
+        std::list<WriteTask>    tasks;
+    };
+
+    // Serialize a write locked node into task, node is kept locked
+    void serialize_node(WriteTask& task);
+
+    // Unlock the serialized node and prepare to write it out
+    BlockWrite prepare_write(WriteTask& task);
+
+    // Serialize a write locked node by writer threads, nodes're
+    // serialized in the order they're submitted.
+    // Node is serialized directly if there're no writer threads
+    void submit_node(WriteGroup& group, Node *node, Layout *layout);
+
+    // Wait until all nodes in group're serialized, pending tasks're
+    // run by the caller as well, then unlock nodes and write them
+    // out asynchronously, nodes of a table're written in one batch.
+    // Locks're released by the thread taking them, because
+    // pthread rwlocks can't be unlocked by other threads
+    void wait_group(WriteGroup& group);
+
     struct WriteCompleteContext {
         Node            *node;
         Layout          *layout;
@@ -95,32 +165,74 @@ private:
     Options options_;
 
     RWLock tables_lock_;
-    std::map<std::string, TableSettings> tables_;
+    std::map<uint32_t, TableSettings> tables_;
+    std::map<std::string, uint32_t> table_ids_;
+    uint32_t next_tid_;
+
+    // total memory size occupied by nodes, charged by dirty queue
+    Atomic<size_t> size_;
+
+    DirtyQueue dirty_queue_;
 
-    // TODO make me atomic
-    Mutex size_mtx_;
-    // total memory size occupied by nodes,
-    // updated everytime the flusher thread runs
-    size_t size_;   
+    // shard to be swept first in the next evict
+    Atomic<size_t> evict_shard_;
 
     class CacheKey {
     public:
-        CacheKey(const std::string& t, bid_t n): tbn(t), nid(n) {}
+        CacheKey(uint32_t t, bid_t n): tid(t), nid(n) {}
 
         bool operator<(const CacheKey& o) const {
-            int c = tbn.compare(o.tbn);
-            if (c < 0) { return true; }
-            else if (c > 0) { return false; }
-            else { return nid < o.nid; }
+            if (tid != o.tid) { return tid < o.tid; }
+            return nid < o.nid;
         }
-        
-        std::string tbn;
+
+        uint32_t tid;
         bid_t nid;
     };
 
-    RWLock nodes_lock_;
+    struct CacheEntry {
+        CacheEntry(const CacheKey& k, Node *n): key(k), node(n) {}
 
-    std::map<CacheKey, Node*> nodes_;
+        CacheKey    key;
+        Node        *node;
+    };
+
+    // nodes of a shard're linked in a ring swept by the CLOCK hand
+    typedef std::list<CacheEntry> EntryList;
+
+    typedef std::map<CacheKey, EntryList::iterator> NodeMap;
+
+    struct Shard {
+        Shard() : hand(entries.end()) {}
+
+        RWLock              lock;
+        EntryList           entries;
+        // the next entry to be checked by the CLOCK hand
+        EntryList::iterator hand;
+        NodeMap             nodes;
+    };
+
+    // Link node in right behind the hand, so that it's the last one
+    // to be checked. Shard must be write locked
+    void link_node(Shard& sd, const CacheKey& key, Node *node);
+
+    // Unlink node from shard and return the next entry,
+    // shard must be write locked
+    EntryList::iterator unlink_node(Shard& sd, EntryList::iterator it);
+
+    // Sweep shard with the CLOCK hand until goal bytes're evicted
+    // or every node is checked twice, return the size evicted.
+    // Sizes of nodes checked're charged again.
+    // Unreferenced dead nodes met're moved into zombies
+    size_t evict_shard(Shard& sd, size_t goal, std::vector<Node*>& zombies);
+
+    Shard& shard(const CacheKey& key)
+    {
+        uint64_t h = (key.nid ^ ((uint64_t)key.tid << 32)) * 0x9E3779B97F4A7C15ULL;
+        return shards_[h >> (64 - CACHE_SHARD_BITS)];
+    }
+
+    Shard shards_[CACHE_SHARD_NUM];
 
     // ensure there is only one thread is doing evict/flush
     Mutex global_mtx_;
@@ -129,6 +241,26 @@ private:
     // scan nodes not being used,
     // async flush dirty page out
     Thread* flusher_;
+
+    // serialize nodes in parallel
+    std::vector<Thread*> writers_;
+    Mutex writer_mtx_;
+    // notify writers that tasks're submitted
+    CondVar writer_cond_;
+    // notify submitters that tasks're done
+    CondVar group_cond_;
+    std::deque<WriteTask*> write_tasks_;
+    bool writers_alive_;
+
+    // notify threads waiting for nodes to be written
+    Mutex flush_mtx_;
+    CondVar flush_cond_;
+    // nodes written so far, guarded by flush_mtx_
+    uint64_t written_;
+    // wake up the flusher if there're threads waiting for room,
+    // it retries every millisecond until they're all done
+    CondVar flusher_cond_;
+    size_t room_waiters_;
 };
 
 }
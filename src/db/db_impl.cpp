@@ -12,9 +12,38 @@ using namespace cascadb;
     
 #define DAT_FILE_SUFFIX "cdb"
 
+// name of table in cache, separated from the default one
+#define TABLE_NAME_SEPARATOR "/"
+
+static void* checkpointer_main(void *arg)
+{
+    DBImpl *db = (DBImpl*) arg;
+    db->run_checkpoints();
+    return NULL;
+}
+
 DBImpl::~DBImpl()
 {
-    delete tree_;
+    if (checkpointer_) {
+        checkpoint_req_mtx_.lock();
+        checkpointer_alive_ = false;
+        checkpoint_cond_.notify();
+        checkpoint_req_mtx_.unlock();
+
+        checkpointer_->join();
+        delete checkpointer_;
+    }
+
+    // nothing is logged or replayed if log isn't opened
+    if (default_ && wal_ && wal_->is_open()) {
+        checkpoint();
+    }
+    for (map<uint32_t, TableImpl*>::iterator it = tables_.begin();
+        it != tables_.end(); it++) {
+        delete it->second;
+    }
+    delete cascader_;
+    delete wal_;
     delete cache_;
     delete layout_;
     delete file_;
@@ -52,33 +81,396 @@ bool DBImpl::init()
         return false;
     }
 
-    tree_ = new Tree(name_, options_, cache_, layout_);
-    if (!tree_->init()) {
+    wal_ = new WAL(dir, name_, options_);
+
+    // cascade threads're shared by all tables
+    if (options_.cascade_threads > 0) {
+        cascader_ = new Cascader(options_.cascade_threads);
+        cascader_->start();
+    }
+
+    default_ = add_table("", 0);
+    if (!default_) {
         LOG_ERROR("tree init error");
         return false;
     }
 
+    // all tables're opened, logged writes to any of them're replayed
+    map<string, uint32_t> tables;
+    layout_->get_tables(tables);
+    for (map<string, uint32_t>::iterator it = tables.begin();
+        it != tables.end(); it++) {
+        if (!add_table(it->first, it->second)) {
+            LOG_ERROR("init table " << it->first << " error");
+            return false;
+        }
+        table_ids_[it->first] = it->second;
+    }
+
+    if (!recover()) {
+        LOG_ERROR("recover from log error");
+        // no checkpoint in destructor
+        delete wal_;
+        wal_ = NULL;
+        return false;
+    }
+
+    checkpointer_alive_ = true;
+    checkpointer_ = new Thread(checkpointer_main);
+    checkpointer_->start(this);
+    return true;
+}
+
+TableImpl* DBImpl::add_table(const std::string& name, uint32_t id)
+{
+    string tree_name = name.empty() ? name_ : name_ + TABLE_NAME_SEPARATOR + name;
+    Tree *tree = new Tree(tree_name, options_, cache_, layout_, wal_, id, cascader_);
+    TableImpl *table = new TableImpl(this, tree, options_);
+
+    map<string, string>::const_iterator it = options_.compress_dictionaries.find(name);
+    if (it != options_.compress_dictionaries.end()) {
+        tree->set_compress_dictionary(it->second);
+    }
+    if (!tree->init()) {
+        delete table;
+        return NULL;
+    }
+
+    ScopedMutex lock(&tables_mtx_);
+    tables_[id] = table;
+    return table;
+}
+
+Table* DBImpl::create_table(const std::string& name)
+{
+    if (name.empty()) {
+        LOG_ERROR("table name should not be empty");
+        return NULL;
+    }
+    if (name.size() > MAX_TABLE_NAME_LENGTH) {
+        LOG_ERROR("table name " << name << " is too long, at most "
+                  << MAX_TABLE_NAME_LENGTH << " bytes");
+        return NULL;
+    }
+
+    ScopedMutex checkpoint_lock(&checkpoint_mtx_);
+
+    ScopedMutex lock(&tables_mtx_);
+    if (table_ids_.find(name) != table_ids_.end()) {
+        LOG_ERROR("table " << name << " exists");
+        return NULL;
+    }
+    // tables're never dropped, so ids're dense
+    uint32_t id = tables_.size();
+    if (id > MAX_TABLE_ID) {
+        LOG_ERROR("too many tables, at most " << MAX_TABLE_ID);
+        return NULL;
+    }
+    lock.unlock();
+
+    TableImpl *table = add_table(name, id);
+    if (!table) {
+        LOG_ERROR("init table " << name << " error");
+        return NULL;
+    }
+
+    lock.lock();
+    table_ids_[name] = id;
+    lock.unlock();
+
+    // table should be recorded in superblock before any write
+    // to it is logged, otherwise it can't be replayed
+    if (!layout_->set_table(name, id) || !make_checkpoint()) {
+        LOG_ERROR("record table " << name << " error");
+        layout_->remove_table(name);
+        lock.lock();
+        table_ids_.erase(name);
+        tables_.erase(id);
+        lock.unlock();
+        delete table;
+        return NULL;
+    }
+
+    LOG_INFO("create table " << name << ", id " << id);
+    return table;
+}
+
+Table* DBImpl::open_table(const std::string& name)
+{
+    ScopedMutex lock(&tables_mtx_);
+    map<string, uint32_t>::iterator it = table_ids_.find(name);
+    if (it == table_ids_.end()) {
+        return NULL;
+    }
+    return tables_[it->second];
+}
+
+bool DBImpl::recover()
+{
+    uint64_t oldest = layout_->log_number();
+    uint64_t number = oldest;
+    // the newest log file with records was being appended at crash,
+    // empty ones after it're left by an interrupted recovery
+    uint64_t newest = oldest;
+    while (options_.dir->file_exists(wal_->filename(number))) {
+        if (options_.dir->file_length(wal_->filename(number)) > 0) {
+            newest = number;
+        }
+        number ++;
+    }
+    for (uint64_t i = oldest; i < number; i++) {
+        if (!replay(wal_->filename(i), i == newest)) {
+            return false;
+        }
+    }
+
+    // appending to a new file,
+    // the newest replayed one might end with a torn record
+    if (!wal_->init(oldest, number)) {
+        return false;
+    }
+
+    if (number > oldest) {
+        // apply replayed writes and delete replayed log files, it must
+        // succeed before any write, otherwise the torn record'd be
+        // followed by newer ones
+        ScopedMutex lock(&checkpoint_mtx_);
+        if (!make_checkpoint()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DBImpl::replay(const std::string& filename, bool newest)
+{
+    LogReader reader(options_.dir, filename);
+    if (!reader.init()) {
+        return false;
+    }
+
+    size_t count = 0;
+    uint32_t id;
+    vector<Msg> msgs;
+    while (reader.read(id, msgs)) {
+        map<uint32_t, TableImpl*>::iterator it = tables_.find(id);
+        if (it == tables_.end()) {
+            LOG_ERROR("replay to unknown table " << id << " in log file " << filename);
+            for (size_t i = 0; i < msgs.size(); i++) {
+                msgs[i].destroy();
+            }
+            return false;
+        }
+        for (size_t i = 0; i < msgs.size(); i++) {
+            it->second->tree()->replay(msgs[i]);
+            msgs[i].destroy();
+        }
+        count += msgs.size();
+        msgs.clear();
+    }
+
+    if (reader.corrupted() || (reader.torn() && !newest)) {
+        LOG_ERROR("log file " << filename << " is corrupted after "
+            << count << " messages replayed");
+        return false;
+    }
+    if (reader.torn()) {
+        LOG_WARN("ignore torn record at the end of log file " << filename);
+    }
+
+    LOG_INFO("replay " << count << " messages from log file " << filename);
     return true;
 }
 
 bool DBImpl::put(Slice key, Slice value)
 {
-    return tree_->put(key, value);
+    return default_->put(key, value);
+}
+
+bool DBImpl::put(Slice key, Slice value, Durability durability)
+{
+    return default_->put(key, value, durability);
 }
 
 bool DBImpl::del(Slice key)
 {
-    return tree_->del(key);
+    return default_->del(key);
+}
+
+bool DBImpl::del(Slice key, Durability durability)
+{
+    return default_->del(key, durability);
+}
+
+bool DBImpl::upsert(Slice key, Slice value)
+{
+    return default_->upsert(key, value);
+}
+
+bool DBImpl::upsert(Slice key, Slice value, Durability durability)
+{
+    return default_->upsert(key, value, durability);
+}
+
+bool DBImpl::del_range(Slice begin, Slice end)
+{
+    return default_->del_range(begin, end);
+}
+
+bool DBImpl::del_range(Slice begin, Slice end, Durability durability)
+{
+    return default_->del_range(begin, end, durability);
+}
+
+bool DBImpl::write(const WriteBatch& batch)
+{
+    return default_->write(batch);
+}
+
+bool DBImpl::write(const WriteBatch& batch, Durability durability)
+{
+    return default_->write(batch, durability);
 }
 
 bool DBImpl::get(Slice key, Slice& value)
 {
-    return tree_->get(key, value);
+    return default_->get(key, value);
+}
+
+bool DBImpl::get(Slice key, Slice& value, const Snapshot* snapshot)
+{
+    return default_->get(key, value, snapshot);
+}
+
+bool DBImpl::get(Slice key, PinnableSlice& value)
+{
+    return default_->get(key, value);
+}
+
+bool DBImpl::get(Slice key, PinnableSlice& value, const Snapshot* snapshot)
+{
+    return default_->get(key, value, snapshot);
+}
+
+Iterator* DBImpl::new_iterator()
+{
+    return default_->new_iterator();
+}
+
+Iterator* DBImpl::new_iterator(const Snapshot* snapshot)
+{
+    return default_->new_iterator(snapshot);
+}
+
+const Snapshot* DBImpl::get_snapshot()
+{
+    return default_->get_snapshot();
+}
+
+void DBImpl::release_snapshot(const Snapshot* snapshot)
+{
+    default_->release_snapshot(snapshot);
+}
+
+bool DBImpl::get_property(const std::string& property, std::string& value)
+{
+    return default_->get_property(property, value);
 }
 
 void DBImpl::flush()
 {
-    cache_->flush_table(name_);
+    checkpoint();
+}
+
+void DBImpl::maybe_checkpoint()
+{
+    if (!wal_->need_checkpoint()) {
+        return;
+    }
+
+    ScopedMutex lock(&checkpoint_req_mtx_);
+    if (!checkpoint_requested_) {
+        checkpoint_requested_ = true;
+        checkpoint_cond_.notify();
+    }
+}
+
+void DBImpl::run_checkpoints()
+{
+    ScopedMutex lock(&checkpoint_req_mtx_);
+    while (true) {
+        while (checkpointer_alive_ && !checkpoint_requested_) {
+            checkpoint_cond_.wait();
+        }
+        if (!checkpointer_alive_) {
+            break;
+        }
+        checkpoint_requested_ = false;
+        lock.unlock();
+
+        // someone else may have done it
+        if (wal_->need_checkpoint()) {
+            checkpoint();
+        }
+        lock.lock();
+    }
+}
+
+void DBImpl::checkpoint()
+{
+    ScopedMutex lock(&checkpoint_mtx_);
+    make_checkpoint();
+}
+
+bool DBImpl::make_checkpoint()
+{
+    ScopedMutex lock(&tables_mtx_);
+    vector<Tree*> trees;
+    for (map<uint32_t, TableImpl*>::iterator it = tables_.begin();
+        it != tables_.end(); it++) {
+        trees.push_back(it->second->tree());
+    }
+    lock.unlock();
+
+    // nodes written out're referenced only after index is flushed, so
+    // most dirty nodes're written before writers're blocked, and only
+    // those dirtied again meanwhile're left to the blocked window
+    for (size_t i = 0; i < trees.size(); i++) {
+        cache_->write_table(trees[i]->table_name());
+    }
+
+    // writes logged in older files're all applied to trees,
+    // staged ones're merged into nodes and get written out by write_table,
+    // with cascades paused so that nodes written're consistent
+    uint64_t blocked = now_micros();
+    uint64_t number = wal_->begin_checkpoint();
+    if (cascader_) {
+        cascader_->pause();
+    }
+    for (size_t i = 0; i < trees.size(); i++) {
+        trees[i]->merge_staged();
+        cache_->write_table(trees[i]->table_name());
+    }
+
+    // writers and cascades're held until index of the nodes written is
+    // on disk along with the log file to replay from, otherwise index
+    // may point to versions of nodes with writes replayed again
+    layout_->set_log_number(number);
+    bool ret = layout_->flush();
+    if (cascader_) {
+        cascader_->resume();
+    }
+    wal_->end_checkpoint();
+    LOG_INFO("checkpoint to log file " << number << ", writers're blocked for "
+        << (now_micros() - blocked) / 1000 << " ms");
+
+    if (!ret) {
+        LOG_ERROR("flush meta error, keep log files");
+        return false;
+    }
+
+    wal_->purge(number);
+    return true;
 }
 
 void DBImpl::debug_print(std::ostream& out)
@@ -86,6 +478,120 @@ void DBImpl::debug_print(std::ostream& out)
     cache_->debug_print(out);
 }
 
+/********************************************************
+                        TableImpl
+*********************************************************/
+
+TableImpl::~TableImpl()
+{
+    delete tree_;
+}
+
+bool TableImpl::put(Slice key, Slice value)
+{
+    return put(key, value, options_.durability);
+}
+
+bool TableImpl::put(Slice key, Slice value, Durability durability)
+{
+    bool ret = tree_->put(key, value, durability);
+    db_->maybe_checkpoint();
+    return ret;
+}
+
+bool TableImpl::del(Slice key)
+{
+    return del(key, options_.durability);
+}
+
+bool TableImpl::del(Slice key, Durability durability)
+{
+    bool ret = tree_->del(key, durability);
+    db_->maybe_checkpoint();
+    return ret;
+}
+
+bool TableImpl::upsert(Slice key, Slice value)
+{
+    return upsert(key, value, options_.durability);
+}
+
+bool TableImpl::upsert(Slice key, Slice value, Durability durability)
+{
+    bool ret = tree_->upsert(key, value, durability);
+    db_->maybe_checkpoint();
+    return ret;
+}
+
+bool TableImpl::del_range(Slice begin, Slice end)
+{
+    return del_range(begin, end, options_.durability);
+}
+
+bool TableImpl::del_range(Slice begin, Slice end, Durability durability)
+{
+    bool ret = tree_->del_range(begin, end, durability);
+    db_->maybe_checkpoint();
+    return ret;
+}
+
+bool TableImpl::write(const WriteBatch& batch)
+{
+    return write(batch, options_.durability);
+}
+
+bool TableImpl::write(const WriteBatch& batch, Durability durability)
+{
+    bool ret = tree_->write(batch, durability);
+    db_->maybe_checkpoint();
+    return ret;
+}
+
+bool TableImpl::get(Slice key, Slice& value)
+{
+    return tree_->get(key, value);
+}
+
+bool TableImpl::get(Slice key, Slice& value, const Snapshot* snapshot)
+{
+    return tree_->get(key, value, snapshot);
+}
+
+bool TableImpl::get(Slice key, PinnableSlice& value)
+{
+    return tree_->get(key, value);
+}
+
+bool TableImpl::get(Slice key, PinnableSlice& value, const Snapshot* snapshot)
+{
+    return tree_->get(key, value, snapshot);
+}
+
+Iterator* TableImpl::new_iterator()
+{
+    return tree_->new_iterator();
+}
+
+Iterator* TableImpl::new_iterator(const Snapshot* snapshot)
+{
+    return tree_->new_iterator(snapshot);
+}
+
+const Snapshot* TableImpl::get_snapshot()
+{
+    return tree_->get_snapshot();
+}
+
+void TableImpl::release_snapshot(const Snapshot* snapshot)
+{
+    tree_->release_snapshot(snapshot);
+}
+
+bool TableImpl::get_property(const std::string& property, std::string& value)
+{
+    return tree_->get_property(property, value);
+}
+
 DB* cascadb::DB::open(const std::string& name, const Options& options)
 {
     DBImpl* db = new DBImpl(name, options);
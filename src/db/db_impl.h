@@ -5,21 +5,85 @@
 #ifndef CASCADB_DB_IMPL_H_
 #define CASCADB_DB_IMPL_H_
 
+#include <map>
+
 #include "cascadb/db.h"
 #include "serialize/layout.h"
 #include "cache/cache.h"
 #include "tree/tree.h"
+#include "tree/cascader.h"
+#include "wal/wal.h"
 
 namespace cascadb {
 
 class Tree;
+class DBImpl;
+
+class TableImpl : public Table {
+public:
+    TableImpl(DBImpl *db, Tree *tree, const Options& options)
+    : db_(db), tree_(tree), options_(options)
+    {
+    }
+
+    ~TableImpl();
+
+    bool put(Slice key, Slice value);
+
+    bool put(Slice key, Slice value, Durability durability);
+
+    bool del(Slice key);
+
+    bool del(Slice key, Durability durability);
+
+    bool upsert(Slice key, Slice value);
+
+    bool upsert(Slice key, Slice value, Durability durability);
+
+    bool del_range(Slice begin, Slice end);
+
+    bool del_range(Slice begin, Slice end, Durability durability);
+
+    bool write(const WriteBatch& batch);
+
+    bool write(const WriteBatch& batch, Durability durability);
+
+    bool get(Slice key, Slice& value);
+
+    bool get(Slice key, Slice& value, const Snapshot* snapshot);
+
+    bool get(Slice key, PinnableSlice& value);
+
+    bool get(Slice key, PinnableSlice& value, const Snapshot* snapshot);
+
+    Iterator* new_iterator();
+
+    Iterator* new_iterator(const Snapshot* snapshot);
+
+    const Snapshot* get_snapshot();
+
+    void release_snapshot(const Snapshot* snapshot);
+
+    bool get_property(const std::string& property, std::string& value);
+
+    Tree* tree() { return tree_; }
+
+private:
+    DBImpl *db_;
+    Tree *tree_;
+    Options options_;
+};
 
 class DBImpl : public DB {
 public:
     DBImpl(const std::string& name, const Options& options)
     : name_(name), options_(options),
       file_(NULL), layout_(NULL),
-      cache_(NULL), tree_(NULL)
+      cache_(NULL), wal_(NULL), cascader_(NULL), default_(NULL),
+      checkpointer_(NULL),
+      checkpoint_cond_(&checkpoint_req_mtx_),
+      checkpoint_requested_(false),
+      checkpointer_alive_(false)
     {
     }
     
@@ -27,24 +91,105 @@ public:
     
     bool init();
 
+    Table* create_table(const std::string& name);
+
+    Table* open_table(const std::string& name);
+
     bool put(Slice key, Slice value);
+
+    bool put(Slice key, Slice value, Durability durability);
     
     bool del(Slice key);
+
+    bool del(Slice key, Durability durability);
+
+    bool upsert(Slice key, Slice value);
+
+    bool upsert(Slice key, Slice value, Durability durability);
+
+    bool del_range(Slice begin, Slice end);
+
+    bool del_range(Slice begin, Slice end, Durability durability);
+
+    bool write(const WriteBatch& batch);
+
+    bool write(const WriteBatch& batch, Durability durability);
     
     bool get(Slice key, Slice& value);
 
+    bool get(Slice key, Slice& value, const Snapshot* snapshot);
+
+    bool get(Slice key, PinnableSlice& value);
+
+    bool get(Slice key, PinnableSlice& value, const Snapshot* snapshot);
+
+    Iterator* new_iterator();
+
+    Iterator* new_iterator(const Snapshot* snapshot);
+
+    const Snapshot* get_snapshot();
+
+    void release_snapshot(const Snapshot* snapshot);
+
+    bool get_property(const std::string& property, std::string& value);
+
     void flush();
 
     void debug_print(std::ostream& out);
 
+    // Loop of checkpoint thread
+    void run_checkpoints();
+
 private:
+    friend class TableImpl;
+
+    // Create tree of table and add it to tables_,
+    // name is empty for the default table
+    TableImpl* add_table(const std::string& name, uint32_t id);
+
+    // Replay log files written since the last checkpoint
+    bool recover();
+
+    // Replay a log file, only the newest one may end with a torn record
+    bool replay(const std::string& filename, bool newest);
+
+    // Wake up the checkpoint thread if log file grows too large,
+    // so that writers don't pay for checkpoints
+    void maybe_checkpoint();
+
+    // Write all dirty nodes out and record the log file
+    // writes after checkpoint go to in superblock
+    void checkpoint();
+
+    // checkpoint_mtx_ must be held, return false if
+    // superblock isn't flushed
+    bool make_checkpoint();
+
     std::string name_;
     Options options_;
     
     AIOFile *file_;
     Layout *layout_;
     Cache *cache_;
-    Tree* tree_;
+    WAL *wal_;
+    Cascader *cascader_;
+
+    // tables indexed by id, the default table's 0
+    std::map<uint32_t, TableImpl*> tables_;
+    std::map<std::string, uint32_t> table_ids_;
+    TableImpl *default_;
+    Mutex tables_mtx_;
+
+    // only one checkpoint at a time,
+    // acquired before tables_mtx_
+    Mutex checkpoint_mtx_;
+
+    // make checkpoints requested by writers in background
+    Thread *checkpointer_;
+    Mutex checkpoint_req_mtx_;
+    CondVar checkpoint_cond_;
+    bool checkpoint_requested_;
+    bool checkpointer_alive_;
 };
 
 }
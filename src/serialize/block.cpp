@@ -6,6 +6,21 @@
 
 using namespace cascadb;
 
+bool BlockReader::readVarUInt32(uint32_t* v)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        uint8_t byte;
+        if (!readUInt8(&byte)) return false;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *v = result;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool BlockReader::readSlice(Slice& s)
 {
     uint32_t sz;
@@ -20,6 +35,29 @@ bool BlockReader::readSlice(Slice& s)
     return false;
 }
 
+bool BlockReader::readSlice(Slice& s, Arena& arena)
+{
+    uint32_t sz;
+    if (readUInt32(&sz)) {
+        assert(offset_ <= block_->size_);
+        if (offset_ + sz <= block_->size_) {
+            s = arena.copy(Slice(block_->start() + offset_, sz));
+            offset_ += sz;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BlockWriter::writeVarUInt32(uint32_t v)
+{
+    while (v >= 0x80) {
+        if (!writeUInt8((uint8_t)(v | 0x80))) return false;
+        v >>= 7;
+    }
+    return writeUInt8((uint8_t)v);
+}
+
 bool BlockWriter::writeSlice(const Slice& s)
 {
     size_t sz = s.size();
@@ -36,3 +74,18 @@ bool BlockWriter::writeSlice(const Slice& s)
     }
     return false;
 }
+
+bool BlockWriter::writeBytes(const Slice& s)
+{
+    size_t sz = s.size();
+    assert(offset_ <= block_->capacity());
+    if (offset_ + sz <= block_->capacity()) {
+        memcpy((char *)block_->start() + offset_, s.data(), sz);
+        offset_ += sz;
+        if (offset_ > block_->size_) {
+            block_->size_ = offset_;
+        }
+        return true;
+    }
+    return false;
+}
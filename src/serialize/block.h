@@ -11,6 +11,7 @@
 #include <string>
 
 #include "cascadb/slice.h"
+#include "util/arena.h"
 #include "util/bits.h"
 
 namespace cascadb {
@@ -111,7 +112,11 @@ public:
     bool readUInt16(uint16_t* v) { return readUInt(v); }
     bool readUInt32(uint32_t* v) { return readUInt(v); }
     bool readUInt64(uint64_t* v) { return readUInt(v); }
+    // 7 bits a byte, smaller integers take less space
+    bool readVarUInt32(uint32_t* v);
     bool readSlice(Slice & s);
+    // Data is copied into arena instead of being cloned
+    bool readSlice(Slice & s, Arena& arena);
     
 protected:
     template<typename T>
@@ -178,7 +183,10 @@ public:
     bool writeUInt16(uint16_t v) { return writeInt(v); }
     bool writeUInt32(uint32_t v) { return writeInt(v); }
     bool writeUInt64(uint64_t v) { return writeInt(v); }
+    bool writeVarUInt32(uint32_t v);
     bool writeSlice(const Slice &s);
+    // Write data without length
+    bool writeBytes(const Slice &s);
 
 protected:
     template<typename T>
@@ -0,0 +1,150 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stdlib.h>
+
+#include "serialize/buffer_pool.h"
+#include "util/logger.h"
+#include "util/bits.h"
+
+using namespace std;
+using namespace cascadb;
+
+// Return the smallest class holding pages
+static int size_class(size_t pages)
+{
+    int cls = 0;
+    while (((size_t)1 << cls) < pages) {
+        cls ++;
+    }
+    return cls;
+}
+
+BufferPool::BufferPool(AIOFile *aio_file, size_t limit)
+: aio_file_(aio_file),
+  limit_(limit),
+  idle_size_(0),
+  hits_(0),
+  misses_(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    if (used_.size()) {
+        LOG_ERROR(used_.size() << " buffers're still in use");
+    }
+
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        for (size_t j = 0; j < idle_[i].size(); j++) {
+            release(idle_[i][j], PAGE_SIZE << i);
+        }
+        idle_[i].clear();
+    }
+    idle_size_ = 0;
+}
+
+Slice BufferPool::alloc(size_t size)
+{
+    assert(size);
+    size_t rounded_size = PAGE_ROUND_UP(size);
+    int cls = size_class(rounded_size / PAGE_SIZE);
+
+    ScopedMutex lock(&mtx_);
+    if (cls < BUFFER_POOL_CLASSES && idle_[cls].size()) {
+        char *buf = idle_[cls].back();
+        idle_[cls].pop_back();
+        idle_size_ -= PAGE_SIZE << cls;
+        used_[buf] = cls;
+        hits_ ++;
+        return Slice(buf, rounded_size);
+    }
+    misses_ ++;
+    lock.unlock();
+
+    char *buf;
+    if (cls < BUFFER_POOL_CLASSES) {
+        buf = create(PAGE_SIZE << cls);
+    } else {
+        buf = create(rounded_size);
+        cls = -1;
+    }
+    if (buf == NULL) {
+        return Slice(); // empty
+    }
+
+    lock.lock();
+    used_[buf] = cls;
+    return Slice(buf, rounded_size);
+}
+
+void BufferPool::free(Slice buffer)
+{
+    if (!buffer.size()) {
+        return;
+    }
+    char *buf = (char *)buffer.data();
+
+    ScopedMutex lock(&mtx_);
+    map<const char*, int>::iterator it = used_.find(buf);
+    if (it == used_.end()) {
+        // not allocated here
+        lock.unlock();
+        LOG_ERROR("free buffer not allocated by pool, size " << buffer.size());
+        ::free(buf);
+        return;
+    }
+    int cls = it->second;
+    used_.erase(it);
+
+    if (cls >= 0 && idle_size_ + (PAGE_SIZE << cls) <= limit_) {
+        idle_[cls].push_back(buf);
+        idle_size_ += PAGE_SIZE << cls;
+        return;
+    }
+    lock.unlock();
+
+    release(buf, cls >= 0 ? PAGE_SIZE << cls : PAGE_ROUND_UP(buffer.size()));
+}
+
+uint64_t BufferPool::hits()
+{
+    ScopedMutex lock(&mtx_);
+    return hits_;
+}
+
+uint64_t BufferPool::misses()
+{
+    ScopedMutex lock(&mtx_);
+    return misses_;
+}
+
+size_t BufferPool::idle_size()
+{
+    ScopedMutex lock(&mtx_);
+    return idle_size_;
+}
+
+char* BufferPool::create(size_t size)
+{
+    void *buf;
+    if (posix_memalign(&buf, PAGE_SIZE, size)) {
+        LOG_ERROR("posix_memalign error, size " << size);
+        return NULL;
+    }
+    assert( ((size_t)buf & (PAGE_SIZE-1)) == 0);
+
+    if (aio_file_) {
+        aio_file_->register_buffer(Slice((char *)buf, size));
+    }
+    return (char *)buf;
+}
+
+void BufferPool::release(char *buf, size_t size)
+{
+    if (aio_file_) {
+        aio_file_->unregister_buffer(Slice(buf, size));
+    }
+    ::free(buf);
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_SERIALIZE_BUFFER_POOL_H_
+#define CASCADB_SERIALIZE_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+#include <map>
+
+#include "cascadb/file.h"
+#include "cascadb/slice.h"
+#include "sys/sys.h"
+
+namespace cascadb {
+
+// number of size classes, the largest one is 2^(n-1) pages
+#define BUFFER_POOL_CLASSES 12
+
+// Pool of page aligned buffers.
+// Buffers're grouped into size classes of power of two pages,
+// freed ones're kept and reused by later allocations of the same
+// class, until idle buffers exceed the limit.
+// Buffers're registered to the AIO file when they're created,
+// so that IO into them can skip mapping pages each time.
+// Buffers larger than the largest class aren't pooled
+class BufferPool {
+public:
+    BufferPool(AIOFile *aio_file, size_t limit);
+
+    // Idle buffers're released, buffers in use should
+    // all be freed back before
+    ~BufferPool();
+
+    // Return a buffer of size rounded up to pages,
+    // it may be larger actually
+    Slice alloc(size_t size);
+
+    // Put buffer back, it can be resized no larger than allocated
+    void free(Slice buffer);
+
+    // Allocations served by idle buffers
+    uint64_t hits();
+
+    // Allocations creating new buffers
+    uint64_t misses();
+
+    // Total size of idle buffers
+    size_t idle_size();
+
+protected:
+    // Create a buffer of size and register it
+    char* create(size_t size);
+
+    void release(char *buf, size_t size);
+
+private:
+    AIOFile                     *aio_file_;
+    size_t                      limit_;
+
+    Mutex                       mtx_;
+
+    // idle buffers of each size class
+    std::vector<char*>          idle_[BUFFER_POOL_CLASSES];
+    size_t                      idle_size_;
+
+    // size class of buffers in use, -1 if not pooled
+    std::map<const char*, int>  used_;
+
+    uint64_t                    hits_;
+    uint64_t                    misses_;
+};
+
+}
+
+#endif
@@ -32,7 +32,8 @@ Layout::Layout(AIOFile* aio_file,
   offset_(0),
   superblock_(new SuperBlock),
   fly_writes_(0),
-  fly_reads_(0)
+  fly_reads_(0),
+  pool_(aio_file, options.buffer_pool_limit)
 {
 }
 
@@ -42,6 +43,8 @@ Layout::~Layout()
         assert(false);
     }
 
+    LOG_INFO("buffer pool hits " << pool_.hits() << ", misses " << pool_.misses());
+
     ScopedMutex block_index_lock(&block_index_mtx_);
     for (BlockIndexType::iterator it = block_index_.begin();
         it != block_index_.end(); it++ ) {
@@ -241,19 +244,13 @@ void Layout::handle_async_read(AsyncReadReq *req, AIOStatus status)
 
 void Layout::async_write(bid_t bid, Block *block, uint32_t skeleton_size, Callback *cb)
 {
-    // assumpt buffer inside block is aligned
-    assert(block->capacity() == PAGE_ROUND_UP(block->size()));
-
-    AsyncWriteReq *req = new AsyncWriteReq();
-    req->bid = bid;
-    req->cb = cb;
-    req->meta.skeleton_size = skeleton_size;
-    req->meta.total_size = block->size();
-    req->buffer = block->buffer();
-    req->meta.offset = get_offset(req->buffer.size());
-    req->meta.crc = crc16(req->buffer.data(), req->buffer.size());
-    req->meta.skeleton_crc = crc16(block->start(), skeleton_size);
+    BlockWrite write;
+    write.bid = bid;
+    write.block = block;
+    write.skeleton_size = skeleton_size;
+    write.cb = cb;
 
+    AsyncWriteReq *req = new_write_req(write, get_offset(block->buffer().size()));
     Callback *ncb = new Callback(this, &Layout::handle_async_write, req);
 
     ScopedMutex lock(&mtx_);
@@ -263,6 +260,55 @@ void Layout::async_write(bid_t bid, Block *block, uint32_t skeleton_size, Callba
     aio_file_->async_write(req->meta.offset, req->buffer, ncb, aio_complete_handler);
 }
 
+void Layout::async_write(const vector<BlockWrite>& writes)
+{
+    if (writes.empty()) {
+        return;
+    }
+
+    // allocate space for all blocks at once
+    size_t total = 0;
+    for (size_t i = 0; i < writes.size(); i++) {
+        total += writes[i].block->buffer().size();
+    }
+    uint64_t offset = get_offset(total);
+
+    vector<AIORequest> reqs(writes.size());
+    for (size_t i = 0; i < writes.size(); i++) {
+        AsyncWriteReq *req = new_write_req(writes[i], offset);
+        offset += req->buffer.size();
+
+        reqs[i].offset = req->meta.offset;
+        reqs[i].buf = req->buffer;
+        reqs[i].context = new Callback(this, &Layout::handle_async_write, req);
+        reqs[i].cb = aio_complete_handler;
+    }
+
+    ScopedMutex lock(&mtx_);
+    fly_writes_ += writes.size();
+    lock.unlock();
+
+    aio_file_->async_writev(&reqs[0], reqs.size());
+}
+
+Layout::AsyncWriteReq* Layout::new_write_req(const BlockWrite& write, uint64_t offset)
+{
+    Block *block = write.block;
+    // assumpt buffer inside block is aligned
+    assert(block->capacity() == PAGE_ROUND_UP(block->size()));
+
+    AsyncWriteReq *req = new AsyncWriteReq();
+    req->bid = write.bid;
+    req->cb = write.cb;
+    req->meta.skeleton_size = write.skeleton_size;
+    req->meta.total_size = block->size();
+    req->buffer = block->buffer();
+    req->meta.offset = offset;
+    req->meta.crc = crc16(req->buffer.data(), req->buffer.size());
+    req->meta.skeleton_crc = crc16(block->start(), write.skeleton_size);
+    return req;
+}
+
 void Layout::handle_async_write(AsyncWriteReq *req, AIOStatus status)
 {
     ScopedMutex lock(&mtx_);
@@ -321,7 +367,9 @@ bool Layout::flush_meta()
     lock.unlock();
 
     if (!flush_index()) return false;
+    if (!aio_file_->sync()) return false;
     if (!flush_superblock()) return false;
+    if (!aio_file_->sync()) return false;
 
     // add fly holes to hole list
     flush_fly_holes(fly_hole_size);
@@ -329,6 +377,48 @@ bool Layout::flush_meta()
     return true;
 }
 
+void Layout::set_log_number(uint64_t number)
+{
+    ScopedMutex lock(&mtx_);
+    superblock_->log_number = number;
+}
+
+uint64_t Layout::log_number()
+{
+    ScopedMutex lock(&mtx_);
+    return superblock_->log_number;
+}
+
+bool Layout::legacy_nodes()
+{
+    ScopedMutex lock(&mtx_);
+    return superblock_->legacy_nodes;
+}
+
+bool Layout::set_table(const string& name, uint32_t id)
+{
+    ScopedMutex lock(&mtx_);
+    assert(superblock_->tables.find(name) == superblock_->tables.end());
+    if (get_superblock_size() + 4 + name.size() + 4 > SUPER_BLOCK_SIZE) {
+        LOG_ERROR("no room in superblock for table " << name);
+        return false;
+    }
+    superblock_->tables[name] = id;
+    return true;
+}
+
+void Layout::remove_table(const string& name)
+{
+    ScopedMutex lock(&mtx_);
+    superblock_->tables.erase(name);
+}
+
+void Layout::get_tables(map<string, uint32_t>& tables)
+{
+    ScopedMutex lock(&mtx_);
+    tables = superblock_->tables;
+}
+
 void Layout::truncate()
 {
     ScopedMutex lock(&mtx_);
@@ -403,7 +493,9 @@ bool Layout::flush_superblock()
     Block block(buffer, 0, 0);
     BlockWriter writer(&block);
     if (!write_superblock(writer)) {
-        assert(false);
+        LOG_ERROR("superblock overflows, size " << SUPER_BLOCK_SIZE);
+        free_buffer(buffer);
+        return false;
     }
 
     // double write to ensure superblock is correct
@@ -525,6 +617,33 @@ bool Layout::read_superblock(BlockReader& reader)
         if (!read_block_meta(superblock_->index_block_meta, reader)) return false;
     }
 
+    superblock_->log_number = 0;
+    if (superblock_->minor_version >= 2) {
+        if (!reader.readUInt64(&(superblock_->log_number))) return false;
+    }
+    superblock_->tables.clear();
+    if (superblock_->minor_version >= 3) {
+        uint32_t n;
+        if (!reader.readUInt32(&n)) return false;
+        for (uint32_t i = 0; i < n; i++) {
+            Slice name;
+            uint32_t id;
+            if (!reader.readSlice(name)) return false;
+            if (!reader.readUInt32(&id)) {
+                name.destroy();
+                return false;
+            }
+            superblock_->tables[name.to_string()] = id;
+            name.destroy();
+        }
+    }
+    superblock_->legacy_nodes = (superblock_->minor_version < 2);
+    if (superblock_->minor_version >= 4) {
+        if (!reader.readBool(&(superblock_->legacy_nodes))) return false;
+    }
+    // upgraded in the next flush
+    superblock_->minor_version = SUPER_BLOCK_MINOR_VERSION;
+
     if (!reader.readUInt64(&(superblock_->magic_number1))) return false;
     if (superblock_->magic_number0 != SUPER_BLOCK_MAGIC_NUM ||
             superblock_->magic_number0 != superblock_->magic_number1) {
@@ -548,10 +667,34 @@ bool Layout::write_superblock(BlockWriter& writer)
         if (!writer.writeBool(false)) return false;
     }
 
+    if (!writer.writeUInt64(superblock_->log_number)) return false;
+
+    if (!writer.writeUInt32(superblock_->tables.size())) return false;
+    for (map<string, uint32_t>::iterator it = superblock_->tables.begin();
+        it != superblock_->tables.end(); it++) {
+        if (!writer.writeSlice(Slice(it->first))) return false;
+        if (!writer.writeUInt32(it->second)) return false;
+    }
+
+    if (!writer.writeBool(superblock_->legacy_nodes)) return false;
+
     if (!writer.writeUInt64(superblock_->magic_number1)) return false;
     return true;
 }
 
+size_t Layout::get_superblock_size()
+{
+    // magic numbers, versions, index block meta, log number
+    // and legacy nodes flag
+    size_t size = 8 + 1 + 1 + 1 + BLOCK_META_SIZE + 8 + 8 + 1;
+    size += 4;
+    for (map<string, uint32_t>::iterator it = superblock_->tables.begin();
+        it != superblock_->tables.end(); it++) {
+        size += 4 + it->first.size() + 4;
+    }
+    return size;
+}
+
 bool Layout::read_index(BlockReader& reader)
 {
     ScopedMutex block_index_lock(&block_index_mtx_);
@@ -934,27 +1077,12 @@ bool Layout::get_hole(size_t size, uint64_t& offset)
 
 Slice Layout::alloc_aligned_buffer(size_t size)
 {
-    assert(size);
-    size_t rounded_size = PAGE_ROUND_UP(size);
-
-    void *buf;
-    if (posix_memalign(&buf, PAGE_SIZE, rounded_size)) {
-        assert(false);
-    }
-
-    if (buf) {
-        assert( ((size_t)buf & (PAGE_SIZE-1)) == 0);
-        return Slice((char *)buf, rounded_size);
-    } else {
-        return Slice(); // empty
-    }
+    return pool_.alloc(size);
 }
 
 void Layout::free_buffer(Slice buffer)
 {
-    if (buffer.size()) {
-        free((char* )buffer.data()); // non-empty
-    }
+    pool_.free(buffer);
 }
 
 Block* Layout::create(size_t size)
@@ -17,6 +17,7 @@
 #include "sys/sys.h"
 #include "util/callback.h"
 #include "block.h"
+#include "buffer_pool.h"
 #include "super_block.h"
 
 namespace cascadb {
@@ -32,6 +33,14 @@ struct BlockMeta {
     uint16_t    skeleton_crc;       // crc of skeleton data
 };
 
+// A block written out in batch
+struct BlockWrite {
+    bid_t       bid;
+    Block       *block;
+    uint32_t    skeleton_size;
+    Callback    *cb;
+};
+
 // Storage layout, read blocks from file and write blocks into file
 
 // TODO:
@@ -66,6 +75,10 @@ public:
 
     // Initiate a write operation
     void async_write(bid_t bid, Block* block, uint32_t skeleton_size, Callback *cb);
+
+    // Initiate a batch of write operations, blocks're laid out
+    // contiguously so that they can be written by fewer requests
+    void async_write(const std::vector<BlockWrite>& writes);
     
     // Delete block from index 
     void delete_block(bid_t bid);
@@ -73,9 +86,30 @@ public:
     // Flush blocks and index out
     bool flush();
 
-    // Flush meta data
+    // Flush meta data, blocks written're synced to disk before
+    // superblock points to them, and superblock is synced before
+    // space of blocks it no longer points to is reused
     bool flush_meta();
 
+    // Number of the oldest log file should be replayed,
+    // persisted in superblock by flush_meta
+    void set_log_number(uint64_t number);
+
+    uint64_t log_number();
+
+    // Whether nodes written before seqs may be left in file,
+    // their buffers're read with seq 0
+    bool legacy_nodes();
+
+    // Record a table created in file, persisted in superblock
+    // by flush_meta. Return false if superblock has no room for it
+    bool set_table(const std::string& name, uint32_t id);
+
+    // Forget a table recorded but failed to be persisted
+    void remove_table(const std::string& name);
+
+    void get_tables(std::map<std::string, uint32_t>& tables);
+
     // Truncate unused space at file end,
     // invoked inside init/flush by default
     void truncate();
@@ -86,6 +120,15 @@ public:
     // Destrcut a Block object
     void destroy(Block* block);
 
+    // Allocate a page aligned buffer from pool, the size is
+    // rounded up to pages
+    Slice alloc_aligned_buffer(size_t size);
+
+    // Put buffer back into pool
+    void free_buffer(Slice buffer);
+
+    BufferPool* buffer_pool() { return &pool_; }
+
 protected:
     // read and deserialize superblock
     bool load_superblock();
@@ -112,6 +155,9 @@ protected:
     // Serialize superblock into buffer
     bool write_superblock(BlockWriter& writer);
 
+    // Length of superblock serialized, called with mtx_ held
+    size_t get_superblock_size();
+
     // Deserialize index from buffer
     bool read_index(BlockReader& reader);
 
@@ -147,6 +193,9 @@ protected:
         Slice                  buffer;
     };
 
+    // Create context of async write to offset
+    AsyncWriteReq* new_write_req(const BlockWrite& write, uint64_t offset);
+
     // called when AIOFile returns the result of asyn write
     void handle_async_write(AsyncWriteReq *req, AIOStatus status);
 
@@ -181,10 +230,6 @@ protected:
 
     bool get_hole(size_t size, uint64_t& offset);
 
-    Slice alloc_aligned_buffer(size_t size);
-
-    void free_buffer(Slice buffer);
-
 private:
     AIOFile                             *aio_file_;
     uint64_t                            length_; // file length
@@ -226,6 +271,9 @@ private:
     // the rest are statistics information
     size_t                              fly_writes_;    // todo atomic
     size_t                              fly_reads_;     // todo atomic
+
+    // buffers of blocks and compression, shared by all tables in file
+    BufferPool                          pool_;
 };
 
 }
@@ -5,12 +5,20 @@
 #ifndef CASCADB_SERIALIZE_SUPER_BLOCK_H_
 #define CASCADB_SERIALIZE_SUPER_BLOCK_H_
 
+#include <map>
+#include <string>
+
 #include "block.h"
 
 namespace cascadb {
 
 #define SUPER_BLOCK_SIZE        4096
 #define SUPER_BLOCK_MAGIC_NUM (0x6264616373616) // "cascadb
+#define SUPER_BLOCK_MINOR_VERSION 4
+
+// tables're recorded in superblock, names're bounded so that
+// the catalog fits in it
+#define MAX_TABLE_NAME_LENGTH   64
 
 class BlockMeta;
 
@@ -20,9 +28,11 @@ public:
     {
         magic_number0 = SUPER_BLOCK_MAGIC_NUM;   // "cascadb
         major_version = 0;                  // "version 0.1"
-        minor_version = 1;
+        minor_version = SUPER_BLOCK_MINOR_VERSION;
 
         index_block_meta = NULL;
+        log_number = 0;
+        legacy_nodes = false;
         magic_number1 = SUPER_BLOCK_MAGIC_NUM;    // "cascadb"
     }
 
@@ -31,6 +41,16 @@ public:
     uint8_t         minor_version;
 
     BlockMeta       *index_block_meta;
+    // log files older than this're applied to the file,
+    // since version 0.2
+    uint64_t        log_number;
+    // ids of tables created in file, indexed by name,
+    // since version 0.3
+    std::map<std::string, uint32_t> tables;
+    // nodes written before messages and records carry seqs may
+    // be left in file, it's set for files of version 0.1, and kept
+    // as they're rewritten lazily, since version 0.4
+    bool            legacy_nodes;
     uint64_t        magic_number1;
 };
 
@@ -50,4 +50,11 @@ AIOStatus AIOFile::write(uint64_t offset, Slice buf)
     req->mtx.unlock();
     delete req;
     return status;
-}
\ No newline at end of file
+}
+
+void AIOFile::async_writev(const AIORequest* reqs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        async_write(reqs[i].offset, reqs[i].buf, reqs[i].context, reqs[i].cb);
+    }
+}
@@ -38,10 +38,12 @@ std::string FSDirectory::to_string()
 
 #include "sys/posix/posix_fs_directory.h"
 
-Directory* cascadb::create_fs_directory(const std::string& path)
+Directory* cascadb::create_fs_directory(const std::string& path,
+                                        AIOEngine engine,
+                                        bool sq_poll)
 {
 #ifdef OS_LINUX
-    return new LinuxFSDirectory(path);
+    return new LinuxFSDirectory(path, engine, sq_poll);
 #else
     return new PosixFSDirectory(path);
 #endif
@@ -4,12 +4,17 @@
 
 // std
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdexcept>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 // posix
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/errno.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -17,6 +22,9 @@
 #ifdef HAS_LIBAIO
 #include <libaio.h>
 #endif
+#ifdef HAS_LIBURING
+#include <liburing.h>
+#endif
 
 #include "sys/sys.h"
 #include "util/logger.h"
@@ -25,11 +33,10 @@
 using namespace std;
 using namespace cascadb;
 
-#ifdef HAS_LIBAIO
+#if defined(HAS_LIBAIO) || defined(HAS_LIBURING)
 
-#define MAX_AIO_EVENTS 128
-
-static void* handle_io_complete(void *ptr);
+// max number of requests merged into one vectored write
+#define MAX_AIO_IOVS 64
 
 enum AIOOP {
     AIORead,
@@ -39,11 +46,128 @@ enum AIOOP {
 class AIOTask {
 public:
     AIOOP op;
+    uint64_t offset;
     size_t size;
     void *context;
     aio_callback_t cb;
+
+    // requests merged into one vectored write,
+    // context and cb above're unused if it's not empty
+    std::vector<AIORequest> reqs;
+    std::vector<struct iovec> iovs;
 };
 
+static bool aio_request_less(const AIORequest& r1, const AIORequest& r2)
+{
+    return r1.offset < r2.offset;
+}
+
+// Merge requests adjacent on disk into vectored write tasks
+static void merge_writes(const AIORequest* reqs, size_t n, std::vector<AIOTask*>& tasks)
+{
+    std::vector<AIORequest> sorted(reqs, reqs + n);
+    std::sort(sorted.begin(), sorted.end(), aio_request_less);
+
+    size_t i = 0;
+    while (i < n) {
+        AIOTask* task = new AIOTask();
+        assert(task);
+        task->op = AIOWrite;
+        task->offset = sorted[i].offset;
+        task->size = 0;
+        task->context = NULL;
+        task->cb = NULL;
+
+        do {
+            AIORequest& req = sorted[i++];
+            struct iovec iov;
+            iov.iov_base = (void *)req.buf.data();
+            iov.iov_len = req.buf.size();
+            task->iovs.push_back(iov);
+            task->reqs.push_back(req);
+            task->size += req.buf.size();
+        } while (i < n && sorted[i].offset == task->offset + task->size
+            && task->iovs.size() < MAX_AIO_IOVS);
+
+        tasks.push_back(task);
+    }
+}
+
+// Pass result of the task to callbacks and delete it,
+// res is number of bytes transferred or negative errno
+static void complete_task(AIOTask* task, int res)
+{
+    switch(task->op) {
+    case AIORead:
+    {
+        AIOStatus status;
+        if (res < 0) {
+            LOG_ERROR("linux aio read error: " << strerror(-1*res));
+            status.succ = false;
+        } else {
+            status.succ = true;
+            status.read = res;
+        }
+        task->cb(task->context, status);
+        break;
+    }
+    case AIOWrite:
+    {
+        AIOStatus status;
+        if (res < 0) {
+            LOG_ERROR("linux aio write error: " << strerror(-1*res));
+            status.succ = false;
+        } else if ((size_t)res < task->size) {
+            LOG_ERROR("linux aio write incomplete, should be " << task->size 
+                << " bytes, actually " << res << " bytes");
+            status.succ = false;
+        } else {
+            assert((size_t)res == task->size);
+            status.succ = true;
+        }
+        if (task->reqs.empty()) {
+            task->cb(task->context, status);
+            break;
+        }
+        // requests written out completely're still ok
+        // in case of an incomplete write
+        size_t end = 0;
+        for (size_t j = 0; j < task->reqs.size(); j++) {
+            AIORequest& req = task->reqs[j];
+            end += req.buf.size();
+            AIOStatus st;
+            st.succ = status.succ || (res >= 0 && end <= (size_t)res);
+            req.cb(req.context, st);
+        }
+        break;
+    }
+    }
+
+    delete task;
+}
+
+// Fail callbacks of a task not submitted and delete it
+static void fail_task(AIOTask* task)
+{
+    AIOStatus status;
+    status.succ = false;
+    if (task->reqs.empty()) {
+        task->cb(task->context, status);
+    }
+    for (size_t j = 0; j < task->reqs.size(); j++) {
+        task->reqs[j].cb(task->reqs[j].context, status);
+    }
+    delete task;
+}
+
+#endif
+
+#ifdef HAS_LIBAIO
+
+#define MAX_AIO_EVENTS 128
+
+static void* handle_io_complete(void *ptr);
+
 // A wrapper of Linxu libaio APIs
 class LinuxAIOFile : public AIOFile {
 public:
@@ -102,41 +226,7 @@ public:
             for (int i = 0; i < nevents; i++) {
                 AIOTask* task = (AIOTask*)events[i].data;
                 assert(task);
-                int res = events[i].res;
-                switch(task->op) {
-                case AIORead:
-                {
-                    AIOStatus status;
-                    if (res < 0) {
-                        LOG_ERROR("linux aio read error: " << strerror(-1*res));
-                        status.succ = false;
-                    } else {
-                        status.succ = true;
-                        status.read = res;
-                    }
-                    task->cb(task->context, status);
-                    break;
-                }
-                case AIOWrite:
-                {
-                    AIOStatus status;
-                    if (res < 0) {
-                        LOG_ERROR("linux aio write error: " << strerror(-1*res));
-                        status.succ = false;
-                    } else if ((size_t)res < task->size) {
-                        LOG_ERROR("linux aio write incomplete, should be " << task->size 
-                            << " bytes, actually " << res << " bytes");
-                        status.succ = false;
-                    } else {
-                        assert((size_t)res == task->size);
-                        status.succ = true;
-                    }
-                    task->cb(task->context, status);
-                    break;
-                }
-                }
-
-                delete task;
+                complete_task(task, events[i].res);
             }
         }
     }
@@ -152,6 +242,7 @@ public:
         AIOTask* task = new AIOTask();
         assert(task);
         task->op = AIORead;
+        task->offset = offset;
         task->size = buf.size();
         task->context = context;
         task->cb = cb;
@@ -159,11 +250,8 @@ public:
         iocbp->data = task;
 
         // submit
-        if (!submit(1, &iocbp)) {
-            AIOStatus status;
-            status.succ = false;
-            cb(context, status);
-            delete task;
+        if (submit(1, &iocbp) != 1) {
+            fail_task(task);
         }
     }
 
@@ -178,6 +266,7 @@ public:
         AIOTask* task = new AIOTask();
         assert(task);
         task->op = AIOWrite;
+        task->offset = offset;
         task->size = buf.size();
         task->context = context;
         task->cb = cb;
@@ -185,11 +274,42 @@ public:
         iocbp->data = task;
 
         // submit 
-        if (!submit(1, &iocbp)) {
-            AIOStatus status;
-            status.succ = false;
-            cb(context, status);
-            delete task;
+        if (submit(1, &iocbp) != 1) {
+            fail_task(task);
+        }
+    }
+
+    void async_writev(const AIORequest* reqs, size_t n)
+    {
+        std::vector<AIOTask*> tasks;
+        merge_writes(reqs, n, tasks);
+
+        // submit at most MAX_AIO_EVENTS iocbs per io_submit
+        size_t pos = 0;
+        while (pos < tasks.size()) {
+            size_t cnt = std::min(tasks.size() - pos, (size_t)MAX_AIO_EVENTS);
+            struct iocb iocbs[MAX_AIO_EVENTS];
+            struct iocb *iocbps[MAX_AIO_EVENTS];
+            for (size_t j = 0; j < cnt; j++) {
+                AIOTask* task = tasks[pos + j];
+                iocbps[j] = &iocbs[j];
+                LOG_TRACE("write " << task->size << " bytes in " << task->reqs.size()
+                    << " requests out to " << path_ << ":" << task->offset);
+                io_prep_pwritev(iocbps[j], fd_, &task->iovs[0], task->iovs.size(),
+                    task->offset);
+                iocbps[j]->data = task;
+            }
+
+            size_t submitted = submit(cnt, iocbps);
+            pos += submitted;
+            if (submitted < cnt) {
+                break;
+            }
+        }
+
+        // fail the rest
+        for (; pos < tasks.size(); pos++) {
+            fail_task(tasks[pos]);
         }
     }
 
@@ -200,6 +320,15 @@ public:
         }
     }
 
+    bool sync()
+    {
+        if (::fdatasync(fd_) < 0) {
+            LOG_ERROR("fdatasync file error " << strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
     void close()
     {
         if (!closed_) {
@@ -219,10 +348,12 @@ public:
         } 
     }
 protected:
-    bool submit(int n, struct iocb **iocbpp) {
-        // submit
-        while (true) {
-            int ret = io_submit(ctx_, n, iocbpp);
+    // Return the number of iocbs submitted, io_submit may accept
+    // part of them when the queue is nearly full
+    size_t submit(size_t n, struct iocb **iocbpp) {
+        size_t submitted = 0;
+        while (submitted < n) {
+            int ret = io_submit(ctx_, n - submitted, iocbpp + submitted);
             if (ret < 0) {
                 int errcode = -1 * ret;
                 if (errcode == EAGAIN) {
@@ -231,11 +362,11 @@ protected:
                     continue;
                 }
                 LOG_ERROR("linux aio io_submit error: " << strerror(errcode));
-                return false;
+                break;
             }
-            assert(ret == n);
-            return true;
+            submitted += ret;
         }
+        return submitted;
     }
 
 private:
@@ -259,17 +390,393 @@ static void* handle_io_complete(void *ptr)
 
 #endif // LIBAIO
 
+#ifdef HAS_LIBURING
+
+#define URING_ENTRIES 128
+
+// max number of registered buffers
+#define URING_MAX_BUFFERS 1024
+
+// idle time in ms before the kernel polling thread sleeps
+#define URING_SQ_THREAD_IDLE 1000
+
+static void* handle_uring_complete(void *ptr);
+
+// A wrapper of Linux io_uring APIs,
+// Requests into registered buffers're issued as fixed reads and writes
+class URingAIOFile : public AIOFile {
+public:
+    URingAIOFile(const std::string& path, bool sq_poll)
+    : path_(path), sq_poll_(sq_poll), closed_(true), fd_(-1),
+      inflight_(0), cq_entries_(0), inflight_cond_(&mtx_),
+      fixed_buffers_(false), thr_(NULL)
+    {
+    }
+
+    ~URingAIOFile()
+    {
+        close();
+    }
+
+    bool open()
+    {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_DIRECT | O_CREAT, 0644);
+        if (fd_ == -1) {
+            LOG_ERROR("open file " << path_ << " error: " << strerror(errno));
+            return false;
+        }
+
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        if (sq_poll_) {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = URING_SQ_THREAD_IDLE;
+        }
+
+        int ret;
+        if ((ret = io_uring_queue_init_params(URING_ENTRIES, &ring_, &params)) < 0) {
+            LOG_ERROR("io_uring_queue_init error " << strerror(-1*ret));
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        cq_entries_ = params.cq_entries;
+
+        // slots're filled in as buffers're registered,
+        // fixed buffers're disabled on older kernels
+        if ((ret = io_uring_register_buffers_sparse(&ring_, URING_MAX_BUFFERS)) < 0) {
+            LOG_INFO("io_uring registered buffers're not supported: " << strerror(-1*ret));
+        } else {
+            fixed_buffers_ = true;
+            for (int i = URING_MAX_BUFFERS - 1; i >= 0; i--) {
+                free_slots_.push_back(i);
+            }
+        }
+
+        thr_ = new Thread(::handle_uring_complete);
+        thr_->start(this);
+
+        closed_ = false;
+        return true;
+    }
+
+    void handle_io_complete()
+    {
+        bool closing = false;
+        while (true) {
+            if (closing) {
+                // requests in flight're all completed before exit
+                ScopedMutex lock(&mtx_);
+                if (inflight_ == 0) {
+                    break;
+                }
+            }
+
+            struct io_uring_cqe *cqe;
+            int ret = io_uring_wait_cqe(&ring_, &cqe);
+            if (ret < 0) {
+                if (-1*ret == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("io_uring_wait_cqe error " << strerror(-1*ret));
+                break;
+            }
+
+            AIOTask* task = (AIOTask*)io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&ring_, cqe);
+
+            // nop with no task is submitted by close()
+            if (task == NULL) {
+                closing = true;
+            } else {
+                complete_task(task, res);
+            }
+
+            ScopedMutex lock(&mtx_);
+            inflight_ --;
+            inflight_cond_.notify_all();
+        }
+    }
+
+    bool register_buffer(Slice buf)
+    {
+        ScopedMutex lock(&mtx_);
+        if (!fixed_buffers_ || free_slots_.empty()) {
+            return false;
+        }
+
+        int slot = free_slots_.back();
+        struct iovec iov;
+        iov.iov_base = (void *)buf.data();
+        iov.iov_len = buf.size();
+        int ret = io_uring_register_buffers_update_tag(&ring_, slot, &iov, NULL, 1);
+        if (ret < 0) {
+            LOG_ERROR("io_uring register buffer error " << strerror(-1*ret));
+            return false;
+        }
+        free_slots_.pop_back();
+
+        RegisteredBuffer& rb = buffers_[(uintptr_t)buf.data()];
+        rb.size = buf.size();
+        rb.slot = slot;
+        return true;
+    }
+
+    void unregister_buffer(Slice buf)
+    {
+        ScopedMutex lock(&mtx_);
+        std::map<uintptr_t, RegisteredBuffer>::iterator it = buffers_.find((uintptr_t)buf.data());
+        if (it == buffers_.end()) {
+            return;
+        }
+
+        // requests in flight keep the old mapping
+        struct iovec iov;
+        iov.iov_base = NULL;
+        iov.iov_len = 0;
+        int ret = io_uring_register_buffers_update_tag(&ring_, it->second.slot, &iov, NULL, 1);
+        if (ret < 0) {
+            LOG_ERROR("io_uring unregister buffer error " << strerror(-1*ret));
+        }
+        free_slots_.push_back(it->second.slot);
+        buffers_.erase(it);
+    }
+
+    void async_read(uint64_t offset, Slice buf, void* context, aio_callback_t cb)
+    {
+        LOG_TRACE("read " << buf.size() << " bytes from " << path_ << ":" << offset);
+
+        AIOTask* task = new AIOTask();
+        assert(task);
+        task->op = AIORead;
+        task->offset = offset;
+        task->size = buf.size();
+        task->context = context;
+        task->cb = cb;
+
+        ScopedMutex lock(&mtx_);
+        struct io_uring_sqe *sqe = get_sqe();
+        int slot = find_slot(buf);
+        if (slot >= 0) {
+            io_uring_prep_read_fixed(sqe, fd_, (void *)buf.data(), buf.size(), offset, slot);
+        } else {
+            io_uring_prep_read(sqe, fd_, (void *)buf.data(), buf.size(), offset);
+        }
+        io_uring_sqe_set_data(sqe, task);
+        submit();
+    }
+
+    void async_write(uint64_t offset, Slice buf, void* context, aio_callback_t cb)
+    {
+        LOG_TRACE("write " << buf.size() << " bytes out to " << path_ << ":" << offset);
+
+        AIOTask* task = new AIOTask();
+        assert(task);
+        task->op = AIOWrite;
+        task->offset = offset;
+        task->size = buf.size();
+        task->context = context;
+        task->cb = cb;
+
+        ScopedMutex lock(&mtx_);
+        struct io_uring_sqe *sqe = get_sqe();
+        int slot = find_slot(buf);
+        if (slot >= 0) {
+            io_uring_prep_write_fixed(sqe, fd_, buf.data(), buf.size(), offset, slot);
+        } else {
+            io_uring_prep_write(sqe, fd_, buf.data(), buf.size(), offset);
+        }
+        io_uring_sqe_set_data(sqe, task);
+        submit();
+    }
+
+    void async_writev(const AIORequest* reqs, size_t n)
+    {
+        std::vector<AIOTask*> tasks;
+        merge_writes(reqs, n, tasks);
+
+        // queue all tasks and submit them together
+        ScopedMutex lock(&mtx_);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            AIOTask* task = tasks[i];
+            LOG_TRACE("write " << task->size << " bytes in " << task->reqs.size()
+                << " requests out to " << path_ << ":" << task->offset);
+
+            struct io_uring_sqe *sqe = get_sqe();
+            io_uring_prep_writev(sqe, fd_, &task->iovs[0], task->iovs.size(), task->offset);
+            io_uring_sqe_set_data(sqe, task);
+        }
+        submit();
+    }
+
+    void truncate(uint64_t offset)
+    {
+        if (::ftruncate(fd_, offset) < 0) {
+            LOG_ERROR("ftruncate file error " << strerror(errno));
+        }
+    }
+
+    bool sync()
+    {
+        if (::fdatasync(fd_) < 0) {
+            LOG_ERROR("fdatasync file error " << strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (!closed_) {
+            closed_ = true;
+
+            // wake up the completion thread, the nop is completed
+            // after requests submitted before it
+            ScopedMutex lock(&mtx_);
+            struct io_uring_sqe *sqe = get_sqe();
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, NULL);
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+            submit();
+            lock.unlock();
+
+            thr_->join();
+            delete thr_;
+            thr_ = NULL;
+
+            io_uring_queue_exit(&ring_);
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+protected:
+    // Get a free submission entry, queued entries're submitted
+    // to make room if the ring is full. Requests in flight're capped
+    // at the size of completion queue, so no completion is dropped
+    // on kernels without IORING_FEAT_NODROP. mtx_ should be held
+    struct io_uring_sqe* get_sqe()
+    {
+        while (inflight_ >= cq_entries_) {
+            submit();
+            inflight_cond_.wait();
+        }
+        while (true) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+            if (sqe) {
+                inflight_ ++;
+                return sqe;
+            }
+            submit();
+        }
+    }
+
+    // Submit queued entries, mtx_ should be held
+    void submit()
+    {
+        while (true) {
+            int ret = io_uring_submit(&ring_);
+            if (ret < 0) {
+                int errcode = -1 * ret;
+                if (errcode == EAGAIN || errcode == EBUSY || errcode == EINTR) {
+                    LOG_INFO("io_uring_submit busy, wait for a while");
+                    cascadb::usleep(1000);
+                    continue;
+                }
+                // entries're kept in the ring and retried next time
+                LOG_ERROR("io_uring_submit error: " << strerror(errcode));
+            }
+            return;
+        }
+    }
+
+    // Return slot of the registered buffer holding buf, or -1,
+    // mtx_ should be held
+    int find_slot(Slice buf)
+    {
+        if (buffers_.empty()) {
+            return -1;
+        }
+        uintptr_t start = (uintptr_t)buf.data();
+        std::map<uintptr_t, RegisteredBuffer>::iterator it = buffers_.upper_bound(start);
+        if (it == buffers_.begin()) {
+            return -1;
+        }
+        it--;
+        if (start + buf.size() > it->first + it->second.size) {
+            return -1;
+        }
+        return it->second.slot;
+    }
+
+private:
+    struct RegisteredBuffer {
+        size_t  size;
+        int     slot;
+    };
+
+    std::string path_;
+
+    bool sq_poll_;
+
+    bool closed_;
+
+    int fd_;
+
+    struct io_uring ring_;
+
+    // protect submission queue and registered buffers
+    Mutex mtx_;
+
+    // entries taken but not completed yet
+    size_t inflight_;
+
+    size_t cq_entries_;
+
+    // notify that requests in flight're completed
+    CondVar inflight_cond_;
+
+    bool fixed_buffers_;
+
+    // registered buffers indexed by start address
+    std::map<uintptr_t, RegisteredBuffer> buffers_;
+
+    std::vector<int> free_slots_;
+
+    Thread *thr_; // thread to handle io completion events
+};
+
+static void* handle_uring_complete(void *ptr)
+{
+    URingAIOFile *aio_file = (URingAIOFile*) ptr;
+    aio_file->handle_io_complete();
+    return NULL;
+}
+
+#endif // LIBURING
+
 AIOFile* LinuxFSDirectory::open_aio_file(const std::string& filename)
 {
+#ifdef HAS_LIBURING
+    if (engine_ == kAutoAIO || engine_ == kURingAIO) {
+        URingAIOFile* file = new URingAIOFile(fullpath(filename), sq_poll_);
+        if (file && file->open()) {
+            return file;
+        }
+        delete file;
+        LOG_WARN("io_uring is unavailable, fall back to other engines");
+    }
+#endif
 #ifdef HAS_LIBAIO
-    LinuxAIOFile* file = new LinuxAIOFile(fullpath(filename));
-    if (file && file->open()) {
-        return file; 
+    if (engine_ != kPosixAIO) {
+        LinuxAIOFile* file = new LinuxAIOFile(fullpath(filename));
+        if (file && file->open()) {
+            return file; 
+        }
+        delete file;
+        LOG_WARN("linux aio is unavailable, fall back to posix aio");
     }
-    delete file;
-    return NULL;
-#else
-    return PosixFSDirectory::open_aio_file(filename);
 #endif
+    return PosixFSDirectory::open_aio_file(filename);
 }
-
@@ -11,10 +11,16 @@ namespace cascadb {
 
 class LinuxFSDirectory : public PosixFSDirectory {
 public:
-    LinuxFSDirectory(const std::string& path) : PosixFSDirectory(path) {}
+    LinuxFSDirectory(const std::string& path,
+                     AIOEngine engine = kAutoAIO,
+                     bool sq_poll = false)
+    : PosixFSDirectory(path), engine_(engine), sq_poll_(sq_poll) {}
 
     virtual AIOFile* open_aio_file(const std::string& filename);
 
+private:
+    AIOEngine   engine_;
+    bool        sq_poll_;
 };
 
 }
@@ -156,7 +156,7 @@ public:
     aio_callback_t  cb;
 };
 
-static void handle_posix_aio_complete(sigval_t sigval)
+static void handle_posix_aio_complete(union sigval sigval)
 {
     AIOStatus status;
     PosixAIORequest *req = (PosixAIORequest*) sigval.sival_ptr;
@@ -272,6 +272,15 @@ public:
         return;
     }
 
+    bool sync()
+    {
+        if (::fdatasync(fd_) < 0) {
+            LOG_ERROR("fdatasync file error " << strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
     void close()
     {
         if (!closed_) {
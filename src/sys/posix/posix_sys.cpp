@@ -197,6 +197,94 @@ void RWLock::unlock()
     pthread_call("rwlock unlock", pthread_rwlock_unlock(&rwlock_));
 }
 
+UpgradableRWLock::UpgradableRWLock()
+: owned_(false)
+{
+}
+
+void UpgradableRWLock::read_lock()
+{
+    lock_.read_lock();
+}
+
+bool UpgradableRWLock::try_read_lock()
+{
+    return lock_.try_read_lock();
+}
+
+void UpgradableRWLock::write_lock()
+{
+    intent_.lock();
+    lock_.write_lock();
+    set_owner();
+}
+
+bool UpgradableRWLock::try_write_lock()
+{
+    if (!intent_.lock_try()) {
+        return false;
+    }
+    if (!lock_.try_write_lock()) {
+        intent_.unlock();
+        return false;
+    }
+    set_owner();
+    return true;
+}
+
+void UpgradableRWLock::upgrade_lock()
+{
+    intent_.lock();
+    lock_.read_lock();
+    set_owner();
+}
+
+void UpgradableRWLock::upgrade()
+{
+    assert(owned());
+    // writers wait for the intent, only readers may get in
+    lock_.unlock();
+    lock_.write_lock();
+}
+
+void UpgradableRWLock::downgrade()
+{
+    assert(owned());
+    // writers still wait for the intent meanwhile
+    lock_.unlock();
+    lock_.read_lock();
+    owned_ = false;
+    intent_.unlock();
+}
+
+void UpgradableRWLock::unlock()
+{
+    if (owned()) {
+        owned_ = false;
+        lock_.unlock();
+        intent_.unlock();
+    } else {
+        lock_.unlock();
+    }
+}
+
+bool UpgradableRWLock::owned()
+{
+    if (!owned_) {
+        return false;
+    }
+    __sync_synchronize();
+    return pthread_equal(owner_, pthread_self());
+}
+
+void UpgradableRWLock::set_owner()
+{
+    owner_ = pthread_self();
+    // readers see owner once the flag is set
+    __sync_synchronize();
+    owned_ = true;
+}
+
 CondVar::CondVar(Mutex* mu) : mu_(mu) {
     pthread_call("init cv", pthread_cond_init(&cv_, NULL));
 }
@@ -269,6 +357,17 @@ extern uint64_t now_micros()
     return t.tv_sec * 1000000 + t.tv_usec;
 }
 
+extern uint64_t coarse_now_micros()
+{
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+    return now_micros();
+#endif
+}
+
 void sleep(Second sec)
 {
     ::sleep(sec);
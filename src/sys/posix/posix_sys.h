@@ -67,6 +67,39 @@ private:
     pthread_rwlock_t rwlock_;
 };
 
+// Read write lock with an intent mode, which shares with readers
+// but excludes writers and other intents. The intent holder can be
+// upgraded to writer, and downgraded to reader, letting no writer in.
+// The intent or write lock holder can't take read lock meanwhile
+class UpgradableRWLock {
+public:
+    UpgradableRWLock();
+    void read_lock();
+    bool try_read_lock();
+
+    void write_lock();
+    bool try_write_lock();
+
+    void upgrade_lock();
+    // Intent lock to write lock
+    void upgrade();
+    // Write or intent lock to read lock
+    void downgrade();
+
+    void unlock();
+private:
+    UpgradableRWLock(const UpgradableRWLock&);
+    UpgradableRWLock& operator =(const UpgradableRWLock&);
+    // intent or write lock held by calling thread
+    bool owned();
+    void set_owner();
+    RWLock lock_;
+    // held by writers and intent holders
+    Mutex intent_;
+    volatile bool owned_;
+    pthread_t owner_;
+};
+
 class CondVar {
 public:
     CondVar(Mutex* mu);
@@ -83,6 +116,38 @@ private:
 };
 
 
+// Integer read and updated atomically without lock
+template<typename T>
+class Atomic {
+public:
+    Atomic(T v = 0) : v_(v) {}
+
+    T get() { return __sync_add_and_fetch(&v_, 0); }
+
+    void set(T v) { __sync_lock_test_and_set(&v_, v); }
+
+    // Return the new value
+    T add(T d) { return __sync_add_and_fetch(&v_, d); }
+
+    T sub(T d) { return __sync_sub_and_fetch(&v_, d); }
+
+    bool compare_and_swap(T expected, T v)
+    {
+        return __sync_bool_compare_and_swap(&v_, expected, v);
+    }
+
+    // Return the old value
+    T fetch_or(T bits) { return __sync_fetch_and_or(&v_, bits); }
+
+    T fetch_and(T bits) { return __sync_fetch_and_and(&v_, bits); }
+
+private:
+    Atomic(const Atomic&);
+    Atomic& operator =(const Atomic&);
+
+    volatile T v_;
+};
+
 typedef struct timeval Time;
 typedef time_t Second;
 typedef useconds_t USecond;
@@ -92,6 +157,9 @@ extern bool operator<(const Time& t1, const Time& t2);
 extern Time now();
 extern std::ostream& operator<<(std::ostream& os, const Time& t);
 extern uint64_t now_micros();
+// Cheap clock with resolution of a few milliseconds,
+// it's read without a system call where supported
+extern uint64_t coarse_now_micros();
 extern void sleep(Second sec);
 extern void usleep(USecond usec);
 // t2 - t1
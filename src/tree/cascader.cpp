@@ -0,0 +1,126 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "cascader.h"
+#include "node.h"
+
+using namespace std;
+using namespace cascadb;
+
+static void* cascader_main(void *arg)
+{
+    Cascader *cascader = (Cascader*) arg;
+    cascader->run();
+    return NULL;
+}
+
+Cascader::Cascader(size_t threads)
+: threads_(threads),
+  cond_(&mtx_),
+  cascaded_cond_(&mtx_),
+  alive_(false),
+  paused_(false),
+  cascading_(0)
+{
+}
+
+Cascader::~Cascader()
+{
+    ScopedMutex lock(&mtx_);
+    alive_ = false;
+    cond_.notify_all();
+    lock.unlock();
+    for (size_t i = 0; i < cascaders_.size(); i++) {
+        cascaders_[i]->join();
+        delete cascaders_[i];
+    }
+    assert(queue_.empty());
+}
+
+void Cascader::start()
+{
+    alive_ = true;
+    for (size_t i = 0; i < threads_; i++) {
+        Thread *cascader = new Thread(cascader_main);
+        cascader->start(this);
+        cascaders_.push_back(cascader);
+    }
+}
+
+bool Cascader::schedule(InnerNode *node)
+{
+    ScopedMutex lock(&mtx_);
+    if (!alive_ || cascaders_.empty()) {
+        return false;
+    }
+    if (!node->cascade_queued_) {
+        node->cascade_queued_ = true;
+        node->inc_ref();
+        queue_.push_back(node);
+        pending_[node->tree_] ++;
+        cond_.notify();
+    }
+    return true;
+}
+
+void Cascader::wait(unsigned int millisec)
+{
+    ScopedMutex lock(&mtx_);
+    cascaded_cond_.wait(millisec);
+}
+
+void Cascader::run()
+{
+    ScopedMutex lock(&mtx_);
+    while (true) {
+        while (alive_ && (queue_.empty() || paused_)) {
+            cond_.wait();
+        }
+        if (queue_.empty()) {
+            break;
+        }
+
+        InnerNode *node = queue_.front();
+        queue_.pop_front();
+        // filled again while cascading, it's queued again
+        node->cascade_queued_ = false;
+        Tree *tree = node->tree_;
+        cascading_ ++;
+        lock.unlock();
+        node->background_cascade();
+        node->dec_ref();
+        lock.lock();
+        cascading_ --;
+        if (-- pending_[tree] == 0) {
+            pending_.erase(tree);
+        }
+        cascaded_cond_.notify_all();
+    }
+}
+
+void Cascader::pause()
+{
+    ScopedMutex lock(&mtx_);
+    assert(!paused_);
+    paused_ = true;
+    while (cascading_) {
+        cascaded_cond_.wait();
+    }
+}
+
+void Cascader::resume()
+{
+    ScopedMutex lock(&mtx_);
+    paused_ = false;
+    cond_.notify_all();
+}
+
+void Cascader::drain(Tree *tree)
+{
+    ScopedMutex lock(&mtx_);
+    assert(!paused_);
+    while (pending_.find(tree) != pending_.end()) {
+        cascaded_cond_.wait();
+    }
+}
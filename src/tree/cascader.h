@@ -0,0 +1,71 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_TREE_CASCADER_H_
+#define CASCADB_TREE_CASCADER_H_
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "sys/sys.h"
+
+namespace cascadb {
+
+class Tree;
+class InnerNode;
+
+// Pool of threads cascading full buffers of inner nodes to children
+// in background, shared by all tables of a DB so that the number of
+// threads doesn't grow with tables
+class Cascader {
+public:
+    Cascader(size_t threads);
+
+    // Nodes queued're cascaded before threads exit
+    ~Cascader();
+
+    void start();
+
+    // Queue node to cascade its buffers,
+    // return false if there is no cascade thread running
+    bool schedule(InnerNode *node);
+
+    // Wait until a cascade is done or timeout in milliseconds
+    void wait(unsigned int millisec);
+
+    // Wait for cascades in flight and hold the rest, so that messages
+    // aren't moving between nodes while they're written out
+    void pause();
+
+    void resume();
+
+    // Wait until nodes of tree queued or in flight're all cascaded,
+    // called before tree is destroyed
+    void drain(Tree *tree);
+
+    // Loop of cascade threads
+    void run();
+
+private:
+    size_t                  threads_;
+
+    std::vector<Thread*>    cascaders_;
+    Mutex                   mtx_;
+    // notify cascade threads that nodes're queued or resumed
+    CondVar                 cond_;
+    // notify that a cascade is done
+    CondVar                 cascaded_cond_;
+    std::deque<InnerNode*>  queue_;
+    bool                    alive_;
+    bool                    paused_;
+    // number of cascades in flight
+    size_t                  cascading_;
+    // number of nodes queued or in flight of each tree
+    std::map<Tree*, size_t> pending_;
+};
+
+}
+
+#endif
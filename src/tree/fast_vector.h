@@ -290,6 +290,29 @@ public:
         return it;
     }
 
+    // Return an iterator that points to the element following the erased one.
+    Iterator erase(Iterator it)
+    {
+        assert(it.container_ == this);
+        assert(it.chain_idx_ < chain_.size());
+
+        VectorType *vec = chain_[it.chain_idx_];
+        assert(it.vector_idx_ < vec->size());
+        vec->erase(vec->begin() + it.vector_idx_);
+        size_ --;
+
+        if (vec->size() == 0) {
+            // empty vector isn't allowed in chain
+            delete vec;
+            chain_.erase(chain_.begin() + it.chain_idx_);
+            it.vector_idx_ = 0;
+        } else if (it.vector_idx_ == vec->size()) {
+            it.chain_idx_ ++;
+            it.vector_idx_ = 0;
+        }
+        return it;
+    }
+
 private:
     template<typename KeyType, typename Compare>
     size_t find_vector(const KeyType& key, Compare compare) const
@@ -2,20 +2,65 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <string.h>
 #include <vector>
 #include <algorithm>
 
 #include "msg.h"
 #include "keycomp.h"
+#include "snapshot.h"
 #include "util/bloom.h"
+#include "util/logger.h"
 
 using namespace std;
 using namespace cascadb;
 
+// Order versions of a key from the newest to the oldest
+class SeqComp {
+public:
+    bool operator() (const Msg& left, const Msg& right)
+    {
+        return left.seq > right.seq;
+    }
+};
+
+bool cascadb::range_covered(Comparator *comp, const std::vector<Msg>& ranges,
+                            Slice key, uint64_t& seq)
+{
+    bool ret = false;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (comp->compare(ranges[i].key, key) <= 0 &&
+            comp->compare(key, ranges[i].value) < 0) {
+            if (!ret || ranges[i].seq > seq) {
+                seq = ranges[i].seq;
+            }
+            ret = true;
+        }
+    }
+    return ret;
+}
+
+bool cascadb::merge_value(MergeOperator *op, Slice key, const Slice *existing,
+                          Slice operand, std::string& result)
+{
+    if (op == NULL) {
+        LOG_ERROR("upsert found but no merge operator is set");
+        return false;
+    }
+
+    result.clear();
+    op->merge(key, existing, operand, result);
+    if (result.empty()) {
+        LOG_ERROR("merge operator returns empty value");
+        return false;
+    }
+    return true;
+}
+
 size_t Msg::size() const
 {
-    size_t sz = 1 + 4 + key.size();
-    if (type == Put) {
+    size_t sz = 1 + 8 + 4 + key.size();
+    if (has_value()) {
         sz += (4 + value.size());
     }
     return sz;
@@ -24,18 +69,42 @@ size_t Msg::size() const
 bool Msg::read_from(BlockReader& reader)
 {
     if (!reader.readUInt8((uint8_t*)&type)) return false;
+    if (!reader.readUInt64(&seq)) return false;
     if (!reader.readSlice(key)) return false;
-    if (type == Put) {
+    if (has_value()) {
         if (!reader.readSlice(value)) return false;
     }
     return true;
 }
 
-bool Msg::write_to(BlockWriter& writer)
+// Read a length prefixed slice pointing into the block
+static bool read_slice_in_place(BlockReader& reader, Slice& s)
+{
+    uint32_t sz;
+    if (!reader.readUInt32(&sz) || reader.remain() < sz) return false;
+    s = Slice(reader.addr(), sz);
+    reader.skip(sz);
+    return true;
+}
+
+bool Msg::read_in_place(BlockReader& reader)
+{
+    if (!reader.readUInt8((uint8_t*)&type)) return false;
+    if (!reader.readUInt64(&seq)) return false;
+    if (!read_slice_in_place(reader, key)) return false;
+    value = Slice();
+    if (has_value()) {
+        if (!read_slice_in_place(reader, value)) return false;
+    }
+    return true;
+}
+
+bool Msg::write_to(BlockWriter& writer) const
 {
     if (!writer.writeUInt8((uint8_t)type)) return false;
+    if (!writer.writeUInt64(seq)) return false;
     if (!writer.writeSlice(key)) return false;
-    if (type == Put) {
+    if (has_value()) {
         if (!writer.writeSlice(value)) return false;
     }
     return true;
@@ -44,7 +113,9 @@ bool Msg::write_to(BlockWriter& writer)
 void Msg::destroy()
 {
     switch(type) {
-    case Put: {
+    case Put:
+    case Upsert:
+    case DelRange: {
         key.destroy();
         value.destroy();
     }
@@ -60,80 +131,523 @@ void Msg::destroy()
 
 MsgBuf::~MsgBuf()
 {
-    for(ContainerType::iterator it = container_.begin(); 
-        it != container_.end(); it++ ) {
-        it->destroy();
-    }
+    // keys and values're freed with arena
     container_.clear();
 }
 
 void MsgBuf::write(const Msg& msg)
 {
-    MsgBuf::Iterator it = container_.lower_bound(msg, KeyComp(comp_));
-    if (it == end() || it->key != msg.key) {
-        container_.insert(it, msg);
-        size_ += msg.size();
-    } else {
-        size_ -= it->size();
-        it->destroy();
-        *it = msg;
-        size_ += msg.size();
-    }
+    merge(&msg, &msg + 1);
 }
 
-void MsgBuf::append(MsgBuf::Iterator first, MsgBuf::Iterator last)
+template<typename Iter>
+void MsgBuf::merge(Iter first, Iter last)
 {
+    thaw_for_write();
+
     MsgBuf::Iterator it = container_.begin();
-    MsgBuf::Iterator jt = first;
+    Iter jt = first;
     KeyComp comp(comp_);
 
     while(jt != last) {
-        it = container_.lower_bound(it, jt->key, comp);
-        if (it == container_.end() || it->key != jt->key) {
-            // important, it maybe invalid after insertion
-            it = container_.insert(it, *jt);
-            size_ += jt->size();
-        } else {
-            size_ -= it->size();
-            it->destroy();
-            *it = *jt;
+        Slice key = jt->key;
+        it = container_.lower_bound(it, key, comp);
+
+        // versions of the same key in input're from newest to oldest,
+        // and they're newer than those buffered
+        versions_.clear();
+        for (; jt != last && jt->key == key; jt ++) {
+            versions_.push_back(copy(*jt));
+        }
+        size_t m = 0;
+        for (MsgBuf::Iterator kt = it;
+            kt != container_.end() && kt->key == key; kt ++) {
+            versions_.push_back(*kt);
+            size_ -= kt->size();
+            if (kt->type == DelRange) {
+                remove_range(*kt);
+            }
+            m ++;
+        }
+
+        // pieces of range tombstones split by pivots may be older
+        // than messages buffered
+        if (versions_.size() > 1) {
+            stable_sort(versions_.begin(), versions_.end(), SeqComp());
+        }
+        compact();
+
+        // overwrite older versions in place, insert or erase the rest,
+        // important, it maybe invalid after insertion
+        size_t i = 0;
+        for (; i < versions_.size() && i < m; i++, it++) {
+            *it = versions_[i];
+            size_ += it->size();
+        }
+        for (; i < versions_.size(); i++, it++) {
+            it = container_.insert(it, versions_[i]);
             size_ += it->size();
         }
-        jt ++;
+        for (; i < m; i++) {
+            it = container_.erase(it);
+        }
+
+        for (i = 0; i < versions_.size(); i++) {
+            if (versions_[i].type == DelRange) {
+                add_range(versions_[i]);
+                // it stays a valid hint, only messages after it're erased
+                drop_covered(it, versions_[i]);
+            }
+        }
+    }
+    versions_.clear();
+    shrink();
+}
+
+void MsgBuf::drop_covered(MsgBuf::Iterator it, const Msg& range)
+{
+    Slice key;
+    bool first = true;
+    uint64_t newer_seq = MAX_SEQ;
+    while (it != container_.end() && comp_->compare(it->key, range.value) < 0) {
+        if (first || it->key != key) {
+            // no newer version of key yet
+            key = it->key;
+            newer_seq = MAX_SEQ;
+            first = false;
+        }
+
+        if (it->seq > range.seq) {
+            newer_seq = it->seq;
+            it ++;
+            continue;
+        }
+
+        // range tombstone is right before the newest version older than it
+        uint64_t seq = it->seq;
+        if (newer_seq > range.seq) {
+            newer_seq = range.seq;
+        }
+        if (!visible(seq, newer_seq) && (it->type != DelRange ||
+            comp_->compare(it->value, range.value) <= 0)) {
+            size_ -= it->size();
+            if (it->type == DelRange) {
+                remove_range(*it);
+            }
+            // keys're still valid while comparing
+            discard(*it);
+            it = container_.erase(it);
+        } else {
+            it ++;
+        }
+        newer_seq = seq;
+    }
+}
+
+bool MsgBuf::covered(Slice key, uint64_t snapshot, uint64_t& seq)
+{
+    if (range_count() == 0) {
+        return false;
+    }
+
+    // tombstones of a frozen buffer point into frozen data, which
+    // stays in arena once it's thawed, so it's searched in place.
+    // Those starting after key can't cover it
+    vector<Msg>::iterator end = upper_bound(tombstones_.begin(),
+        tombstones_.end(), key, KeyComp(comp_));
+
+    bool ret = false;
+    for (vector<Msg>::iterator it = tombstones_.begin(); it != end; it++) {
+        if (it->seq <= snapshot && comp_->compare(key, it->value) < 0) {
+            if (!ret || it->seq > seq) {
+                seq = it->seq;
+            }
+            ret = true;
+        }
+    }
+    return ret;
+}
+
+void MsgBuf::add_range(const Msg& range)
+{
+    assert(range.type == DelRange);
+    vector<Msg>::iterator it = upper_bound(tombstones_.begin(),
+        tombstones_.end(), range.key, KeyComp(comp_));
+    tombstones_.insert(it, range);
+}
+
+void MsgBuf::remove_range(const Msg& range)
+{
+    assert(range.type == DelRange);
+    vector<Msg>::iterator it = lower_bound(tombstones_.begin(),
+        tombstones_.end(), range.key, KeyComp(comp_));
+    for (; it != tombstones_.end() && it->key == range.key; it++) {
+        if (it->seq == range.seq && it->value == range.value) {
+            tombstones_.erase(it);
+            return;
+        }
+    }
+    assert(false);
+}
+
+void MsgBuf::compact()
+{
+    // the newest version is always kept
+    size_t n = 1;
+    for (size_t i = 1; i < versions_.size(); i++) {
+        Msg& newer = versions_[n-1];
+        if (!visible(versions_[i].seq, newer.seq) &&
+            fold(newer, versions_[i])) {
+            discard(versions_[i]);
+        } else {
+            versions_[n++] = versions_[i];
+        }
+    }
+    versions_.resize(n);
+}
+
+bool MsgBuf::fold(Msg& newer, const Msg& older)
+{
+    if (older.type == DelRange) {
+        // it covers other keys as well
+        return newer.type == DelRange &&
+            comp_->compare(older.value, newer.value) <= 0;
+    }
+
+    if (newer.type != Upsert) {
+        // older version is overwritten
+        return true;
+    }
+
+    if (older.type == Upsert) {
+        std::string res;
+        if (merge_op_ == NULL ||
+            !merge_op_->combine(newer.key, older.value, newer.value, res)) {
+            return false;
+        }
+        garbage_ += newer.value.size();
+        newer.value = arena_.copy(Slice(res));
+        return true;
+    }
+
+    std::string value;
+    if (!merge_value(merge_op_, newer.key,
+            older.type == Put ? &older.value : NULL, newer.value, value)) {
+        return false;
+    }
+    garbage_ += newer.value.size();
+    newer.type = Put;
+    newer.value = arena_.copy(Slice(value));
+    return true;
+}
+
+bool MsgBuf::visible(uint64_t seq, uint64_t newer_seq)
+{
+    return snapshots_ && snapshots_->visible(seq, newer_seq);
+}
+
+Msg MsgBuf::copy(const Msg& msg)
+{
+    Msg m = msg;
+    m.key = arena_.copy(msg.key);
+    if (msg.has_value()) {
+        m.value = arena_.copy(msg.value);
+    }
+    return m;
+}
+
+void MsgBuf::discard(const Msg& msg)
+{
+    garbage_ += msg.key.size();
+    if (msg.has_value()) {
+        garbage_ += msg.value.size();
+    }
+}
+
+void MsgBuf::shrink()
+{
+    // overwrites of a few keys don't make buffer grow, so that
+    // memory taken is kept in proportion to size()
+    if (garbage_ < ARENA_MIN_BLOCK_SIZE || garbage_ * 2 < arena_.usage()) {
+        return;
+    }
+
+    // no message refers to frozen data after thaw_for_write
+    assert(frozen_data_.size() == 0);
+    Arena arena;
+    tombstones_.clear();
+    for (ContainerType::iterator it = container_.begin();
+        it != container_.end(); it++ ) {
+        it->key = arena.copy(it->key);
+        if (it->has_value()) {
+            it->value = arena.copy(it->value);
+        }
+        // messages're ordered by key, so're tombstones
+        if (it->type == DelRange) {
+            tombstones_.push_back(*it);
+        }
     }
+    arena_.swap(arena);
+    garbage_ = 0;
+}
+
+void MsgBuf::append(MsgBuf::Iterator first, MsgBuf::Iterator last)
+{
+    merge(first, last);
+}
+
+void MsgBuf::append(const Msg *first, const Msg *last)
+{
+    merge(first, last);
 }
 
 MsgBuf::Iterator MsgBuf::find(Slice key)
 {
+    thaw();
     return container_.lower_bound(key, KeyComp(comp_));
 }
 
+MsgBuf::Cursor MsgBuf::find(Slice key, uint64_t snapshot)
+{
+    // checked once, frozen messages stay valid if
+    // buffer is thawed by another reader meanwhile
+    Cursor c(this, key, frozen());
+    if (c.frozen_) {
+        c.idx_ = frozen_lower_bound(key);
+    } else {
+        c.it_ = container_.lower_bound(key, KeyComp(comp_));
+    }
+    for (c.load(); c.valid() && c.msg().seq > snapshot; c.next()) {
+        ;
+    }
+    return c;
+}
+
+void MsgBuf::Cursor::next()
+{
+    assert(valid_);
+    if (frozen_) {
+        idx_ ++;
+    } else {
+        it_ ++;
+    }
+    load();
+}
+
+void MsgBuf::Cursor::load()
+{
+    if (frozen_) {
+        valid_ = idx_ < mb_->offsets_.size();
+        if (valid_) {
+            msg_ = mb_->frozen_msg(idx_);
+        }
+    } else {
+        valid_ = it_ != mb_->container_.end();
+        if (valid_) {
+            msg_ = *it_;
+        }
+    }
+    valid_ = valid_ && msg_.key == key_;
+}
+
+Msg MsgBuf::frozen_msg(size_t idx) const
+{
+    // offsets're validated as buffer is read
+    Block block(frozen_data_, 0, frozen_data_.size());
+    BlockReader reader(&block);
+    reader.seek(offsets_[idx]);
+    Msg msg;
+    bool ok = msg.read_in_place(reader);
+    assert(ok);
+    (void) ok;
+    return msg;
+}
+
+size_t MsgBuf::frozen_lower_bound(Slice key) const
+{
+    size_t left = 0, right = offsets_.size();
+    while (left < right) {
+        size_t mid = left + (right - left) / 2;
+        if (comp_->compare(frozen_msg(mid).key, key) < 0) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return left;
+}
+
+void MsgBuf::thaw()
+{
+    if (!frozen()) {
+        return;
+    }
+
+    ScopedMutex lock(&thaw_mtx_);
+    if (!frozen()) {
+        return;
+    }
+    // keys and values point into frozen data, nothing is copied
+    for (size_t i = 0; i < offsets_.size(); i++) {
+        container_.push_back(frozen_msg(i));
+    }
+    frozen_.set(0);
+}
+
+void MsgBuf::thaw_for_write()
+{
+    thaw();
+    if (offsets_.size() || frozen_data_.size()) {
+        std::vector<uint32_t>().swap(offsets_);
+        // frozen data is left in arena, the room taken by
+        // serialized headers is counted as wasted
+        size_t payload = 0;
+        for (ContainerType::iterator it = container_.begin();
+            it != container_.end(); it++ ) {
+            payload += it->key.size() + it->value.size();
+        }
+        garbage_ += frozen_data_.size() - payload;
+        frozen_data_ = Slice();
+    }
+}
+
+void MsgBuf::split(Slice key, MsgBuf *right)
+{
+    assert(right->count() == 0);
+    thaw_for_write();
+
+    vector<Msg> pieces;
+    MsgBuf::Iterator it = container_.begin();
+    for (; it != container_.end() && comp_->compare(it->key, key) < 0; it++) {
+        if (it->type == DelRange && comp_->compare(it->value, key) > 0) {
+            // copied by right, old value stays in arena meanwhile
+            Msg piece(DelRange, key, it->value);
+            piece.seq = it->seq;
+            pieces.push_back(piece);
+            size_ -= it->size();
+            garbage_ += it->value.size();
+            remove_range(*it);
+            it->value = arena_.copy(key);
+            add_range(*it);
+            size_ += it->size();
+        }
+    }
+
+    vector<Msg> msgs;
+    while (it != container_.end()) {
+        size_ -= it->size();
+        if (it->type == DelRange) {
+            remove_range(*it);
+        }
+        discard(*it);
+        msgs.push_back(*it);
+        it = container_.erase(it);
+    }
+
+    if (msgs.size()) {
+        right->append(&msgs[0], &msgs[0] + msgs.size());
+    }
+    if (pieces.size()) {
+        // pieces're ordered by seq as they're merged
+        right->append(&pieces[0], &pieces[0] + pieces.size());
+    }
+    shrink();
+}
+
 void MsgBuf::clear()
 {
     container_.clear();
+    arena_.clear();
     size_ = 0;
+    tombstones_.clear();
+    garbage_ = 0;
+    frozen_data_ = Slice();
+    std::vector<uint32_t>().swap(offsets_);
+    frozen_.set(0);
 }
 
 bool MsgBuf::read_from(BlockReader& reader)
 {
+    assert(count() == 0);
+
     uint32_t cnt = 0;
     if (!reader.readUInt32(&cnt)) return false;
-    // container_.resize(cnt);
-    // for (size_t i = 0; i < cnt; i++ ) {
-    //     if (!container_[i].read_from(reader)) return false;
-    //     size_ += container_[i].size();
-    // }
+
+    // only offsets're taken, messages're parsed as they're searched
+    const char *start = reader.addr();
+    size_t pos = reader.pos();
+    vector<size_t> ranges;
+    offsets_.reserve(cnt);
     for (size_t i = 0; i < cnt; i++ ) {
+        offsets_.push_back(reader.pos() - pos);
         Msg msg;
-        if (!msg.read_from(reader)) return false;
+        if (!msg.read_in_place(reader)) {
+            std::vector<uint32_t>().swap(offsets_);
+            size_ = 0;
+            return false;
+        }
         size_ += msg.size();
-        container_.push_back(msg);
+        if (msg.type == DelRange) {
+            ranges.push_back(i);
+        }
+    }
+
+    if (cnt) {
+        // block is reused once buffer is read
+        frozen_data_ = arena_.copy(Slice(start, reader.pos() - pos));
+        // range tombstones're parsed ahead, so that buffer isn't
+        // thawed to look for them
+        for (size_t i = 0; i < ranges.size(); i++) {
+            tombstones_.push_back(frozen_msg(ranges[i]));
+        }
+        frozen_.set(1);
     }
     return true;
 }
 
+bool MsgBuf::read_legacy(BlockReader& reader)
+{
+    uint32_t cnt = 0;
+    if (!reader.readUInt32(&cnt)) return false;
+
+    // only puts and dels're written then, without seqs
+    vector<Msg> msgs;
+    size_t length = 4;
+    for (size_t i = 0; i < cnt; i++) {
+        Msg msg;
+        if (!reader.readUInt8((uint8_t*)&msg.type)) return false;
+        if (msg.type != Put && msg.type != Del) return false;
+        if (!read_slice_in_place(reader, msg.key)) return false;
+        if (msg.type == Put) {
+            if (!read_slice_in_place(reader, msg.value)) return false;
+        }
+        length += msg.size();
+        msgs.push_back(msg);
+    }
+
+    Slice data = Slice::alloc(length);
+    Block block(data, 0, 0);
+    BlockWriter writer(&block);
+    writer.writeUInt32(cnt);
+    for (size_t i = 0; i < msgs.size(); i++) {
+        msgs[i].write_to(writer);
+    }
+    assert(block.size() == length);
+
+    BlockReader rr(&block);
+    bool ret = read_from(rr);
+    data.destroy();
+    return ret;
+}
+
 bool MsgBuf::write_to(BlockWriter& writer)
 {
+    if (frozen()) {
+        // unchanged since it's read, so it's written as it is
+        if (!writer.writeUInt32(offsets_.size())) return false;
+        return writer.writeBytes(frozen_data_);
+    }
+
     if (!writer.writeUInt32(container_.size())) return false;
     for (ContainerType::iterator it = container_.begin();
         it != container_.end(); it ++ ) {
@@ -145,12 +659,25 @@ bool MsgBuf::write_to(BlockWriter& writer)
 void MsgBuf::get_filter(std::string* filter)
 {
     std::vector<Slice> key_slices;
-    key_slices.reserve(container_.size());
+    key_slices.reserve(count());
 
-    for(ContainerType::iterator it = container_.begin(); 
-        it != container_.end(); it++ ) {
-        key_slices.push_back(it->key);
+    if (frozen()) {
+        for (size_t i = 0; i < offsets_.size(); i++) {
+            key_slices.push_back(frozen_msg(i).key);
+        }
+    } else {
+        for(ContainerType::iterator it = container_.begin(); 
+            it != container_.end(); it++ ) {
+            key_slices.push_back(it->key);
+        }
     }
 
+    size_t offset = filter->size();
     bloom_create(&key_slices[0], key_slices.size(), filter);
+
+    // keys covered by range tombstones aren't in filter,
+    // so it should match any key
+    if (range_count()) {
+        memset(&(*filter)[offset], 0xff, filter->size() - offset - 1);
+    }
 }
@@ -6,11 +6,14 @@
 #define CASCADB_MSG_H_
 
 #include <assert.h>
+#include <vector>
 
 #include "cascadb/slice.h"
 #include "cascadb/comparator.h"
+#include "cascadb/merge_operator.h"
 #include "serialize/block.h"
 #include "sys/sys.h"
+#include "util/arena.h"
 #include "fast_vector.h"
 
 // Implement message and message buffer
@@ -22,14 +25,16 @@ enum MsgType {
     _Msg, // uninitialized state
     Put,
     Del,
+    Upsert, // applied to the older version with merge operator
+    DelRange, // delete keys in [key, value)
 };
 
 class Msg {
 public:
-    Msg() : type(_Msg) {}
+    Msg() : type(_Msg), seq(0) {}
     
     Msg(MsgType t, Slice k, Slice v = Slice())
-    : type(t), key(k), value(v)
+    : type(t), seq(0), key(k), value(v)
     {
     }
     
@@ -45,34 +50,83 @@ public:
         type = Del;
         key = k;
     }
+
+    void set_upsert(Slice k, Slice v)
+    {
+        type = Upsert;
+        key = k;
+        value = v;
+    }
+
+    void set_del_range(Slice begin, Slice end)
+    {
+        type = DelRange;
+        key = begin;
+        value = end;
+    }
+
+    // all but Del carry a value
+    bool has_value() const
+    {
+        return type == Put || type == Upsert || type == DelRange;
+    }
     
     size_t size() const;
     
     bool read_from(BlockReader& reader);
+
+    // Key and value point into the block, nothing is copied
+    bool read_in_place(BlockReader& reader);
     
-    bool write_to(BlockWriter& writer);
+    bool write_to(BlockWriter& writer) const;
 
     void destroy();
 
     MsgType type;
+    // sequence number assigned when message enters the tree,
+    // used to tell versions visible to snapshots
+    uint64_t seq;
     Slice key;
     Slice value;
 };
 
-// Store all messages buffered for a child node
+class SnapshotList;
+
+// Apply operand of upsert to the existing value of key, existing is NULL
+// if key doesn't exist
+bool merge_value(MergeOperator *op, Slice key, const Slice *existing,
+                 Slice operand, std::string& result);
+
+// Return true if key is covered by any of range tombstones,
+// seq is set to the newest one covering it
+bool range_covered(Comparator *comp, const std::vector<Msg>& ranges,
+                   Slice key, uint64_t& seq);
+
+// Store all messages buffered for a child node.
+// Multiple versions of a key're ordered from the newest to the oldest,
+// older versions're kept only if they're visible to live snapshots,
+// or an upsert newer than them can't be folded into them.
+// Keys and values're copied into arena of the buffer as messages're
+// written, callers keep their own copies, and they're all freed at
+// once as the buffer is cleared or destroyed.
+// A buffer read from disk is frozen, messages're kept serialized with
+// an array of their offsets, and looked up with binary search in place.
+// It's thawed into the mutable form once it's written or iterated
 class MsgBuf {
 public:
-    MsgBuf(Comparator *comp)
-    : comp_(comp), size_(0)
+    MsgBuf(Comparator *comp, SnapshotList *snapshots = NULL,
+           MergeOperator *merge_op = NULL)
+    : comp_(comp), snapshots_(snapshots), merge_op_(merge_op),
+      size_(0), garbage_(0), frozen_(0)
     {
     }
     
     ~MsgBuf();
     
-    // Write a single Msg into MsgBuf
+    // Write a single Msg into MsgBuf as the newest version
     void write(const Msg& msg);
     
-    // Clear all Msg objects buffered but not destroy them
+    // Drop all Msg objects buffered and free their memory
     void clear();
     
     // You should lock MsgBuf before use iterator related operations
@@ -96,26 +150,86 @@ public:
     
     typedef ContainerType::iterator Iterator;
     
-    Iterator begin() { return container_.begin(); }
+    // Iterators thaw the buffer
+    Iterator begin() { thaw(); return container_.begin(); }
     
-    Iterator end() { return container_.end(); }
+    Iterator end() { thaw(); return container_.end(); }
+
+    // Versions of a key from the newest to the oldest,
+    // they're parsed in place if the buffer is frozen
+    class Cursor {
+    public:
+        bool valid() const { return valid_; }
+
+        // valid until buffer is unlocked
+        const Msg& msg() const { return msg_; }
+
+        void next();
+
+    private:
+        friend class MsgBuf;
+
+        Cursor(MsgBuf *mb, Slice key, bool frozen)
+        : mb_(mb), key_(key), frozen_(frozen), idx_(0), valid_(false)
+        {
+        }
+
+        // load message at the position, invalid once key changes
+        void load();
+
+        MsgBuf      *mb_;
+        Slice       key_;
+        bool        frozen_;
+        size_t      idx_;
+        Iterator    it_;
+        Msg         msg_;
+        bool        valid_;
+    };
     
-    // Append range of Msg objects from another MsgBuf
+    // Append range of Msg objects from another MsgBuf,
+    // they're newer than those buffered
     void append(Iterator first, Iterator last);
 
+    // Append sorted array of Msg objects, versions of a key
+    // should be ordered from newest to oldest
+    void append(const Msg *first, const Msg *last);
+
     // Find the whole buffer for the input key,
     // Return position of the first element no less than the input key,
-    // aka the first element equal or bigger than the input key
+    // aka the first element equal or bigger than the input key,
+    // which is the newest version if key exists
     Iterator find(Slice key);
+
+    // Find the newest version of key no newer than snapshot,
+    // older versions follow it if it's an upsert.
+    // The cursor is invalid if there is no such version,
+    // a frozen buffer is searched without being thawed
+    Cursor find(Slice key, uint64_t snapshot);
+
+    // Move messages no less than key into empty right,
+    // range tombstones crossing key're clipped at it
+    void split(Slice key, MsgBuf *right);
     
     // Return the number of messages buffered
-    size_t count() const
+    size_t count()
     {
-        return container_.size();
+        return frozen() ? offsets_.size() : container_.size();
     }
+
+    // Return the number of range tombstones buffered
+    size_t range_count() const
+    {
+        return tombstones_.size();
+    }
+
+    // Return true if key is covered by a range tombstone no newer than
+    // snapshot, seq is set to the newest one.
+    // Only range tombstones starting no later than key're searched
+    bool covered(Slice key, uint64_t snapshot, uint64_t& seq);
     
-    const Msg& get(size_t idx) const
+    const Msg& get(size_t idx)
     {
+        thaw();
         assert(idx >= 0 && idx < container_.size());
         return container_[idx];
     }
@@ -126,7 +240,25 @@ public:
         return 4 + size_;
     }
 
+    // Return bytes taken in memory, messages and their arena included
+    size_t memory_usage() const
+    {
+        return (container_.size() + tombstones_.size()) * sizeof(Msg) +
+               offsets_.size() * sizeof(uint32_t) + arena_.usage();
+    }
+
+    bool frozen() { return frozen_.get(); }
+
+    // Convert frozen buffer into the mutable form, it's done once
+    // even if buffer is only read locked
+    void thaw();
+
+    // Read messages into a frozen buffer
     bool read_from(BlockReader& reader);
+
+    // Read messages written before seqs, they're converted into
+    // the current format with seq 0, and frozen as well
+    bool read_legacy(BlockReader& reader);
     
     bool write_to(BlockWriter& writer);
 
@@ -134,10 +266,70 @@ public:
     void  get_filter(std::string* filter);
     
 private:
+    template<typename Iter>
+    void merge(Iter first, Iter last);
+
+    // Drop versions in versions_ invisible to any snapshot,
+    // upserts right before them're folded
+    void compact();
+
+    // Fold the older version into the newer one,
+    // Return false if they have to be kept apart
+    bool fold(Msg& newer, const Msg& older);
+
+    // Drop messages after it covered by range tombstone,
+    // which're invisible to any snapshot
+    void drop_covered(Iterator it, const Msg& range);
+
+    bool visible(uint64_t seq, uint64_t newer_seq);
+
+    // Keep tombstones_ in step with range tombstones in buffer
+    void add_range(const Msg& range);
+
+    void remove_range(const Msg& range);
+
+    // Copy key and value of msg into arena
+    Msg copy(const Msg& msg);
+
+    // Count memory of msg dropped from buffer as wasted
+    void discard(const Msg& msg);
+
+    // Copy messages into a new arena once most of it is wasted
+    void shrink();
+
+    // Thaw buffer write locked before it's modified, frozen
+    // messages're dropped since nobody else can read them
+    void thaw_for_write();
+
+    // Parse the idx-th message of frozen buffer
+    Msg frozen_msg(size_t idx) const;
+
+    // Return the first message no less than key in frozen buffer
+    size_t frozen_lower_bound(Slice key) const;
+
     Comparator          *comp_;
+    SnapshotList        *snapshots_;
+    MergeOperator       *merge_op_;
     mutable RWLock      lock_;
     ContainerType       container_;
     size_t              size_;
+    // copies of range tombstones buffered, ordered by their
+    // beginnings, keys and values're shared with messages
+    std::vector<Msg>    tombstones_;
+
+    Arena               arena_;
+    // bytes of keys and values dropped but not freed yet
+    size_t              garbage_;
+
+    // messages serialized in arena while buffer is frozen,
+    // they're still referred to by messages thawed
+    Slice                   frozen_data_;
+    std::vector<uint32_t>   offsets_;
+    Atomic<uint32_t>        frozen_;
+    Mutex                   thaw_mtx_;
+
+    // versions of a key being merged, reused across writes
+    std::vector<Msg>    versions_;
 };
 
 }
@@ -13,15 +13,140 @@
 #include "util/logger.h"
 #include "util/crc16.h"
 #include "util/bloom.h"
+#include "util/epoch.h"
 
 using namespace std;
 using namespace cascadb;
 
+/********************************************************
+                        DirtyQueue
+*********************************************************/
+
+DirtyQueue::DirtyQueue(Atomic<size_t> *total)
+: head_(NULL),
+  tail_(NULL),
+  count_(0),
+  size_(0),
+  total_(total)
+{
+}
+
+void DirtyQueue::link(Node *node, size_t size)
+{
+    ScopedMutex lock(&mtx_);
+    node->charged_size_ = size;
+    total_->add(size);
+    if (node->is_dirty()) {
+        push_back(node);
+    }
+}
+
+void DirtyQueue::unlink(Node *node)
+{
+    ScopedMutex lock(&mtx_);
+    if (node->queued_) {
+        erase(node);
+    }
+    total_->sub(node->charged_size_);
+    node->charged_size_ = 0;
+}
+
+void DirtyQueue::set_dirty(Node *node, bool dirty, size_t size)
+{
+    ScopedMutex lock(&mtx_);
+    if (dirty) {
+        charge_locked(node, size);
+        if (!node->queued_) {
+            push_back(node);
+        }
+    } else if (node->queued_) {
+        erase(node);
+    }
+}
+
+void DirtyQueue::charge(Node *node, size_t size)
+{
+    ScopedMutex lock(&mtx_);
+    charge_locked(node, size);
+}
+
+void DirtyQueue::charge_locked(Node *node, size_t size)
+{
+    size_t old = node->charged_size_;
+    if (size >= old) {
+        total_->add(size - old);
+        if (node->queued_) size_.add(size - old);
+    } else {
+        total_->sub(old - size);
+        if (node->queued_) size_.sub(old - size);
+    }
+    node->charged_size_ = size;
+}
+
+void DirtyQueue::pick(uint64_t expire, bool all, size_t goal, std::vector<Node*>& nodes)
+{
+    ScopedMutex lock(&mtx_);
+    size_t picked = 0;
+    for (Node *node = head_; node && picked < goal; node = node->dirty_next_) {
+        if (!all && node->get_first_write_timestamp() >= expire) {
+            break;
+        }
+        // do not write node until last write is completed
+        if (node->is_flushing() || node->pin() || node->is_dead()) {
+            continue;
+        }
+        node->inc_ref();
+        nodes.push_back(node);
+        picked += node->charged_size_;
+    }
+}
+
+size_t DirtyQueue::count()
+{
+    ScopedMutex lock(&mtx_);
+    return count_;
+}
+
+void DirtyQueue::push_back(Node *node)
+{
+    assert(!node->queued_);
+    node->queued_ = true;
+    node->dirty_prev_ = tail_;
+    node->dirty_next_ = NULL;
+    if (tail_) {
+        tail_->dirty_next_ = node;
+    } else {
+        head_ = node;
+    }
+    tail_ = node;
+    count_ ++;
+    size_.add(node->charged_size_);
+}
+
+void DirtyQueue::erase(Node *node)
+{
+    assert(node->queued_);
+    if (node->dirty_prev_) {
+        node->dirty_prev_->dirty_next_ = node->dirty_next_;
+    } else {
+        head_ = node->dirty_next_;
+    }
+    if (node->dirty_next_) {
+        node->dirty_next_->dirty_prev_ = node->dirty_prev_;
+    } else {
+        tail_ = node->dirty_prev_;
+    }
+    node->dirty_prev_ = node->dirty_next_ = NULL;
+    node->queued_ = false;
+    count_ --;
+    size_.sub(node->charged_size_);
+}
+
 /********************************************************
                         SchemaNode 
 *********************************************************/
 
-#define SCHEMA_NODE_SIZE 32
+#define SCHEMA_NODE_SIZE 40
 
 size_t SchemaNode::size()
 {
@@ -39,6 +164,10 @@ bool SchemaNode::read_from(BlockReader& reader, bool skeleton_only)
     if (!reader.readUInt64(&next_inner_node_id)) return false;
     if (!reader.readUInt64(&next_leaf_node_id)) return false;
     if (!reader.readUInt64(&tree_depth)) return false;
+    // absent in older files
+    if (reader.remain() >= 8) {
+        if (!reader.readUInt64(&last_seq)) return false;
+    }
 
     return true;
 }
@@ -49,31 +178,127 @@ bool SchemaNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     if (!writer.writeUInt64(next_inner_node_id)) return false;
     if (!writer.writeUInt64(next_leaf_node_id)) return false;
     if (!writer.writeUInt64(tree_depth)) return false;
+    if (!writer.writeUInt64(last_seq)) return false;
     skeleton_size = SCHEMA_NODE_SIZE;
     return true;
 }
 
+/********************************************************
+                        ScanRange
+*********************************************************/
+
+void ScanRange::destroy()
+{
+    if (has_lower) {
+        lower.destroy();
+        has_lower = false;
+    }
+    if (has_upper) {
+        upper.destroy();
+        has_upper = false;
+    }
+
+    for (size_t i = 0; i < records.size(); i++) {
+        records[i].key.destroy();
+        records[i].value.destroy();
+    }
+    records.clear();
+
+    for (size_t i = 0; i < msgs.size(); i++) {
+        for (size_t j = 0; j < msgs[i].size(); j++) {
+            msgs[i][j].destroy();
+        }
+    }
+    msgs.clear();
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        for (size_t j = 0; j < ranges[i].size(); j++) {
+            ranges[i][j].destroy();
+        }
+    }
+    ranges.clear();
+}
+
+/********************************************************
+                        DataNode
+*********************************************************/
+
+bool DataNode::begin_loading(size_t idx)
+{
+    ScopedMutex lock(&load_mtx_);
+    if (loading_.count(idx) == 0) {
+        loading_.insert(idx);
+        return true;
+    }
+
+    // release read lock so that the loader can install the buffer
+    unlock();
+    while (loading_.count(idx)) {
+        load_cond_.wait();
+    }
+    lock.unlock();
+    read_lock();
+    return false;
+}
+
+void DataNode::end_loading(size_t idx)
+{
+    ScopedMutex lock(&load_mtx_);
+    loading_.erase(idx);
+    load_cond_.notify_all();
+}
+
 /********************************************************
                         InnerNode
 *********************************************************/
 
+PivotRoute::~PivotRoute()
+{
+    if (first_filter.size()) {
+        first_filter.destroy();
+    }
+    for (size_t i = 0; i < pivots.size(); i++) {
+        pivots[i].key.destroy();
+        if (pivots[i].filter.size()) {
+            pivots[i].filter.destroy();
+        }
+    }
+}
+
+int PivotRoute::find_pivot(Comparator *comp, Slice k)
+{
+    vector<Pivot>::iterator it = std::upper_bound(pivots.begin(),
+        pivots.end(), k, KeyComp(comp));
+    return distance(pivots.begin(), it);
+}
+
 InnerNode::~InnerNode()
 {
-    delete first_msgbuf_;
+    // msgbufs moved to other nodes may be still seen by readers
+    // through outdated routes
+    if (first_msgbuf_) {
+        epoch_retire(first_msgbuf_);
+    }
     first_msgbuf_ = NULL;
     for(vector<Pivot>::iterator it = pivots_.begin();
         it != pivots_.end(); it++) {
         it->key.destroy();
-        delete it->msgbuf;
+        if (it->msgbuf) {
+            epoch_retire(it->msgbuf);
+        }
     }
     pivots_.clear();
+
+    // no reader can see it since node isn't referenced
+    delete route_.get();
 }
 
 void InnerNode::init_empty_root()
 {
     assert(first_msgbuf_ == NULL);
     // create the first child for root
-    first_msgbuf_ = new MsgBuf(tree_->options_.comparator);
+    first_msgbuf_ = new MsgBuf(tree_->options_.comparator,
+                               &tree_->snapshots_, tree_->options_.merge_operator);
     msgbufsz_ = first_msgbuf_->size();
     bottom_ = true;
     set_dirty(true);
@@ -95,6 +320,51 @@ bool InnerNode::write(const Msg& m)
     return true;
 }
 
+bool InnerNode::write_batch(std::vector<Msg>& msgs)
+{
+    if (msgs.empty()) {
+        return true;
+    }
+
+    read_lock();
+    if (status_ == kSkeletonLoaded) {
+        load_all_msgbuf();
+    }
+    unlock();
+
+    // node won't be unloaded since it's referenced
+    write_lock();
+
+    vector<Msg> pieces;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (msgs[i].type == DelRange) {
+            clip_range(msgs[i], find_pivot(msgs[i].key), pieces);
+        }
+    }
+
+    // messages between two pivots go to the same buffer in a single append
+    const Msg *first = &msgs[0];
+    const Msg *last = first + msgs.size();
+    const Msg *rs = first;
+    while (rs != last) {
+        int idx = find_pivot(rs->key);
+        const Msg *re = last;
+        if ((size_t)idx < pivots_.size()) {
+            re = std::lower_bound(rs, last, pivots_[idx].key,
+                KeyComp(tree_->options_.comparator));
+        }
+        insert_msgbuf(rs, re, idx);
+        rs = re;
+    }
+    insert_pieces(pieces);
+    set_dirty(true);
+    unlock();
+
+    read_lock();
+    maybe_cascade();
+    return true;
+}
+
 bool InnerNode::cascade(MsgBuf *mb, InnerNode* parent){
     read_lock();
 
@@ -108,12 +378,52 @@ bool InnerNode::cascade(MsgBuf *mb, InnerNode* parent){
     size_t oldcnt = mb->count();
     size_t oldsz = mb->size();
 
+    append_msgbuf(mb);
+
+    // clear message buffer and modify parent's status
+    mb->clear();
+    parent->account(mb->count() - oldcnt, mb->size() - oldsz);
+
+    // unlock message buffer
+    mb->unlock();
+    // crab walk
+    parent->unlock();
+
+    set_dirty(true);
+    maybe_cascade();
+    
+    return true;
+}
+
+void InnerNode::merge_msgbuf(MsgBuf *mb)
+{
+    read_lock();
+
+    if (status_ == kSkeletonLoaded) {
+        load_all_msgbuf();
+    }
+
+    append_msgbuf(mb);
+    mb->clear();
+
+    set_dirty(true);
+    maybe_cascade();
+}
+
+void InnerNode::append_msgbuf(MsgBuf *mb)
+{
+    // range tombstones crossing pivots're split
+    vector<Msg> pieces;
+
     MsgBuf::Iterator rs, it, end;
     rs = it = mb->begin(); // range start
     end = mb->end(); // range end
     size_t i = 0;
     while (it != end && i < pivots_.size()) {
         if( comp_pivot(it->key, i) < 0 ) {
+            if (it->type == DelRange) {
+                clip_range(*it, i, pieces);
+            }
             it ++;
         } else {
             if (rs != it) {
@@ -126,21 +436,7 @@ bool InnerNode::cascade(MsgBuf *mb, InnerNode* parent){
     if(rs != end) {
         insert_msgbuf(rs, end, i);
     }
-
-    // clear message buffer and modify parent's status
-    mb->clear();
-    parent->msgcnt_ = parent->msgcnt_ + mb->count() - oldcnt;
-    parent->msgbufsz_ = parent->msgbufsz_ + mb->size() - oldsz;
-
-    // unlock message buffer
-    mb->unlock();
-    // crab walk
-    parent->unlock();
-
-    set_dirty(true);
-    maybe_cascade();
-    
-    return true;
+    insert_pieces(pieces);
 }
 
 int InnerNode::comp_pivot(Slice k, int i)
@@ -190,6 +486,22 @@ int InnerNode::find_pivot(Slice k)
     return distance(pivots_.begin(), first);
 }
 
+int InnerNode::scan_pivot(Slice k, bool backward)
+{
+    if (k.empty()) {
+        return backward ? pivots_.size() : 0;
+    }
+
+    if (!backward) {
+        return find_pivot(k);
+    }
+
+    // the child right before k, whose keys're all less than k
+    vector<Pivot>::iterator it = std::lower_bound(pivots_.begin(),
+        pivots_.end(), k, KeyComp(tree_->options_.comparator));
+    return distance(pivots_.begin(), it);
+}
+
 MsgBuf* InnerNode::msgbuf(int idx)
 {
     assert(idx >= 0 && (size_t)idx <= pivots_.size());
@@ -240,6 +552,8 @@ void InnerNode::set_child(int idx, bid_t c)
     } else {
         pivots_[idx-1].child = c;
     }
+    // it's done with read lock
+    invalidate_route();
 }
 
 void InnerNode::insert_msgbuf(const Msg& m, int idx)
@@ -251,10 +565,13 @@ void InnerNode::insert_msgbuf(const Msg& m, int idx)
     size_t oldcnt = b->count();
     size_t oldsz = b->size();
 
-    b->write(m);
+    // sequence number is assigned with msgbuf locked, so that
+    // the message is visible to all snapshots acquired afterwards
+    Msg msg = m;
+    msg.seq = tree_->next_seq();
+    b->write(msg);
 
-    msgcnt_ = msgcnt_ + b->count() - oldcnt;
-    msgbufsz_ = msgbufsz_ + b->size() - oldsz;
+    account(b->count() - oldcnt, b->size() - oldsz);
     b->unlock();
 }
 
@@ -270,11 +587,70 @@ void InnerNode::insert_msgbuf(MsgBuf::Iterator begin,
 
     b->append(begin, end);
 
-    msgcnt_ = msgcnt_ + b->count() - oldcnt;
-    msgbufsz_ = msgbufsz_ + b->size() - oldsz;
+    account(b->count() - oldcnt, b->size() - oldsz);
     b->unlock();
 }
 
+void InnerNode::insert_msgbuf(const Msg *begin, const Msg *end, int idx)
+{
+    MsgBuf *b = msgbuf(idx);
+    assert(b);
+
+    b->write_lock();
+    size_t oldcnt = b->count();
+    size_t oldsz = b->size();
+
+    b->append(begin, end);
+
+    account(b->count() - oldcnt, b->size() - oldsz);
+    b->unlock();
+}
+
+void InnerNode::clip_range(Msg& m, int idx, std::vector<Msg>& pieces)
+{
+    Comparator *comp = tree_->options_.comparator;
+    if ((size_t)idx == pivots_.size() || comp->compare(m.value, pivots_[idx].key) <= 0) {
+        return;
+    }
+
+    // pieces refer to pivot keys, they're copied as they're
+    // written into buffers, before pivots can be modified
+    for (size_t i = idx + 1; i <= pivots_.size(); i++) {
+        Msg piece(DelRange, pivots_[i-1].key);
+        piece.seq = m.seq;
+        if (i < pivots_.size() && comp->compare(m.value, pivots_[i].key) > 0) {
+            piece.value = pivots_[i].key;
+            pieces.push_back(piece);
+        } else {
+            piece.value = m.value;
+            pieces.push_back(piece);
+            break;
+        }
+    }
+
+    m.value = pivots_[idx].key;
+}
+
+void InnerNode::insert_pieces(std::vector<Msg>& pieces)
+{
+    if (pieces.empty()) {
+        return;
+    }
+
+    KeyComp comp(tree_->options_.comparator);
+    stable_sort(pieces.begin(), pieces.end(), comp);
+
+    const Msg *first = &pieces[0];
+    const Msg *last = first + pieces.size();
+    const Msg *rs = first;
+    while (rs != last) {
+        int idx = find_pivot(rs->key);
+        const Msg *re = std::upper_bound(rs, last, rs->key, comp);
+        insert_msgbuf(rs, re, idx);
+        rs = re;
+    }
+}
+
 int InnerNode::find_msgbuf_maxcnt()
 {
     int idx = 0, ret = 0;
@@ -310,30 +686,83 @@ int InnerNode::find_msgbuf_maxsz()
 }
 
 void InnerNode::maybe_cascade()
+{
+    size_t maxcnt = tree_->options_.inner_node_msg_count;
+    size_t maxsz = tree_->options_.inner_node_page_size;
+    if (msgcnt_ < maxcnt && size() < maxsz) {
+        unlock();
+        return;
+    }
+
+    if (tree_->schedule_cascade(this)) {
+        unlock();
+        return;
+    }
+    cascade_largest();
+}
+
+bool InnerNode::overflowed()
+{
+    size_t maxcnt = tree_->options_.inner_node_msg_count;
+    size_t maxsz = tree_->options_.inner_node_page_size;
+    size_t factor = max(tree_->options_.cascade_stall_factor, 1U);
+
+    // beware of overflow of unlimited count
+    return (maxcnt <= ((size_t)-1) / factor && msgcnt_ >= maxcnt * factor) ||
+           size() >= maxsz * factor;
+}
+
+void InnerNode::background_cascade()
+{
+    read_lock();
+
+    // lock is released while msgbufs're loaded
+    if (status_ == kSkeletonLoaded && !is_dead()) {
+        load_all_msgbuf();
+    }
+
+    // merged or collapsed since queued
+    if (is_dead()) {
+        unlock();
+        return;
+    }
+
+    if (msgcnt_ < tree_->options_.inner_node_msg_count &&
+        size() < tree_->options_.inner_node_page_size) {
+        unlock();
+        return;
+    }
+    cascade_largest();
+}
+
+void InnerNode::cascade_largest()
 {
     int idx = -1;
     if (msgcnt_ >= tree_->options_.inner_node_msg_count) {
         idx = find_msgbuf_maxcnt();
-    } else if (size() >= tree_->options_.inner_node_page_size) {
-        idx = find_msgbuf_maxsz();
     } else {
-        unlock();
-        return;
+        idx = find_msgbuf_maxsz();
     }
    
     assert(idx >= 0);
     MsgBuf* b = msgbuf(idx);
     bid_t nid = child(idx);
 
-    DataNode *node = NULL;
     if (nid == NID_NIL) {
-        // cannot be inner node
+        // cannot be inner node,
+        // buffers cascading to the same child're serialized by its lock
         assert(bottom_);
-        node = tree_->new_leaf_node();
-        set_child(idx, node->nid());
-    } else {
-        node = tree_->load_node(nid, false);
+        b->write_lock();
+        nid = child(idx);
+        if (nid == NID_NIL) {
+            LeafNode *leaf = tree_->new_leaf_node();
+            nid = leaf->nid();
+            set_child(idx, nid);
+            leaf->dec_ref();
+        }
+        b->unlock();
     }
+    DataNode *node = tree_->load_node(nid, false);
     assert(node);
     node->cascade(b, this);
     node->dec_ref();
@@ -341,28 +770,31 @@ void InnerNode::maybe_cascade()
     // it's possible to cascade twice
     // lock is released in child, so it's nescessarty to obtain it again
     read_lock();
-    if (msgcnt_ >= tree_->options_.inner_node_msg_count ||
-        size() >= tree_->options_.inner_node_page_size) {
-        maybe_cascade();
-    } else {
-        unlock();
-    }
+    maybe_cascade();
 }
 
 void InnerNode::add_pivot(Slice key, bid_t nid, std::vector<DataNode*>& path)
 {
     assert(path.back() == this);
-
-    if (status_ == kSkeletonLoaded) {
-        load_all_msgbuf();
-    }
+    // loaded by lock_path, load_all_msgbuf() would downgrade write lock
+    assert(status_ != kSkeletonLoaded);
 
     vector<Pivot>::iterator it = std::lower_bound(pivots_.begin(), 
         pivots_.end(), key, KeyComp(tree_->options_.comparator));
-    MsgBuf* mb = new MsgBuf(tree_->options_.comparator);
+    MsgBuf* mb = new MsgBuf(tree_->options_.comparator,
+                            &tree_->snapshots_, tree_->options_.merge_operator);
+
+    // messages buffered for the new child since it's split out
+    // of its left sibling go along with it
+    MsgBuf *left = msgbuf(it - pivots_.begin());
+    size_t oldcnt = left->count();
+    size_t oldsz = left->size();
+    left->split(key, mb);
+    msgcnt_ = msgcnt_ + left->count() + mb->count() - oldcnt;
+    msgbufsz_ = msgbufsz_ + left->size() + mb->size() - oldsz;
+
     pivots_.insert(it, Pivot(key.clone(), nid, mb));
     pivots_sz_ += pivot_size(key);
-    msgbufsz_ += mb->size();
     set_dirty(true);
     
     if (pivots_.size() + 1 > tree_->options_.inner_node_children_number) {
@@ -414,30 +846,46 @@ void InnerNode::split(std::vector<DataNode*>& path)
     ni->dec_ref();
 
     path.pop_back();
-    unlock();
-    dec_ref();
     
     // propagation
     if( path.size() == 0) {
-        // i'm root
-        InnerNode *nr = tree_->new_inner_node();
-        assert(nr);
-        nr->bottom_ = false;
-        nr->first_child_ = nid_;
-        MsgBuf* mb0 = new MsgBuf(tree_->options_.comparator);
-        nr->first_msgbuf_ = mb0;
-        nr->msgbufsz_ += mb0->size();
-        nr->pivots_.resize(1);
-        MsgBuf* mb1 = new MsgBuf(tree_->options_.comparator);
-        nr->pivots_[0] = Pivot(k.clone(), ni->nid_, mb1);
-        nr->pivots_sz_ += pivot_size(k);
-        nr->msgbufsz_ += mb1->size();
-        nr->set_dirty(true);
-        
-        tree_->pileup(nr);
-        
-        // need not do nr->dec_ref() here
+        // i'm root, the left half moves down to a new node so that
+        // root stays the same node, and threads waiting for its lock
+        // still reach the whole tree from it
+        InnerNode *nl = tree_->new_inner_node();
+        assert(nl);
+        nl->bottom_ = bottom_;
+        nl->first_child_ = first_child_;
+        nl->first_msgbuf_ = first_msgbuf_;
+        nl->first_filter_ = first_filter_;
+        nl->pivots_.swap(pivots_);
+        nl->pivots_sz_ = pivots_sz_;
+        nl->msgcnt_ = msgcnt_;
+        nl->msgbufsz_ = msgbufsz_;
+        nl->set_dirty(true);
+
+        bottom_ = false;
+        first_child_ = nl->nid_;
+        first_filter_ = Slice();
+        first_msgbuf_ = new MsgBuf(tree_->options_.comparator,
+                                   &tree_->snapshots_, tree_->options_.merge_operator);
+        MsgBuf* mb1 = new MsgBuf(tree_->options_.comparator,
+                                 &tree_->snapshots_, tree_->options_.merge_operator);
+        pivots_.push_back(Pivot(k.clone(), ni->nid_, mb1));
+        pivots_sz_ = pivot_size(k);
+        msgcnt_ = 0;
+        msgbufsz_ = first_msgbuf_->size() + mb1->size();
+        set_dirty(true);
+        nl->dec_ref();
+
+        tree_->pileup();
+
+        unlock();
+        dec_ref();
     } else {
+        unlock();
+        dec_ref();
+
         // propagation
         InnerNode* parent = (InnerNode*) path.back();
         assert(parent);
@@ -450,20 +898,18 @@ void InnerNode::rm_pivot(bid_t nid, std::vector<DataNode*>& path)
     // todo free memory of pivot key
 
     assert(path.back() == this);
-
-    if (status_ == kSkeletonLoaded) {
-        load_all_msgbuf();
-    }
+    // loaded by lock_path, load_all_msgbuf() would downgrade write lock
+    assert(status_ != kSkeletonLoaded);
 
     if (first_child_ == nid) {
         /// @todo this is true only for single thread, fix me
         assert(first_msgbuf_->count() == 0);
         msgbufsz_ -= first_msgbuf_->size();
-        delete first_msgbuf_;
+        epoch_retire(first_msgbuf_);
         
         if (pivots_.size() == 0) {
             first_msgbuf_ = NULL;
-            dead_ = true;
+            set_dead();
 
             path.pop_back();
             unlock();
@@ -502,7 +948,7 @@ void InnerNode::rm_pivot(bid_t nid, std::vector<DataNode*>& path)
         /// @todo this is true only for single thread, fix me
         assert(it->msgbuf->count() == 0);
         msgbufsz_ -= it->msgbuf->size();
-        delete it->msgbuf;
+        epoch_retire(it->msgbuf);
 
         pivots_sz_ -= pivot_size(it->key);
         pivots_.erase(it);
@@ -520,7 +966,8 @@ void InnerNode::rm_pivot(bid_t nid, std::vector<DataNode*>& path)
     }
 }
 
-bool InnerNode::find(Slice key, Slice& value, InnerNode *parent)
+bool InnerNode::find(Slice key, PinnableSlice& value, uint64_t snapshot,
+                     std::vector<Msg>& upserts, InnerNode *parent)
 {
     bool ret = false;
     read_lock();
@@ -535,18 +982,14 @@ bool InnerNode::find(Slice key, Slice& value, InnerNode *parent)
     // if b is NULL, means rejected by bloom filter
     if (b) {
         b->read_lock(); 
-        MsgBuf::Iterator it = b->find(key);
-        if (it != b->end() && it->key == key ) {
-            if (it->type == Put) {
-                value = it->value.clone();
-                ret = true;
-            }
-            // otherwise deleted
-            b->unlock();
+        uint64_t seq;
+        FindResult res = find_msgbuf(b, key, value, snapshot, upserts, seq);
+        b->unlock();
+        if (res != kFindRetry) {
+            drop_upserts(upserts, seq);
             unlock();
-            return ret;
+            return res == kFindFound;
         }
-        b->unlock();
     }
 
     bid_t chidx = child(idx);
@@ -559,13 +1002,332 @@ bool InnerNode::find(Slice key, Slice& value, InnerNode *parent)
     // find in child
     DataNode* ch = tree_->load_node(chidx, true);
     assert(ch);
-    ret = ch->find(key, value, this);
+    ret = ch->find(key, value, snapshot, upserts, this);
+    ch->dec_ref();
+    return ret;
+}
+
+void InnerNode::drop_upserts(std::vector<Msg>& upserts, uint64_t seq)
+{
+    while (upserts.size() && upserts.back().seq <= seq) {
+        upserts.back().value.destroy();
+        upserts.pop_back();
+    }
+}
+
+FindResult InnerNode::find_msgbuf(MsgBuf *b, Slice key, PinnableSlice& value,
+                                  uint64_t snapshot, std::vector<Msg>& upserts,
+                                  uint64_t& seq)
+{
+    uint64_t range_seq = 0;
+    bool covered = b->covered(key, snapshot, range_seq);
+    // frozen buffer is searched in place
+    for (MsgBuf::Cursor c = b->find(key, snapshot); c.valid(); c.next()) {
+        const Msg& m = c.msg();
+        if (covered && m.seq < range_seq) {
+            break;
+        }
+        if (m.type == DelRange) {
+            continue;
+        }
+        if (m.type == Upsert) {
+            // upserts no older than those collected're either collected
+            // already and cascaded since, or written after them
+            if (upserts.empty() || m.seq < upserts.back().seq) {
+                Msg operand(Upsert, Slice(), m.value.clone());
+                operand.seq = m.seq;
+                upserts.push_back(operand);
+            }
+            // go on to the older version
+            continue;
+        }
+        seq = m.seq;
+        if (m.type == Put) {
+            // buffered values may be freed once the buffer's unlocked
+            value.own(m.value.clone());
+            return kFindFound;
+        }
+        // otherwise deleted
+        return kFindMissing;
+    }
+    if (covered) {
+        // deleted by range tombstone
+        seq = range_seq;
+        return kFindMissing;
+    }
+    return kFindRetry;
+}
+
+FindResult InnerNode::find_optimistic(Slice key, PinnableSlice& value, uint64_t snapshot,
+                                      std::vector<Msg>& upserts)
+{
+    Comparator *comp = tree_->options_.comparator;
+    InnerNode *node = this;
+    node->inc_ref();
+
+    uint64_t version;
+    PivotRoute *route = node->get_route(version);
+    while (true) {
+        if (route == NULL) {
+            node->dec_ref();
+            return kFindRetry;
+        }
+
+        int idx = route->find_pivot(comp, key);
+        MsgBuf *b;
+        bid_t chidx;
+        if (idx == 0) {
+            b = route->first_msgbuf;
+            chidx = route->first_child;
+        } else {
+            b = route->pivots[idx-1].msgbuf;
+            chidx = route->pivots[idx-1].child;
+        }
+
+        if (b) {
+            // msgbuf remains valid in epoch even if it's deleted
+            b->read_lock();
+            uint64_t seq;
+            FindResult res = find_msgbuf(b, key, value, snapshot, upserts, seq);
+            b->unlock();
+            if (node->version() != version) {
+                if (res == kFindFound) {
+                    value.reset();
+                }
+                node->dec_ref();
+                return kFindRetry;
+            }
+            if (res != kFindRetry) {
+                // upserts collected're kept until it's validated,
+                // caller starts over with them if it fails
+                drop_upserts(upserts, seq);
+                node->dec_ref();
+                return res;
+            }
+        } else {
+            Slice filter = (idx == 0) ? route->first_filter : route->pivots[idx-1].filter;
+            if (bloom_matches(key, filter)) {
+                // msgbuf should be loaded
+                node->dec_ref();
+                return kFindLocked;
+            }
+        }
+
+        if (chidx == NID_NIL) {
+            // the child may be being created
+            node->dec_ref();
+            return kFindLocked;
+        }
+
+        // child nid may be outdated, it's validated once loaded
+        DataNode *ch = tree_->load_node(chidx, true);
+        if (ch == NULL) {
+            node->dec_ref();
+            return kFindRetry;
+        }
+
+        if (IS_LEAF(chidx)) {
+            LeafNode *leaf = (LeafNode*) ch;
+            leaf->read_lock();
+            // as if the node is unlocked with lock coupling
+            if (leaf->is_dead() || node->version() != version) {
+                leaf->unlock();
+                leaf->dec_ref();
+                node->dec_ref();
+                return kFindRetry;
+            }
+            node->dec_ref();
+            bool ret = leaf->find_locked(key, value, snapshot, upserts);
+            leaf->dec_ref();
+            return ret ? kFindFound : kFindMissing;
+        }
+
+        InnerNode *inner = (InnerNode*) ch;
+        uint64_t chversion;
+        PivotRoute *chroute = inner->get_route(chversion);
+        if (chroute == NULL || inner->is_dead() || node->version() != version) {
+            inner->dec_ref();
+            node->dec_ref();
+            return kFindRetry;
+        }
+        node->dec_ref();
+        node = inner;
+        version = chversion;
+        route = chroute;
+    }
+}
+
+PivotRoute* InnerNode::get_route(uint64_t& version)
+{
+    version = this->version();
+    PivotRoute *route = route_.get();
+    if (route && route->version == version) {
+        return route;
+    }
+    if (version & 1) {
+        // being modified
+        return NULL;
+    }
+
+    // rebuild with read lock, version doesn't change meanwhile
+    read_lock();
+    version = this->version();
+    route = route_.get();
+    if (route && route->version == version) {
+        unlock();
+        return route;
+    }
+
+    PivotRoute *fresh = new PivotRoute();
+    fresh->version = version;
+    fresh->first_child = first_child_;
+    fresh->first_msgbuf = first_msgbuf_;
+    if (first_msgbuf_ == NULL && first_filter_.size()) {
+        fresh->first_filter = first_filter_.clone();
+    }
+    fresh->pivots.reserve(pivots_.size());
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        Pivot p(pivots_[i].key.clone(), pivots_[i].child, pivots_[i].msgbuf);
+        if (p.msgbuf == NULL && pivots_[i].filter.size()) {
+            p.filter = pivots_[i].filter.clone();
+        }
+        fresh->pivots.push_back(p);
+    }
+
+    // racing with other readers rebuilding the same version
+    if (route_.compare_and_swap(route, fresh)) {
+        if (route) {
+            epoch_retire(route);
+        }
+        route = fresh;
+    } else {
+        delete fresh;
+        route = route_.get();
+        if (route == NULL || route->version != version) {
+            route = NULL;
+        }
+    }
+    unlock();
+    return route;
+}
+
+void InnerNode::invalidate_route()
+{
+    PivotRoute *route = route_.get();
+    while (route) {
+        if (route_.compare_and_swap(route, NULL)) {
+            epoch_retire(route);
+            break;
+        }
+        route = route_.get();
+    }
+}
+
+bool InnerNode::scan(Slice key, bool backward, uint64_t snapshot,
+                     ScanRange& range, InnerNode *parent)
+{
+    read_lock();
+
+    // load msgbufs before parent is released, otherwise this node
+    // may be split while lock is upgraded
+    if (status_ == kSkeletonLoaded) {
+        load_all_msgbuf();
+    }
+
+    if (parent) {
+        parent->unlock(); // lock coupling
+    }
+
+    Comparator *comp = tree_->options_.comparator;
+    int idx = scan_pivot(key, backward);
+
+    // pivots at lower level're always inside the bounds of upper level
+    if (idx > 0) {
+        if (range.has_lower) {
+            range.lower.destroy();
+        }
+        range.lower = pivots_[idx-1].key.clone();
+        range.has_lower = true;
+    }
+    if ((size_t)idx < pivots_.size()) {
+        if (range.has_upper) {
+            range.upper.destroy();
+        }
+        range.upper = pivots_[idx].key.clone();
+        range.has_upper = true;
+    }
+
+    range.msgs.push_back(vector<Msg>());
+    vector<Msg>& msgs = range.msgs.back();
+    range.ranges.push_back(vector<Msg>());
+    vector<Msg>& ranges = range.ranges.back();
+
+    MsgBuf *b = msgbuf(idx);
+    assert(b);
+    b->read_lock();
+    MsgBuf::Iterator it;
+    if (b->range_count()) {
+        for (it = b->begin(); it != b->end(); it++) {
+            if (range.has_upper && comp->compare(it->key, range.upper) >= 0) {
+                break;
+            }
+            if (it->type == DelRange && it->seq <= snapshot && (!range.has_lower ||
+                comp->compare(it->value, range.lower) > 0)) {
+                Msg m(DelRange, it->key.clone(), it->value.clone());
+                m.seq = it->seq;
+                ranges.push_back(m);
+            }
+        }
+    }
+
+    it = range.has_lower ? b->find(range.lower) : b->begin();
+    for (; it != b->end(); it++) {
+        if (range.has_upper && comp->compare(it->key, range.upper) >= 0) {
+            break;
+        }
+        // the newest visible version, and older ones if it's an upsert
+        if (it->type == DelRange || it->seq > snapshot || (msgs.size() &&
+            comp->compare(msgs.back().key, it->key) == 0 &&
+            msgs.back().type != Upsert)) {
+            continue;
+        }
+        uint64_t range_seq;
+        if (ranges.size() && range_covered(comp, ranges, it->key, range_seq) &&
+            it->seq < range_seq) {
+            // stop at range tombstone
+            msgs.push_back(Msg(Del, it->key.clone()));
+            continue;
+        }
+        if (it->type == Put || it->type == Upsert) {
+            msgs.push_back(Msg(it->type, it->key.clone(), it->value.clone()));
+        } else {
+            msgs.push_back(Msg(it->type, it->key.clone()));
+        }
+    }
+    b->unlock();
+
+    bid_t chidx = child(idx);
+    if (chidx == NID_NIL) {
+        assert(idx == 0); // must be the first child
+        unlock();
+        return true;
+    }
+
+    DataNode* ch = tree_->load_node(chidx, false);
+    assert(ch);
+    bool ret = ch->scan(key, backward, snapshot, range, this);
     ch->dec_ref();
     return ret;
 }
 
 void InnerNode::lock_path(Slice key, std::vector<DataNode*>& path)
 {
+    // pivots and msgbufs're modified by nodes on path,
+    // make them ready without releasing write lock
+    if (status_ == kSkeletonLoaded) {
+        load_all_msgbuf_locked();
+    }
+
     int idx = find_pivot(key);
     DataNode* ch = tree_->load_node(child(idx), false);
     assert(ch);
@@ -599,6 +1361,23 @@ size_t InnerNode::size()
     return sz;
 }
 
+size_t InnerNode::memory_usage()
+{
+    size_t sz = 0;
+    sz += 1 + 4 + (8 + 4 + 4 + 4 + 2);
+    sz += pivots_sz_;
+    // buffers not loaded yet take no memory
+    if (first_msgbuf_) {
+        sz += first_msgbuf_->memory_usage();
+    }
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        if (pivots_[i].msgbuf) {
+            sz += pivots_[i].msgbuf->memory_usage();
+        }
+    }
+    return sz;
+}
+
 size_t InnerNode::estimated_buffer_size()
 {
     size_t sz = 0;
@@ -607,10 +1386,11 @@ size_t InnerNode::estimated_buffer_size()
     sz += bloom_size(first_msgbuf_->count());
     sz += pivots_sz_;
 
-    if (tree_->compressor_) {
-        sz += tree_->compressor_->max_compressed_length(first_msgbuf_->size());
+    Compressor *compressor = tree_->compressor(tree_->inner_compress_);
+    if (compressor) {
+        sz += compressor->max_compressed_length(first_msgbuf_->size());
         for (size_t i = 0; i < pivots_.size(); i++) {
-            sz += tree_->compressor_->max_compressed_length(pivots_[i].msgbuf->size());
+            sz += compressor->max_compressed_length(pivots_[i].msgbuf->size());
             sz += bloom_size(pivots_[i].msgbuf->count());
         }
     } else {
@@ -636,6 +1416,11 @@ bool InnerNode::read_from(BlockReader& reader, bool skeleton_only)
     if (!reader.readUInt32(&first_msgbuf_offset_)) return false;
     if (!reader.readUInt32(&first_msgbuf_length_)) return false;
     if (!reader.readUInt32(&first_msgbuf_uncompressed_length_)) return false;
+    // nodes written since seqs're all tagged
+    legacy_ = tree_->layout_->legacy_nodes() &&
+              !codec_tagged(first_msgbuf_uncompressed_length_);
+    first_msgbuf_codec_ = untag_codec(first_msgbuf_uncompressed_length_,
+                                      tree_->options_.compress);
     if (!reader.readUInt16(&first_msgbuf_crc_)) return false;
     if (!reader.readSlice(first_filter_)) return false;
 
@@ -648,6 +1433,8 @@ bool InnerNode::read_from(BlockReader& reader, bool skeleton_only)
         if (!reader.readUInt32(&(pivots_[i].offset))) return false;
         if (!reader.readUInt32(&(pivots_[i].length))) return false;
         if (!reader.readUInt32(&(pivots_[i].uncompressed_length))) return false;
+        pivots_[i].codec = untag_codec(pivots_[i].uncompressed_length,
+                                       tree_->options_.compress);
         if (!reader.readUInt16(&(pivots_[i].crc))) return false;
         if (!reader.readSlice(pivots_[i].filter)) return false;
     }
@@ -658,25 +1445,63 @@ bool InnerNode::read_from(BlockReader& reader, bool skeleton_only)
         status_ = kSkeletonLoaded;
     }
 
-    return true;
+    return true;
+}
+
+bool InnerNode::load_msgbuf(int idx)
+{
+    if (!begin_loading(idx)) {
+        // loaded by another thread, or it failed
+        return true;
+    }
+
+    // readers go on while msgbuf is read, writers're kept out
+    // until it's installed
+    unlock();
+    upgrade_lock();
+
+    // node might be modified while it's unlocked
+    bool ret = true;
+    MsgBuf **pb = NULL;
+    if ((size_t)idx <= pivots_.size()) {
+        pb = (idx == 0) ? &first_msgbuf_ : &(pivots_[idx-1].msgbuf);
+    }
+    if (pb && *pb == NULL) {
+        MsgBuf *b = fetch_msgbuf(idx);
+        if (b) {
+            upgrade();
+            *pb = b;
+            msgcnt_ += b->count();
+            msgbufsz_ += b->size();
+        } else {
+            ret = false;
+        }
+    }
+    downgrade();
+
+    end_loading(idx);
+    return ret;
 }
 
-bool InnerNode::load_msgbuf(int idx)
+MsgBuf* InnerNode::fetch_msgbuf(int idx)
 {
     uint32_t offset;
     uint32_t length;
     uint32_t uncompressed_length;
+    Compress codec;
     uint16_t expected_crc;
     uint16_t actual_crc;
     if (idx == 0) {
         offset = first_msgbuf_offset_;
         length = first_msgbuf_length_;
         uncompressed_length = first_msgbuf_uncompressed_length_;
+        codec = first_msgbuf_codec_;
         expected_crc = first_msgbuf_crc_;
     } else {
         offset = pivots_[idx-1].offset;
         length = pivots_[idx-1].length;
         uncompressed_length = pivots_[idx-1].uncompressed_length;
+        codec = pivots_[idx-1].codec;
         expected_crc = pivots_[idx-1].crc;
     }
 
@@ -684,7 +1509,7 @@ bool InnerNode::load_msgbuf(int idx)
     if (block == NULL) {
         LOG_ERROR("read msgbuf from layout error " << " nid " << nid_ << ", idx " << idx
                 << ", offset " << offset << ", length " << length);
-        return false;
+        return NULL;
     }
 
     actual_crc = crc16(block->start(), length);
@@ -696,55 +1521,70 @@ bool InnerNode::load_msgbuf(int idx)
                 << ", length " << length);
 
         tree_->layout_->destroy(block);
-        return false;
+        return NULL;
     }
 
     BlockReader reader(block);
 
     Slice buffer;
-    if (tree_->compressor_) {
-        buffer = Slice::alloc(uncompressed_length);
+    if (codec != kNoCompress) {
+        buffer = tree_->layout_->alloc_aligned_buffer(uncompressed_length);
     }
 
-    MsgBuf *b = new MsgBuf(tree_->options_.comparator);
+    MsgBuf *b = new MsgBuf(tree_->options_.comparator,
+                           &tree_->snapshots_, tree_->options_.merge_operator);
     assert(b);
 
-    if (!read_msgbuf(reader, length, uncompressed_length, b, buffer)) {
+    if (!read_msgbuf(reader, length, uncompressed_length, codec, b, buffer)) {
         LOG_ERROR("read_msgbuf error " << " nid " << nid_ << ", idx " << idx);
         delete b;
         if (buffer.size()) {
-            buffer.destroy();
+            tree_->layout_->free_buffer(buffer);
         }
         tree_->layout_->destroy(block);
-        return false;
+        return NULL;
     }
 
     if (buffer.size()) {
-        buffer.destroy();
+        tree_->layout_->free_buffer(buffer);
     }
 
-    // lazy load, upgrade lock to write lock
-    // TODO: write a upgradable rwlock
+    tree_->layout_->destroy(block);
+    return b;
+}
+
+bool InnerNode::load_all_msgbuf()
+{
+    // readers go on while node is read, writers're kept out
+    // until msgbufs're installed
     unlock();
-    write_lock();
+    upgrade_lock();
 
-    MsgBuf **pb = (idx == 0) ? &first_msgbuf_ : &(pivots_[idx-1].msgbuf);
-    if (*pb == NULL) {
-        *pb = b;
-        msgcnt_ += b->count();
-        msgbufsz_ += b->size();
-    } else {
-        delete b;
+    // node might be loaded by another thread, or merged away
+    // while it's unlocked
+    if (status_ != kSkeletonLoaded || is_dead()) {
+        downgrade();
+        return true;
     }
 
-    unlock();
-    read_lock();
+    Block* block = tree_->layout_->read(nid_, false);
+    if (block == NULL) {
+        LOG_ERROR("load all msgbuf error, cannot read " << " nid " << nid_);
+        downgrade();
+        return false;
+    }
+
+    BlockReader reader(block);
+
+    upgrade();
+    bool ret = load_all_msgbuf(reader);
+    downgrade();
 
     tree_->layout_->destroy(block);
-    return true;
+    return ret;
 }
 
-bool InnerNode::load_all_msgbuf()
+bool InnerNode::load_all_msgbuf_locked()
 {
     Block* block = tree_->layout_->read(nid_, false);
     if (block == NULL) {
@@ -753,43 +1593,39 @@ bool InnerNode::load_all_msgbuf()
     }
 
     BlockReader reader(block);
-
-    // lazy load, upgrade lock to write lock
-    // TODO: write a upgradable rwlock
-    unlock();
-    write_lock();
-
     bool ret = load_all_msgbuf(reader);
 
-    unlock();
-    read_lock();
-
     tree_->layout_->destroy(block);
     return ret;
 }
 
 bool InnerNode::load_all_msgbuf(BlockReader& reader)
 {
+    // buffer is shared by compressed msgbufs
     Slice buffer;
-    if (tree_->compressor_) {
-        size_t buffer_length = first_msgbuf_uncompressed_length_;
-        for (size_t i = 0; i < pivots_.size(); i++) {
-            if (buffer_length < pivots_[i].uncompressed_length) {
-                buffer_length = pivots_[i].uncompressed_length;
-            }
+    size_t buffer_length = 0;
+    if (first_msgbuf_codec_ != kNoCompress) {
+        buffer_length = first_msgbuf_uncompressed_length_;
+    }
+    for (size_t i = 0; i < pivots_.size(); i++) {
+        if (pivots_[i].codec != kNoCompress &&
+            buffer_length < pivots_[i].uncompressed_length) {
+            buffer_length = pivots_[i].uncompressed_length;
         }
-
-        buffer = Slice::alloc(buffer_length);
+    }
+    if (buffer_length) {
+        buffer = tree_->layout_->alloc_aligned_buffer(buffer_length);
     }
 
     if (first_msgbuf_ == NULL) {
         reader.seek(first_msgbuf_offset_);
-        first_msgbuf_ = new MsgBuf(tree_->options_.comparator);
+        first_msgbuf_ = new MsgBuf(tree_->options_.comparator,
+                                   &tree_->snapshots_, tree_->options_.merge_operator);
         if (!read_msgbuf(reader, first_msgbuf_length_,
                          first_msgbuf_uncompressed_length_, 
-                         first_msgbuf_, buffer)) {
+                         first_msgbuf_codec_, first_msgbuf_, buffer)) {
             if (buffer.size()) {
-                buffer.destroy();
+                tree_->layout_->free_buffer(buffer);
             }
             return false;
         }
@@ -800,12 +1636,15 @@ bool InnerNode::load_all_msgbuf(BlockReader& reader)
     for (size_t i = 0; i < pivots_.size(); i++) {
         if (pivots_[i].msgbuf == NULL) {
             reader.seek(pivots_[i].offset);
-            pivots_[i].msgbuf = new MsgBuf(tree_->options_.comparator);
+            pivots_[i].msgbuf = new MsgBuf(tree_->options_.comparator,
+                                           &tree_->snapshots_,
+                                           tree_->options_.merge_operator);
             if (!read_msgbuf(reader, pivots_[i].length,
                              pivots_[i].uncompressed_length,
+                             pivots_[i].codec,
                              pivots_[i].msgbuf, buffer)) {
                 if (buffer.size()) {
-                    buffer.destroy();
+                    tree_->layout_->free_buffer(buffer);
                 }
                 return false;
             }
@@ -815,7 +1654,7 @@ bool InnerNode::load_all_msgbuf(BlockReader& reader)
     }
 
     if (buffer.size()) {
-        buffer.destroy();
+        tree_->layout_->free_buffer(buffer);
     }
 
     status_ = kFullLoaded;
@@ -825,15 +1664,23 @@ bool InnerNode::load_all_msgbuf(BlockReader& reader)
 bool InnerNode::read_msgbuf(BlockReader& reader,
                             size_t compressed_length, 
                             size_t uncompressed_length,
+                            Compress codec,
                             MsgBuf *mb, Slice buffer)
 {
-    if (tree_->compressor_) {
+    if (codec != kNoCompress) {
         assert(compressed_length <= reader.remain());
         assert(uncompressed_length <= buffer.size());
 
+        Compressor *compressor = tree_->compressor(codec);
+        if (compressor == NULL) {
+            LOG_ERROR("msgbuf is compressed with codec " << codec
+                << ", which isn't built in, nid " << nid_);
+            return false;
+        }
+
         // 1. uncompress
-        if (!tree_->compressor_->uncompress(reader.addr(),
-            compressed_length, (char *)buffer.data())) {
+        if (!compressor->uncompress(reader.addr(), compressed_length,
+            (char *)buffer.data(), uncompressed_length)) {
             return false;
         }
         reader.skip(compressed_length);
@@ -841,9 +1688,9 @@ bool InnerNode::read_msgbuf(BlockReader& reader,
         // 2. deserialize
         Block block(buffer, 0, uncompressed_length);
         BlockReader rr(&block);
-        return mb->read_from(rr);
+        return legacy_ ? mb->read_legacy(rr) : mb->read_from(rr);
     } else {
-        return mb->read_from(reader);
+        return legacy_ ? mb->read_legacy(reader) : mb->read_from(reader);
     }
 }
 
@@ -862,7 +1709,7 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
 
     // prepare buffer if compression is enabled
     Slice buffer;
-    if (tree_->compressor_) {
+    if (tree_->compressor(tree_->inner_compress_)) {
         // get buffer length to serialize msgbuf
         size_t buffer_length = first_msgbuf_->size();
         for (size_t i = 0; i < pivots_.size(); i++) {
@@ -870,14 +1717,15 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
                 buffer_length = pivots_[i].msgbuf->size();
         }
 
-        buffer = Slice::alloc(buffer_length);
+        buffer = tree_->layout_->alloc_aligned_buffer(buffer_length);
     }
 
     char *mb_start;
     // write the first msgbuf
     mb_start = writer.addr();
     first_msgbuf_offset_ = writer.pos();
-    if (!write_msgbuf(writer, first_msgbuf_, buffer)) return false;
+    if (!write_msgbuf(writer, first_msgbuf_, buffer,
+                      first_msgbuf_codec_)) return false;
     first_msgbuf_length_ = writer.pos() - first_msgbuf_offset_;
     first_msgbuf_uncompressed_length_ = first_msgbuf_->size();
     first_msgbuf_crc_ = crc16(mb_start, first_msgbuf_length_);
@@ -886,14 +1734,15 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     for (size_t i = 0; i < pivots_.size(); i++) {
         mb_start = writer.addr();
         pivots_[i].offset = writer.pos();
-        if (!write_msgbuf(writer, pivots_[i].msgbuf, buffer)) return false;
+        if (!write_msgbuf(writer, pivots_[i].msgbuf, buffer,
+                          pivots_[i].codec)) return false;
         pivots_[i].length = writer.pos() - pivots_[i].offset;
         pivots_[i].uncompressed_length = pivots_[i].msgbuf->size();
         pivots_[i].crc = crc16(mb_start, pivots_[i].length);
     }
 
     if (buffer.size()) {
-        buffer.destroy();
+        tree_->layout_->free_buffer(buffer);
     }
 
     size_t last_offset = writer.pos();
@@ -908,7 +1757,8 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     if (!writer.writeUInt64(first_child_)) return false;
     if (!writer.writeUInt32(first_msgbuf_offset_)) return false;
     if (!writer.writeUInt32(first_msgbuf_length_)) return false;
-    if (!writer.writeUInt32(first_msgbuf_uncompressed_length_)) return false;
+    if (!writer.writeUInt32(tag_codec(first_msgbuf_uncompressed_length_,
+                                      first_msgbuf_codec_))) return false;
     if (!writer.writeUInt16(first_msgbuf_crc_)) return false;
 
     // first msgbuf bloom filter
@@ -923,7 +1773,8 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
         if (!writer.writeUInt64(pivots_[i].child)) return false;
         if (!writer.writeUInt32(pivots_[i].offset)) return false;
         if (!writer.writeUInt32(pivots_[i].length)) return false;
-        if (!writer.writeUInt32(pivots_[i].uncompressed_length)) return false;
+        if (!writer.writeUInt32(tag_codec(pivots_[i].uncompressed_length,
+                                          pivots_[i].codec))) return false;
         if (!writer.writeUInt16(pivots_[i].crc)) return false;
 
 	// get the bloom filter bitsets
@@ -937,30 +1788,31 @@ bool InnerNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     return true;
 }
 
-bool InnerNode::write_msgbuf(BlockWriter& writer, MsgBuf *mb, Slice buffer)
+bool InnerNode::write_msgbuf(BlockWriter& writer, MsgBuf *mb, Slice buffer,
+                             Compress& codec)
 {
-    if (tree_->compressor_) {
+    Compressor *compressor = tree_->compressor(tree_->inner_compress_);
+    if (compressor) {
         // 1. write to buffer
         Block block(buffer, 0, 0);
         BlockWriter wr(&block);
         if (!mb->write_to(wr)) return false;
 
-        // 2. compress
-        assert(tree_->compressor_->max_compressed_length(block.size()) <=
-            writer.remain());
-
-        size_t compressed_length;
-        if (!tree_->compressor_->compress(buffer.data(), block.size(),
-             writer.addr(), &compressed_length)) {
+        // 2. compress, or write raw if it's incompressible
+        if (!tree_->compress_block(compressor, Slice(buffer.data(), block.size()),
+                                   writer, codec)) {
             LOG_ERROR("compress msgbuf error, nid " << nid_);
             return false;
         }
 
-        // 3. skip
-        writer.skip(compressed_length);
-
+        if (codec == kNoCompress) {
+            tree_->skipped_msgbufs_.add(1);
+        } else {
+            tree_->compressed_msgbufs_.add(1);
+        }
         return true;
     } else {
+        codec = kNoCompress;
         return mb->write_to(writer);
     }
 }
@@ -975,7 +1827,8 @@ LeafNode::LeafNode(const std::string& table_name, bid_t nid, Tree *tree)
   left_sibling_(NID_NIL),
   right_sibling_(NID_NIL),
   buckets_info_size_(0),
-  records_(tree->options_.leaf_node_bucket_size)
+  records_(tree->options_.leaf_node_bucket_size),
+  encoded_length_(0)
 {
     assert(nid >= NID_LEAF_START);
 }
@@ -986,16 +1839,8 @@ LeafNode::~LeafNode()
         buckets_info_[i].key.destroy();
     }
 
-    for (size_t i = 0; i < records_.buckets_number(); i++ ) {
-        RecordBucket *bucket = records_.bucket(i);
-        if (bucket) {
-            for (RecordBucket::iterator it = bucket->begin();
-                it != bucket->end(); it++) {
-                it->key.destroy();
-                it->value.destroy();
-            }
-        }
-    }
+    retire_buckets(records_);
+    drop_encoded_buckets();
 }
 
 bool LeafNode::cascade(MsgBuf *mb, InnerNode* parent)
@@ -1011,55 +1856,104 @@ bool LeafNode::cascade(MsgBuf *mb, InnerNode* parent)
     size_t oldcnt = mb->count();
     size_t oldsz = mb->size();
 
+    // cascaded by another thread already
+    if (oldcnt == 0) {
+        mb->unlock();
+        parent->unlock();
+        unlock();
+        return true;
+    }
+
     Slice anchor = mb->begin()->key.clone();
 
-    // merge message buffer into leaf
+    // merge message buffer into leaf, records're copied into
+    // new buckets, and old buckets're freed as a whole
     RecordBuckets res(tree_->options_.leaf_node_bucket_size);
+    Comparator *comp = tree_->options_.comparator;
+    vector<Record> versions;
+    vector<Msg> msgs;
+    // values of upserts applied
+    Arena merged;
+
+    // range tombstones drop records they cover in bulk
+    vector<Msg> ranges;
+    MsgBuf::Iterator it;
+    if (mb->range_count()) {
+        for (it = mb->begin(); it != mb->end(); it++) {
+            if (it->type == DelRange) {
+                ranges.push_back(*it);
+            }
+        }
+    }
 
-    MsgBuf::Iterator it = mb->begin();
+    it = mb->begin();
     RecordBuckets::Iterator jt = records_.get_iterator();
-    while (it != mb->end() && jt.valid()) {
-        int n = tree_->options_.comparator->compare(it->key, jt.record().key);
-        if (n < 0) {
-            if (it->type == Put) {
-                res.push_back(to_record(*it));
-            } else {
-                // just throw deletion to non-exist record
-                it->destroy();
-            }
+    while (it != mb->end() || jt.valid()) {
+        if (it != mb->end() && it->type == DelRange) {
             it ++;
-        } else if (n > 0) {
+            continue;
+        }
+
+        int n;
+        if (it == mb->end()) {
+            n = 1;
+        } else if (!jt.valid()) {
+            n = -1;
+        } else {
+            n = comp->compare(it->key, jt.record().key);
+        }
+
+        Slice key = n > 0 ? jt.record().key : it->key;
+        uint64_t range_seq = 0;
+        bool covered = ranges.size() &&
+            range_covered(comp, ranges, key, range_seq);
+
+        if (n > 0 && !covered) {
             res.push_back(jt.record());
             jt.next();
-        } else {
-            if (it->type == Put) {
-                res.push_back(to_record(*it));
+            continue;
+        }
+
+        // messages're newer than records
+        for (; it != mb->end() && it->key == key; it++) {
+            if (it->type != DelRange) {
+                msgs.push_back(*it);
             }
-            // old record is deleted
-            it ++;
-            jt.record().key.destroy();
-            jt.record().value.destroy();
-            jt.next();
         }
-    }
-    for (; it != mb->end(); it++) {
-        if (it->type == Put) {
-            res.push_back(to_record(*it));
+        if (n >= 0) {
+            for (; jt.valid() && jt.record().key == key; jt.next()) {
+                versions.push_back(jt.record());
+            }
         }
-    }
-    while(jt.valid()) {
-        res.push_back(jt.record());
-        jt.next();
+        // from the oldest message, upserts're folded into older versions,
+        // range tombstone goes right after messages newer than it
+        for (size_t i = msgs.size(); i > 0; i--) {
+            if (covered && msgs[i-1].seq > range_seq) {
+                versions.insert(versions.begin(), to_tombstone(key, range_seq));
+                covered = false;
+            }
+            const Record *older = versions.size() ? &versions.front() : NULL;
+            Record r;
+            if (to_record(msgs[i-1], older, merged, r)) {
+                versions.insert(versions.begin(), r);
+            }
+        }
+        if (covered) {
+            versions.insert(versions.begin(), to_tombstone(key, range_seq));
+        }
+        push_versions(versions, res);
+        versions.clear();
+        msgs.clear();
     }
     records_.swap(res);
+    retire_buckets(res);
 
     refresh_buckets_info();
     set_dirty(true);
 
     // clear message buffer
     mb->clear();
-    parent->msgcnt_ = parent->msgcnt_ + mb->count() - oldcnt;
-    parent->msgbufsz_ = parent->msgbufsz_ + mb->size() - oldsz;
+    parent->account(mb->count() - oldcnt, mb->size() - oldsz);
 
     // unlock message buffer
     mb->unlock();
@@ -1080,12 +1974,68 @@ bool LeafNode::cascade(MsgBuf *mb, InnerNode* parent)
     return true;
 }
 
-Record LeafNode::to_record(const Msg& m)
+bool LeafNode::to_record(const Msg& m, const Record *older, Arena& arena,
+                         Record& r)
+{
+    r = Record(m.key, m.value, m.seq);
+    if (m.type == Del) {
+        r.deleted = true;
+    } else if (m.type == Upsert) {
+        const Slice *existing = NULL;
+        if (older && !older->deleted) {
+            existing = &older->value;
+        }
+        std::string value;
+        if (merge_value(tree_->options_.merge_operator, m.key, existing,
+                        m.value, value)) {
+            r.value = arena.copy(Slice(value));
+        } else {
+            // older version is kept
+            LOG_ERROR("apply upsert error nid " << nid_ << ", upsert is dropped");
+            return false;
+        }
+    } else {
+        assert(m.type == Put);
+    }
+    return true;
+}
+
+Record LeafNode::to_tombstone(Slice key, uint64_t seq)
 {
-    assert(m.type == Put);
-    return Record(m.key, m.value);
+    Record r(key, Slice(), seq);
+    r.deleted = true;
+    return r;
+}
+
+void LeafNode::push_versions(vector<Record>& versions, RecordBuckets& res)
+{
+    // versions invisible to any snapshot're dropped
+    size_t n = 0;
+    for (size_t i = 0; i < versions.size(); i++) {
+        if (i == 0 || tree_->snapshots_.visible(versions[i].seq,
+                                                versions[i-1].seq)) {
+            versions[n++] = versions[i];
+        }
+    }
+
+    // nothing left to be deleted at leaf
+    while (n && versions[n-1].deleted) {
+        n --;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        res.push_back(versions[i]);
+    }
 }
 
+void LeafNode::retire_buckets(RecordBuckets& records)
+{
+    vector<RecordBucket*> buckets;
+    records.release(buckets);
+    for (size_t i = 0; i < buckets.size(); i++) {
+        tree_->retire_bucket(buckets[i]);
+    }
+}
 
 void LeafNode::split(Slice anchor)
 {
@@ -1104,10 +2054,12 @@ void LeafNode::split(Slice anchor)
     tree_->lock_path(anchor, path);
     assert(path.back() == this);
 
-    // may have deletions during this period
-    if (records_.size() <= 1 ||
+    // may have deletions during this period,
+    // or all records're versions of the same key
+    if (records_.size() <= 1 || !records_.splittable() ||
         (records_.size() <= (tree_->options_.leaf_node_record_count / 2) &&
          size() <= (tree_->options_.leaf_node_page_size / 2) )) {
+        balancing_ = false;
         while (path.size()) {
             path.back()->unlock();
             path.back()->dec_ref();
@@ -1127,6 +2079,10 @@ void LeafNode::split(Slice anchor)
         LeafNode *rl = (LeafNode*)tree_->load_node(right_sibling_, false);
         assert(rl);
         rl->write_lock();
+        // written out as a whole once it's dirty
+        if (rl->status_ == kSkeletonLoaded) {
+            rl->load_all_buckets();
+        }
         rl->left_sibling_ = nl->nid_;
         rl->set_dirty(true);
         rl->unlock();
@@ -1169,8 +2125,13 @@ void LeafNode::merge(Slice anchor)
     tree_->lock_path(anchor, path);
     assert(path.back() == this);
 
-    // may have insertions during this period
-    if (records_.size() > 0) {
+    // may have insertions during this period,
+    // or messages buffered in parent not cascaded yet
+    InnerNode *parent = (InnerNode*) path[path.size() - 2];
+    assert(parent->status_ != kSkeletonLoaded);
+    if (records_.size() > 0 ||
+        parent->msgbuf(parent->find_pivot(anchor))->count() > 0) {
+        balancing_ = false;
         while (path.size()) {
             path.back()->unlock();
             path.back()->dec_ref();
@@ -1183,6 +2144,10 @@ void LeafNode::merge(Slice anchor)
         LeafNode *ll = (LeafNode*)tree_->load_node(left_sibling_, false);
         assert(ll);
         ll->write_lock();
+        // written out as a whole once it's dirty
+        if (ll->status_ == kSkeletonLoaded) {
+            ll->load_all_buckets();
+        }
         ll->right_sibling_ = right_sibling_;
         ll->set_dirty(true);
         ll->unlock();
@@ -1192,12 +2157,16 @@ void LeafNode::merge(Slice anchor)
         LeafNode *rl = (LeafNode*)tree_->load_node(right_sibling_, false);
         assert(rl);
         rl->write_lock();
+        // written out as a whole once it's dirty
+        if (rl->status_ == kSkeletonLoaded) {
+            rl->load_all_buckets();
+        }
         rl->left_sibling_ = left_sibling_;
         rl->set_dirty(true);
         rl->unlock();
         rl->dec_ref();
     }
-    dead_ = true;
+    set_dead();
     balancing_ = false;
 
     path.pop_back();
@@ -1205,18 +2174,24 @@ void LeafNode::merge(Slice anchor)
     dec_ref();
 
     // propagation
-    InnerNode *parent = (InnerNode*) path.back();
-    assert(parent);
+    assert(path.back() == parent);
     parent->rm_pivot(nid_, path);
 }
 
-bool LeafNode::find(Slice key, Slice& value, InnerNode *parent) 
+bool LeafNode::find(Slice key, PinnableSlice& value, uint64_t snapshot,
+                    std::vector<Msg>& upserts, InnerNode *parent)
 {
     assert(parent);
     read_lock();
 
     parent->unlock();
 
+    return find_locked(key, value, snapshot, upserts);
+}
+
+bool LeafNode::find_locked(Slice key, PinnableSlice& value, uint64_t snapshot,
+                           std::vector<Msg>& upserts)
+{
     size_t idx = 0;
     for (; idx < buckets_info_.size(); idx ++) {
         if (tree_->options_.comparator->compare(key, buckets_info_[idx].key) < 0) {
@@ -1229,47 +2204,143 @@ bool LeafNode::find(Slice key, Slice& value, InnerNode *parent)
         return false;
     }
 
-    RecordBucket *bucket = records_.bucket(idx - 1);
-    if (bucket == NULL) {
+    if (!bucket_loaded(idx - 1)) {
         if (!load_bucket(idx - 1)) {
             LOG_ERROR("load bucket error nid " << nid_ << ", bucket " << (idx-1));
             unlock();
             return false;
         }
-        bucket = records_.bucket(idx - 1);
-        assert(bucket);
+        assert(bucket_loaded(idx - 1));
     } 
 
     bool ret = false;
-    vector<Record>::iterator it = lower_bound(
-        bucket->begin(), bucket->end(), key, KeyComp(tree_->options_.comparator));
-    if (it != bucket->end() && it->key == key) {
-        ret = true;
-        value = it->value.clone();
+    RecordBucket *bucket = records_.bucket(idx - 1);
+    if (bucket) {
+        vector<Record>::iterator it = lower_bound(
+            bucket->begin(), bucket->end(), key, KeyComp(tree_->options_.comparator));
+        for (; it != bucket->end() && it->key == key; it++) {
+            if (it->seq <= snapshot) {
+                InnerNode::drop_upserts(upserts, it->seq);
+                if (!it->deleted) {
+                    ret = true;
+                    // pinned before it's unlocked, so that it's freed
+                    // after value's reset even if it's replaced
+                    value.pin(it->value, &Tree::unpin_values, tree_, tree_->pin_values());
+                }
+                break;
+            }
+        }
+    } else {
+        // values point into the encoded bucket, which is retired
+        // as a whole after the leaf is fully loaded
+        BucketView view(encoded_buckets_[idx - 1]);
+        for (view.seek(key, tree_->options_.comparator);
+             view.valid() && view.key() == key; view.next()) {
+            if (view.seq() <= snapshot) {
+                InnerNode::drop_upserts(upserts, view.seq());
+                if (!view.deleted()) {
+                    ret = true;
+                    value.pin(view.value(), &Tree::unpin_values, tree_, tree_->pin_values());
+                }
+                break;
+            }
+        }
     }
 
     unlock();
     return ret;
 }
 
+bool LeafNode::scan(Slice key, bool backward, uint64_t snapshot,
+                    ScanRange& range, InnerNode *parent)
+{
+    assert(parent);
+    read_lock();
+
+    // load buckets before parent is released, otherwise
+    // this leaf may be split while lock is upgraded
+    if (status_ == kSkeletonLoaded) {
+        // readers go on while leaf is read, writers're kept out
+        // until buckets're installed
+        unlock();
+        upgrade_lock();
+        // parent is locked, so leaf can't be merged meanwhile
+        assert(!is_dead());
+        if (status_ == kSkeletonLoaded) {
+            upgrade();
+            if (!load_all_buckets()) {
+                LOG_ERROR("load all buckets error nid " << nid_);
+                unlock();
+                parent->unlock();
+                return false;
+            }
+        }
+        downgrade();
+    }
+
+    parent->unlock();
+
+    Comparator *comp = tree_->options_.comparator;
+    range.records.reserve(records_.size());
+    Slice last;
+    bool has_last = false;
+    for (RecordBuckets::Iterator it = records_.get_iterator();
+        it.valid(); it.next()) {
+        Record& r = it.record();
+        if (range.has_lower && comp->compare(r.key, range.lower) < 0) {
+            continue;
+        }
+        if (range.has_upper && comp->compare(r.key, range.upper) >= 0) {
+            break;
+        }
+        // the newest visible version only
+        if (r.seq > snapshot || (has_last && comp->compare(last, r.key) == 0)) {
+            continue;
+        }
+        has_last = true;
+        last = r.key;
+        if (!r.deleted) {
+            range.records.push_back(Record(r.key.clone(), r.value.clone()));
+        }
+    }
+
+    unlock();
+    return true;
+}
+
 void LeafNode::lock_path(Slice key, std::vector<DataNode*>& path)
 {
 }
 
 size_t LeafNode::size()
 {
-    return 8 + 8 + buckets_info_size_ + records_.length();
+    return 8 + 8 + buckets_info_size_ + records_.length() + encoded_length_;
+}
+
+size_t LeafNode::memory_usage()
+{
+    size_t sz = 8 + 8 + buckets_info_size_ + encoded_length_;
+    for (size_t i = 0; i < records_.buckets_number(); i++) {
+        RecordBucket *bucket = records_.bucket(i);
+        if (bucket) {
+            sz += bucket->memory_usage();
+        }
+    }
+    return sz;
 }
 
 size_t LeafNode::estimated_buffer_size()
 {
     size_t length = 8 + 8 + buckets_info_size_;
-    if (tree_->compressor_) { 
-        for (size_t i = 0; i < records_.buckets_number(); i++) {
-            length += tree_->compressor_->max_compressed_length(records_.bucket_length(i));
+    Compressor *compressor = tree_->compressor(tree_->leaf_compress_);
+    for (size_t i = 0; i < records_.buckets_number(); i++) {
+        size_t bucket_length = max_encoded_bucket_length(
+            records_.bucket_length(i), records_.bucket(i)->size());
+        if (compressor) { 
+            length += compressor->max_compressed_length(bucket_length);
+        } else {
+            length += bucket_length;
         }
-    } else {
-        length += records_.length();
     }
     return length;
 }
@@ -1302,14 +2373,16 @@ bool LeafNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     if (!writer.skip(skeleton_size)) return false;
 
     Slice buffer;
-    if (tree_->compressor_) {
+    if (tree_->compressor(tree_->leaf_compress_)) {
         size_t buffer_length = 0;
         for (size_t i = 0; i < records_.buckets_number(); i++) {
-            if (buffer_length < records_.bucket_length(i)) {
-                buffer_length = records_.bucket_length(i);
+            size_t bucket_length = max_encoded_bucket_length(
+                records_.bucket_length(i), records_.bucket(i)->size());
+            if (buffer_length < bucket_length) {
+                buffer_length = bucket_length;
             }
         }
-        buffer = Slice::alloc(buffer_length);
+        buffer = tree_->layout_->alloc_aligned_buffer(buffer_length);
     }
 
     assert(records_.buckets_number() == buckets_info_.size());
@@ -1318,20 +2391,22 @@ bool LeafNode::write_to(BlockWriter& writer, size_t& skeleton_size)
 	char *bkt_buffer = writer.addr();
 
         buckets_info_[i].offset = writer.pos();
-        if (!write_bucket(writer, bucket, buffer)) {
+        size_t uncompressed_length;
+        if (!write_bucket(writer, bucket, buffer, uncompressed_length,
+                          buckets_info_[i].codec)) {
             if (buffer.size()) {
-                buffer.destroy();
+                tree_->layout_->free_buffer(buffer);
             }
             return false;
         }
         buckets_info_[i].length = writer.pos() - buckets_info_[i].offset;
-        buckets_info_[i].uncompressed_length = records_.bucket_length(i);
+        buckets_info_[i].uncompressed_length = uncompressed_length;
         buckets_info_[i].crc = crc16(bkt_buffer, buckets_info_[i].length);
     }
     size_t last_pos = writer.pos();
 
     if (buffer.size()) {
-        buffer.destroy();
+        tree_->layout_->free_buffer(buffer);
     }
 
     writer.seek(skeleton_pos);
@@ -1346,41 +2421,43 @@ bool LeafNode::write_to(BlockWriter& writer, size_t& skeleton_size)
     return true;
 }
 
-bool LeafNode::write_bucket(BlockWriter& writer, RecordBucket *bucket, Slice buffer)
+bool LeafNode::write_bucket(BlockWriter& writer, RecordBucket *bucket, Slice buffer,
+                            size_t& uncompressed_length, Compress& codec)
 {
-    if (tree_->compressor_) {
+    Compressor *compressor = tree_->compressor(tree_->leaf_compress_);
+    if (compressor) {
         // 1. write to buffer
         Block block(buffer, 0, 0);
         BlockWriter wr(&block);
-        if (!write_bucket(wr, bucket)) return false;
-
-        // 2. compress
-        assert(tree_->compressor_->max_compressed_length(block.size()) <=
-            writer.remain());
-
-        size_t compressed_length;
-        if (!tree_->compressor_->compress(buffer.data(), block.size(),
-             writer.addr(), &compressed_length)) {
-            LOG_ERROR("compress msgbuf error, nid " << nid_);
+        if (!encode_bucket(wr, *bucket)) {
+            LOG_ERROR("encode bucket error, nid " << nid_);
             return false;
         }
+        uncompressed_length = block.size();
 
-        // 3. skip
-        writer.skip(compressed_length);
+        // 2. compress, or write raw if it's incompressible
+        if (!tree_->compress_block(compressor, Slice(buffer.data(), block.size()),
+                                   writer, codec)) {
+            LOG_ERROR("compress bucket error, nid " << nid_);
+            return false;
+        }
 
+        if (codec == kNoCompress) {
+            tree_->skipped_buckets_.add(1);
+        } else {
+            tree_->compressed_buckets_.add(1);
+        }
         return true;
     } else {
-        return write_bucket(writer, bucket);
-    }
-}
-
-bool LeafNode::write_bucket(BlockWriter& writer, RecordBucket *bucket)
-{
-    if (!writer.writeUInt32(bucket->size())) return false;
-    for (size_t j = 0; j < bucket->size(); j++) {
-        if (!(*bucket)[j].write_to(writer)) return false;
+        codec = kNoCompress;
+        size_t start = writer.pos();
+        if (!encode_bucket(writer, *bucket)) {
+            LOG_ERROR("encode bucket error, nid " << nid_);
+            return false;
+        }
+        uncompressed_length = writer.pos() - start;
+        return true;
     }
-    return true;
 }
 
 void LeafNode::refresh_buckets_info()
@@ -1401,6 +2478,7 @@ void LeafNode::refresh_buckets_info()
         buckets_info_[i].offset = 0;
         buckets_info_[i].length = 0;
         buckets_info_[i].uncompressed_length = 0;
+        buckets_info_[i].codec = kNoCompress;
         buckets_info_[i].crc = 0;
 
         buckets_info_size_ += 4 + buckets_info_[i].key.size()
@@ -1423,6 +2501,13 @@ bool LeafNode::read_buckets_info(BlockReader& reader)
         if (!reader.readUInt32(&(buckets_info_[i].offset))) return false;
         if (!reader.readUInt32(&(buckets_info_[i].length))) return false;
         if (!reader.readUInt32(&(buckets_info_[i].uncompressed_length))) return false;
+        if (i == 0) {
+            // nodes written since seqs're all tagged
+            legacy_ = tree_->layout_->legacy_nodes() &&
+                      !codec_tagged(buckets_info_[i].uncompressed_length);
+        }
+        buckets_info_[i].codec = untag_codec(buckets_info_[i].uncompressed_length,
+                                             tree_->options_.compress);
         if (!reader.readUInt16(&(buckets_info_[i].crc))) return false;
         buckets_info_size_ += 4 + buckets_info_[i].key.size() 
 		+ 4 // sizeof(offset)
@@ -1433,6 +2518,7 @@ bool LeafNode::read_buckets_info(BlockReader& reader)
 
     // init buckets number
     records_.set_buckets_number(nbuckets);
+    encoded_buckets_.resize(nbuckets);
 
     status_ = kSkeletonLoaded;
     return true;
@@ -1445,27 +2531,76 @@ bool LeafNode::write_buckets_info(BlockWriter& writer)
         if (!writer.writeSlice(buckets_info_[i].key)) return false;
         if (!writer.writeUInt32(buckets_info_[i].offset)) return false;
         if (!writer.writeUInt32(buckets_info_[i].length)) return false;
-        if (!writer.writeUInt32(buckets_info_[i].uncompressed_length)) return false;
+        if (!writer.writeUInt32(tag_codec(buckets_info_[i].uncompressed_length,
+                                          buckets_info_[i].codec))) return false;
         if (!writer.writeUInt16(buckets_info_[i].crc)) return false;
     }
     return true;
 }
 
+bool LeafNode::bucket_loaded(size_t idx)
+{
+    return records_.bucket(idx) != NULL ||
+        (idx < encoded_buckets_.size() && encoded_buckets_[idx].size());
+}
+
 bool LeafNode::load_bucket(size_t idx)
+{
+    if (!begin_loading(idx)) {
+        // loaded by another thread, leaf might be modified meanwhile
+        return idx < buckets_info_.size() && bucket_loaded(idx);
+    }
+
+    // readers go on while bucket is read, writers're kept out
+    // until it's installed
+    unlock();
+    upgrade_lock();
+
+    // leaf might be modified while it's unlocked
+    bool ret = true;
+    if (idx < buckets_info_.size() && !bucket_loaded(idx)) {
+        Slice data = fetch_bucket(idx);
+        if (data.size() == 0) {
+            ret = false;
+        } else if (is_prefix_encoded(data)) {
+            // searched in place, no record is deserialized
+            upgrade();
+            encoded_buckets_[idx] = data;
+            encoded_length_ += data.size();
+        } else {
+            RecordBucket *bucket = new RecordBucket();
+            if (decode_bucket(data, *bucket, legacy_)) {
+                upgrade();
+                records_.set_bucket(idx, bucket);
+            } else {
+                LOG_ERROR("deserialize bucket error nid " << nid_ << ", idx " << idx);
+                delete bucket;
+                ret = false;
+            }
+            data.destroy();
+        }
+    }
+    downgrade();
+
+    end_loading(idx);
+    return ret;
+}
+
+Slice LeafNode::fetch_bucket(size_t idx)
 {
     assert(status_ != kFullLoaded);
     assert(idx < buckets_info_.size());
-    assert(records_.bucket(idx) == NULL);
 
     uint32_t offset = buckets_info_[idx].offset;
     uint32_t length = buckets_info_[idx].length;
     uint32_t uncompressed_length = buckets_info_[idx].uncompressed_length;
+    Compress codec = buckets_info_[idx].codec;
 
     Block* block = tree_->layout_->read(nid_, offset, length);
     if (block == NULL) {
         LOG_ERROR("read bucket error " << " nid " << nid_ << ", idx " << idx
             << ", offset " << offset << ", length " << length);
-        return false;
+        return Slice();
     }
     
     // do bucket crc checking
@@ -1478,53 +2613,33 @@ bool LeafNode::load_bucket(size_t idx)
             << ", expected_crc " << expected_crc << " ,actual_crc " << actual_crc);
 
         tree_->layout_->destroy(block);
-        return false;
-    }
-
-    BlockReader reader(block);
-
-    RecordBucket *bucket = new RecordBucket();
-    if (bucket == NULL) {
-        tree_->layout_->destroy(block);
-        return false;
+        return Slice();
     }
 
-    Slice buffer;
-    if (tree_->compressor_) {
-        buffer = Slice::alloc(uncompressed_length);
-    }
-
-    if (!read_bucket(reader, length, uncompressed_length, bucket, buffer)) {
-        if (buffer.size()) {
-            buffer.destroy();
+    Slice data;
+    if (codec != kNoCompress) {
+        Compressor *compressor = tree_->compressor(codec);
+        if (compressor == NULL) {
+            LOG_ERROR("bucket is compressed with codec " << codec
+                << ", which isn't built in, nid " << nid_ << ", idx " << idx);
+            tree_->layout_->destroy(block);
+            return Slice();
         }
-        delete bucket;
-        tree_->layout_->destroy(block);
-        return false;
-    }
-
-    if (buffer.size()) {
-        buffer.destroy();
-    }
 
-    // this operation must be inside read lock
-
-    // lazy load, upgrade lock to write lock
-    // TODO: write a upgradable rwlock
-    unlock();
-    write_lock();
-    if (records_.bucket(idx) == NULL) {
-        records_.set_bucket(idx, bucket);
+        data = Slice::alloc(uncompressed_length);
+        if (!compressor->uncompress(block->start(), length,
+            (char *)data.data(), uncompressed_length)) {
+            LOG_ERROR("uncompress bucket error nid " << nid_ << ", idx " << idx);
+            data.destroy();
+            tree_->layout_->destroy(block);
+            return Slice();
+        }
     } else {
-        // it's possible another read thread loading 
-        // the same block at the same time
-        delete bucket;
+        data = Slice(block->start(), length).clone();
     }
-    unlock();
-    read_lock();
 
     tree_->layout_->destroy(block);
-    return true;
+    return data;
 }
 
 bool LeafNode::load_all_buckets()
@@ -1551,20 +2666,25 @@ bool LeafNode::load_all_buckets()
 
 bool LeafNode::load_all_buckets(BlockReader& reader)
 {
+    // buffer is shared by compressed buckets
     Slice buffer;
-    if (tree_->compressor_) {
-        size_t buffer_length = 0;
-        for (size_t i = 0; i < buckets_info_.size(); i++ ) {
-            if (buffer_length < buckets_info_[i].uncompressed_length) {
-                buffer_length = buckets_info_[i].uncompressed_length;
-            }
+    size_t buffer_length = 0;
+    for (size_t i = 0; i < buckets_info_.size(); i++ ) {
+        if (buckets_info_[i].codec != kNoCompress &&
+            buffer_length < buckets_info_[i].uncompressed_length) {
+            buffer_length = buckets_info_[i].uncompressed_length;
         }
-        buffer = Slice::alloc(buffer_length);
+    }
+    if (buffer_length) {
+        buffer = tree_->layout_->alloc_aligned_buffer(buffer_length);
     }
 
     bool ret = true;
     for (size_t i = 0; i < buckets_info_.size(); i++) {
-        reader.seek(buckets_info_[i].offset);
+        // may be loaded individually already
+        if (records_.bucket(i)) {
+            continue;
+        }
 
         RecordBucket *bucket = new RecordBucket();
         if (bucket == NULL) {
@@ -1572,10 +2692,16 @@ bool LeafNode::load_all_buckets(BlockReader& reader)
             break;
         }
 
-        if (!read_bucket(reader, buckets_info_[i].length, 
-                         buckets_info_[i].uncompressed_length,
-                         bucket, buffer)) {
-            ret = false;
+        if (i < encoded_buckets_.size() && encoded_buckets_[i].size()) {
+            ret = decode_bucket(encoded_buckets_[i], *bucket);
+        } else {
+            reader.seek(buckets_info_[i].offset);
+            ret = read_bucket(reader, buckets_info_[i].length, 
+                              buckets_info_[i].uncompressed_length,
+                              buckets_info_[i].codec,
+                              bucket, buffer);
+        }
+        if (!ret) {
             delete bucket;
             break;
         }
@@ -1584,9 +2710,12 @@ bool LeafNode::load_all_buckets(BlockReader& reader)
     }
 
     if (buffer.size()) {
-        buffer.destroy();
+        tree_->layout_->free_buffer(buffer);
     }
 
+    // records're all deserialized
+    drop_encoded_buckets();
+
     status_ = kFullLoaded;
     return ret;
 }
@@ -1594,41 +2723,46 @@ bool LeafNode::load_all_buckets(BlockReader& reader)
 bool LeafNode::read_bucket(BlockReader& reader, 
                            size_t compressed_length,
                            size_t uncompressed_length,
+                           Compress codec,
                            RecordBucket *bucket, Slice buffer)
 {
-    if (tree_->compressor_) {
-        // 1. uncompress
-        assert(compressed_length <= reader.remain());
+    if (compressed_length > reader.remain()) {
+        return false;
+    }
+
+    Slice data;
+    if (codec != kNoCompress) {
         assert(uncompressed_length <= buffer.size());
 
-        // 1. uncompress
-        if (!tree_->compressor_->uncompress(reader.addr(),
-            compressed_length, (char *)buffer.data())) {
+        Compressor *compressor = tree_->compressor(codec);
+        if (compressor == NULL) {
+            LOG_ERROR("bucket is compressed with codec " << codec
+                << ", which isn't built in, nid " << nid_);
             return false;
         }
-        reader.skip(compressed_length);
 
-        // 2. deserialize
-        Block block(buffer, 0, uncompressed_length);
-        BlockReader rr(&block);
-        return read_bucket(rr, bucket);
+        // 1. uncompress
+        if (!compressor->uncompress(reader.addr(), compressed_length,
+            (char *)buffer.data(), uncompressed_length)) {
+            return false;
+        }
+        data = Slice(buffer.data(), uncompressed_length);
     } else {
-        return read_bucket(reader, bucket);
+        data = Slice(reader.addr(), compressed_length);
     }
+    reader.skip(compressed_length);
+
+    // 2. deserialize
+    return decode_bucket(data, *bucket, legacy_);
 }
 
-bool LeafNode::read_bucket(BlockReader& reader,
-                           RecordBucket *bucket)
+void LeafNode::drop_encoded_buckets()
 {
-    uint32_t nrecords;
-    if (!reader.readUInt32(&nrecords)) return false;
-
-    bucket->resize(nrecords);
-    for (size_t i = 0; i < nrecords; i++) {
-        if (!(*bucket)[i].read_from(reader)) {
-            return false;
+    for (size_t i = 0; i < encoded_buckets_.size(); i++) {
+        if (encoded_buckets_[i].size()) {
+            tree_->retire_value(encoded_buckets_[i]);
         }
     }
-
-    return true;
+    encoded_buckets_.clear();
+    encoded_length_ = 0;
 }
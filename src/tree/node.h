@@ -9,7 +9,9 @@
 #include <set>
 
 #include "cascadb/slice.h"
+#include "cascadb/pinnable_slice.h"
 #include "cascadb/comparator.h"
+#include "cascadb/options.h"
 #include "serialize/layout.h"
 #include "msg.h"
 #include "record.h"
@@ -20,16 +22,102 @@ namespace cascadb {
 #define NID_SCHEMA          ((bid_t)1)
 #define NID_START           (NID_NIL + 2)
 #define NID_LEAF_START      (bid_t)((1LL << 48) + 1)
-#define IS_LEAF(nid)        ((nid) >= NID_LEAF_START)
+
+// The highest byte of nid is id of the table node belongs to,
+// so that tables can share a single data file
+#define NID_TABLE_SHIFT     56
+#define NID_LOCAL_MASK      ((((bid_t)1) << NID_TABLE_SHIFT) - 1)
+#define MAX_TABLE_ID        255
+#define TABLE_NID(tid, nid) ((((bid_t)(tid)) << NID_TABLE_SHIFT) | (nid))
+
+#define IS_LEAF(nid)        (((nid) & NID_LOCAL_MASK) >= NID_LEAF_START)
 
 class Tree;
+class Node;
+
+// Accounts memory of nodes in cache. Dirty nodes're linked in the
+// order they're modified for the first time, so that the flusher
+// picks the oldest ones without scanning the cache.
+// Sizes of nodes're charged when they're put into cache, marked dirty,
+// or checked by the cache, and uncharged when they're deleted.
+class DirtyQueue {
+public:
+    // total accumulates sizes of all nodes charged
+    DirtyQueue(Atomic<size_t> *total);
+
+    // Start accounting a node, it's queued if dirty
+    void link(Node *node, size_t size);
+
+    // Stop accounting a node that is deleted
+    void unlink(Node *node);
+
+    // Node is marked dirty or clean
+    void set_dirty(Node *node, bool dirty, size_t size);
+
+    // Charge the current size of node
+    void charge(Node *node, size_t size);
+
+    // Pick dirty nodes from the oldest till goal bytes're picked,
+    // stop at nodes modified after expire unless all is true.
+    // Nodes being flushed, pinned or dead're skipped.
+    // Nodes picked're referenced under the mutex of queue rather than
+    // the cache shard lock, so the cache checks references again
+    // after charging before it deletes a node
+    void pick(uint64_t expire, bool all, size_t goal, std::vector<Node*>& nodes);
+
+    // Total size of dirty nodes
+    size_t size() { return size_.get(); }
+
+    size_t count();
+
+private:
+    void charge_locked(Node *node, size_t size);
+
+    void push_back(Node *node);
+
+    void erase(Node *node);
+
+    Mutex           mtx_;
+    Node            *head_;
+    Node            *tail_;
+    size_t          count_;
+    Atomic<size_t>  size_;
+    Atomic<size_t>  *total_;
+};
+
+// Codec of a msgbuf or bucket is recorded in the top bits of its
+// uncompressed length in skeleton, as its value plus one. Those written
+// before codecs're recorded're tagged 0, they're compressed with
+// Options::compress. Those incompressible're stored raw and tagged
+// with kNoCompress, so they're read without decompression
+#define CODEC_SHIFT         28
+#define CODEC_LENGTH_MASK   ((1U << CODEC_SHIFT) - 1)
+
+inline uint32_t tag_codec(uint32_t length, Compress codec)
+{
+    assert(length <= CODEC_LENGTH_MASK);
+    return length | ((uint32_t)(codec + 1) << CODEC_SHIFT);
+}
+
+// Nodes written before codecs're recorded have no tag at all
+inline bool codec_tagged(uint32_t length)
+{
+    return (length >> CODEC_SHIFT) != 0;
+}
+
+inline Compress untag_codec(uint32_t& length, Compress legacy)
+{
+    uint32_t tag = length >> CODEC_SHIFT;
+    length &= CODEC_LENGTH_MASK;
+    return tag ? (Compress)(tag - 1) : legacy;
+}
 
 class Pivot {
 public:
     Pivot() {}
     
     Pivot(Slice k, bid_t c, MsgBuf* mb)
-    : key(k), child(c), msgbuf(mb)
+    : key(k), child(c), msgbuf(mb), codec(kNoCompress)
     {
     }
     
@@ -45,6 +133,8 @@ public:
     uint32_t    length;
     // length of msgbuf before compression
     uint32_t    uncompressed_length;
+    // codec msgbuf is compressed with
+    Compress    codec;
     // crc of msgbuf
     uint16_t    crc;
 };
@@ -52,17 +142,22 @@ public:
 class Node {
 public:
     Node(const std::string& table_name, bid_t nid)
-    : table_name_(table_name), nid_(nid)
+    : table_name_(table_name), nid_(nid),
+      state_(0), first_write_timestamp_(0), refcnt_(0), pincnt_(0),
+      version_(0), write_locked_(false)
     {
-        dirty_ = false;
-        dead_ = false;
-        flushing_ = false;
-        
-        refcnt_ = 0;
-        pincnt_ = 0;
+        dirty_queue_ = NULL;
+        queued_ = false;
+        dirty_prev_ = dirty_next_ = NULL;
+        charged_size_ = 0;
     }
     
-    virtual ~Node() {}
+    virtual ~Node()
+    {
+        if (dirty_queue_) {
+            dirty_queue_->unlink(this);
+        }
+    }
     
     // size of node in memory
     virtual size_t size() = 0;
@@ -70,6 +165,10 @@ public:
     // size of node after serialization
     virtual size_t estimated_buffer_size() = 0;
 
+    // bytes taken in memory, including arenas of buffers and buckets,
+    // it's what the node is charged for in cache
+    virtual size_t memory_usage() { return size(); }
+
     virtual bool read_from(BlockReader& reader, bool skeleton_only) = 0;
 
     virtual bool write_to(BlockWriter& writer, size_t& skeleton_size) = 0;
@@ -88,55 +187,79 @@ public:
         return table_name_;
     }
 
+    // Node should be write locked, or not shared yet
     void set_dirty(bool dirty)
     {
-        ScopedMutex lock(&mtx_);
-        if (!dirty_ && dirty) {
-            first_write_timestamp_ = now();
+        if (dirty) {
+            if (!(state_.fetch_or(NODE_DIRTY) & NODE_DIRTY)) {
+                first_write_timestamp_.set(coarse_now_micros());
+            }
+        } else {
+            state_.fetch_and(~NODE_DIRTY);
+        }
+
+        if (dirty_queue_) {
+            dirty_queue_->set_dirty(this, dirty, dirty ? memory_usage() : 0);
         }
-        dirty_ = dirty;
     }
     
     bool is_dirty()
     {
-        ScopedMutex lock(&mtx_);
-        return dirty_;
+        return state_.get() & NODE_DIRTY;
     }
     
     void set_dead()
     {
-        ScopedMutex lock(&mtx_);
-        dead_ = true;
+        state_.fetch_or(NODE_DEAD);
     }
     
     bool is_dead()
     {
-        ScopedMutex lock(&mtx_);
-        return dead_;
+        return state_.get() & NODE_DEAD;
     }
     
     void set_flushing(bool flushing)
     {
-        ScopedMutex lock(&mtx_);
-        flushing_ = flushing;
+        if (flushing) {
+            state_.fetch_or(NODE_FLUSHING);
+        } else {
+            state_.fetch_and(~NODE_FLUSHING);
+        }
     }
     
     bool is_flushing()
     {
-        ScopedMutex lock(&mtx_);
-        return flushing_;
+        return state_.get() & NODE_FLUSHING;
     }
     
-    Time get_first_write_timestamp()
+    // In microseconds of the coarse clock
+    uint64_t get_first_write_timestamp()
     {
-        ScopedMutex lock(&mtx_);
-        return first_write_timestamp_;
+        return first_write_timestamp_.get();
     }
     
-    Time get_last_used_timestamp()
+    // Start accounting node in cache
+    void set_dirty_queue(DirtyQueue *queue)
     {
-        ScopedMutex lock(&mtx_);
-        return last_used_timestamp_;
+        assert(dirty_queue_ == NULL);
+        dirty_queue_ = queue;
+        dirty_queue_->link(this, memory_usage());
+    }
+
+    DirtyQueue* dirty_queue()
+    {
+        return dirty_queue_;
+    }
+
+    // Test whether node is used since the last call,
+    // and clear the mark
+    bool clear_referenced()
+    {
+        // skip the write if it's clear already
+        if (!(state_.get() & NODE_REFERENCED)) {
+            return false;
+        }
+        return state_.fetch_and(~NODE_REFERENCED) & NODE_REFERENCED;
     }
     
     /***************************
@@ -145,41 +268,40 @@ public:
     
     void inc_ref()
     {
-        ScopedMutex lock(&mtx_);
-        refcnt_ ++;
+        refcnt_.add(1);
     }
     
     void dec_ref()
     {
-        ScopedMutex lock(&mtx_);
-        refcnt_ --;
-        assert(refcnt_ >= 0);
-        last_used_timestamp_ = now();
+        // mark before releasing, node might be deleted right after
+        if (!(state_.get() & NODE_REFERENCED)) {
+            state_.fetch_or(NODE_REFERENCED);
+        }
+        int refcnt = refcnt_.sub(1);
+        assert(refcnt >= 0);
+        (void) refcnt;
     }
     
     int ref()
     {
-        ScopedMutex lock(&mtx_);
-        return refcnt_;
+        return refcnt_.get();
     }
     
     void inc_pin()
     {
-        ScopedMutex lock(&mtx_);
-        pincnt_ ++;
+        pincnt_.add(1);
     }
     
     void dec_pin()
     {
-        ScopedMutex lock(&mtx_);
-        pincnt_ --;
-        assert(pincnt_ >= 0);
+        int pincnt = pincnt_.sub(1);
+        assert(pincnt >= 0);
+        (void) pincnt;
     }
     
     int pin()
     {
-        ScopedMutex lock(&mtx_);
-        return pincnt_;
+        return pincnt_.get();
     }
     
     // Read lock is locked when:
@@ -202,59 +324,116 @@ public:
     void write_lock()
     {
         lock_.write_lock();
+        write_locked_ = true;
+        version_.add(1);
     }
 
     bool try_write_lock()
     {
-        return lock_.try_write_lock();
+        if (!lock_.try_write_lock()) {
+            return false;
+        }
+        write_locked_ = true;
+        version_.add(1);
+        return true;
     }
     
     void unlock()
     {
+        // only the writer can see the flag set
+        if (write_locked_) {
+            write_locked_ = false;
+            version_.add(1);
+        }
         lock_.unlock();
     }
+
+    // Intent lock is shared with readers but not writers, it's
+    // locked when node is read and going to be modified,
+    // e.g. loading buffers lazily
+    void upgrade_lock()
+    {
+        lock_.upgrade_lock();
+    }
+
+    // Intent lock to write lock
+    void upgrade()
+    {
+        lock_.upgrade();
+        write_locked_ = true;
+        version_.add(1);
+    }
+
+    // Intent or write lock to read lock
+    void downgrade()
+    {
+        if (write_locked_) {
+            write_locked_ = false;
+            version_.add(1);
+        }
+        lock_.downgrade();
+    }
+
+    // Odd while node is write locked, and changed by every write lock,
+    // readers without locks validate what they've read against it
+    uint64_t version()
+    {
+        return version_.get();
+    }
     
 protected:
     std::string     table_name_;
     bid_t           nid_;
 
-    // TODO: use atomic
-    Mutex           mtx_;
-        
-    bool            dirty_;
-    bool            dead_;
+    enum {
+        NODE_DIRTY          = 0x1,
+        NODE_DEAD           = 0x2,
+        // protect the same node being written out concurrently
+        NODE_FLUSHING       = 0x4,
+        // set when node is released, nodes used recently're skipped
+        // once by the CLOCK hand in cache before evicted
+        NODE_REFERENCED     = 0x8,
+    };
 
-    // flushing_ flag will protect the same node being 
-    // written out concurrently
-    bool            flushing_;
+    // flags above, read and modified without locks
+    Atomic<uint32_t> state_;
 
     // the order of dirty nodes be flushed out
-    Time            first_write_timestamp_;
+    Atomic<uint64_t> first_write_timestamp_;
 
-    // the order of clean nodes be evicted
-    Time            last_used_timestamp_;
+    // the rest're maintained by dirty queue under its lock
+    friend class DirtyQueue;
+    DirtyQueue      *dirty_queue_;
+    bool            queued_;
+    Node            *dirty_prev_;
+    Node            *dirty_next_;
+    size_t          charged_size_;
     
     // reference counting, node can be destructed only
     // when this count reaches 0
-    int             refcnt_;
+    Atomic<int>     refcnt_;
 
     // the number of times a node has been pinned, 
     // a node should not be flushed out when pinned
-    int             pincnt_;
+    Atomic<int>     pincnt_;
 
     // latch
-    RWLock          lock_;
+    UpgradableRWLock lock_;
+
+    Atomic<uint64_t> version_;
+    bool            write_locked_;
 };
 
 class SchemaNode : public Node {
 public:
-    SchemaNode(const std::string& table_name)
-    : Node(table_name, NID_SCHEMA)
+    SchemaNode(const std::string& table_name, bid_t nid = NID_SCHEMA)
+    : Node(table_name, nid)
     {
         root_node_id = NID_NIL;
         next_inner_node_id = NID_NIL;
         next_leaf_node_id = NID_NIL;
         tree_depth = 0;
+        last_seq = 0;
     }
 
     size_t size();
@@ -269,6 +448,8 @@ public:
     bid_t           next_inner_node_id;
     bid_t           next_leaf_node_id;
     size_t          tree_depth;
+    // sequence numbers no larger than this may have been used
+    uint64_t        last_seq;
 };
 
 enum NodeStatus {
@@ -278,12 +459,54 @@ enum NodeStatus {
     kFullLoaded
 };
 
+// Result of looking up a key without locking inner nodes
+enum FindResult {
+    kFindFound,
+    kFindMissing,
+    // nodes're modified concurrently, retry from root
+    kFindRetry,
+    // go the locked way, e.g. buffers need to be loaded
+    kFindLocked
+};
+
+// Key range covered by a single leaf, together with records of
+// the leaf and messages buffered for this range along the path
+// from root.
+// Everything's cloned so it remains valid after node locks
+// are released, call destroy() to free memory.
+class ScanRange {
+public:
+    ScanRange() : has_lower(false), has_upper(false) {}
+
+    void destroy();
+
+    // lower bound is inclusive, and upper bound is exclusive,
+    // range is unbounded at the side if has_lower/has_upper is false
+    bool                            has_lower;
+    Slice                           lower;
+    bool                            has_upper;
+    Slice                           upper;
+
+    // records in leaf
+    std::vector<Record>             records;
+
+    // messages buffered at each level, ordered from root to bottom,
+    // those at upper levels may fall out of the range since bounds
+    // get narrower while descending
+    std::vector<std::vector<Msg> >  msgs;
+
+    // range tombstones buffered at each level, they delete
+    // records from the lower levels
+    std::vector<std::vector<Msg> >  ranges;
+};
+
 class InnerNode;
 
 class DataNode : public Node {
 public:
     DataNode(const std::string& table_name, bid_t nid, Tree *tree)
-    : Node(table_name, nid), tree_(tree), status_(kNew)
+    : Node(table_name, nid), tree_(tree), status_(kNew), legacy_(false),
+      load_cond_(&load_mtx_)
     {
     }
 
@@ -292,19 +515,71 @@ public:
     // Merge messages cascading from parent
     virtual bool cascade(MsgBuf *mb, InnerNode* parent) = 0;
 
-    // Find values buffered in this node and all descendants
-    virtual bool find(Slice key, Slice& value, InnerNode* parent) = 0;
+    // Find values buffered in this node and all descendants,
+    // the newest version no newer than snapshot is returned,
+    // values in leaf're pinned rather than copied.
+    // Operands of upserts newer than it're collected into upserts,
+    // from the newest to the oldest, and left to the caller to apply.
+    // Upserts keep their seqs, so that those cascaded meanwhile
+    // into nodes below, or folded into the version found, are
+    // collected only once
+    virtual bool find(Slice key, PinnableSlice& value, uint64_t snapshot,
+                      std::vector<Msg>& upserts, InnerNode* parent) = 0;
+
+    // Collect the leaf range containing key, or the range right before
+    // key if backward is true. An empty key stands for the first range,
+    // or the last range if backward is true.
+    // Only versions visible to snapshot're collected
+    virtual bool scan(Slice key, bool backward, uint64_t snapshot,
+                      ScanRange& range, InnerNode* parent) = 0;
     
     virtual void lock_path(Slice key, std::vector<DataNode*>& path) = 0;
 
 protected:
+    // Called with read lock when buffer idx is going to be loaded.
+    // Return true if the caller should load it, otherwise another thread
+    // is loading it, and it's waited with read lock released meanwhile
+    bool begin_loading(size_t idx);
+
+    // Wake up threads waiting for buffer idx
+    void end_loading(size_t idx);
+
     Tree            *tree_;
 
     NodeStatus      status_;
+
+    // written before seqs, its buffers're read with seq 0
+    bool            legacy_;
+
+    // buffers being loaded lazily, so that only one thread
+    // reads each of them
+    Mutex           load_mtx_;
+    CondVar         load_cond_;
+    std::set<size_t> loading_;
 };
 
 class LeafNode;
 
+// Immutable copy of pivots of an inner node, which readers route
+// keys through without locking the node. Keys and filters're cloned,
+// it's valid only while the version of node equals to version,
+// and deleted by epoch reclamation once replaced
+class PivotRoute {
+public:
+    PivotRoute() : version(0), first_child(NID_NIL), first_msgbuf(NULL) {}
+
+    ~PivotRoute();
+
+    int find_pivot(Comparator *comp, Slice k);
+
+    uint64_t            version;
+    bid_t               first_child;
+    MsgBuf              *first_msgbuf;
+    // only set if msgbuf is not loaded
+    Slice               first_filter;
+    std::vector<Pivot>  pivots;
+};
+
 class InnerNode : public DataNode {
 public:
     InnerNode(const std::string& table_name, bid_t nid, Tree *tree)
@@ -315,11 +590,14 @@ public:
       first_msgbuf_offset_(0),
       first_msgbuf_length_(0),
       first_msgbuf_uncompressed_length_(0),
+      first_msgbuf_codec_(kNoCompress),
       pivots_sz_(0),
       msgcnt_(0), 
-      msgbufsz_(0)
+      msgbufsz_(0),
+      route_(NULL),
+      cascade_queued_(false)
     {
-        assert(nid >= NID_START && nid < NID_LEAF_START);
+        assert((nid & NID_LOCAL_MASK) >= NID_START && !IS_LEAF(nid));
     }
     
     virtual ~InnerNode();
@@ -329,17 +607,65 @@ public:
     
     bool put(Slice key, Slice value)
     {
-        return write(Msg(Put, key.clone(), value.clone()));
+        return write(Msg(Put, key, value));
     }
     
     bool del(Slice key)
     {
-        return write(Msg(Del, key.clone()));
+        return write(Msg(Del, key));
+    }
+
+    bool upsert(Slice key, Slice value)
+    {
+        return write(Msg(Upsert, key, value));
     }
 
+    // Write messages sorted by key with node write locked,
+    // so that readers see all or none of them.
+    // Sequence numbers're assigned by callers.
+    // Messages're copied into buffers, callers keep their own
+    bool write_batch(std::vector<Msg>& msgs);
+
     virtual bool cascade(MsgBuf *mb, InnerNode* parent);
     
-    virtual bool find(Slice key, Slice& value, InnerNode* parent);
+    virtual bool find(Slice key, PinnableSlice& value, uint64_t snapshot,
+                      std::vector<Msg>& upserts, InnerNode* parent);
+
+    // Find key from this node down without locking inner nodes,
+    // nodes're read through pivot routes and validated against
+    // their versions, leaf is read locked as usual.
+    // Caller should be in an epoch and hold a reference to this node,
+    // upserts collected're left to the caller if it fails
+    FindResult find_optimistic(Slice key, PinnableSlice& value, uint64_t snapshot,
+                               std::vector<Msg>& upserts);
+
+    // Look key up in read locked msgbuf, return kFindRetry if
+    // it should go on to older buffers, otherwise seq is set
+    // to the version found
+    static FindResult find_msgbuf(MsgBuf *b, Slice key, PinnableSlice& value,
+                                  uint64_t snapshot, std::vector<Msg>& upserts,
+                                  uint64_t& seq);
+
+    // Drop upserts collected from buffers above which're no newer
+    // than the version found at seq, they've cascaded down and been
+    // folded into it since those buffers were read
+    static void drop_upserts(std::vector<Msg>& upserts, uint64_t seq);
+
+    // Move messages of write locked mb into buffers of this node,
+    // they should be newer than those buffered.
+    // Unlike write_batch, sequence numbers're kept and the node
+    // is only read locked, so readers're not blocked
+    void merge_msgbuf(MsgBuf *mb);
+
+    // Called by cascade threads for nodes queued
+    void background_cascade();
+
+    // Test whether buffers grow beyond the hard limit,
+    // read without lock
+    bool overflowed();
+
+    virtual bool scan(Slice key, bool backward, uint64_t snapshot,
+                      ScanRange& range, InnerNode* parent);
     
     void add_pivot(Slice key, bid_t nid, std::vector<DataNode*>& path);
     
@@ -350,6 +676,8 @@ public:
     
     size_t size();
 
+    size_t memory_usage();
+
     size_t estimated_buffer_size();
     
     bool read_from(BlockReader& reader, bool skeleton_only);
@@ -364,32 +692,72 @@ protected:
     bool write(const Msg& m);
     int comp_pivot(Slice k, int i);
     int find_pivot(Slice k);
+    int scan_pivot(Slice k, bool backward);
     
     MsgBuf* msgbuf(int idx);
     MsgBuf* msgbuf(int idx, Slice& key);
 
+    // Return the route of current version, it's rebuilt if outdated.
+    // NULL if this node is write locked
+    PivotRoute* get_route(uint64_t& version);
+
+    // Drop the route after pivots're modified without write lock
+    void invalidate_route();
+
     bid_t child(int idx);
     void set_child(int idx, bid_t c);
     
     void insert_msgbuf(const Msg& m, int idx);
     void insert_msgbuf(MsgBuf::Iterator begin, MsgBuf::Iterator end, int idx);
+    void insert_msgbuf(const Msg *begin, const Msg *end, int idx);
+
+    // Clip range tombstone m going to child idx at the upper bound of
+    // child, pieces for the following children're pushed into pieces
+    void clip_range(Msg& m, int idx, std::vector<Msg>& pieces);
+    void insert_pieces(std::vector<Msg>& pieces);
     
+    // Distribute messages of locked mb into buffers with read lock held
+    void append_msgbuf(MsgBuf *mb);
+
+    // Add changes of a buffer to counters, buffers're modified
+    // concurrently with only read lock of node held
+    void account(size_t cnt, size_t sz)
+    {
+        __sync_add_and_fetch(&msgcnt_, cnt);
+        __sync_add_and_fetch(&msgbufsz_, sz);
+    }
+
     int find_msgbuf_maxcnt();
     int find_msgbuf_maxsz();
 
+    // Cascade buffers if node is full with read lock held,
+    // it's left to cascade threads if there're any.
+    // Lock is released when it returns
     void maybe_cascade();
+
+    // Cascade the largest buffer with read lock held
+    void cascade_largest();
     
     void split(std::vector<DataNode*>& path);
 
+    // Load msgbuf idx with read lock held
     bool load_msgbuf(int idx);
+    // Read and decompress msgbuf idx, NULL on error
+    MsgBuf* fetch_msgbuf(int idx);
     bool load_all_msgbuf();
+    // Load all msgbufs with write lock held, which is kept
+    bool load_all_msgbuf_locked();
     bool load_all_msgbuf(BlockReader& reader);
     bool read_msgbuf(BlockReader& reader, 
                      size_t compressed_length,
                      size_t uncompressed_length,
+                     Compress codec,
                      MsgBuf *mb, Slice buffer);
 
-    bool write_msgbuf(BlockWriter& writer, MsgBuf *mb, Slice buffer);
+    // codec is set to the one msgbuf is written with,
+    // kNoCompress if it doesn't compress well
+    bool write_msgbuf(BlockWriter& writer, MsgBuf *mb, Slice buffer,
+                      Compress& codec);
 
     // true if children're leaf nodes
     bool bottom_;
@@ -400,6 +768,7 @@ protected:
     uint32_t first_msgbuf_offset_;
     uint32_t first_msgbuf_length_;
     uint32_t first_msgbuf_uncompressed_length_;
+    Compress first_msgbuf_codec_;
     uint16_t first_msgbuf_crc_;
     
     std::vector<Pivot> pivots_;
@@ -407,6 +776,13 @@ protected:
     size_t pivots_sz_; 
     size_t msgcnt_;
     size_t msgbufsz_;
+
+    Atomic<PivotRoute*> route_;
+
+    // maintained by cascader under its lock
+    friend class Tree;
+    friend class Cascader;
+    bool cascade_queued_;
 };
 
 class LeafNode : public DataNode { 
@@ -417,9 +793,19 @@ public:
 
     virtual bool cascade(MsgBuf *mb, InnerNode* parent);
     
-    virtual bool find(Slice key, Slice& value, InnerNode* parent);
+    virtual bool find(Slice key, PinnableSlice& value, uint64_t snapshot,
+                      std::vector<Msg>& upserts, InnerNode* parent);
+
+    // Find key in this read locked leaf, lock is released before return
+    bool find_locked(Slice key, PinnableSlice& value, uint64_t snapshot,
+                     std::vector<Msg>& upserts);
+
+    virtual bool scan(Slice key, bool backward, uint64_t snapshot,
+                      ScanRange& range, InnerNode* parent);
     
     size_t size();
+
+    size_t memory_usage();
     
     size_t estimated_buffer_size();
 
@@ -430,7 +816,20 @@ public:
     void lock_path(Slice key, std::vector<DataNode*>& path);
     
 protected:
-    Record to_record(const Msg& msg);
+    // Convert message into record, upsert is applied to the older
+    // version, older is NULL if there isn't, the result is put in arena.
+    // Return false if upsert can't be applied, and it's dropped
+    bool to_record(const Msg& msg, const Record *older, Arena& arena,
+                   Record& r);
+
+    // Deleted record for key covered by range tombstone
+    Record to_tombstone(Slice key, uint64_t seq);
+
+    // Push versions of a key into res, from the newest to the oldest
+    void push_versions(std::vector<Record>& versions, RecordBuckets& res);
+
+    // Values may be pinned by readers, so buckets're retired to tree
+    void retire_buckets(RecordBuckets& records);
   
     void split(Slice anchor);
     
@@ -441,18 +840,27 @@ protected:
     bool read_buckets_info(BlockReader& reader);
     bool write_buckets_info(BlockWriter& writer);
 
+    // Return true if bucket idx is deserialized or kept encoded
+    bool bucket_loaded(size_t idx);
+    // Load bucket idx with read lock held
     bool load_bucket(size_t idx);
+    // Read and decompress bucket idx, empty on error
+    Slice fetch_bucket(size_t idx);
     bool load_all_buckets();
     bool load_all_buckets(BlockReader& reader);
     bool read_bucket(BlockReader& reader, 
                      size_t compressed_length,
                      size_t uncompressed_length,
+                     Compress codec,
                      RecordBucket *bucket, Slice buffer);
-    bool read_bucket(BlockReader& reader,
-                     RecordBucket *bucket);
 
-    bool write_bucket(BlockWriter& writer, RecordBucket *bucket, Slice buffer);
-    bool write_bucket(BlockWriter& writer, RecordBucket *bucket);
+    // codec is set to the one bucket is written with,
+    // kNoCompress if it doesn't compress well
+    bool write_bucket(BlockWriter& writer, RecordBucket *bucket, Slice buffer,
+                      size_t& uncompressed_length, Compress& codec);
+
+    // Retire buckets kept encoded, they may be pinned by readers
+    void drop_encoded_buckets();
 
 private:
     // either spliting or merging to get tree balanced
@@ -469,6 +877,7 @@ private:
         uint32_t            offset;
         uint32_t            length;
         uint32_t            uncompressed_length;
+        Compress            codec;
         uint16_t            crc;
     };
     size_t                  buckets_info_size_;
@@ -477,6 +886,11 @@ private:
 
     RecordBuckets           records_;
 
+    // prefix encoded buckets loaded by point reads're searched in place,
+    // they're deserialized once the leaf is fully loaded
+    std::vector<Slice>      encoded_buckets_;
+    size_t                  encoded_length_;
+
 };
 
 
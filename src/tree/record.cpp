@@ -10,25 +10,261 @@
 using namespace std;
 using namespace cascadb;
 
-size_t Record::size()
+size_t Record::size() const
 {
-    return 4 + key.size() + 4 + value.size();
+    size_t sz = 4 + key.size() + 8 + 1;
+    if (!deleted) {
+        sz += 4 + value.size();
+    }
+    return sz;
 }
         
 bool Record::read_from(BlockReader& reader)
 {
     if (!reader.readSlice(key)) return false;
-    if (!reader.readSlice(value)) return false;
+    if (!reader.readUInt64(&seq)) return false;
+    if (!reader.readBool(&deleted)) return false;
+    if (!deleted) {
+        if (!reader.readSlice(value)) return false;
+    }
     return true;
 }
     
+bool Record::read_from(BlockReader& reader, Arena& arena)
+{
+    if (!reader.readSlice(key, arena)) return false;
+    if (!reader.readUInt64(&seq)) return false;
+    if (!reader.readBool(&deleted)) return false;
+    if (!deleted) {
+        if (!reader.readSlice(value, arena)) return false;
+    }
+    return true;
+}
+
+bool Record::read_legacy(BlockReader& reader, Arena& arena)
+{
+    if (!reader.readSlice(key, arena)) return false;
+    if (!reader.readSlice(value, arena)) return false;
+    seq = 0;
+    deleted = false;
+    return true;
+}
+
 bool Record::write_to(BlockWriter& writer)
 {
     if (!writer.writeSlice(key)) return false;
-    if (!writer.writeSlice(value)) return false;
+    if (!writer.writeUInt64(seq)) return false;
+    if (!writer.writeBool(deleted)) return false;
+    if (!deleted) {
+        if (!writer.writeSlice(value)) return false;
+    }
     return true;
 }
 
+void Record::destroy()
+{
+    key.destroy();
+    if (!deleted) {
+        value.destroy();
+    }
+}
+
+bool cascadb::encode_bucket(BlockWriter& writer, const RecordBucket& bucket)
+{
+    assert(bucket.size() < BUCKET_PREFIX_ENCODED);
+    size_t restarts = (bucket.size() + BUCKET_RESTART_INTERVAL - 1) / BUCKET_RESTART_INTERVAL;
+
+    size_t start = writer.pos();
+    if (!writer.writeUInt32(bucket.size() | BUCKET_PREFIX_ENCODED)) return false;
+    if (!writer.writeUInt32(restarts)) return false;
+    // offsets're filled in after records're written
+    size_t offsets_pos = writer.pos();
+    if (!writer.skip(4 * restarts)) return false;
+
+    vector<uint32_t> offsets;
+    offsets.reserve(restarts);
+    Slice last;
+    for (size_t i = 0; i < bucket.size(); i++) {
+        const Record& rec = bucket[i];
+        size_t shared = 0;
+        if (i % BUCKET_RESTART_INTERVAL == 0) {
+            offsets.push_back(writer.pos() - start);
+        } else {
+            size_t n = min(last.size(), rec.key.size());
+            while (shared < n && last[shared] == rec.key[shared]) {
+                shared ++;
+            }
+        }
+        last = rec.key;
+
+        if (!writer.writeVarUInt32(shared)) return false;
+        if (!writer.writeVarUInt32(rec.key.size() - shared)) return false;
+        if (!writer.writeBytes(Slice(rec.key.data() + shared,
+                                     rec.key.size() - shared))) return false;
+        if (!writer.writeUInt64(rec.seq)) return false;
+        if (!writer.writeBool(rec.deleted)) return false;
+        if (!rec.deleted) {
+            if (!writer.writeVarUInt32(rec.value.size())) return false;
+            if (!writer.writeBytes(rec.value)) return false;
+        }
+    }
+
+    size_t end_pos = writer.pos();
+    writer.seek(offsets_pos);
+    for (size_t i = 0; i < offsets.size(); i++) {
+        if (!writer.writeUInt32(offsets[i])) return false;
+    }
+    writer.seek(end_pos);
+    return true;
+}
+
+bool cascadb::is_prefix_encoded(Slice data)
+{
+    return data.size() >= 4 &&
+        (*(uint32_t*)data.data() & BUCKET_PREFIX_ENCODED);
+}
+
+bool cascadb::decode_bucket(Slice data, RecordBucket& bucket, bool legacy)
+{
+    if (data.size() == 0) {
+        return false;
+    }
+
+    if (!is_prefix_encoded(data)) {
+        Block block(data, 0, data.size());
+        BlockReader reader(&block);
+
+        uint32_t nrecords;
+        if (!reader.readUInt32(&nrecords)) return false;
+        bucket.resize(nrecords);
+        for (size_t i = 0; i < nrecords; i++) {
+            bool ok = legacy ? bucket[i].read_legacy(reader, bucket.arena())
+                             : bucket[i].read_from(reader, bucket.arena());
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint32_t nrecords = *(uint32_t*)data.data() & ~BUCKET_PREFIX_ENCODED;
+    bucket.reserve(nrecords);
+
+    BucketView view(data);
+    for (view.seek_to_first(); view.valid(); view.next()) {
+        Record rec(view.key(), view.value(), view.seq());
+        rec.deleted = view.deleted();
+        bucket.append(rec);
+    }
+    return bucket.size() == nrecords;
+}
+
+BucketView::BucketView(Slice data)
+: data_(data),
+  count_(0),
+  restarts_(0),
+  valid_(false),
+  idx_(0),
+  next_offset_(0),
+  seq_(0),
+  deleted_(false)
+{
+    if (is_prefix_encoded(data_) && data_.size() >= 8) {
+        count_ = *(uint32_t*)data_.data() & ~BUCKET_PREFIX_ENCODED;
+        restarts_ = *(uint32_t*)(data_.data() + 4);
+        if (8 + 4 * (size_t)restarts_ > data_.size()) {
+            LOG_ERROR("bad restarts count " << restarts_
+                << ", bucket length " << data_.size());
+            count_ = restarts_ = 0;
+        }
+    }
+}
+
+uint32_t BucketView::restart_offset(size_t idx)
+{
+    assert(idx < restarts_);
+    return *(uint32_t*)(data_.data() + 8 + 4 * idx);
+}
+
+bool BucketView::parse(size_t offset)
+{
+    Block block(data_, 0, data_.size());
+    BlockReader reader(&block);
+    reader.seek(offset);
+
+    uint32_t shared, non_shared;
+    if (!reader.readVarUInt32(&shared)) return false;
+    if (!reader.readVarUInt32(&non_shared)) return false;
+    if (shared > key_.size() || reader.remain() < non_shared) return false;
+    key_.resize(shared);
+    key_.append(reader.addr(), non_shared);
+    reader.skip(non_shared);
+
+    if (!reader.readUInt64(&seq_)) return false;
+    if (!reader.readBool(&deleted_)) return false;
+    value_ = Slice();
+    if (!deleted_) {
+        uint32_t length;
+        if (!reader.readVarUInt32(&length)) return false;
+        if (reader.remain() < length) return false;
+        value_ = Slice(reader.addr(), length);
+        reader.skip(length);
+    }
+
+    next_offset_ = reader.pos();
+    return true;
+}
+
+void BucketView::seek_to_first()
+{
+    idx_ = 0;
+    key_.clear();
+    valid_ = restarts_ > 0 && parse(restart_offset(0));
+}
+
+void BucketView::seek(Slice key, Comparator *comp)
+{
+    if (restarts_ == 0) {
+        valid_ = false;
+        return;
+    }
+
+    // find the last restart point whose key is less than key,
+    // versions of key may start before a restart point of it
+    size_t left = 0, right = restarts_;
+    while (right - left > 1) {
+        size_t mid = (left + right) / 2;
+        key_.clear();
+        if (!parse(restart_offset(mid))) {
+            valid_ = false;
+            return;
+        }
+        if (comp->compare(Slice(key_), key) < 0) {
+            left = mid;
+        } else {
+            right = mid;
+        }
+    }
+
+    idx_ = left * BUCKET_RESTART_INTERVAL;
+    key_.clear();
+    valid_ = parse(restart_offset(left));
+    while (valid_ && comp->compare(Slice(key_), key) < 0) {
+        next();
+    }
+}
+
+void BucketView::next()
+{
+    assert(valid_);
+    idx_ ++;
+    if (idx_ >= count_ || next_offset_ >= data_.size()) {
+        valid_ = false;
+        return;
+    }
+    valid_ = parse(next_offset_);
+}
+
 RecordBuckets::~RecordBuckets()
 {
     for (size_t i = 0; i < buckets_.size(); i++) {
@@ -36,11 +272,14 @@ RecordBuckets::~RecordBuckets()
     }
 }
 
-void RecordBuckets::push_back(Record record)
+void RecordBuckets::push_back(const Record& record)
 {
     RecordBucket* bucket;
-    if (buckets_.size() == 0 || last_bucket_length_ + 
-            record.size() > max_bucket_length_) {
+    // versions of a key're never divided into different buckets,
+    // since a bucket is located by the key of its first record
+    if (buckets_.size() == 0 || (last_bucket_length_ + 
+            record.size() > max_bucket_length_ &&
+            buckets_.back().bucket->back().key != record.key)) {
         bucket = new RecordBucket();
         RecordBucketInfo info;
         info.bucket = bucket;
@@ -52,7 +291,7 @@ void RecordBuckets::push_back(Record record)
         bucket = buckets_.back().bucket;
     }
 
-    bucket->push_back(record);
+    bucket->append(record);
     buckets_.back().length += record.size();
     last_bucket_length_ += record.size();
     
@@ -60,6 +299,19 @@ void RecordBuckets::push_back(Record record)
     size_ ++;
 }
 
+void RecordBuckets::release(std::vector<RecordBucket*>& buckets)
+{
+    for (size_t i = 0; i < buckets_.size(); i++) {
+        if (buckets_[i].bucket) {
+            buckets.push_back(buckets_[i].bucket);
+        }
+    }
+    buckets_.clear();
+    last_bucket_length_ = 0;
+    length_ = 0;
+    size_ = 0;
+}
+
 void RecordBuckets::swap(RecordBuckets &other)
 {
     buckets_.swap(other.buckets_);
@@ -68,6 +320,18 @@ void RecordBuckets::swap(RecordBuckets &other)
     std::swap(size_, other.size_);
 }
 
+bool RecordBuckets::splittable()
+{
+    if (buckets_.size() > 1) {
+        return true;
+    }
+    if (buckets_.size() == 0) {
+        return false;
+    }
+    RecordBucket *bucket = buckets_[0].bucket;
+    return bucket->size() > 1 && bucket->front().key != bucket->back().key;
+}
+
 Slice RecordBuckets::split(RecordBuckets &other)
 {
     assert(other.buckets_number() == 0);
@@ -79,8 +343,21 @@ Slice RecordBuckets::split(RecordBuckets &other)
         RecordBucket *dst = new RecordBucket();
 
         size_t n = src->size() / 2;
-        dst->resize(src->size() - n);
-        std::copy(src->begin() + n, src->end(), dst->begin());
+        // don't divide versions of a key
+        while (n < src->size() && (*src)[n].key == (*src)[n-1].key) {
+            n ++;
+        }
+        if (n == src->size()) {
+            n = src->size() / 2;
+            while (n > 1 && (*src)[n].key == (*src)[n-1].key) {
+                n --;
+            }
+        }
+        // records moved're left in arena of src
+        dst->reserve(src->size() - n);
+        for (size_t i = n; i < src->size(); i++) {
+            dst->append((*src)[i]);
+        }
         src->resize(n);
 
         buckets_[0].length = 4;
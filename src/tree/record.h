@@ -6,29 +6,149 @@
 #define CASCADB_TREE_RECORD_H_
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 #include <stdexcept>
 
 #include "cascadb/slice.h"
+#include "cascadb/comparator.h"
 #include "serialize/block.h"
+#include "util/arena.h"
 
 namespace cascadb {
 
-// Data is stored as Record inside leaf node
+// Data is stored as Record inside leaf node.
+// Multiple versions of a key're kept from the newest to the oldest
+// if older ones're visible to live snapshots, a deleted record
+// stands for deletion of older versions.
 class Record {
 public:
-    Record() {}
-    Record(Slice k, Slice v) : key(k), value(v) {}
+    Record() : seq(0), deleted(false) {}
+    Record(Slice k, Slice v, uint64_t s = 0)
+    : key(k), value(v), seq(s), deleted(false) {}
 
-    size_t size();
+    size_t size() const;
     bool read_from(BlockReader& reader);
+    // Key and value're copied into arena
+    bool read_from(BlockReader& reader, Arena& arena);
+    // Read record written before seqs, it's seq 0 and never deleted
+    bool read_legacy(BlockReader& reader, Arena& arena);
     bool write_to(BlockWriter& writer);
+
+    void destroy();
     
-    Slice  key;
-    Slice  value;
+    Slice       key;
+    Slice       value;
+    uint64_t    seq;
+    bool        deleted;
 };
 
-typedef std::vector<Record> RecordBucket;
+// Records of a bucket, keys and values appended're copied into
+// arena of the bucket, and freed along with it
+class RecordBucket : public std::vector<Record> {
+public:
+    // Append a copy of record
+    void append(const Record& record)
+    {
+        Record r = record;
+        r.key = arena_.copy(record.key);
+        if (!record.deleted) {
+            r.value = arena_.copy(record.value);
+        }
+        push_back(r);
+    }
+
+    Arena& arena() { return arena_; }
+
+    // Return bytes taken in memory, records and their arena included
+    size_t memory_usage() const { return size() * sizeof(Record) + arena_.usage(); }
+
+private:
+    Arena   arena_;
+};
+
+// Keys in a bucket're prefix compressed, each key is stored as the
+// length it shares with the previous key plus the rest of it, except
+// at restart points every BUCKET_RESTART_INTERVAL records, where full
+// keys're stored, so that the bucket can be binary searched in place.
+//
+//   uint32  records count | BUCKET_PREFIX_ENCODED
+//   uint32  restarts count
+//   uint32  offset of each restart point from the bucket start
+//   records, each of which is
+//     varint shared length, varint non shared length, non shared key,
+//     uint64 seq, bool deleted, varint value length and value if not deleted
+//
+// Buckets written before have no flag in count, and records're stored
+// one by one by Record::write_to
+#define BUCKET_PREFIX_ENCODED   0x80000000U
+#define BUCKET_RESTART_INTERVAL 16
+
+// Upper bound of the encoded length of a bucket, length is summed up
+// by Record::size() with the 4 bytes count included.
+// A record has up to three varints of at most 5 bytes each in place
+// of two fixed 4 bytes lengths, so it grows by at most 7 bytes
+inline size_t max_encoded_bucket_length(size_t length, size_t count)
+{
+    size_t restarts = (count + BUCKET_RESTART_INTERVAL - 1) / BUCKET_RESTART_INTERVAL;
+    return length + 4 + 4 * restarts + 7 * count;
+}
+
+extern bool encode_bucket(BlockWriter& writer, const RecordBucket& bucket);
+
+// Deserialize bucket of either format, keys and values're copied
+// into arena of bucket. Buckets without flag're read as written
+// before seqs if legacy is set
+extern bool decode_bucket(Slice data, RecordBucket& bucket, bool legacy = false);
+
+// Return true if data is a prefix encoded bucket
+extern bool is_prefix_encoded(Slice data);
+
+// Read only view of a prefix encoded bucket, records're located by
+// binary searching restart points and read in place
+class BucketView {
+public:
+    BucketView(Slice data);
+
+    // Position at the first record whose key isn't less than key
+    void seek(Slice key, Comparator *comp);
+
+    void seek_to_first();
+
+    // false at the end of bucket or if bucket is corrupted
+    bool valid() { return valid_; }
+
+    void next();
+
+    // valid until the view is moved
+    Slice key() { return Slice(key_); }
+
+    uint64_t seq() { return seq_; }
+
+    bool deleted() { return deleted_; }
+
+    // points into data
+    Slice value() { return value_; }
+
+private:
+    // parse record at offset, previous key is kept in key_
+    bool parse(size_t offset);
+
+    uint32_t restart_offset(size_t idx);
+
+    Slice           data_;
+    uint32_t        count_;
+    uint32_t        restarts_;
+
+    bool            valid_;
+    size_t          idx_;
+    size_t          next_offset_;
+
+    std::string     key_;
+    uint64_t        seq_;
+    bool            deleted_;
+    Slice           value_;
+};
 
 // Records're arranged into multiple buckets inside a single leaf node,
 // in CascaDB nodes're configured big enough to accelerate write speed,
@@ -129,7 +249,11 @@ public:
 
     Iterator get_iterator() { return Iterator(this); }
 
-    void push_back(Record record);
+    // Append a copy of record
+    void push_back(const Record& record);
+
+    // Move all buckets out, so that they can be freed later
+    void release(std::vector<RecordBucket*>& buckets);
 
     inline size_t length() { return length_; }
 
@@ -150,6 +274,9 @@ public:
 
     void swap(RecordBuckets &other);
 
+    // Return true if records have at least two keys
+    bool splittable();
+
     Slice split(RecordBuckets &other);
 
 private:
@@ -0,0 +1,64 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_TREE_SNAPSHOT_H_
+#define CASCADB_TREE_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <set>
+
+#include "cascadb/db.h"
+#include "sys/sys.h"
+
+namespace cascadb {
+
+// Read without snapshot sees the latest version
+#define MAX_SEQ     ((uint64_t)-1)
+
+class SnapshotImpl : public Snapshot {
+public:
+    SnapshotImpl(uint64_t s) : seq(s) {}
+
+    // writes with sequence number no larger than seq're visible
+    uint64_t        seq;
+};
+
+// Sequence numbers of live snapshots.
+// A version of key superseded by a newer one is kept only if some
+// live snapshot falls in between.
+class SnapshotList {
+public:
+    SnapshotList() {}
+
+    void add(uint64_t seq)
+    {
+        ScopedMutex lock(&mtx_);
+        seqs_.insert(seq);
+    }
+
+    void remove(uint64_t seq)
+    {
+        ScopedMutex lock(&mtx_);
+        std::multiset<uint64_t>::iterator it = seqs_.find(seq);
+        assert(it != seqs_.end());
+        seqs_.erase(it);
+    }
+
+    // Return true if the version of seq is visible to any live snapshot,
+    // given the next newer version of the same key is newer_seq
+    bool visible(uint64_t seq, uint64_t newer_seq)
+    {
+        ScopedMutex lock(&mtx_);
+        std::multiset<uint64_t>::iterator it = seqs_.lower_bound(seq);
+        return it != seqs_.end() && *it < newer_seq;
+    }
+
+private:
+    Mutex                       mtx_;
+    std::multiset<uint64_t>     seqs_;
+};
+
+}
+
+#endif
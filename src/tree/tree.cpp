@@ -3,15 +3,53 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include <vector>
+#include <algorithm>
+#include <sstream>
 
 #include "util/logger.h"
+#include "util/epoch.h"
 #include "tree.h"
+#include "tree_iterator.h"
+#include "keycomp.h"
 
 using namespace std;
 using namespace cascadb;
 
+// number of sequence numbers reserved each time
+#define SEQ_RESERVED_NUM    (1 << 16)
+
+// times to read without locks before falling back to lock coupling
+#define TREE_OPTIMISTIC_RETRIES 3
+
+// number of partitions single writes're staged in
+#define TREE_STAGING_PARTITIONS 16
+
+// a partition is merged into root once it buffers this many messages
+#define TREE_STAGING_MSG_COUNT  64
+
+// how long writers stalled wait before checking root again, in milliseconds
+#define TREE_STALL_INTERVAL     10
+
+// blocks at least 4 times larger're sampled before being compressed
+#define COMPRESS_SAMPLE_SIZE    (4 * 1024)
+
 Tree::~Tree()
 {
+    if (root_) {
+        merge_staged();
+    }
+
+    // nodes queued're cascaded before they're freed
+    if (cascader_) {
+        cascader_->drain(this);
+        if (own_cascader_) {
+            delete cascader_;
+        }
+    }
+    for (size_t i = 0; i < staging_.size(); i++) {
+        delete staging_[i];
+    }
+
     if (root_) {
         root_->dec_ref();
     }
@@ -22,9 +60,109 @@ Tree::~Tree()
 
     cache_->del_table(table_name_);
 
+    // free msgbufs of deleted nodes retired for readers
+    epoch_reclaim();
+
+    if (pins_.size()) {
+        LOG_ERROR(pins_.size() << " values're still pinned in table " << table_name_);
+    }
+    for (size_t i = 0; i < retired_.size(); i++) {
+        retired_[i].deleter(retired_[i].p);
+    }
+    retired_.clear();
+
     delete node_factory_;
 
-    delete compressor_;
+    for (int i = 0; i < kDefaultCompress; i++) {
+        delete compressors_[i];
+    }
+}
+
+Compress Tree::choose_compress(Compress type)
+{
+    if (type == kDefaultCompress) {
+        type = options_.compress;
+    }
+    if (type != kNoCompress && compressor(type) == NULL) {
+        LOG_WARN("compression " << type << " isn't built in, "
+                 "table " << table_name_ << " is written uncompressed");
+        return kNoCompress;
+    }
+    return type;
+}
+
+bool Tree::compress_block(Compressor *compressor, Slice data,
+                          BlockWriter& writer, Compress& codec)
+{
+    assert(compressor->max_compressed_length(data.size()) <= writer.remain());
+
+    // trial compress a sample in the middle first, so compressing
+    // the whole block is saved if it's incompressible
+    size_t compressed_length;
+    if (data.size() >= 4 * COMPRESS_SAMPLE_SIZE) {
+        const char *sample = data.data() + (data.size() - COMPRESS_SAMPLE_SIZE) / 2;
+        if (!compressor->compress(sample, COMPRESS_SAMPLE_SIZE,
+             writer.addr(), &compressed_length)) {
+            return false;
+        }
+        if (compressed_length * 100 >
+            COMPRESS_SAMPLE_SIZE * options_.compress_max_ratio) {
+            codec = kNoCompress;
+            return writer.writeBytes(data);
+        }
+    }
+
+    if (!compressor->compress(data.data(), data.size(),
+         writer.addr(), &compressed_length)) {
+        return false;
+    }
+    if (compressed_length * 100 > data.size() * options_.compress_max_ratio) {
+        // overwrite what's compressed
+        codec = kNoCompress;
+        return writer.writeBytes(data);
+    }
+
+    writer.skip(compressed_length);
+    codec = compressor->type();
+    return true;
+}
+
+static void print_skip_rate(std::ostream& out, const char *name,
+                            uint64_t compressed, uint64_t skipped)
+{
+    uint64_t total = compressed + skipped;
+    out << name << ": " << compressed << " compressed, "
+        << skipped << " stored raw, skip rate "
+        << (total ? skipped * 100.0 / total : 0.0) << "%\n";
+}
+
+bool Tree::get_property(const std::string& property, std::string& value)
+{
+    uint64_t n;
+    if (property == "cascadb.compressed-msgbufs") {
+        n = compressed_msgbufs_.get();
+    } else if (property == "cascadb.skipped-msgbufs") {
+        n = skipped_msgbufs_.get();
+    } else if (property == "cascadb.compressed-buckets") {
+        n = compressed_buckets_.get();
+    } else if (property == "cascadb.skipped-buckets") {
+        n = skipped_buckets_.get();
+    } else if (property == "cascadb.compress-stats") {
+        std::ostringstream out;
+        print_skip_rate(out, "msgbufs", compressed_msgbufs_.get(),
+                        skipped_msgbufs_.get());
+        print_skip_rate(out, "buckets", compressed_buckets_.get(),
+                        skipped_buckets_.get());
+        value = out.str();
+        return true;
+    } else {
+        return false;
+    }
+
+    std::ostringstream out;
+    out << n;
+    value = out.str();
+    return true;
 }
 
 bool Tree::init()
@@ -34,30 +172,40 @@ bool Tree::init()
         return false;
     }
 
-    switch(options_.compress) {
-    case kNoCompress:
-        break;
-    case kSnappyCompress:
-        compressor_ = new SnappyCompressor();
-        break;
+    for (int i = 0; i < kDefaultCompress; i++) {
+        compressors_[i] = new_compressor((Compress) i, compress_dictionary_);
+    }
+    inner_compress_ = choose_compress(options_.inner_node_compress);
+    leaf_compress_ = choose_compress(options_.leaf_node_compress);
+
+    for (size_t i = 0; i < TREE_STAGING_PARTITIONS; i++) {
+        staging_.push_back(new MsgBuf(options_.comparator, &snapshots_,
+                                      options_.merge_operator));
     }
 
     node_factory_ = new TreeNodeFactory(this);
-    if (!cache_->add_table(table_name_, node_factory_, layout_))  {
+    // with WAL, meta is flushed only by checkpoints of DB
+    if (!cache_->add_table(table_name_, node_factory_, layout_, cache_tid_,
+                           wal_ == NULL))  {
         LOG_ERROR("init table in cache error");
         return false;
     }
 
-    schema_ = (SchemaNode*) cache_->get(table_name_, NID_SCHEMA, false);
+    if (table_id_ > MAX_TABLE_ID) {
+        LOG_ERROR("table id " << table_id_ << " out of range");
+        return false;
+    }
+
+    schema_ = (SchemaNode*) cache_->get(cache_tid_, schema_nid(), false);
     if (schema_ == NULL) {
         LOG_INFO("schema node doesn't exist, init empty db");
-        schema_ = new SchemaNode(table_name_);
+        schema_ = new SchemaNode(table_name_, schema_nid());
         schema_->root_node_id = NID_NIL;
-        schema_->next_inner_node_id = NID_START;
-        schema_->next_leaf_node_id = NID_LEAF_START;
+        schema_->next_inner_node_id = TABLE_NID(table_id_, NID_START);
+        schema_->next_leaf_node_id = TABLE_NID(table_id_, NID_LEAF_START);
         schema_->tree_depth = 2;
         schema_->set_dirty(true);
-        cache_->put(table_name_, NID_SCHEMA, schema_);
+        cache_->put(cache_tid_, schema_nid(), schema_);
     }
 
     if (schema_->root_node_id == NID_NIL) {
@@ -74,40 +222,497 @@ bool Tree::init()
         root_ = (InnerNode*)load_node(schema_->root_node_id, false);
     }
 
+    seq_ = seq_limit_ = schema_->last_seq;
+
+    if (cascader_ == NULL && options_.cascade_threads > 0) {
+        cascader_ = new Cascader(options_.cascade_threads);
+        cascader_->start();
+        own_cascader_ = true;
+    }
+
     assert(root_);
     return true;
 }
 
-bool Tree::put(Slice key, Slice value)
+bool Tree::put(Slice key, Slice value, Durability durability)
 {
+    return write(Msg(Put, key, value), durability);
+}
+
+bool Tree::del(Slice key, Durability durability)
+{
+    return write(Msg(Del, key), durability);
+}
+
+bool Tree::upsert(Slice key, Slice value, Durability durability)
+{
+    if (options_.merge_operator == NULL) {
+        LOG_ERROR("upsert without merge operator");
+        return false;
+    }
+    return write(Msg(Upsert, key, value), durability);
+}
+
+bool Tree::del_range(Slice begin, Slice end, Durability durability)
+{
+    if (options_.comparator->compare(begin, end) >= 0) {
+        LOG_ERROR("delete empty range");
+        return false;
+    }
+    return write(Msg(DelRange, begin, end), durability);
+}
+
+bool Tree::write(const WriteBatch& batch, Durability durability)
+{
+    if (batch.count() == 0) {
+        return true;
+    }
+
+    // before logging, so that checkpoints aren't held up
+    cache_->wait_for_room();
+    maybe_stall();
+
+    vector<Msg> msgs;
+    msgs.reserve(batch.count());
+    for (size_t i = 0; i < batch.count(); i++) {
+        switch (batch.type(i)) {
+        // buffers take copies of messages
+        case WriteBatch::kPut:
+            msgs.push_back(Msg(Put, batch.key(i), batch.value(i)));
+            break;
+        case WriteBatch::kDel:
+            msgs.push_back(Msg(Del, batch.key(i)));
+            break;
+        case WriteBatch::kUpsert:
+            if (options_.merge_operator == NULL) {
+                LOG_ERROR("upsert without merge operator");
+                return false;
+            }
+            msgs.push_back(Msg(Upsert, batch.key(i), batch.value(i)));
+            break;
+        }
+    }
+
+    // stable, so writes to a key're kept in order
+    Comparator *comp = options_.comparator;
+    stable_sort(msgs.begin(), msgs.end(), KeyComp(comp));
+
+    if (wal_) {
+        wal_->begin_write();
+    }
+
+    // older versions staged of keys in batch're merged first,
+    // partitions're locked in order to avoid deadlock
+    vector<size_t> parts;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        parts.push_back(staging_index(msgs[i].key));
+    }
+    sort(parts.begin(), parts.end());
+    parts.erase(unique(parts.begin(), parts.end()), parts.end());
+    for (size_t i = 0; i < parts.size(); i++) {
+        staging_[parts[i]]->write_lock();
+        merge_staged(staging_[parts[i]]);
+    }
+
+    // messages take consecutive sequence numbers reserved at once,
+    // so that no snapshot falls among them, and readers of keys in
+    // batch're blocked by partitions until they're all written,
+    // snapshots see all or none of them.
+    // It's logged with partitions locked, so that writes to a key
+    // in different batches're logged in the order they're applied
+    uint64_t seq = next_seq(msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        msgs[i].seq = seq + i;
+    }
+    uint64_t lsn = 0;
+    if (wal_) {
+        lsn = wal_->append(table_id_, &msgs[0], msgs.size(), durability);
+    }
+
+    // msgbufs take versions of a key from the newest to the oldest,
+    // superseded ones're dropped or folded there
+    for (size_t i = 0; i < msgs.size(); ) {
+        size_t j = i + 1;
+        while (j < msgs.size() && comp->compare(msgs[i].key, msgs[j].key) == 0) {
+            j ++;
+        }
+        reverse(msgs.begin() + i, msgs.begin() + j);
+        i = j;
+    }
+
+    assert(root_);
+    InnerNode *root = root_;
+    root->inc_ref();
+    bool ret = root->write_batch(msgs);
+    root->dec_ref();
+
+    for (size_t i = 0; i < parts.size(); i++) {
+        staging_[parts[i]]->unlock();
+    }
+
+    if (wal_ && !wal_->commit(lsn, durability)) {
+        LOG_ERROR("write log error");
+        return false;
+    }
+    return ret;
+}
+
+bool Tree::replay(const Msg& msg)
+{
+    return apply(msg, kNoDurability, NULL);
+}
+
+bool Tree::write(const Msg& msg, Durability durability)
+{
+    cache_->wait_for_room();
+    maybe_stall();
+
+    if (wal_ == NULL) {
+        return apply(msg, durability, NULL);
+    }
+
+    wal_->begin_write();
+    uint64_t lsn = 0;
+    bool ret = apply(msg, durability, &lsn);
+    if (!wal_->commit(lsn, durability)) {
+        LOG_ERROR("write log error");
+        return false;
+    }
+    return ret;
+}
+
+bool Tree::apply(const Msg& m, Durability durability, uint64_t *lsn)
+{
+    // buffers take copies of messages
+    switch (m.type) {
+    case Put:
+    case Upsert:
+    case Del:
+        return stage(m, durability, lsn);
+    case DelRange:
+        break;
+    default:
+        assert(false);
+        return false;
+    }
+
+    // range may cover keys staged in any partition
+    for (size_t i = 0; i < staging_.size(); i++) {
+        staging_[i]->write_lock();
+        merge_staged(staging_[i]);
+    }
+
+    // logged with all partitions locked, so that it's ordered
+    // with writes to any key covered
+    vector<Msg> msgs(1, m);
+    msgs[0].seq = next_seq();
+    if (lsn) {
+        *lsn = wal_->append(table_id_, &msgs[0], 1, durability);
+    }
+
     assert(root_);
     InnerNode *root = root_;
     root->inc_ref();
-    bool ret = root->put(key, value);
+    // pieces of range tombstone go to buffers atomically
+    bool ret = root->write_batch(msgs);
     root->dec_ref();
+
+    for (size_t i = 0; i < staging_.size(); i++) {
+        staging_[i]->unlock();
+    }
     return ret;
 }
 
-bool Tree::del(Slice key)
+size_t Tree::staging_index(Slice key)
 {
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < key.size(); i++) {
+        h = (h ^ (unsigned char) key[i]) * 16777619U;
+    }
+    return h % staging_.size();
+}
+
+bool Tree::stage(const Msg& m, Durability durability, uint64_t *lsn)
+{
+    MsgBuf *mb = staging_[staging_index(m.key)];
+    mb->write_lock();
+
+    // sequence number is assigned with partition locked, so that
+    // the message is visible to all snapshots acquired afterwards,
+    // and versions of a key're logged in the order of their seqs
+    Msg msg = m;
+    msg.seq = next_seq();
+    if (lsn) {
+        *lsn = wal_->append(table_id_, &msg, 1, durability);
+    }
+    mb->write(msg);
+
+    if (mb->count() >= TREE_STAGING_MSG_COUNT) {
+        merge_staged(mb);
+    }
+    mb->unlock();
+    return true;
+}
+
+void Tree::merge_staged(MsgBuf *mb)
+{
+    if (mb->count() == 0) {
+        return;
+    }
+
     assert(root_);
     InnerNode *root = root_;
     root->inc_ref();
-    bool ret = root->del(key);
+    root->merge_msgbuf(mb);
     root->dec_ref();
+}
+
+void Tree::merge_staged()
+{
+    for (size_t i = 0; i < staging_.size(); i++) {
+        staging_[i]->write_lock();
+        merge_staged(staging_[i]);
+        staging_[i]->unlock();
+    }
+}
+
+bool Tree::get(Slice key, Slice& value, const Snapshot* snapshot)
+{
+    PinnableSlice v;
+    if (!get(key, v, snapshot)) {
+        return false;
+    }
+    value = v.detach();
+    return true;
+}
+
+bool Tree::get(Slice key, PinnableSlice& value, const Snapshot* snapshot)
+{
+    value.reset();
+
+    // nodes loaded count as well
+    cache_->wait_for_room();
+
+    uint64_t seq = MAX_SEQ;
+    if (snapshot) {
+        seq = ((const SnapshotImpl*)snapshot)->seq;
+    }
+
+    assert(root_);
+    vector<Msg> upserts;
+    bool ret = false;
+
+    // newest versions're staged in partition, what's found there is
+    // copied so that the partition is unlocked before reading nodes,
+    // upserts merged into root meanwhile're told by their seqs
+    MsgBuf *mb = staging_[staging_index(key)];
+    mb->read_lock();
+    uint64_t found_seq;
+    FindResult res = InnerNode::find_msgbuf(mb, key, value, seq, upserts, found_seq);
+    mb->unlock();
+    size_t staged = upserts.size();
+
+    // read inner nodes without locks first, and fall back to
+    // lock coupling if it keeps conflicting with writers
+    for (int i = 0; i < TREE_OPTIMISTIC_RETRIES && res == kFindRetry; i++) {
+        ScopedEpoch epoch;
+        InnerNode *root = root_;
+        root->inc_ref();
+        res = root->find_optimistic(key, value, seq, upserts);
+        root->dec_ref();
+        if (res == kFindRetry || res == kFindLocked) {
+            for (size_t j = staged; j < upserts.size(); j++) {
+                upserts[j].value.destroy();
+            }
+            upserts.resize(staged);
+        }
+    }
+
+    if (res == kFindFound || res == kFindMissing) {
+        ret = (res == kFindFound);
+    } else {
+        InnerNode *root = root_;
+        root->inc_ref();
+        ret = root->find(key, value, seq, upserts, NULL);
+        root->dec_ref();
+    }
+
+    // apply upserts from the oldest to the newest, one that can't be
+    // applied is dropped and the older version is kept, as cascade does
+    for (size_t i = upserts.size(); i > 0; i--) {
+        std::string v;
+        Slice existing = value.slice();
+        if (merge_value(options_.merge_operator, key,
+                        ret ? &existing : NULL, upserts[i-1].value, v)) {
+            value.own(Slice(v).clone());
+            ret = true;
+        }
+        upserts[i-1].value.destroy();
+    }
     return ret;
 }
 
-bool Tree::get(Slice key, Slice& value)
+uint64_t Tree::pin_values()
+{
+    ScopedMutex lock(&pin_mtx_);
+    pins_.insert(pin_gen_);
+    pin_count_.add(1);
+    return pin_gen_;
+}
+
+void Tree::unpin_values(void *p, uint64_t token)
+{
+    Tree *tree = (Tree*) p;
+    vector<RetiredMemory> objs;
+
+    ScopedMutex lock(&tree->pin_mtx_);
+    multiset<uint64_t>::iterator it = tree->pins_.find(token);
+    assert(it != tree->pins_.end());
+    tree->pins_.erase(it);
+    tree->pin_count_.sub(1);
+
+    // memory retired after the oldest pin left is still referenced
+    uint64_t oldest = tree->pins_.empty() ? (uint64_t)-1 : *tree->pins_.begin();
+    while (tree->retired_.size() && tree->retired_.front().gen <= oldest) {
+        objs.push_back(tree->retired_.front());
+        tree->retired_.pop_front();
+    }
+    lock.unlock();
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        objs[i].deleter(objs[i].p);
+    }
+}
+
+static void delete_array(void *p)
+{
+    delete[] (char*) p;
+}
+
+void Tree::retire_value(Slice value)
+{
+    retire((void*) value.data(), delete_array);
+}
+
+void Tree::retire_bucket(RecordBucket *bucket)
+{
+    retire(bucket, epoch_delete<RecordBucket>);
+}
+
+void Tree::retire(void *p, EpochDeleter deleter)
+{
+    // pins're taken with leaf locked, and memory is unlinked
+    // after leaf is locked again, so the count is up to date
+    if (pin_count_.get() == 0) {
+        deleter(p);
+        return;
+    }
+
+    ScopedMutex lock(&pin_mtx_);
+    if (pins_.empty()) {
+        lock.unlock();
+        deleter(p);
+        return;
+    }
+    RetiredMemory obj;
+    obj.gen = ++ pin_gen_;
+    obj.p = p;
+    obj.deleter = deleter;
+    retired_.push_back(obj);
+}
+
+Iterator* Tree::new_iterator(const Snapshot* snapshot)
 {
+    assert(root_);
+    // snapshot is taken first, versions visible to it
+    // and staged're all merged then
+    Iterator *it = new TreeIterator(this, snapshot);
+    merge_staged();
+    return it;
+}
+
+const Snapshot* Tree::get_snapshot()
+{
+    // registered with seq_mtx_ held, so that older versions
+    // aren't discarded by writes following
+    ScopedMutex lock(&seq_mtx_);
+    snapshots_.add(seq_);
+    return new SnapshotImpl(seq_);
+}
+
+void Tree::release_snapshot(const Snapshot* snapshot)
+{
+    const SnapshotImpl *s = (const SnapshotImpl*)snapshot;
+    snapshots_.remove(s->seq);
+    delete s;
+}
+
+uint64_t Tree::next_seq(size_t n)
+{
+    ScopedMutex lock(&seq_mtx_);
+    seq_ += n;
+    if (seq_ > seq_limit_) {
+        seq_limit_ = seq_ + SEQ_RESERVED_NUM;
+        schema_->write_lock();
+        schema_->last_seq = seq_limit_;
+        schema_->set_dirty(true);
+        schema_->unlock();
+    }
+    return seq_ - n + 1;
+}
+
+bool Tree::scan(Slice key, bool backward, uint64_t snapshot, ScanRange& range)
+{
+    cache_->wait_for_room();
+
     assert(root_);
     InnerNode *root = root_;
     root->inc_ref();
-    bool ret = root->find(key, value, NULL);
+    bool ret = root->scan(key, backward, snapshot, range, NULL);
     root->dec_ref();
     return ret;
 }
 
+bool Tree::schedule_cascade(InnerNode *node)
+{
+    return cascader_ && cascader_->schedule(node);
+}
+
+void Tree::pause_cascade()
+{
+    if (cascader_) {
+        cascader_->pause();
+    }
+}
+
+void Tree::resume_cascade()
+{
+    if (cascader_) {
+        cascader_->resume();
+    }
+}
+
+void Tree::maybe_stall()
+{
+    if (cascader_ == NULL) {
+        return;
+    }
+
+    assert(root_);
+    InnerNode *root = root_;
+    root->inc_ref();
+    // root is read without lock, and might be outdated
+    while (root->overflowed()) {
+        // it might be loaded from disk and not queued yet
+        if (!schedule_cascade(root)) {
+            break;
+        }
+        cascader_->wait(TREE_STALL_INTERVAL);
+    }
+    root->dec_ref();
+}
+
 InnerNode* Tree::new_inner_node()
 {
     schema_->write_lock();
@@ -118,7 +723,7 @@ InnerNode* Tree::new_inner_node()
     InnerNode* node = (InnerNode *)node_factory_->new_node(nid);
     assert(node);
 
-    cache_->put(table_name_, nid, node);
+    cache_->put(cache_tid_, nid, node);
     return node;
 }
 
@@ -132,24 +737,19 @@ LeafNode* Tree::new_leaf_node()
     LeafNode* node = (LeafNode *)node_factory_->new_node(nid);
     assert(node);
 
-    cache_->put(table_name_, nid, node);
+    cache_->put(cache_tid_, nid, node);
     return node;
 }
 
 DataNode* Tree::load_node(bid_t nid, bool skeleton_only)
 {
-    assert(nid != NID_NIL && nid != NID_SCHEMA);
-    return (DataNode*) cache_->get(table_name_, nid, skeleton_only);
+    assert(nid != NID_NIL && nid != schema_nid());
+    return (DataNode*) cache_->get(cache_tid_, nid, skeleton_only);
 }
 
-void Tree::pileup(InnerNode *root)
+void Tree::pileup()
 {
-    assert(root_ != root);
-    root_->dec_ref();
-    root_ = root;
-
     schema_->write_lock();
-    schema_->root_node_id = root_->nid();
     schema_->tree_depth ++;
     schema_->set_dirty(true);
     schema_->unlock();
@@ -187,11 +787,11 @@ Tree::TreeNodeFactory::TreeNodeFactory(Tree *tree)
 
 Node* Tree::TreeNodeFactory::new_node(bid_t nid)
 {
-    if (nid == NID_SCHEMA) {
-        return new SchemaNode(tree_->table_name_);
+    if (nid == tree_->schema_nid()) {
+        return new SchemaNode(tree_->table_name_, nid);
     } else {
         DataNode *node;
-        if (nid >= NID_LEAF_START) {
+        if (IS_LEAF(nid)) {
             node = new LeafNode(tree_->table_name_, nid, tree_);
         } else {
             node = new InnerNode(tree_->table_name_, nid, tree_);
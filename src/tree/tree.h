@@ -8,14 +8,24 @@
 #include <assert.h>
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include <set>
 
 #include "cascadb/slice.h"
+#include "cascadb/pinnable_slice.h"
 #include "cascadb/comparator.h"
 #include "cascadb/options.h"
+#include "cascadb/iterator.h"
+#include "cascadb/write_batch.h"
 #include "sys/sys.h"
 #include "cache/cache.h"
+#include "wal/wal.h"
 #include "util/compressor.h"
+#include "util/epoch.h"
 #include "node.h"
+#include "snapshot.h"
+#include "cascader.h"
 
 namespace cascadb {
 
@@ -40,46 +50,152 @@ public:
     Tree(const std::string& table_name,
          const Options& options,
          Cache *cache,
-         Layout *layout)
+         Layout *layout,
+         WAL *wal = NULL,
+         uint32_t table_id = 0,
+         Cascader *cascader = NULL)
     : table_name_(table_name),
+      table_id_(table_id),
+      cache_tid_(0),
       options_(options),
       cache_(cache),
       layout_(layout),
+      wal_(wal),
       node_factory_(NULL),
-      compressor_(NULL),
+      inner_compress_(kNoCompress),
+      leaf_compress_(kNoCompress),
       schema_(NULL),
-      root_(NULL)
+      root_(NULL),
+      seq_(0),
+      seq_limit_(0),
+      cascader_(cascader),
+      own_cascader_(false),
+      pin_gen_(0)
     {
+        for (int i = 0; i < kDefaultCompress; i++) {
+            compressors_[i] = NULL;
+        }
     }
     
     ~Tree();
     
+    // Statistics of table, e.g. "cascadb.compress-stats",
+    // see Table::get_property()
+    bool get_property(const std::string& property, std::string& value);
+
+    // Zstd dictionary of table, set before init
+    void set_compress_dictionary(const std::string& dictionary)
+    {
+        compress_dictionary_ = dictionary;
+    }
+
     bool init();
     
-    bool put(Slice key, Slice value);
+    // Writes're logged into WAL first if there is one
+    bool put(Slice key, Slice value, Durability durability = kNoDurability);
     
-    bool del(Slice key);
+    bool del(Slice key, Durability durability = kNoDurability);
+
+    // Fails if no merge operator is set
+    bool upsert(Slice key, Slice value, Durability durability = kNoDurability);
+
+    // Delete keys in [begin, end) with a single range tombstone
+    bool del_range(Slice begin, Slice end, Durability durability = kNoDurability);
+
+    // Apply a batch of writes atomically, logged as a single record
+    bool write(const WriteBatch& batch, Durability durability = kNoDurability);
+
+    // Apply a message replayed from WAL without logging it again
+    bool replay(const Msg& msg);
+
+    bool get(Slice key, Slice& value, const Snapshot* snapshot = NULL);
+
+    // Values found in leaves're pinned rather than copied
+    bool get(Slice key, PinnableSlice& value, const Snapshot* snapshot = NULL);
+
+    // Iterate over snapshot, or a snapshot taken right now if NULL
+    Iterator* new_iterator(const Snapshot* snapshot = NULL);
+
+    const Snapshot* get_snapshot();
 
-    bool get(Slice key, Slice& value);
+    void release_snapshot(const Snapshot* snapshot);
+
+    const std::string& table_name() { return table_name_; }
+
+    // Merge writes staged in partitions into root, so that
+    // they're seen by whoever reads root only
+    void merge_staged();
+
+    // Wait for cascades in flight and hold the rest, so that messages
+    // aren't moving between nodes while they're written out
+    void pause_cascade();
+
+    void resume_cascade();
 
 private:
     friend class InnerNode;
     friend class LeafNode;
+    friend class TreeIterator;
+
+    bool scan(Slice key, bool backward, uint64_t snapshot, ScanRange& range);
+
+    // Allocate n consecutive sequence numbers for writes,
+    // return the first one
+    uint64_t next_seq(size_t n = 1);
+
+    bool write(const Msg& msg, Durability durability);
+
+    // Apply msg to tree, it's logged with the locks applying it held
+    // and lsn of the record is returned unless lsn is NULL
+    bool apply(const Msg& msg, Durability durability, uint64_t *lsn);
+
+    // Wait for cascade threads if root grows beyond the hard limit
+    void maybe_stall();
+
+    // Single writes're staged in a partition chosen by key hash
+    // rather than written into root, so that writers to different
+    // keys rarely contend. Versions of a key always go to the same
+    // partition, and're newer than those in root
+    size_t staging_index(Slice key);
+
+    bool stage(const Msg& msg, Durability durability, uint64_t *lsn);
+
+    // Move messages of write locked partition into root
+    void merge_staged(MsgBuf *mb);
 
     InnerNode* new_inner_node();
     
     LeafNode* new_leaf_node();
     
     DataNode* load_node(bid_t nid, bool skeleton_only);
+
+    bid_t schema_nid() { return TABLE_NID(table_id_, NID_SCHEMA); }
     
     InnerNode* root() { return root_; }
     
-    void pileup(InnerNode *root);
+    // Root is split, it's still the same node
+    void pileup();
     
     void collapse();
 
     void lock_path(Slice key, std::vector<DataNode*>& path);
 
+    // Pin values of leaf records, those retired afterwards aren't
+    // freed until it's unpinned. Return token of the pin
+    uint64_t pin_values();
+
+    static void unpin_values(void *tree, uint64_t token);
+
+    // Free memory of leaf records unlinked, deferred if it
+    // might be referenced by pins taken before
+    void retire_value(Slice value);
+
+    void retire_bucket(RecordBucket *bucket);
+
+    // Queue node to cascade its buffers in background,
+    // return false if there is no cascader
+    bool schedule_cascade(InnerNode *node);
+
     class TreeNodeFactory : public NodeFactory {
     public:
         TreeNodeFactory(Tree *tree);
@@ -90,19 +206,84 @@ private:
 
     std::string     table_name_;
 
+    // nids of the table're prefixed with it in the shared data file
+    uint32_t        table_id_;
+
+    // id of table in cache
+    uint32_t        cache_tid_;
+
     Options         options_;
 
     Cache           *cache_;
 
     Layout          *layout_;
 
+    WAL             *wal_;
+
     TreeNodeFactory *node_factory_;
 
-    Compressor      *compressor_;
+    // Resolve codec in options, kNoCompress if it isn't built in
+    Compress choose_compress(Compress type);
+
+    // Return compressor of codec, NULL if it's kNoCompress or not built in
+    Compressor* compressor(Compress type)
+    {
+        return type < kDefaultCompress ? compressors_[type] : NULL;
+    }
+
+    // Compress data into writer, or write it raw if it doesn't compress
+    // well, codec is set to the one it's written with
+    bool compress_block(Compressor *compressor, Slice data,
+                        BlockWriter& writer, Compress& codec);
+
+    std::string     compress_dictionary_;
+
+    // codecs nodes're written with
+    Compress        inner_compress_;
+    Compress        leaf_compress_;
+
+    // all codecs built in, since blocks're read with
+    // the codec they're written with
+    Compressor      *compressors_[kDefaultCompress];
+
+    // msgbufs and buckets compressed or written raw since opened
+    Atomic<uint64_t> compressed_msgbufs_;
+    Atomic<uint64_t> skipped_msgbufs_;
+    Atomic<uint64_t> compressed_buckets_;
+    Atomic<uint64_t> skipped_buckets_;
 
     SchemaNode      *schema_;
 
     InnerNode       *root_;
+
+    // sequence numbers're reserved in schema node by chunk
+    Mutex           seq_mtx_;
+    uint64_t        seq_;
+    uint64_t        seq_limit_;
+
+    SnapshotList    snapshots_;
+
+    std::vector<MsgBuf*> staging_;
+
+    // cascade full buffers in background, shared by tables of DB,
+    // or owned by tree if it's opened alone
+    Cascader        *cascader_;
+    bool            own_cascader_;
+
+    void retire(void *p, EpochDeleter deleter);
+
+    // memory retired is tagged with a generation, and freed after
+    // pins taken in older generations're all released
+    struct RetiredMemory {
+        uint64_t        gen;
+        void            *p;
+        EpochDeleter    deleter;
+    };
+    Mutex           pin_mtx_;
+    Atomic<size_t>  pin_count_;
+    uint64_t        pin_gen_;
+    std::multiset<uint64_t> pins_;
+    std::deque<RetiredMemory> retired_;
 };
 
 }
@@ -0,0 +1,280 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <algorithm>
+
+#include "tree.h"
+#include "tree_iterator.h"
+#include "keycomp.h"
+#include "util/logger.h"
+
+using namespace std;
+using namespace cascadb;
+
+TreeIterator::TreeIterator(Tree *tree, const Snapshot *snapshot)
+: tree_(tree),
+  snapshot_(snapshot),
+  own_snapshot_(false),
+  pos_(0),
+  valid_(false)
+{
+    if (snapshot_ == NULL) {
+        snapshot_ = tree_->get_snapshot();
+        own_snapshot_ = true;
+    }
+    seq_ = ((const SnapshotImpl*)snapshot_)->seq;
+}
+
+TreeIterator::~TreeIterator()
+{
+    range_.destroy();
+    if (own_snapshot_) {
+        tree_->release_snapshot(snapshot_);
+    }
+}
+
+bool TreeIterator::valid()
+{
+    return valid_;
+}
+
+void TreeIterator::seek_to_first()
+{
+    if (!load(Slice(), false)) {
+        valid_ = false;
+        return;
+    }
+    skip_forward();
+}
+
+void TreeIterator::seek_to_last()
+{
+    if (!load(Slice(), true)) {
+        valid_ = false;
+        return;
+    }
+    pos_ = range_.records.size();
+    skip_backward();
+}
+
+void TreeIterator::seek(Slice target)
+{
+    // empty key is before all keys
+    if (target.size() == 0) {
+        seek_to_first();
+        return;
+    }
+
+    if (!load(target, false)) {
+        valid_ = false;
+        return;
+    }
+
+    vector<Record>::iterator it = lower_bound(range_.records.begin(),
+        range_.records.end(), target, KeyComp(tree_->options_.comparator));
+    pos_ = distance(range_.records.begin(), it);
+    skip_forward();
+}
+
+void TreeIterator::next()
+{
+    assert(valid_);
+    pos_ ++;
+    skip_forward();
+}
+
+void TreeIterator::prev()
+{
+    assert(valid_);
+    skip_backward();
+}
+
+Slice TreeIterator::key()
+{
+    assert(valid_);
+    return range_.records[pos_].key;
+}
+
+Slice TreeIterator::value()
+{
+    assert(valid_);
+    return range_.records[pos_].value;
+}
+
+bool TreeIterator::load(Slice key, bool backward)
+{
+    range_.destroy();
+    pos_ = 0;
+
+    if (!tree_->scan(key, backward, seq_, range_)) {
+        LOG_ERROR("scan tree error");
+        range_.destroy();
+        return false;
+    }
+
+    merge();
+    return true;
+}
+
+void TreeIterator::merge()
+{
+    Comparator *comp = tree_->options_.comparator;
+    vector<Record>& records = range_.records;
+    vector<Record> res;
+
+    while (range_.msgs.size()) {
+        vector<Msg>& msgs = range_.msgs.back();
+        res.reserve(records.size() + msgs.size());
+
+        // records from lower levels covered by range tombstones're deleted
+        vector<Msg>& ranges = range_.ranges.back();
+        if (ranges.size()) {
+            size_t k = 0;
+            for (size_t j = 0; j < records.size(); j++) {
+                uint64_t seq;
+                if (range_covered(comp, ranges, records[j].key, seq)) {
+                    records[j].key.destroy();
+                    records[j].value.destroy();
+                } else {
+                    records[k++] = records[j];
+                }
+            }
+            records.resize(k);
+            for (size_t j = 0; j < ranges.size(); j++) {
+                ranges[j].destroy();
+            }
+        }
+        range_.ranges.pop_back();
+
+        size_t i = 0, j = 0;
+        while (i < msgs.size() || j < records.size()) {
+            int n;
+            if (i == msgs.size()) {
+                n = 1;
+            } else if (j == records.size()) {
+                n = -1;
+            } else {
+                n = comp->compare(msgs[i].key, records[j].key);
+            }
+
+            if (n > 0) {
+                res.push_back(records[j++]);
+                continue;
+            }
+
+            Slice value;
+            bool exists = false;
+            if (n == 0) {
+                records[j].key.destroy();
+                value = records[j].value;
+                exists = true;
+                j ++;
+            }
+
+            // apply versions of key from the oldest to the newest
+            size_t k = i + 1;
+            while (k < msgs.size() && comp->compare(msgs[k].key, msgs[i].key) == 0) {
+                k ++;
+            }
+            for (size_t x = k; x > i; x--) {
+                Msg& m = msgs[x-1];
+                Slice v;
+                bool has = false;
+                if (m.type == Put) {
+                    v = m.value;
+                    has = true;
+                } else if (m.type == Upsert) {
+                    std::string merged;
+                    has = merge_value(tree_->options_.merge_operator, m.key,
+                                      exists ? &value : NULL, m.value, merged);
+                    m.value.destroy();
+                    if (!has) {
+                        // dropped, older version is kept
+                        if (x - 1 > i) {
+                            m.key.destroy();
+                        }
+                        continue;
+                    }
+                    v = Slice(merged).clone();
+                }
+                if (exists) {
+                    value.destroy();
+                }
+                value = v;
+                exists = has;
+                if (x - 1 > i) {
+                    m.key.destroy();
+                }
+            }
+
+            Msg& m = msgs[i];
+            if (exists && in_range(m.key)) {
+                res.push_back(Record(m.key, value));
+            } else {
+                m.key.destroy();
+                if (exists) {
+                    value.destroy();
+                }
+            }
+            i = k;
+        }
+
+        // ownership of all messages is moved
+        range_.msgs.pop_back();
+        records.swap(res);
+        res.clear();
+    }
+}
+
+bool TreeIterator::in_range(Slice key)
+{
+    Comparator *comp = tree_->options_.comparator;
+    if (range_.has_lower && comp->compare(key, range_.lower) < 0) {
+        return false;
+    }
+    if (range_.has_upper && comp->compare(key, range_.upper) >= 0) {
+        return false;
+    }
+    return true;
+}
+
+void TreeIterator::skip_forward()
+{
+    while (pos_ == range_.records.size()) {
+        if (!range_.has_upper) {
+            valid_ = false;
+            return;
+        }
+
+        Slice upper = range_.upper.clone();
+        bool ret = load(upper, false);
+        upper.destroy();
+        if (!ret) {
+            valid_ = false;
+            return;
+        }
+    }
+    valid_ = true;
+}
+
+void TreeIterator::skip_backward()
+{
+    while (pos_ == 0) {
+        if (!range_.has_lower) {
+            valid_ = false;
+            return;
+        }
+
+        Slice lower = range_.lower.clone();
+        bool ret = load(lower, true);
+        lower.destroy();
+        if (!ret) {
+            valid_ = false;
+            return;
+        }
+        pos_ = range_.records.size();
+    }
+    pos_ --;
+    valid_ = true;
+}
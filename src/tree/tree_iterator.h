@@ -0,0 +1,81 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_TREE_ITERATOR_H_
+#define CASCADB_TREE_ITERATOR_H_
+
+#include "cascadb/iterator.h"
+#include "node.h"
+
+namespace cascadb {
+
+class Tree;
+
+// Iterate over a tree leaf by leaf.
+// Records of a leaf and messages buffered for the leaf along the path
+// from root're collected in a single descent and merged into a
+// sorted view, so leaves're read once rather than descending per key.
+// Moving across the leaf boundary descends again with the boundary
+// key, since messages for the neighbouring leaf're buffered at
+// different inner nodes and sibling links alone can't reach them.
+class TreeIterator : public Iterator {
+public:
+    // a snapshot is taken and owned by iterator if snapshot is NULL
+    TreeIterator(Tree *tree, const Snapshot *snapshot);
+
+    ~TreeIterator();
+
+    bool valid();
+
+    void seek_to_first();
+
+    void seek_to_last();
+
+    void seek(Slice target);
+
+    void next();
+
+    void prev();
+
+    Slice key();
+
+    Slice value();
+
+private:
+    // collect range containing key or right before key
+    bool load(Slice key, bool backward);
+
+    // apply buffered messages to records,
+    // from the bottom level up to root
+    void merge();
+
+    bool in_range(Slice key);
+
+    // move to the first record at or after pos_,
+    // crossing empty ranges
+    void skip_forward();
+
+    // move to the last record in current range or the ranges before,
+    // crossing empty ranges
+    void skip_backward();
+
+    Tree            *tree_;
+
+    const Snapshot  *snapshot_;
+
+    bool            own_snapshot_;
+
+    uint64_t        seq_;
+
+    // current range, messages're merged into records
+    ScanRange       range_;
+
+    size_t          pos_;
+
+    bool            valid_;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <string.h>
+#include <algorithm>
+
+#include "arena.h"
+
+using namespace std;
+using namespace cascadb;
+
+Arena::Arena()
+: ptr_(NULL),
+  remain_(0),
+  block_size_(ARENA_MIN_BLOCK_SIZE),
+  usage_(0)
+{
+}
+
+Arena::~Arena()
+{
+    clear();
+}
+
+char* Arena::allocate(size_t bytes)
+{
+    if (bytes <= remain_) {
+        char *p = ptr_;
+        ptr_ += bytes;
+        remain_ -= bytes;
+        return p;
+    }
+
+    // large pieces get blocks of their own, so that
+    // space left in the current block isn't wasted
+    if (bytes > block_size_ / 4) {
+        return allocate_block(bytes);
+    }
+
+    if (block_size_ < ARENA_MAX_BLOCK_SIZE && blocks_.size()) {
+        block_size_ *= 2;
+    }
+    ptr_ = allocate_block(block_size_);
+    remain_ = block_size_;
+
+    char *p = ptr_;
+    ptr_ += bytes;
+    remain_ -= bytes;
+    return p;
+}
+
+char* Arena::allocate_block(size_t bytes)
+{
+    char *block = new char[bytes];
+    blocks_.push_back(block);
+    usage_ += bytes;
+    return block;
+}
+
+Slice Arena::copy(Slice s)
+{
+    if (s.size() == 0) {
+        return Slice();
+    }
+    char *p = allocate(s.size());
+    memcpy(p, s.data(), s.size());
+    return Slice(p, s.size());
+}
+
+void Arena::clear()
+{
+    for (size_t i = 0; i < blocks_.size(); i++) {
+        delete[] blocks_[i];
+    }
+    blocks_.clear();
+    ptr_ = NULL;
+    remain_ = 0;
+    block_size_ = ARENA_MIN_BLOCK_SIZE;
+    usage_ = 0;
+}
+
+void Arena::swap(Arena& other)
+{
+    std::swap(ptr_, other.ptr_);
+    std::swap(remain_, other.remain_);
+    std::swap(block_size_, other.block_size_);
+    std::swap(usage_, other.usage_);
+    blocks_.swap(other.blocks_);
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_UTIL_ARENA_H_
+#define CASCADB_UTIL_ARENA_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "cascadb/slice.h"
+
+namespace cascadb {
+
+// size of the first block, blocks double in size as arena grows
+#define ARENA_MIN_BLOCK_SIZE    1024
+#define ARENA_MAX_BLOCK_SIZE    (64 << 10)
+
+// Allocate small pieces of memory from large blocks, which're
+// freed all together when arena is cleared or destroyed.
+// Not thread safe
+class Arena {
+public:
+    Arena();
+
+    ~Arena();
+
+    char* allocate(size_t bytes);
+
+    // Copy data of s into arena, empty slice isn't allocated
+    Slice copy(Slice s);
+
+    // Free all blocks
+    void clear();
+
+    void swap(Arena& other);
+
+    // Return bytes of blocks allocated
+    size_t usage() const { return usage_; }
+
+private:
+    char* allocate_block(size_t bytes);
+
+    char                *ptr_;
+    size_t              remain_;
+    size_t              block_size_;
+    size_t              usage_;
+    std::vector<char*>  blocks_;
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+}
+
+#endif
@@ -8,6 +8,38 @@ using namespace cascadb;
 #include <snappy.h>
 #endif
 
+#ifdef HAS_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAS_ZSTD
+#include <zstd.h>
+#endif
+
+// level of Zstd, a little higher than its default since leaves
+// favor ratio and they're compressed in background
+#define ZSTD_LEVEL  5
+
+Compressor* cascadb::new_compressor(Compress type, const std::string& dictionary)
+{
+    switch (type) {
+#ifdef HAS_SNAPPY
+    case kSnappyCompress:
+        return new SnappyCompressor();
+#endif
+#ifdef HAS_LZ4
+    case kLZ4Compress:
+        return new LZ4Compressor();
+#endif
+#ifdef HAS_ZSTD
+    case kZstdCompress:
+        return new ZstdCompressor(dictionary, ZSTD_LEVEL);
+#endif
+    default:
+        return NULL;
+    }
+}
+
 size_t SnappyCompressor::max_compressed_length(size_t size)
 {
 #ifdef HAS_SNAPPY
@@ -27,9 +59,14 @@ bool SnappyCompressor::compress(const char *buf, size_t size, char *obuf, size_t
 #endif
 }
 
-bool SnappyCompressor::uncompress(const char *buf, size_t size, char *obuf)
+bool SnappyCompressor::uncompress(const char *buf, size_t size, char *obuf, size_t osize)
 {
 #ifdef HAS_SNAPPY
+    size_t length;
+    if (!snappy::GetUncompressedLength(buf, size, &length) || length > osize) {
+        LOG_ERROR("snappy uncompressed length error");
+        return false;
+    }
     if (!snappy::RawUncompress(buf, size, obuf)) {
         LOG_ERROR("snappy uncompress error");
         return false;
@@ -39,3 +76,183 @@ bool SnappyCompressor::uncompress(const char *buf, size_t size, char *obuf)
     return false;
 #endif
 }
+
+size_t LZ4Compressor::max_compressed_length(size_t size)
+{
+#ifdef HAS_LZ4
+    return LZ4_compressBound(size);
+#else
+    return 0;
+#endif
+}
+
+bool LZ4Compressor::compress(const char *buf, size_t size, char *obuf, size_t *sp)
+{
+#ifdef HAS_LZ4
+    int n = LZ4_compress_default(buf, obuf, size, LZ4_compressBound(size));
+    if (n <= 0) {
+        LOG_ERROR("lz4 compress error");
+        return false;
+    }
+    *sp = n;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool LZ4Compressor::uncompress(const char *buf, size_t size, char *obuf, size_t osize)
+{
+#ifdef HAS_LZ4
+    int n = LZ4_decompress_safe(buf, obuf, size, osize);
+    if (n < 0 || (size_t)n != osize) {
+        LOG_ERROR("lz4 uncompress error");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+ZstdCompressor::ZstdCompressor(const std::string& dictionary, int level)
+: level_(level),
+  cdict_(NULL),
+  ddict_(NULL)
+{
+#ifdef HAS_ZSTD
+    if (dictionary.size()) {
+        cdict_ = ZSTD_createCDict(dictionary.data(), dictionary.size(), level);
+        ddict_ = ZSTD_createDDict(dictionary.data(), dictionary.size());
+        if (cdict_ == NULL || ddict_ == NULL) {
+            LOG_ERROR("zstd load dictionary error");
+        }
+    }
+#endif
+}
+
+ZstdCompressor::~ZstdCompressor()
+{
+#ifdef HAS_ZSTD
+    for (size_t i = 0; i < cctxs_.size(); i++) {
+        ZSTD_freeCCtx((ZSTD_CCtx*) cctxs_[i]);
+    }
+    for (size_t i = 0; i < dctxs_.size(); i++) {
+        ZSTD_freeDCtx((ZSTD_DCtx*) dctxs_[i]);
+    }
+    ZSTD_freeCDict((ZSTD_CDict*) cdict_);
+    ZSTD_freeDDict((ZSTD_DDict*) ddict_);
+#endif
+}
+
+size_t ZstdCompressor::max_compressed_length(size_t size)
+{
+#ifdef HAS_ZSTD
+    return ZSTD_compressBound(size);
+#else
+    return 0;
+#endif
+}
+
+bool ZstdCompressor::compress(const char *buf, size_t size, char *obuf, size_t *sp)
+{
+#ifdef HAS_ZSTD
+    ZSTD_CCtx *cctx = (ZSTD_CCtx*) get_cctx();
+    if (cctx == NULL) {
+        return false;
+    }
+
+    size_t n;
+    if (cdict_) {
+        n = ZSTD_compress_usingCDict(cctx, obuf, ZSTD_compressBound(size),
+                                     buf, size, (ZSTD_CDict*) cdict_);
+    } else {
+        n = ZSTD_compressCCtx(cctx, obuf, ZSTD_compressBound(size),
+                              buf, size, level_);
+    }
+    put_cctx(cctx);
+
+    if (ZSTD_isError(n)) {
+        LOG_ERROR("zstd compress error " << ZSTD_getErrorName(n));
+        return false;
+    }
+    *sp = n;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ZstdCompressor::uncompress(const char *buf, size_t size, char *obuf, size_t osize)
+{
+#ifdef HAS_ZSTD
+    ZSTD_DCtx *dctx = (ZSTD_DCtx*) get_dctx();
+    if (dctx == NULL) {
+        return false;
+    }
+
+    // the frame refers to the id of dictionary it's compressed with,
+    // so data compressed with another one is rejected
+    size_t n;
+    if (ddict_) {
+        n = ZSTD_decompress_usingDDict(dctx, obuf, osize, buf, size,
+                                       (ZSTD_DDict*) ddict_);
+    } else {
+        n = ZSTD_decompressDCtx(dctx, obuf, osize, buf, size);
+    }
+    put_dctx(dctx);
+
+    if (ZSTD_isError(n) || n != osize) {
+        LOG_ERROR("zstd uncompress error "
+            << (ZSTD_isError(n) ? ZSTD_getErrorName(n) : "length mismatch"));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void* ZstdCompressor::get_cctx()
+{
+#ifdef HAS_ZSTD
+    ScopedMutex lock(&mtx_);
+    if (cctxs_.size()) {
+        void *cctx = cctxs_.back();
+        cctxs_.pop_back();
+        return cctx;
+    }
+    lock.unlock();
+    return ZSTD_createCCtx();
+#else
+    return NULL;
+#endif
+}
+
+void ZstdCompressor::put_cctx(void *cctx)
+{
+    ScopedMutex lock(&mtx_);
+    cctxs_.push_back(cctx);
+}
+
+void* ZstdCompressor::get_dctx()
+{
+#ifdef HAS_ZSTD
+    ScopedMutex lock(&mtx_);
+    if (dctxs_.size()) {
+        void *dctx = dctxs_.back();
+        dctxs_.pop_back();
+        return dctx;
+    }
+    lock.unlock();
+    return ZSTD_createDCtx();
+#else
+    return NULL;
+#endif
+}
+
+void ZstdCompressor::put_dctx(void *dctx)
+{
+    ScopedMutex lock(&mtx_);
+    dctxs_.push_back(dctx);
+}
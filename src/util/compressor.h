@@ -1,6 +1,13 @@
 #ifndef CASCADB_UTIL_COMPRESSOR_H_
 #define CASCADB_UTIL_COMPRESSOR_H_
 
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "cascadb/options.h"
+#include "sys/sys.h"
+
 namespace cascadb {
 
 // Interface of data compression and decompression.
@@ -8,25 +15,78 @@ class Compressor {
  public:
     virtual ~Compressor() {}
 
+    // Codec recorded with data compressed
+    virtual Compress type() = 0;
+
     virtual size_t max_compressed_length(size_t size) = 0;
 
     // obuf should be larger than max_compressed_length(size)
     virtual bool compress(const char *buf, size_t size, char *obuf, size_t *sp) = 0;
 
-    // obuf should be larger than uncompressed length
-    virtual bool uncompress(const char *buf, size_t size, char *obuf) = 0;
+    // obuf should be larger than uncompressed length, which is osize
+    virtual bool uncompress(const char *buf, size_t size, char *obuf, size_t osize) = 0;
 };
 
+// Create compressor of codec, return NULL if it's kNoCompress or
+// not built in. Dictionary is used by Zstd only
+extern Compressor* new_compressor(Compress type,
+                                  const std::string& dictionary = std::string());
+
 class SnappyCompressor : public Compressor {
 public:
+    Compress type() { return kSnappyCompress; }
+
     size_t max_compressed_length(size_t size);
 
     bool compress(const char *buf, size_t size, char *obuf, size_t *sp);
 
     // obuf should be larger than uncompressed length
-    bool uncompress(const char *buf, size_t size, char *obuf);
+    bool uncompress(const char *buf, size_t size, char *obuf, size_t osize);
+};
+
+class LZ4Compressor : public Compressor {
+public:
+    Compress type() { return kLZ4Compress; }
+
+    size_t max_compressed_length(size_t size);
+
+    bool compress(const char *buf, size_t size, char *obuf, size_t *sp);
+
+    bool uncompress(const char *buf, size_t size, char *obuf, size_t osize);
+};
+
+// Contexts're reused across calls, data is compressed with
+// the dictionary if it isn't empty
+class ZstdCompressor : public Compressor {
+public:
+    ZstdCompressor(const std::string& dictionary, int level);
+
+    ~ZstdCompressor();
+
+    Compress type() { return kZstdCompress; }
+
+    size_t max_compressed_length(size_t size);
+
+    bool compress(const char *buf, size_t size, char *obuf, size_t *sp);
+
+    bool uncompress(const char *buf, size_t size, char *obuf, size_t osize);
+
+private:
+    void *get_cctx();
+    void put_cctx(void *cctx);
+    void *get_dctx();
+    void put_dctx(void *dctx);
+
+    int                 level_;
+    // ZSTD_CDict and ZSTD_DDict, NULL without dictionary
+    void                *cdict_;
+    void                *ddict_;
+
+    Mutex               mtx_;
+    std::vector<void*>  cctxs_;
+    std::vector<void*>  dctxs_;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,164 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "sys/sys.h"
+#include "epoch.h"
+
+using namespace std;
+
+namespace cascadb {
+
+// reclaim once this many objects're retired
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+struct EpochRecord {
+    EpochRecord() : epoch(0), in_use(true), next(NULL) {}
+
+    // epoch entered, 0 if not in read section
+    volatile uint64_t   epoch;
+    // owned by a living thread
+    bool                in_use;
+    EpochRecord         *next;
+    // keep records of threads in different cache lines
+    char                padding[64];
+};
+
+struct RetiredObject {
+    void                *p;
+    EpochDeleter        deleter;
+    uint64_t            epoch;
+};
+
+static Atomic<uint64_t> global_epoch(1);
+
+// guards records and retired objects
+static Mutex epoch_mtx;
+static EpochRecord *epoch_records = NULL;
+static vector<RetiredObject> retired_objects;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static void release_record(void *arg)
+{
+    EpochRecord *rec = (EpochRecord*) arg;
+    ScopedMutex lock(&epoch_mtx);
+    rec->epoch = 0;
+    rec->in_use = false;
+}
+
+static void create_key()
+{
+    pthread_key_create(&epoch_key, release_record);
+}
+
+static EpochRecord* local_record()
+{
+    EpochRecord *rec = (EpochRecord*) pthread_getspecific(epoch_key);
+    if (rec) {
+        return rec;
+    }
+
+    // records of exited threads're reused
+    ScopedMutex lock(&epoch_mtx);
+    for (rec = epoch_records; rec; rec = rec->next) {
+        if (!rec->in_use) {
+            rec->in_use = true;
+            break;
+        }
+    }
+    if (rec == NULL) {
+        rec = new EpochRecord();
+        rec->next = epoch_records;
+        epoch_records = rec;
+    }
+    lock.unlock();
+
+    pthread_setspecific(epoch_key, rec);
+    return rec;
+}
+
+void epoch_enter()
+{
+    pthread_once(&epoch_once, create_key);
+    EpochRecord *rec = local_record();
+    assert(rec->epoch == 0);
+    rec->epoch = global_epoch.get();
+    // publish epoch before loading any shared pointer
+    __sync_synchronize();
+}
+
+void epoch_exit()
+{
+    EpochRecord *rec = (EpochRecord*) pthread_getspecific(epoch_key);
+    assert(rec && rec->epoch);
+    // finish reading before leaving
+    __sync_synchronize();
+    rec->epoch = 0;
+}
+
+// Move objects safe to delete out of the retired list
+static void collect_locked(vector<RetiredObject>& objs)
+{
+    // readers entered before an object is retired may see it
+    uint64_t min_epoch = (uint64_t) -1;
+    for (EpochRecord *rec = epoch_records; rec; rec = rec->next) {
+        uint64_t epoch = rec->epoch;
+        if (epoch && epoch < min_epoch) {
+            min_epoch = epoch;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < retired_objects.size(); i++) {
+        if (retired_objects[i].epoch <= min_epoch) {
+            objs.push_back(retired_objects[i]);
+        } else {
+            retired_objects[n++] = retired_objects[i];
+        }
+    }
+    retired_objects.resize(n);
+}
+
+static void delete_objects(vector<RetiredObject>& objs)
+{
+    for (size_t i = 0; i < objs.size(); i++) {
+        objs[i].deleter(objs[i].p);
+    }
+}
+
+void epoch_retire(void *p, EpochDeleter deleter)
+{
+    RetiredObject obj;
+    obj.p = p;
+    obj.deleter = deleter;
+    // readers entering from now on can't see the object
+    obj.epoch = global_epoch.add(1);
+
+    vector<RetiredObject> objs;
+    ScopedMutex lock(&epoch_mtx);
+    retired_objects.push_back(obj);
+    if (retired_objects.size() >= EPOCH_RECLAIM_THRESHOLD) {
+        collect_locked(objs);
+    }
+    lock.unlock();
+
+    delete_objects(objs);
+}
+
+void epoch_reclaim()
+{
+    vector<RetiredObject> objs;
+    ScopedMutex lock(&epoch_mtx);
+    collect_locked(objs);
+    lock.unlock();
+
+    delete_objects(objs);
+}
+
+}
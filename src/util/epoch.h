@@ -0,0 +1,52 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_UTIL_EPOCH_H_
+#define CASCADB_UTIL_EPOCH_H_
+
+namespace cascadb {
+
+// Epoch based reclamation of data read without locks.
+// Readers enter an epoch before loading shared pointers and exit
+// when they're done with them. Writers unlink objects first, then
+// retire them, retired objects're deleted after all readers who
+// might see them have exited.
+// Entering and exiting only write to the record of calling thread
+
+// Read sections can't be nested
+extern void epoch_enter();
+
+extern void epoch_exit();
+
+typedef void (*EpochDeleter)(void *p);
+
+extern void epoch_retire(void *p, EpochDeleter deleter);
+
+// Delete retired objects not visible to any reader
+extern void epoch_reclaim();
+
+template<typename T>
+void epoch_delete(void *p)
+{
+    delete (T*) p;
+}
+
+template<typename T>
+void epoch_retire(T *p)
+{
+    epoch_retire(p, epoch_delete<T>);
+}
+
+class ScopedEpoch {
+public:
+    ScopedEpoch() { epoch_enter(); }
+    ~ScopedEpoch() { epoch_exit(); }
+private:
+    ScopedEpoch(const ScopedEpoch&);
+    ScopedEpoch& operator =(const ScopedEpoch&);
+};
+
+}
+
+#endif
@@ -0,0 +1,399 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stdio.h>
+
+#include "util/logger.h"
+#include "util/crc16.h"
+#include "serialize/block.h"
+#include "wal.h"
+
+using namespace std;
+using namespace cascadb;
+
+#define LOG_FILE_SUFFIX "log"
+
+static void* log_main(void *arg)
+{
+    WAL *wal = (WAL*) arg;
+    wal->run();
+    return NULL;
+}
+
+/********************************************************
+                        LogReader
+*********************************************************/
+
+LogReader::LogReader(Directory *dir, const std::string& filename)
+: dir_(dir),
+  filename_(filename),
+  offset_(0),
+  torn_(false),
+  corrupted_(false)
+{
+}
+
+LogReader::~LogReader()
+{
+    if (buffer_.size()) {
+        buffer_.destroy();
+    }
+}
+
+bool LogReader::init()
+{
+    size_t length = dir_->file_length(filename_);
+    if (length == 0) {
+        return true;
+    }
+
+    SequenceFileReader *reader = dir_->open_sequence_file_reader(filename_);
+    if (reader == NULL) {
+        LOG_ERROR("cannot open log file " << filename_);
+        return false;
+    }
+
+    buffer_ = Slice::alloc(length);
+    size_t res = reader->read(buffer_);
+    delete reader;
+
+    if (res != length) {
+        LOG_ERROR("read log file " << filename_ << " error, expected "
+            << length << " bytes, got " << res << " bytes");
+        return false;
+    }
+    return true;
+}
+
+bool LogReader::read(uint32_t& table_id, std::vector<Msg>& msgs)
+{
+    if (offset_ == buffer_.size()) {
+        return false;
+    }
+
+    if (offset_ + LOG_RECORD_HEADER_SIZE > buffer_.size()) {
+        LOG_WARN("torn record header at offset " << offset_ << " in " << filename_);
+        torn_ = true;
+        return false;
+    }
+
+    Block header(buffer_, offset_, LOG_RECORD_HEADER_SIZE);
+    BlockReader hr(&header);
+    uint32_t length;
+    uint16_t expected_crc;
+    if (!hr.readUInt32(&length)) return false;
+    if (!hr.readUInt16(&expected_crc)) return false;
+
+    size_t start = offset_ + LOG_RECORD_HEADER_SIZE;
+    if (length == 0 || start + length > buffer_.size()) {
+        LOG_WARN("torn record at offset " << offset_ << " in " << filename_);
+        torn_ = true;
+        return false;
+    }
+
+    uint16_t actual_crc = crc16(buffer_.data() + start, length);
+    if (actual_crc != expected_crc) {
+        LOG_WARN("record crc error at offset " << offset_ << " in " << filename_
+            << ", expected_crc " << expected_crc << ", actual_crc " << actual_crc);
+        // only the last record might be partially written
+        if (start + length == buffer_.size()) {
+            torn_ = true;
+        } else {
+            corrupted_ = true;
+        }
+        return false;
+    }
+
+    Block data(buffer_, start, length);
+    BlockReader reader(&data);
+    uint32_t n;
+    if (!reader.readUInt32(&table_id) || !reader.readUInt32(&n)) {
+        LOG_ERROR("bad record at offset " << offset_ << " in " << filename_);
+        corrupted_ = true;
+        return false;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        Msg msg;
+        if (!msg.read_from(reader)) {
+            LOG_ERROR("bad record at offset " << offset_ << " in " << filename_);
+            for (size_t j = 0; j < msgs.size(); j++) {
+                msgs[j].destroy();
+            }
+            msgs.clear();
+            corrupted_ = true;
+            return false;
+        }
+        msgs.push_back(msg);
+    }
+
+    offset_ = start + length;
+    return true;
+}
+
+/********************************************************
+                          WAL
+*********************************************************/
+
+WAL::WAL(Directory *dir, const std::string& name, const Options& options)
+: dir_(dir),
+  name_(name),
+  options_(options),
+  writer_(NULL),
+  number_(0),
+  cond_(&mtx_),
+  work_cond_(&mtx_),
+  last_lsn_(0),
+  written_lsn_(0),
+  synced_lsn_(0),
+  sync_lsn_(0),
+  urgent_(false),
+  error_(false),
+  writers_(0),
+  checkpointing_(false),
+  file_size_(0),
+  oldest_number_(0),
+  alive_(false),
+  thread_(NULL)
+{
+}
+
+WAL::~WAL()
+{
+    if (thread_) {
+        mtx_.lock();
+        alive_ = false;
+        work_cond_.notify();
+        mtx_.unlock();
+
+        thread_->join();
+        delete thread_;
+    }
+
+    if (writer_) {
+        writer_->close();
+        delete writer_;
+    }
+}
+
+bool WAL::init(uint64_t oldest, uint64_t number)
+{
+    assert(writer_ == NULL);
+
+    writer_ = dir_->open_sequence_file_writer(filename(number));
+    if (writer_ == NULL) {
+        LOG_ERROR("cannot open log file " << filename(number));
+        return false;
+    }
+    number_ = number;
+    oldest_number_ = oldest;
+
+    alive_ = true;
+    thread_ = new Thread(log_main);
+    thread_->start(this);
+    return true;
+}
+
+std::string WAL::filename(uint64_t number)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%06llu", (unsigned long long)number);
+    return name_ + "." + buf + "." + LOG_FILE_SUFFIX;
+}
+
+void WAL::begin_write()
+{
+    ScopedMutex lock(&mtx_);
+    while (checkpointing_) {
+        cond_.wait();
+    }
+    writers_ ++;
+}
+
+uint64_t WAL::append(uint32_t table_id, const Msg *msgs, size_t n,
+                     Durability durability)
+{
+    size_t length = 4 + 4;
+    for (size_t i = 0; i < n; i++) {
+        length += msgs[i].size();
+    }
+
+    ScopedMutex lock(&mtx_);
+    assert(writers_ > 0);
+
+    size_t pos = buffer_.size();
+    buffer_.resize(pos + LOG_RECORD_HEADER_SIZE + length);
+    char *data = &buffer_[pos + LOG_RECORD_HEADER_SIZE];
+
+    Block block(Slice(data, length), 0, 0);
+    BlockWriter writer(&block);
+    writer.writeUInt32(table_id);
+    writer.writeUInt32(n);
+    for (size_t i = 0; i < n; i++) {
+        msgs[i].write_to(writer);
+    }
+    assert(block.size() == length);
+
+    Block header(Slice(&buffer_[pos], LOG_RECORD_HEADER_SIZE), 0, 0);
+    BlockWriter hw(&header);
+    hw.writeUInt32(length);
+    hw.writeUInt16(crc16(data, length));
+
+    uint64_t lsn = ++ last_lsn_;
+    if (durability == kSyncedDurability) {
+        sync_lsn_ = lsn;
+    }
+    if (durability != kNoDurability && !urgent_) {
+        urgent_ = true;
+        work_cond_.notify();
+    }
+    return lsn;
+}
+
+bool WAL::commit(uint64_t lsn, Durability durability)
+{
+    ScopedMutex lock(&mtx_);
+    assert(writers_ > 0);
+    writers_ --;
+    if (writers_ == 0 && checkpointing_) {
+        cond_.notify_all();
+    }
+
+    switch (durability) {
+    case kNoDurability:
+        break;
+    case kBufferedDurability:
+        while (!error_ && written_lsn_ < lsn) {
+            cond_.wait();
+        }
+        break;
+    case kSyncedDurability:
+        while (!error_ && synced_lsn_ < lsn) {
+            cond_.wait();
+        }
+        break;
+    }
+    return !error_;
+}
+
+bool WAL::need_checkpoint()
+{
+    ScopedMutex lock(&mtx_);
+    return file_size_ >= options_.log_checkpoint_size;
+}
+
+uint64_t WAL::begin_checkpoint()
+{
+    ScopedMutex io_lock(&io_mtx_);
+
+    mtx_.lock();
+    checkpointing_ = true;
+    while (writers_ > 0) {
+        cond_.wait();
+    }
+    mtx_.unlock();
+
+    if (writer_ == NULL) {
+        LOG_ERROR("log isn't opened, no log file to switch");
+        return number_;
+    }
+
+    // the older log file should be complete before it is closed
+    write_buffer(true);
+
+    SequenceFileWriter *writer = dir_->open_sequence_file_writer(filename(number_ + 1));
+    if (writer == NULL) {
+        LOG_ERROR("cannot open log file " << filename(number_ + 1)
+            << ", keep appending to " << filename(number_));
+        return number_;
+    }
+
+    writer_->close();
+    delete writer_;
+    writer_ = writer;
+    number_ ++;
+
+    mtx_.lock();
+    file_size_ = 0;
+    mtx_.unlock();
+
+    LOG_INFO("switch to log file " << filename(number_));
+    return number_;
+}
+
+void WAL::end_checkpoint()
+{
+    ScopedMutex lock(&mtx_);
+    checkpointing_ = false;
+    cond_.notify_all();
+}
+
+void WAL::purge(uint64_t number)
+{
+    ScopedMutex io_lock(&io_mtx_);
+    assert(number <= number_);
+    for (; oldest_number_ < number; oldest_number_ ++) {
+        string fn = filename(oldest_number_);
+        if (dir_->file_exists(fn)) {
+            LOG_INFO("delete log file " << fn);
+            dir_->delete_file(fn);
+        }
+    }
+}
+
+void WAL::run()
+{
+    while (true) {
+        mtx_.lock();
+        if (alive_ && !urgent_) {
+            work_cond_.wait(options_.log_flush_interval);
+        }
+        bool alive = alive_;
+        mtx_.unlock();
+
+        io_mtx_.lock();
+        write_buffer(false);
+        io_mtx_.unlock();
+
+        if (!alive) {
+            break;
+        }
+    }
+}
+
+bool WAL::write_buffer(bool sync)
+{
+    mtx_.lock();
+    writing_.clear();
+    writing_.swap(buffer_);
+    uint64_t lsn = last_lsn_;
+    if (sync_lsn_ > synced_lsn_) {
+        sync = true;
+    }
+    urgent_ = false;
+    mtx_.unlock();
+
+    bool ret = true;
+    if (writing_.size()) {
+        ret = writer_->append(Slice(writing_));
+    }
+    if (ret && sync && synced_lsn_ < lsn) {
+        ret = writer_->flush();
+    }
+
+    mtx_.lock();
+    if (ret) {
+        file_size_ += writing_.size();
+        written_lsn_ = lsn;
+        if (sync) {
+            synced_lsn_ = lsn;
+        }
+    } else {
+        LOG_ERROR("write log file " << filename(number_) << " error");
+        error_ = true;
+    }
+    cond_.notify_all();
+    mtx_.unlock();
+
+    return ret;
+}
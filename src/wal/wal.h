@@ -0,0 +1,163 @@
+// Copyright (c) 2013 The CascaDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef CASCADB_WAL_H_
+#define CASCADB_WAL_H_
+
+#include <string>
+#include <vector>
+
+#include "cascadb/directory.h"
+#include "cascadb/options.h"
+#include "sys/sys.h"
+#include "tree/msg.h"
+
+namespace cascadb {
+
+// Log records're appended into a sequence of log files, each named
+// after the DB with an increasing number.
+// A log record consists of
+//     length of data      4 bytes
+//     crc of data         2 bytes
+//     data                id of table written(4 bytes),
+//                         number of messages(4 bytes) followed by messages
+// Messages inside a single record're always replayed together.
+
+#define LOG_RECORD_HEADER_SIZE (4 + 2)
+
+// Read log records from a log file
+class LogReader {
+public:
+    LogReader(Directory *dir, const std::string& filename);
+
+    ~LogReader();
+
+    bool init();
+
+    // Read the next record, messages returned should be destroyed by
+    // caller. Return false at the end of log, or if record is torn
+    // or corrupted
+    bool read(uint32_t& table_id, std::vector<Msg>& msgs);
+
+    // Test whether reading stopped at a torn record, which is
+    // incomplete or fails crc checking at the end of log, left by
+    // a crash while it was appended
+    bool torn() { return torn_; }
+
+    // Test whether reading stopped at a bad record followed by others
+    bool corrupted() { return corrupted_; }
+
+private:
+    Directory       *dir_;
+    std::string     filename_;
+    Slice           buffer_;
+    size_t          offset_;
+    bool            torn_;
+    bool            corrupted_;
+};
+
+// Write ahead log with group commit.
+// Writers append records into a memory buffer, and a log thread writes
+// the buffer out, so that concurrent writers waiting for durability're
+// served by a single write and fdatasync.
+// Writes're excluded while making checkpoint, which guarantees writes
+// logged in older files're applied to tree when checkpoint begins.
+class WAL {
+public:
+    WAL(Directory *dir, const std::string& name, const Options& options);
+
+    ~WAL();
+
+    // Start appending to log file number, log files since oldest
+    // (those replayed) will be purged after the next checkpoint
+    bool init(uint64_t oldest, uint64_t number);
+
+    std::string filename(uint64_t number);
+
+    // Test whether init() succeeded
+    bool is_open() { return writer_ != NULL; }
+
+    // Wait for checkpoint in progress and register as a writer,
+    // it should be called before any lock of tree is taken
+    void begin_write();
+
+    // Append messages to table as a single record, writer should
+    // append and apply messages with the same locks held, so that
+    // they're logged in the order they're applied.
+    // Return lsn of the record
+    uint64_t append(uint32_t table_id, const Msg *msgs, size_t n,
+                    Durability durability);
+
+    // Unregister the writer and wait until the record reaches the
+    // durability required, lsn is 0 if nothing is appended.
+    // Return false if log cannot be written
+    bool commit(uint64_t lsn, Durability durability);
+
+    // Test whether current log file grows large enough
+    bool need_checkpoint();
+
+    // Wait for the running writers and block new writers,
+    // then switch to a new log file.
+    // Return number of the new log file
+    uint64_t begin_checkpoint();
+
+    // Let writers go on
+    void end_checkpoint();
+
+    // Delete log files older than number
+    void purge(uint64_t number);
+
+    // Loop of log thread
+    void run();
+
+private:
+    // Write buffered records out, io_mtx_ must be held
+    bool write_buffer(bool sync);
+
+    Directory               *dir_;
+    std::string             name_;
+    Options                 options_;
+
+    // serialize file operations
+    Mutex                   io_mtx_;
+    SequenceFileWriter      *writer_;
+    uint64_t                number_;
+    // records being written out
+    std::string             writing_;
+
+    Mutex                   mtx_;
+    // notify writers that records're written or checkpoint ends
+    CondVar                 cond_;
+    // wake up the log thread
+    CondVar                 work_cond_;
+
+    std::string             buffer_;
+
+    // lsn of the last record appended/written/synced
+    uint64_t                last_lsn_;
+    uint64_t                written_lsn_;
+    uint64_t                synced_lsn_;
+    // lsn of the last record requested to be synced
+    uint64_t                sync_lsn_;
+
+    // some writer is waiting
+    bool                    urgent_;
+    bool                    error_;
+
+    // number of writers between begin_write() and commit()
+    size_t                  writers_;
+    bool                    checkpointing_;
+
+    // size of current log file
+    size_t                  file_size_;
+    // the oldest log file not purged
+    uint64_t                oldest_number_;
+
+    bool                    alive_;
+    Thread                  *thread_;
+};
+
+}
+
+#endif
@@ -86,7 +86,7 @@ public:
             EXPECT_TRUE(memcmp(buf.data(), shouldbe, 4096) == 0);
         }
 
-        buf.destroy();
+        freebuf(buf);
     }
 
     void TestReadAndWrite()
@@ -104,7 +104,7 @@ public:
         while(result.size() != 1000) cascadb::usleep(10000); // 10ms
         for (int i = 0; i < 1000; i++ ) {
             EXPECT_EQ(true, result[i].succ);
-            buf[i].destroy();
+            freebuf(buf[i]);
         }
         result.clear();
 
@@ -121,7 +121,44 @@ public:
             char shouldbe[4096];
             memset(shouldbe, i&0xFF, 4096);
             EXPECT_TRUE(memcmp(buf[i].data(), shouldbe, 4096) == 0);
-            buf[i].destroy();
+            freebuf(buf[i]);
+        }
+    }
+
+    void TestBatchWrite()
+    {
+        AIORequest  reqs[1000];
+        int         id[1000];
+        Slice       buf[1000];
+
+        // in reverse order, every 10 blocks're adjacent on disk
+        for (int i = 0; i < 1000; i++ ) {
+            id[i] = i;
+            buf[i] = allocbuf(4096);
+            memset((void*)buf[i].data(), i&0xFF, 4096);
+
+            AIORequest& req = reqs[999 - i];
+            req.offset = (i + i / 10) * 4096;
+            req.buf = buf[i];
+            req.context = id + i;
+            req.cb = io_complete;
+        }
+        file->async_writev(reqs, 1000);
+
+        while(result.size() != 1000) cascadb::usleep(10000); // 10ms
+        for (int i = 0; i < 1000; i++ ) {
+            EXPECT_EQ(true, result[i].succ);
+        }
+        result.clear();
+
+        for (int i = 0; i < 1000; i++ ) {
+            AIOStatus status = file->read((i + i / 10) * 4096, buf[i]);
+            EXPECT_TRUE(status.succ);
+
+            char shouldbe[4096];
+            memset(shouldbe, i&0xFF, 4096);
+            EXPECT_TRUE(memcmp(buf[i].data(), shouldbe, 4096) == 0);
+            freebuf(buf[i]);
         }
     }
 
@@ -134,7 +171,7 @@ public:
 
         cascadb::usleep(100000); // wait 100 ms
         EXPECT_EQ(true, result[0].succ);
-        buf.destroy();
+        freebuf(buf);
         result.clear();
 
         buf = allocbuf(8192);
@@ -143,7 +180,7 @@ public:
         cascadb::usleep(100000); // wait 100 ms
         EXPECT_EQ(true, result[0].succ);
         EXPECT_EQ(4096U, result[0].read);
-        buf.destroy();
+        freebuf(buf);
     }
 
     Slice allocbuf(size_t size)
@@ -152,6 +189,12 @@ public:
         return Slice((char*)ptr, size);
     }
 
+    // memalign'd buffers're released with free, not Slice::destroy
+    void freebuf(Slice buf)
+    {
+        free((void*)buf.data());
+    }
+
     static void io_complete(void* context, AIOStatus status)
     {
         ScopedMutex lock(&mtx);
@@ -3,12 +3,17 @@
 
 #define PUT(mb, k, v) \
 {\
-    (mb).write(Msg(Put, Slice(k).clone(), Slice(v).clone()));\
+    (mb).write(Msg(Put, Slice(k), Slice(v)));\
 }
 
 #define DEL(mb, k) \
 {\
-    (mb).write(Msg(Del, Slice(k).clone()));\
+    (mb).write(Msg(Del, Slice(k)));\
+}
+
+#define UPSERT(mb, k, v) \
+{\
+    (mb).write(Msg(Upsert, Slice(k), Slice(v)));\
 }
 
 #define CHK_MSG(m, t, k, v) \
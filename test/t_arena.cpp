@@ -0,0 +1,47 @@
+#include <gtest/gtest.h>
+#include "util/arena.h"
+
+using namespace cascadb;
+using namespace std;
+
+TEST(Arena, allocate)
+{
+    Arena arena;
+    EXPECT_EQ(0U, arena.usage());
+
+    // empty slice isn't allocated
+    Slice s = arena.copy(Slice());
+    EXPECT_EQ(0U, s.size());
+    EXPECT_EQ(0U, arena.usage());
+
+    Slice a = arena.copy("hello");
+    Slice b = arena.copy("world");
+    EXPECT_EQ("hello", a);
+    EXPECT_EQ("world", b);
+    // small pieces share a block
+    EXPECT_EQ(a.data() + 5, b.data());
+    EXPECT_EQ((size_t)ARENA_MIN_BLOCK_SIZE, arena.usage());
+
+    // large piece takes a block of its own
+    string large(ARENA_MIN_BLOCK_SIZE, 'x');
+    Slice c = arena.copy(large);
+    EXPECT_EQ(large, c.to_string());
+    EXPECT_EQ(2U * ARENA_MIN_BLOCK_SIZE, arena.usage());
+
+    // and the current block is still used
+    Slice d = arena.copy("!");
+    EXPECT_EQ(b.data() + 5, d.data());
+
+    arena.clear();
+    EXPECT_EQ(0U, arena.usage());
+}
+
+TEST(Arena, swap)
+{
+    Arena a1, a2;
+    Slice s = a1.copy("abc");
+    a1.swap(a2);
+    EXPECT_EQ(0U, a1.usage());
+    EXPECT_EQ((size_t)ARENA_MIN_BLOCK_SIZE, a2.usage());
+    EXPECT_EQ("abc", s);
+}
@@ -76,3 +76,26 @@ TEST(Block, reader_overflow)
     EXPECT_TRUE(bw.writeUInt8(2));
     EXPECT_TRUE(br.readUInt8(&n));
 }
+
+TEST(Block, varint)
+{
+    char buffer[4096];
+    Block blk(Slice(buffer, 4096), 0, 0);
+    BlockWriter bw(&blk);
+
+    uint32_t values[] = {0, 1, 127, 128, 16383, 16384, 123456789, 0xffffffff};
+    size_t n = sizeof(values)/sizeof(values[0]);
+    for (size_t i = 0; i < n; i++) {
+        ASSERT_TRUE(bw.writeVarUInt32(values[i]));
+    }
+    EXPECT_EQ(1U + 1 + 1 + 2 + 2 + 3 + 4 + 5, blk.size());
+
+    BlockReader br(&blk);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v;
+        ASSERT_TRUE(br.readVarUInt32(&v));
+        EXPECT_EQ(values[i], v);
+    }
+    uint32_t v;
+    EXPECT_FALSE(br.readVarUInt32(&v));
+}
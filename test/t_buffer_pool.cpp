@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include "serialize/buffer_pool.h"
+#include "util/bits.h"
+
+using namespace cascadb;
+using namespace std;
+
+TEST(BufferPool, reuse)
+{
+    BufferPool pool(NULL, 1 << 20);
+
+    Slice b1 = pool.alloc(5000);
+    EXPECT_EQ((size_t)PAGE_ROUND_UP(5000), b1.size());
+    EXPECT_EQ(0U, ((size_t)b1.data()) & (PAGE_SIZE - 1));
+    EXPECT_EQ(0U, pool.hits());
+    EXPECT_EQ(1U, pool.misses());
+
+    const char *p = b1.data();
+    pool.free(b1);
+    EXPECT_EQ(2U * PAGE_SIZE, pool.idle_size());
+
+    // same class
+    Slice b2 = pool.alloc(2 * PAGE_SIZE);
+    EXPECT_EQ(p, b2.data());
+    EXPECT_EQ(2U * PAGE_SIZE, b2.size());
+    EXPECT_EQ(1U, pool.hits());
+    EXPECT_EQ(0U, pool.idle_size());
+
+    // other class
+    Slice b3 = pool.alloc(3 * PAGE_SIZE);
+    EXPECT_EQ(2U, pool.misses());
+
+    // resized buffer goes back into its class
+    b2.resize(PAGE_SIZE);
+    pool.free(b2);
+    pool.free(b3);
+    EXPECT_EQ(6U * PAGE_SIZE, pool.idle_size());
+
+    Slice b4 = pool.alloc(2 * PAGE_SIZE);
+    EXPECT_EQ(p, b4.data());
+    pool.free(b4);
+}
+
+TEST(BufferPool, limit)
+{
+    BufferPool pool(NULL, 4 * PAGE_SIZE);
+
+    Slice b1 = pool.alloc(4 * PAGE_SIZE);
+    Slice b2 = pool.alloc(PAGE_SIZE);
+    pool.free(b1);
+    // exceeds limit
+    pool.free(b2);
+    EXPECT_EQ(4U * PAGE_SIZE, pool.idle_size());
+
+    // too large to be pooled
+    Slice b3 = pool.alloc((PAGE_SIZE << BUFFER_POOL_CLASSES) + 1);
+    EXPECT_EQ((size_t)PAGE_ROUND_UP((PAGE_SIZE << BUFFER_POOL_CLASSES) + 1), b3.size());
+    pool.free(b3);
+    EXPECT_EQ(4U * PAGE_SIZE, pool.idle_size());
+}
@@ -1,3 +1,6 @@
+#include <stdio.h>
+#include <sstream>
+
 #include <gtest/gtest.h>
 
 #include "cascadb/options.h"
@@ -75,12 +78,14 @@ TEST(Cache, read_and_write) {
     cache->init();
 
     NodeFactory *factory = new FakeNodeFactory("t1");
-    cache->add_table("t1", factory, layout);
+    uint32_t tid;
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    ASSERT_FALSE(cache->add_table("t1", factory, layout, tid));
 
     for (int i = 0; i < 1000; i++) {
         Node *node = new FakeNode("t1", i);
         node->set_dirty(true);
-        cache->put("t1", i, node);
+        cache->put(tid, i, node);
         node->dec_ref();
     }
 
@@ -89,9 +94,51 @@ TEST(Cache, read_and_write) {
     // flush rest and clear nodes
     cache->del_table("t1");
 
-    cache->add_table("t1", factory, layout);
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    for (int i = 0; i < 1000; i++) {
+        Node *node = cache->get(tid, i, false);
+        EXPECT_TRUE(node != NULL);
+        EXPECT_EQ((uint64_t)i, ((FakeNode*)node)->data);
+        node->dec_ref();
+    }
+    cache->del_table("t1");
+
+    delete cache;
+    delete factory;
+    delete layout;
+    delete file;
+    delete dir;
+}
+
+TEST(Cache, parallel_write) {
+    Options opts;
+    opts.cache_limit = 4096 * 1000;
+    opts.cache_writeback_threads = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("cache_test");
+    Layout *layout = new Layout(file, 0, opts);
+    layout->init(true);
+
+    Cache *cache = new Cache(opts);
+    cache->init();
+
+    NodeFactory *factory = new FakeNodeFactory("t1");
+    uint32_t tid;
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    for (int i = 0; i < 1000; i++) {
+        Node *node = new FakeNode("t1", i);
+        node->set_dirty(true);
+        cache->put(tid, i, node);
+        node->dec_ref();
+    }
+    // write all nodes by the pool
+    cache->flush_table("t1");
+    cache->del_table("t1");
+
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
     for (int i = 0; i < 1000; i++) {
-        Node *node = cache->get("t1", i, false);
+        Node *node = cache->get(tid, i, false);
         EXPECT_TRUE(node != NULL);
         EXPECT_EQ((uint64_t)i, ((FakeNode*)node)->data);
         node->dec_ref();
@@ -103,4 +150,178 @@ TEST(Cache, read_and_write) {
     delete layout;
     delete file;
     delete dir;
-}
\ No newline at end of file
+}
+
+TEST(Cache, evict) {
+    Options opts;
+    opts.cache_limit = 4096 * 1000;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("cache_test");
+    Layout *layout = new Layout(file, 0, opts);
+    layout->init(true);
+
+    Cache *cache = new Cache(opts);
+    cache->init();
+
+    NodeFactory *factory = new FakeNodeFactory("t1");
+    uint32_t tid;
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    for (int i = 0; i < 1000; i++) {
+        Node *node = new FakeNode("t1", i);
+        node->set_dirty(true);
+        cache->put(tid, i, node);
+        node->dec_ref();
+    }
+    cache->del_table("t1");
+    delete cache;
+
+    // room for 100 nodes only, nodes're evicted and loaded again
+    opts.cache_limit = 4096 * 100;
+    cache = new Cache(opts);
+    cache->init();
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 1000; i++) {
+            Node *node = cache->get(tid, i, false);
+            ASSERT_TRUE(node != NULL);
+            EXPECT_EQ((uint64_t)i, ((FakeNode*)node)->data);
+            node->dec_ref();
+
+            // hot node
+            node = cache->get(tid, 0, false);
+            ASSERT_TRUE(node != NULL);
+            EXPECT_EQ(0UL, ((FakeNode*)node)->data);
+            node->dec_ref();
+        }
+    }
+    cache->del_table("t1");
+
+    delete cache;
+    delete factory;
+    delete layout;
+    delete file;
+    delete dir;
+}
+
+// Return total bytes of nodes in cache
+static size_t cache_size(Cache *cache)
+{
+    ostringstream os;
+    cache->debug_print(os);
+    string dump = os.str();
+    size_t count, size;
+    size_t pos = dump.find("Total ");
+    if (pos == string::npos ||
+        sscanf(dump.c_str() + pos, "Total %zu nodes (%zu bytes)", &count, &size) != 2) {
+        return 0;
+    }
+    return size;
+}
+
+TEST(Cache, wait_for_room) {
+    Options opts;
+    opts.cache_limit = 4096 * 100;
+    // dirty nodes're written only because cache is full
+    opts.cache_dirty_high_watermark = 100;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("cache_test");
+    Layout *layout = new Layout(file, 0, opts);
+    layout->init(true);
+
+    Cache *cache = new Cache(opts);
+    cache->init();
+
+    NodeFactory *factory = new FakeNodeFactory("t1");
+    uint32_t tid;
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+
+    // dirty nodes can't be evicted to make room
+    for (int i = 0; i < 150; i++) {
+        Node *node = new FakeNode("t1", i);
+        node->set_dirty(true);
+        cache->put(tid, i, node);
+        node->dec_ref();
+    }
+
+    // until they're written out
+    for (int i = 150; i < 300; i++) {
+        cache->wait_for_room();
+        EXPECT_LT(cache_size(cache), opts.cache_limit);
+
+        Node *node = new FakeNode("t1", i);
+        node->set_dirty(true);
+        cache->put(tid, i, node);
+        node->dec_ref();
+    }
+    cache->del_table("t1");
+
+    ASSERT_TRUE(cache->add_table("t1", factory, layout, tid));
+    for (int i = 0; i < 300; i++) {
+        Node *node = cache->get(tid, i, false);
+        ASSERT_TRUE(node != NULL);
+        EXPECT_EQ((uint64_t)i, ((FakeNode*)node)->data);
+        node->dec_ref();
+    }
+    cache->del_table("t1");
+
+    delete cache;
+    delete factory;
+    delete layout;
+    delete file;
+    delete dir;
+}
+
+TEST(DirtyQueue, pick) {
+    Atomic<size_t> total;
+    DirtyQueue queue(&total);
+
+    FakeNode *nodes[10];
+    for (int i = 0; i < 10; i++) {
+        nodes[i] = new FakeNode("t1", i);
+        nodes[i]->set_dirty_queue(&queue);
+    }
+    EXPECT_EQ(4096UL * 10, total.get());
+    EXPECT_EQ(0UL, queue.count());
+
+    // queued in the order they're dirtied
+    for (int i = 9; i >= 0; i--) {
+        nodes[i]->set_dirty(true);
+    }
+    // dirty again doesn't requeue
+    nodes[9]->set_dirty(true);
+    nodes[5]->set_dirty(false);
+    EXPECT_EQ(9UL, queue.count());
+    EXPECT_EQ(4096UL * 9, queue.size());
+
+    uint64_t future = coarse_now_micros() + 10 * 1000000;
+    vector<Node*> picked;
+    queue.pick(future, false, 4096 * 3, picked);
+    ASSERT_EQ(3UL, picked.size());
+    EXPECT_EQ(nodes[9], picked[0]);
+    EXPECT_EQ(nodes[8], picked[1]);
+    EXPECT_EQ(nodes[7], picked[2]);
+    for (size_t i = 0; i < picked.size(); i++) {
+        EXPECT_EQ(1, picked[i]->ref());
+        picked[i]->dec_ref();
+    }
+
+    // nothing expired
+    uint64_t past = coarse_now_micros() - 10 * 1000000;
+    picked.clear();
+    queue.pick(past, false, 4096 * 3, picked);
+    EXPECT_EQ(0UL, picked.size());
+    queue.pick(past, true, 4096 * 3, picked);
+    EXPECT_EQ(3UL, picked.size());
+    for (size_t i = 0; i < picked.size(); i++) {
+        picked[i]->dec_ref();
+    }
+
+    for (int i = 0; i < 10; i++) {
+        delete nodes[i];
+    }
+    EXPECT_EQ(0UL, total.get());
+    EXPECT_EQ(0UL, queue.count());
+    EXPECT_EQ(0UL, queue.size());
+}
@@ -8,20 +8,73 @@ const char *text =
   "Yet another write-optimized storage engine, "
   "using buffered B-tree algorithm inspired by TokuDB.";
 
-#ifdef HAS_SNAPPY
-
-TEST(SnappyCompressor, compress) {
-    Compressor *compressor = new SnappyCompressor();
-
+static void test_compress(Compressor *compressor)
+{
     size_t len1;
     char* str1 = new char[compressor->max_compressed_length(strlen(text))];
     EXPECT_TRUE(compressor->compress(text, strlen(text), str1, &len1));
     EXPECT_NE(len1, strlen(text));
 
     char *str2 = new char[strlen(text)];
-    EXPECT_TRUE(compressor->uncompress(str1, len1, str2));
+    EXPECT_TRUE(compressor->uncompress(str1, len1, str2, strlen(text)));
 
     EXPECT_TRUE(strncmp(text, str2, strlen(text)) == 0);
+
+    delete[] str1;
+    delete[] str2;
+}
+
+TEST(Compressor, new_compressor) {
+    EXPECT_TRUE(new_compressor(kNoCompress) == NULL);
+    EXPECT_TRUE(new_compressor(kDefaultCompress) == NULL);
+
+    Compress types[] = {kSnappyCompress, kLZ4Compress, kZstdCompress};
+    for (size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        Compressor *compressor = new_compressor(types[i]);
+        if (compressor) {
+            EXPECT_EQ(types[i], compressor->type());
+            test_compress(compressor);
+            delete compressor;
+        }
+    }
+}
+
+#ifdef HAS_SNAPPY
+
+TEST(SnappyCompressor, compress) {
+    Compressor *compressor = new SnappyCompressor();
+    test_compress(compressor);
+    delete compressor;
+}
+
+#endif
+
+#ifdef HAS_LZ4
+
+TEST(LZ4Compressor, compress) {
+    Compressor *compressor = new LZ4Compressor();
+    test_compress(compressor);
+    delete compressor;
+}
+
+#endif
+
+#ifdef HAS_ZSTD
+
+TEST(ZstdCompressor, compress) {
+    Compressor *compressor = new ZstdCompressor("", 5);
+    test_compress(compressor);
+    delete compressor;
+}
+
+TEST(ZstdCompressor, dictionary) {
+    string dictionary;
+    for (int i = 0; i < 16; i++) {
+        dictionary += text;
+    }
+    Compressor *compressor = new ZstdCompressor(dictionary, 5);
+    test_compress(compressor);
+    delete compressor;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -3,10 +3,78 @@
 #include <gtest/gtest.h>
 
 #include "cascadb/db.h"
+#include "cascadb/file.h"
+#include "sys/sys.h"
+#include "wal/wal.h"
 
 using namespace std;
 using namespace cascadb;
 
+// add uint64 operands to the counter
+class CounterOperator : public MergeOperator {
+public:
+    void merge(const Slice& key, const Slice* existing,
+               const Slice& operand, std::string& result) const
+    {
+        uint64_t n = existing ? *(uint64_t*)existing->data() : 0;
+        n += *(uint64_t*)operand.data();
+        result.assign((char*)&n, sizeof(uint64_t));
+    }
+
+    bool combine(const Slice& key, const Slice& older,
+                 const Slice& newer, std::string& result) const
+    {
+        merge(key, &older, newer, result);
+        return true;
+    }
+};
+
+// append operand to the string, operands can't be combined
+class AppendOperator : public MergeOperator {
+public:
+    void merge(const Slice& key, const Slice* existing,
+               const Slice& operand, std::string& result) const
+    {
+        if (existing) {
+            result = existing->to_string();
+        }
+        result.append(operand.data(), operand.size());
+    }
+};
+
+// append like AppendOperator, but operand "!" can't be applied
+class PickyOperator : public MergeOperator {
+public:
+    void merge(const Slice& key, const Slice* existing,
+               const Slice& operand, std::string& result) const
+    {
+        if (operand == Slice("!")) {
+            return;
+        }
+        if (existing) {
+            result = existing->to_string();
+        }
+        result.append(operand.data(), operand.size());
+    }
+};
+
+// compare keys ignoring case, so distinct bytes may be equal
+class CaseInsensitiveComparator : public Comparator {
+public:
+    int compare(const Slice& s1, const Slice& s2) const
+    {
+        size_t n = min(s1.size(), s2.size());
+        for (size_t i = 0; i < n; i++) {
+            int c1 = tolower(s1[i]);
+            int c2 = tolower(s2[i]);
+            if (c1 != c2) {
+                return c1 - c2;
+            }
+        }
+        return (int)s1.size() - (int)s2.size();
+    }
+};
+
 TEST(DB, put) {
     Options opts;
     opts.dir = create_ram_directory();
@@ -110,6 +178,61 @@ TEST(DB, batch_write) {
     delete opts.comparator;
 }
 
+TEST(DB, pinned_get) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_msg_count = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cascade_threads = 0;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    for (uint64_t i = 0; i < 2000; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "old%ld", i);
+        ASSERT_TRUE(db->put(Slice((char*)&i, sizeof(uint64_t)), buf));
+    }
+
+    // values reaching leaves're pinned
+    PinnableSlice values[100];
+    size_t pinned = 0;
+    for (uint64_t i = 0; i < 100; i++ ) {
+        ASSERT_TRUE(db->get(Slice((char*)&i, sizeof(uint64_t)), values[i]));
+        if (values[i].pinned()) {
+            pinned ++;
+        }
+    }
+    EXPECT_TRUE(pinned > 0);
+
+    // replace them and push new versions down to leaves
+    for (uint64_t i = 0; i < 2000; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "new%ld", i);
+        ASSERT_TRUE(db->put(Slice((char*)&i, sizeof(uint64_t)), buf));
+    }
+    db->flush();
+
+    for (uint64_t i = 0; i < 100; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "old%ld", i);
+        EXPECT_EQ(Slice(buf), values[i].slice()) << "pinned value " << i << " changed";
+        values[i].reset();
+
+        sprintf(buf, "new%ld", i);
+        string value;
+        ASSERT_TRUE(db->get(Slice((char*)&i, sizeof(uint64_t)), value));
+        EXPECT_EQ(buf, value);
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
 TEST(DB, batch_delete) {
     Options opts;
     opts.dir = create_ram_directory();
@@ -160,4 +283,1256 @@ TEST(DB, batch_delete) {
     delete db;
     delete opts.dir;
     delete opts.comparator;
-}
\ No newline at end of file
+}
+
+TEST(DB, iterator) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cache_limit = 32 * 1024;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    Iterator *it = db->new_iterator();
+    it->seek_to_first();
+    ASSERT_FALSE(it->valid());
+    delete it;
+
+    // even keys only, written in scattered order so that messages
+    // are left buffered at different levels
+    const uint64_t n = 20000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        uint64_t k = ((i * 7919) % n) * 2;
+        char buf[16] = {0};
+        sprintf(buf, "%ld", k);
+        Slice key = Slice((char*)&k, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    db->flush();
+
+    // delete every key divisible by 3 and overwrite some others
+    for (uint64_t k = 0; k < 2 * n; k += 2) {
+        Slice key = Slice((char*)&k, sizeof(uint64_t));
+        if (k % 3 == 0) {
+            ASSERT_TRUE(db->del(key));
+        } else if (k % 5 == 0) {
+            ASSERT_TRUE(db->put(key, "new"));
+        }
+    }
+
+    it = db->new_iterator();
+
+    // forward
+    uint64_t expected = 2;
+    size_t count = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        ASSERT_EQ(sizeof(uint64_t), it->key().size());
+        uint64_t k = *(uint64_t*)it->key().data();
+        ASSERT_EQ(expected, k);
+
+        char buf[16] = {0};
+        if (k % 5 == 0) {
+            sprintf(buf, "new");
+        } else {
+            sprintf(buf, "%ld", k);
+        }
+        ASSERT_EQ(string(buf), it->value().to_string());
+
+        count ++;
+        expected += 2;
+        while (expected % 3 == 0) expected += 2;
+    }
+    ASSERT_EQ(2 * n, expected);
+    ASSERT_EQ(n - (n + 2) / 3, count);
+
+    // backward
+    expected = 2 * n - 2;
+    while (expected % 3 == 0) expected -= 2;
+    for (it->seek_to_last(); it->valid(); it->prev()) {
+        uint64_t k = *(uint64_t*)it->key().data();
+        ASSERT_EQ(expected, k);
+        count --;
+        if (expected == 2) break;
+        expected -= 2;
+        while (expected % 3 == 0) expected -= 2;
+    }
+    ASSERT_EQ(0U, count);
+    it->prev();
+    ASSERT_FALSE(it->valid());
+
+    // seek to odd and deleted keys lands on the following one
+    uint64_t target = 1001;
+    it->seek(Slice((char*)&target, sizeof(uint64_t)));
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ(1004U, *(uint64_t*)it->key().data());
+    it->prev();
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ(1000U, *(uint64_t*)it->key().data());
+
+    // seek to empty key is seek to first
+    it->seek(Slice());
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ(2U, *(uint64_t*)it->key().data());
+
+    target = 2 * n;
+    it->seek(Slice((char*)&target, sizeof(uint64_t)));
+    ASSERT_FALSE(it->valid());
+
+    delete it;
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+TEST(DB, iterator_comparator) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new CaseInsensitiveComparator();
+    opts.merge_operator = new AppendOperator();
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    // batches're written into root directly, so versions of a key
+    // spelled differently meet in the same buffer
+    WriteBatch b1;
+    b1.upsert("a", "1");
+    ASSERT_TRUE(db->write(b1));
+    WriteBatch b2;
+    b2.upsert("A", "2");
+    ASSERT_TRUE(db->write(b2));
+
+    Iterator *it = db->new_iterator();
+    it->seek_to_first();
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ("12", it->value().to_string());
+    it->next();
+    ASSERT_FALSE(it->valid());
+    delete it;
+
+    delete db;
+    delete opts.dir;
+    delete opts.merge_operator;
+    delete opts.comparator;
+}
+
+TEST(DB, write_batch) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cache_limit = 32 * 1024;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    // batches in descending order, later batches overwrite
+    // and delete keys written by earlier ones
+    const uint64_t n = 20000;
+    const uint64_t batch_size = 1000;
+    WriteBatch batch;
+    for (uint64_t i = 0; i < n; i++ ) {
+        uint64_t k = n - 1 - i;
+        char buf[16] = {0};
+        sprintf(buf, "%ld", k);
+        Slice key = Slice((char*)&k, sizeof(uint64_t));
+        batch.put(key, Slice(buf, strlen(buf)));
+
+        if (k % 7 == 0) {
+            batch.put(key, "new");
+        }
+        if (k % 3 == 0 && k + 3 < n) {
+            uint64_t d = k + 3;
+            batch.del(Slice((char*)&d, sizeof(uint64_t)));
+        }
+
+        if (batch.count() >= batch_size) {
+            ASSERT_TRUE(db->write(batch));
+            batch.clear();
+        }
+    }
+    ASSERT_TRUE(db->write(batch));
+    batch.clear();
+    ASSERT_TRUE(db->write(batch));
+
+    for (uint64_t k = 0; k < n; k++ ) {
+        Slice key = Slice((char*)&k, sizeof(uint64_t));
+        string value;
+        if (k % 3 == 0 && k >= 3) {
+            ASSERT_FALSE(db->get(key, value)) << "key " << k << " not deleted";
+            continue;
+        }
+        ASSERT_TRUE(db->get(key, value)) << "get key " << k << " error";
+        char buf[16] = {0};
+        if (k % 7 == 0) {
+            sprintf(buf, "new");
+        } else {
+            sprintf(buf, "%ld", k);
+        }
+        ASSERT_EQ(string(buf), value);
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+static void copy_file(Directory *from, Directory *to, const string& filename)
+{
+    size_t length = from->file_length(filename);
+    SequenceFileReader *reader = from->open_sequence_file_reader(filename);
+    SequenceFileWriter *writer = to->open_sequence_file_writer(filename);
+
+    Slice buf = Slice::alloc(length);
+    ASSERT_EQ(length, reader->read(buf));
+    ASSERT_TRUE(writer->append(buf));
+    buf.destroy();
+
+    reader->close();
+    writer->close();
+    delete reader;
+    delete writer;
+}
+
+TEST(DB, recover) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+    // nothing is written back before checkpoint
+    opts.cache_dirty_expire = 3600 * 1000;
+    opts.durability = kBufferedDurability;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+
+        if (i == n / 2) {
+            db->flush();
+            ASSERT_FALSE(opts.dir->file_exists("test_db.000000.log"));
+            ASSERT_TRUE(opts.dir->file_exists("test_db.000001.log"));
+        }
+    }
+    for (uint64_t i = 0; i < n; i += 3) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->del(key));
+    }
+
+    // simulate a crash by copying files out while db is still open
+    Directory *dir = create_ram_directory();
+    copy_file(opts.dir, dir, "test_db.cdb");
+    copy_file(opts.dir, dir, "test_db.000001.log");
+
+    delete db;
+    delete opts.dir;
+    opts.dir = dir;
+
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_FALSE(dir->file_exists("test_db.000001.log"));
+
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        if (i % 3 == 0) {
+            ASSERT_FALSE(db->get(key, value)) << "key " << i << " not deleted";
+        } else {
+            ASSERT_TRUE(db->get(key, value)) << "key " << i << " lost";
+            char buf[16] = {0};
+            sprintf(buf, "%ld", i);
+            ASSERT_EQ(string(buf), value);
+        }
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+static string read_file(Directory *dir, const string& filename)
+{
+    size_t length = dir->file_length(filename);
+    SequenceFileReader *reader = dir->open_sequence_file_reader(filename);
+    Slice buf = Slice::alloc(length);
+    EXPECT_EQ(length, reader->read(buf));
+    string data(buf.data(), length);
+    buf.destroy();
+    reader->close();
+    delete reader;
+    return data;
+}
+
+static void write_file(Directory *dir, const string& filename, const string& data)
+{
+    SequenceFileWriter *writer = dir->open_sequence_file_writer(filename);
+    if (data.size()) {
+        EXPECT_TRUE(writer->append(Slice(data)));
+    }
+    writer->close();
+    delete writer;
+}
+
+// open db with data file and the given log files, as if it crashed
+static DB* open_crashed(Options& opts, const string& data,
+                        const vector<string>& logs)
+{
+    delete opts.dir;
+    opts.dir = create_ram_directory();
+    write_file(opts.dir, "test_db.cdb", data);
+    for (size_t i = 0; i < logs.size(); i++) {
+        char buf[32];
+        sprintf(buf, "test_db.%06d.log", (int)i);
+        write_file(opts.dir, buf, logs[i]);
+    }
+    return DB::open("test_db", opts);
+}
+
+TEST(DB, recover_corrupted_log) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.compress = kNoCompress;
+    opts.cache_dirty_expire = 3600 * 1000;
+    opts.durability = kBufferedDurability;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 100;
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, "value"));
+    }
+
+    // simulate a crash by copying files out while db is still open
+    string data = read_file(opts.dir, "test_db.cdb");
+    string log = read_file(opts.dir, "test_db.000000.log");
+    delete db;
+
+    string torn = log.substr(0, log.size() - 3);
+    string bad_tail = log;
+    bad_tail[bad_tail.size() - 1] ^= 0xff;
+    string bad_head = log;
+    bad_head[LOG_RECORD_HEADER_SIZE] ^= 0xff;
+
+    string value;
+    uint64_t k = 0;
+    Slice first = Slice((char*)&k, sizeof(uint64_t));
+    vector<string> logs;
+
+    // the newest log might end with a partially written record,
+    // empty logs after it're left by an interrupted recovery
+    logs.push_back(torn);
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_TRUE(db->get(first, value));
+    delete db;
+
+    logs[0] = bad_tail;
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_TRUE(db->get(first, value));
+    delete db;
+
+    logs.push_back("");
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db != NULL);
+    ASSERT_TRUE(db->get(first, value));
+    delete db;
+
+    // but not in the middle of log, or in older logs
+    logs.clear();
+    logs.push_back(bad_head);
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db == NULL);
+
+    logs[0] = torn;
+    logs.push_back(log);
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db == NULL);
+
+    logs[0] = bad_tail;
+    db = open_crashed(opts, data, logs);
+    ASSERT_TRUE(db == NULL);
+
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+struct ColdReadContext {
+    DB          *db;
+    uint64_t    n;
+    bool        ok;
+};
+
+static void* cold_read(void *arg)
+{
+    ColdReadContext *ctx = (ColdReadContext*) arg;
+    for (uint64_t i = 0; i < ctx->n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        if (!ctx->db->get(key, value) || value != buf) {
+            ctx->ok = false;
+        }
+    }
+    return NULL;
+}
+
+TEST(DB, cold_read) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    delete db;
+
+    // buffers're loaded lazily by readers racing with each other
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    ColdReadContext ctx[4];
+    Thread *readers[4];
+    for (int i = 0; i < 4; i++) {
+        ctx[i].db = db;
+        ctx[i].n = n;
+        ctx[i].ok = true;
+        readers[i] = new Thread(cold_read);
+        readers[i]->start(&ctx[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        readers[i]->join();
+        EXPECT_TRUE(ctx[i].ok);
+        delete readers[i];
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+static void* cold_scan(void *arg)
+{
+    ColdReadContext *ctx = (ColdReadContext*) arg;
+    Iterator *it = ctx->db->new_iterator();
+    uint64_t expected = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        uint64_t k = *(uint64_t*)it->key().data();
+        char buf[16] = {0};
+        sprintf(buf, "%ld", k);
+        if (k != expected || it->value().to_string() != buf) {
+            ctx->ok = false;
+        }
+        expected ++;
+    }
+    if (expected != ctx->n) {
+        ctx->ok = false;
+    }
+    delete it;
+    return NULL;
+}
+
+static void* rewrite(void *arg)
+{
+    ColdReadContext *ctx = (ColdReadContext*) arg;
+    for (uint64_t i = 0; i < ctx->n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        if (!ctx->db->put(key, Slice(buf, strlen(buf)))) {
+            ctx->ok = false;
+        }
+    }
+    return NULL;
+}
+
+TEST(DB, cold_scan) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    delete db;
+
+    // nodes're loaded as a whole by scanners racing with each other
+    // and with a writer, which rewrites keys with the same values
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    ColdReadContext ctx[4];
+    Thread *threads[4];
+    for (int i = 0; i < 4; i++) {
+        ctx[i].db = db;
+        ctx[i].n = n;
+        ctx[i].ok = true;
+        threads[i] = new Thread(i == 0 ? rewrite : cold_scan);
+        threads[i]->start(&ctx[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        threads[i]->join();
+        EXPECT_TRUE(ctx[i].ok);
+        delete threads[i];
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+TEST(DB, cold_siblings) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i += 2) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    delete db;
+
+    // leaves're only partly loaded by reads, and those beyond n/2
+    // aren't written, so right siblings of leaves split're left cold
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    for (uint64_t i = 0; i < n; i += 100) {
+        string value;
+        ASSERT_TRUE(db->get(Slice((char*)&i, sizeof(uint64_t)), value));
+    }
+    for (uint64_t i = 1; i < n / 2; i += 2) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    delete db;
+
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    for (uint64_t i = 0; i < n; i++) {
+        if (i >= n / 2 && i % 2) {
+            continue;
+        }
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        string value;
+        ASSERT_TRUE(db->get(Slice((char*)&i, sizeof(uint64_t)), value)) << "key " << i << " lost";
+        ASSERT_EQ(buf, value);
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+struct ConcurrentWriteContext {
+    DB          *db;
+    uint64_t    begin;
+    uint64_t    end;
+    bool        ok;
+};
+
+static void* concurrent_write(void *arg)
+{
+    ConcurrentWriteContext *ctx = (ConcurrentWriteContext*) arg;
+    uint64_t one = 1;
+    for (uint64_t i = ctx->begin; i < ctx->end; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        if (!ctx->db->put(key, Slice(buf, strlen(buf))) ||
+            !ctx->db->get(key, value) || value != buf) {
+            ctx->ok = false;
+        }
+        uint64_t counter = (uint64_t) -1;
+        if (!ctx->db->upsert(Slice((char*)&counter, sizeof(uint64_t)),
+                             Slice((char*)&one, sizeof(uint64_t)))) {
+            ctx->ok = false;
+        }
+    }
+    return NULL;
+}
+
+static void check_concurrent_write(DB *db, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        string value;
+        ASSERT_TRUE(db->get(Slice((char*)&i, sizeof(uint64_t)), value));
+        ASSERT_EQ(buf, value);
+    }
+
+    uint64_t counter = (uint64_t) -1;
+    string value;
+    ASSERT_TRUE(db->get(Slice((char*)&counter, sizeof(uint64_t)), value));
+    ASSERT_EQ(sizeof(uint64_t), value.size());
+    ASSERT_EQ(n, *(uint64_t*)value.data());
+}
+
+TEST(DB, concurrent_write) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.merge_operator = new CounterOperator();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    // writers stage into partitions and merge into root concurrently
+    const uint64_t n = 8000;
+    ConcurrentWriteContext ctx[8];
+    Thread *writers[8];
+    for (int i = 0; i < 8; i++) {
+        ctx[i].db = db;
+        ctx[i].begin = i * n / 8;
+        ctx[i].end = (i + 1) * n / 8;
+        ctx[i].ok = true;
+        writers[i] = new Thread(concurrent_write);
+        writers[i]->start(&ctx[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        writers[i]->join();
+        EXPECT_TRUE(ctx[i].ok);
+        delete writers[i];
+    }
+    check_concurrent_write(db, n);
+
+    // range tombstone covers writes staged
+    uint64_t begin = 0, end = n / 2;
+    ASSERT_TRUE(db->del_range(Slice((char*)&begin, sizeof(uint64_t)),
+                              Slice((char*)&end, sizeof(uint64_t))));
+    string value;
+    for (uint64_t i = 0; i < n / 2; i++) {
+        ASSERT_FALSE(db->get(Slice((char*)&i, sizeof(uint64_t)), value));
+    }
+    for (uint64_t i = 0; i < n / 2; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        ASSERT_TRUE(db->put(Slice((char*)&i, sizeof(uint64_t)), Slice(buf, strlen(buf))));
+    }
+    delete db;
+
+    // staged writes're merged and written out on close
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    check_concurrent_write(db, n);
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+    delete opts.merge_operator;
+}
+
+TEST(DB, snapshot) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cache_limit = 32 * 1024;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+
+    const Snapshot *snapshot = db->get_snapshot();
+
+    // overwrite twice and delete, enough to cascade down to leaves
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, "new"));
+    }
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        if (i % 2 == 0) {
+            ASSERT_TRUE(db->del(key));
+        } else {
+            ASSERT_TRUE(db->put(key, "newer"));
+        }
+    }
+    db->flush();
+
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        ASSERT_TRUE(db->get(key, value, snapshot)) << "key " << i << " lost";
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        ASSERT_EQ(string(buf), value);
+
+        if (i % 2 == 0) {
+            ASSERT_FALSE(db->get(key, value));
+        } else {
+            ASSERT_TRUE(db->get(key, value));
+            ASSERT_EQ("newer", value);
+        }
+    }
+
+    Iterator *it = db->new_iterator(snapshot);
+    uint64_t expected = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        ASSERT_EQ(expected, *(uint64_t*)it->key().data());
+        char buf[16] = {0};
+        sprintf(buf, "%ld", expected);
+        ASSERT_EQ(string(buf), it->value().to_string());
+        expected ++;
+    }
+    ASSERT_EQ(n, expected);
+    delete it;
+
+    db->release_snapshot(snapshot);
+
+    // older versions're discarded as they're rewritten
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, "newest"));
+    }
+
+    it = db->new_iterator();
+    expected = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        ASSERT_EQ(expected, *(uint64_t*)it->key().data());
+        ASSERT_EQ("newest", it->value().to_string());
+        expected ++;
+    }
+    ASSERT_EQ(n, expected);
+    delete it;
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+TEST(DB, upsert) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cache_limit = 32 * 1024;
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    uint64_t k = 0;
+    ASSERT_FALSE(db->upsert(Slice((char*)&k, sizeof(uint64_t)), "1"));
+    WriteBatch rejected;
+    rejected.put(Slice((char*)&k, sizeof(uint64_t)), "0");
+    rejected.upsert(Slice((char*)&k, sizeof(uint64_t)), "1");
+    ASSERT_FALSE(db->write(rejected));
+    string value;
+    ASSERT_FALSE(db->get(Slice((char*)&k, sizeof(uint64_t)), value));
+    delete db;
+    delete opts.dir;
+
+    opts.dir = create_ram_directory();
+    opts.merge_operator = new CounterOperator();
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    // key i is increased by 1 for i times, keys divisible by 7 are
+    // reset in the middle, so upserts meet puts and deletes
+    const uint64_t n = 500;
+    const uint64_t one = 1;
+    const Snapshot *snapshot = NULL;
+    for (uint64_t r = 0; r < n; r++) {
+        for (uint64_t i = r; i < n; i++) {
+            Slice key = Slice((char*)&i, sizeof(uint64_t));
+            ASSERT_TRUE(db->upsert(key, Slice((char*)&one, sizeof(uint64_t))));
+        }
+        if (r == n / 2) {
+            for (uint64_t i = 0; i < n; i += 7) {
+                Slice key = Slice((char*)&i, sizeof(uint64_t));
+                if (i % 2) {
+                    ASSERT_TRUE(db->del(key));
+                } else {
+                    uint64_t zero = 0;
+                    ASSERT_TRUE(db->put(key, Slice((char*)&zero, sizeof(uint64_t))));
+                }
+            }
+            snapshot = db->get_snapshot();
+        }
+    }
+    db->flush();
+
+    // counters now and at the time snapshot was taken,
+    // keys reset by delete are absent if not upserted since
+    Iterator *it = db->new_iterator();
+    it->seek_to_first();
+    for (uint64_t i = 0; i < n; i++) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+
+        bool exists = true;
+        uint64_t expected = i + 1;
+        if (i % 7 == 0) {
+            exists = (i % 2 == 0) || i > n / 2;
+            expected = i > n / 2 ? i - n / 2 : 0;
+        }
+        if (exists) {
+            ASSERT_TRUE(it->valid());
+            ASSERT_EQ(i, *(uint64_t*)it->key().data());
+            ASSERT_EQ(expected, *(uint64_t*)it->value().data());
+            it->next();
+            ASSERT_TRUE(db->get(key, value));
+            ASSERT_EQ(expected, *(uint64_t*)value.data());
+        } else {
+            ASSERT_FALSE(db->get(key, value));
+        }
+
+        expected = min(i, n / 2) + 1;
+        if (i % 7 == 0) {
+            expected = 0;
+        }
+        if (i % 14 == 7) {
+            ASSERT_FALSE(db->get(key, value, snapshot));
+        } else {
+            ASSERT_TRUE(db->get(key, value, snapshot));
+            ASSERT_EQ(expected, *(uint64_t*)value.data());
+        }
+    }
+    ASSERT_FALSE(it->valid());
+    delete it;
+    db->release_snapshot(snapshot);
+
+    // upserts in batch're applied in order
+    WriteBatch batch;
+    k = 0;
+    Slice key = Slice((char*)&k, sizeof(uint64_t));
+    batch.del(key);
+    batch.upsert(key, Slice((char*)&one, sizeof(uint64_t)));
+    batch.upsert(key, Slice((char*)&one, sizeof(uint64_t)));
+    ASSERT_TRUE(db->write(batch));
+    ASSERT_TRUE(db->get(key, value));
+    ASSERT_EQ(2U, *(uint64_t*)value.data());
+
+    delete db;
+    delete opts.dir;
+    delete opts.merge_operator;
+
+    // operands can't be combined, all upserts're kept until cascaded
+    opts.dir = create_ram_directory();
+    opts.merge_operator = new AppendOperator();
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    for (uint64_t r = 0; r < 10; r++) {
+        for (uint64_t i = 0; i < n; i++) {
+            Slice key = Slice((char*)&i, sizeof(uint64_t));
+            char buf[16] = {0};
+            sprintf(buf, "%ld", r);
+            ASSERT_TRUE(db->upsert(key, buf));
+        }
+    }
+
+    it = db->new_iterator();
+    uint64_t count = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        ASSERT_EQ("0123456789", it->value().to_string());
+        ASSERT_TRUE(db->get(it->key(), value));
+        ASSERT_EQ("0123456789", value);
+        count ++;
+    }
+    ASSERT_EQ(n, count);
+    delete it;
+
+    delete db;
+    delete opts.dir;
+    delete opts.merge_operator;
+
+    // upserts that can't be applied're dropped, the older version
+    // is kept, or key is still absent if there was none
+    opts.dir = create_ram_directory();
+    opts.merge_operator = new PickyOperator();
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    for (uint64_t i = 0; i < 2 * n; i++) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        if (i % 2 == 0) {
+            ASSERT_TRUE(db->put(key, "v"));
+        }
+        ASSERT_TRUE(db->upsert(key, "!"));
+        if (i < n) {
+            ASSERT_TRUE(db->upsert(key, "w"));
+        }
+    }
+
+    for (int round = 0; round < 2; round++) {
+        it = db->new_iterator();
+        it->seek_to_first();
+        for (uint64_t i = 0; i < 2 * n; i++) {
+            Slice key = Slice((char*)&i, sizeof(uint64_t));
+            string expected;
+            if (i % 2 == 0) {
+                expected = "v";
+            }
+            if (i < n) {
+                expected += "w";
+            }
+            if (expected.empty()) {
+                ASSERT_FALSE(db->get(key, value)) << "key " << i;
+                continue;
+            }
+            ASSERT_TRUE(db->get(key, value)) << "key " << i;
+            ASSERT_EQ(expected, value);
+            ASSERT_TRUE(it->valid());
+            ASSERT_EQ(i, *(uint64_t*)it->key().data());
+            ASSERT_EQ(expected, it->value().to_string());
+            it->next();
+        }
+        ASSERT_FALSE(it->valid());
+        delete it;
+
+        // again after tree is flushed
+        db->flush();
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.merge_operator;
+    delete opts.comparator;
+}
+
+TEST(DB, del_range) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.cache_limit = 32 * 1024;
+    opts.compress = kNoCompress;
+    opts.durability = kBufferedDurability;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const uint64_t n = 10000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, Slice(buf, strlen(buf))));
+    }
+    db->flush();
+
+    uint64_t b = 1000, e = 3000;
+    ASSERT_FALSE(db->del_range(Slice((char*)&e, sizeof(uint64_t)),
+                               Slice((char*)&b, sizeof(uint64_t))));
+
+    const Snapshot *snapshot = db->get_snapshot();
+    ASSERT_TRUE(db->del_range(Slice((char*)&b, sizeof(uint64_t)),
+                              Slice((char*)&e, sizeof(uint64_t))));
+    // rewritten after deletion
+    for (uint64_t i = b; i < e; i += 100) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, "new"));
+    }
+
+    Iterator *it = db->new_iterator();
+    uint64_t expected = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+        ASSERT_EQ(expected, *(uint64_t*)it->key().data());
+        string value;
+        ASSERT_TRUE(db->get(it->key(), value));
+        ASSERT_EQ(value, it->value().to_string());
+        expected ++;
+        if (expected == b) {
+            for (uint64_t i = b + 1; i < e; i ++) {
+                Slice key = Slice((char*)&i, sizeof(uint64_t));
+                ASSERT_EQ(i % 100 == 0, db->get(key, value)) << "key " << i;
+            }
+        }
+        if (expected > b && expected < e) {
+            expected = (expected + 99) / 100 * 100;
+        }
+    }
+    ASSERT_EQ(n, expected);
+    delete it;
+
+    // old values're visible to snapshot
+    for (uint64_t i = 0; i < n; i += 7) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        ASSERT_TRUE(db->get(key, value, snapshot));
+        char buf[16] = {0};
+        sprintf(buf, "%ld", i);
+        ASSERT_EQ(string(buf), value);
+    }
+    db->release_snapshot(snapshot);
+
+    // simulate a crash, range tombstone is replayed
+    Directory *dir = create_ram_directory();
+    copy_file(opts.dir, dir, "test_db.cdb");
+    copy_file(opts.dir, dir, "test_db.000001.log");
+
+    delete db;
+    delete opts.dir;
+    opts.dir = dir;
+
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    // cascade range tombstone down to leaves
+    for (uint64_t i = b; i < e; i += 2) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(db->put(key, "again"));
+    }
+    db->flush();
+
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        string value;
+        if (i >= b && i < e) {
+            if (i % 2) {
+                ASSERT_FALSE(db->get(key, value)) << "key " << i << " not deleted";
+            } else {
+                ASSERT_TRUE(db->get(key, value));
+                ASSERT_EQ("again", value);
+            }
+        } else {
+            ASSERT_TRUE(db->get(key, value)) << "key " << i << " lost";
+            char buf[16] = {0};
+            sprintf(buf, "%ld", i);
+            ASSERT_EQ(string(buf), value);
+        }
+    }
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+TEST(DB, tables) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new NumericComparator<uint64_t>();
+    opts.inner_node_page_size = 4 * 1024;
+    opts.inner_node_children_number = 16;
+    opts.leaf_node_page_size = 4 * 1024;
+    opts.leaf_node_bucket_size = 512;
+    opts.compress = kNoCompress;
+    // nothing is written back before checkpoint, or files copied out
+    // while db is open may be torn
+    opts.cache_dirty_expire = 3600 * 1000;
+    opts.durability = kBufferedDurability;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    const char *names[] = {"t1", "t2", "t3"};
+    const size_t m = sizeof(names) / sizeof(names[0]);
+    Table *tables[m + 1];
+    tables[0] = db;
+    for (size_t t = 0; t < m; t++) {
+        ASSERT_TRUE(db->open_table(names[t]) == NULL);
+        tables[t + 1] = db->create_table(names[t]);
+        ASSERT_TRUE(tables[t + 1] != NULL);
+        ASSERT_EQ(tables[t + 1], db->open_table(names[t]));
+    }
+    ASSERT_TRUE(db->create_table("t1") == NULL);
+    ASSERT_TRUE(db->create_table("") == NULL);
+
+    // same keys with different values in each table
+    const uint64_t n = 5000;
+    for (uint64_t i = 0; i < n; i++ ) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        for (size_t t = 0; t <= m; t++) {
+            char buf[32] = {0};
+            sprintf(buf, "%lu-%ld", t, i);
+            ASSERT_TRUE(tables[t]->put(key, Slice(buf, strlen(buf))));
+        }
+        if (i == n / 2) {
+            db->flush();
+        }
+    }
+    for (uint64_t i = 0; i < n; i += 3) {
+        Slice key = Slice((char*)&i, sizeof(uint64_t));
+        ASSERT_TRUE(tables[2]->del(key));
+    }
+
+    // simulate a crash, writes after the last checkpoint're replayed
+    Directory *dir = create_ram_directory();
+    copy_file(opts.dir, dir, "test_db.cdb");
+    for (int i = 0; i < 10; i++) {
+        char buf[32] = {0};
+        sprintf(buf, "test_db.%06d.log", i);
+        if (opts.dir->file_exists(buf)) {
+            copy_file(opts.dir, dir, buf);
+        }
+    }
+
+    delete db;
+    delete opts.dir;
+    opts.dir = dir;
+
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    tables[0] = db;
+    for (size_t t = 0; t < m; t++) {
+        tables[t + 1] = db->open_table(names[t]);
+        ASSERT_TRUE(tables[t + 1] != NULL);
+    }
+    ASSERT_TRUE(db->open_table("t4") == NULL);
+
+    for (size_t t = 0; t <= m; t++) {
+        for (uint64_t i = 0; i < n; i++ ) {
+            Slice key = Slice((char*)&i, sizeof(uint64_t));
+            string value;
+            if (t == 2 && i % 3 == 0) {
+                ASSERT_FALSE(tables[t]->get(key, value)) << "key " << i << " not deleted";
+            } else {
+                ASSERT_TRUE(tables[t]->get(key, value)) << "key " << i << " lost in table " << t;
+                char buf[32] = {0};
+                sprintf(buf, "%lu-%ld", t, i);
+                ASSERT_EQ(string(buf), value);
+            }
+        }
+
+        Iterator *it = tables[t]->new_iterator();
+        uint64_t count = 0;
+        for (it->seek_to_first(); it->valid(); it->next()) {
+            count ++;
+        }
+        ASSERT_EQ(t == 2 ? n - (n + 2) / 3 : n, count);
+        delete it;
+    }
+
+    // nothing is compressed
+    string value;
+    ASSERT_TRUE(tables[1]->get_property("cascadb.compressed-buckets", value));
+    EXPECT_EQ("0", value);
+    ASSERT_TRUE(db->get_property("cascadb.compress-stats", value));
+    EXPECT_NE(string::npos, value.find("buckets: 0 compressed"));
+    EXPECT_FALSE(db->get_property("cascadb.unknown", value));
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
+
+TEST(DB, table_catalog) {
+    Options opts;
+    opts.dir = create_ram_directory();
+    opts.comparator = new LexicalComparator();
+    opts.compress = kNoCompress;
+
+    DB *db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+
+    ASSERT_TRUE(db->create_table(string(65, 'x')) == NULL);
+
+    // tables're created till superblock is full
+    size_t n = 0;
+    for (; n < 1000; n++) {
+        char buf[16] = {0};
+        sprintf(buf, "%08d", (int)n);
+        if (db->create_table(string(56, 'x') + buf) == NULL) {
+            break;
+        }
+    }
+    EXPECT_GT(n, 0U);
+    EXPECT_LT(n, 1000U);
+
+    char buf[16] = {0};
+    sprintf(buf, "%08d", (int)n);
+    string name = string(56, 'x') + buf;
+    EXPECT_TRUE(db->open_table(name) == NULL);
+    ASSERT_TRUE(db->put("a", "1"));
+    delete db;
+
+    // and all of them're recorded
+    db = DB::open("test_db", opts);
+    ASSERT_TRUE(db != NULL);
+    for (size_t i = 0; i < n; i++) {
+        sprintf(buf, "%08d", (int)i);
+        EXPECT_TRUE(db->open_table(string(56, 'x') + buf) != NULL);
+    }
+    EXPECT_TRUE(db->open_table(name) == NULL);
+    string value;
+    EXPECT_TRUE(db->get("a", value));
+
+    delete db;
+    delete opts.dir;
+    delete opts.comparator;
+}
@@ -74,16 +74,51 @@ public:
         for (int i = 0; i < 1000; i++ ) {
             ASSERT_TRUE(results[i]);
         }
+        KeepWriteBufs();
     }
 
-    void ClearWriteBufs() {
+    void WriteBatch() {
+        results.clear();
+        vector<BlockWrite> writes;
+        for (int i = 0; i < 1000; i++ ) {
+            size_t size = min_page_size + rand() % (max_page_size - min_page_size);
+            write_bufs[i] = layout->create(size);
+            BlockWriter writer(write_bufs[i]);
+            for (size_t j = 0; j < size; j++ ) {
+                writer.writeUInt8(i&0xff);
+            }
+
+            BlockWrite write;
+            write.bid = i;
+            write.block = write_bufs[i];
+            write.skeleton_size = size;
+            write.cb = new Callback(this, &LayoutTest::callback, (bid_t)i);
+            writes.push_back(write);
+        }
+        layout->async_write(writes);
+
+        while(results.size() != 1000) cascadb::usleep(10000); // 10ms
+        for (int i = 0; i < 1000; i++ ) {
+            ASSERT_TRUE(results[i]);
+        }
+        KeepWriteBufs();
+    }
+
+    // buffers're put back into layout before it's closed,
+    // contents're kept to check reads
+    void KeepWriteBufs() {
         for (map<bid_t, Block*>::iterator it = write_bufs.begin();
             it != write_bufs.end(); it++ ) {
+            written[it->first] = string(it->second->start(), it->second->size());
             layout->destroy(it->second);
         }
         write_bufs.clear();
     }
 
+    void ClearWriteBufs() {
+        written.clear();
+    }
+
     void AsyncRead() {
         results.clear();
         Block *read_bufs[1000];
@@ -96,8 +131,8 @@ public:
         for (int i = 0; i < 1000; i++ ) {
             ASSERT_TRUE(results[i]);
             if (results[i]) {
-                ASSERT_EQ(write_bufs[i]->size(), read_bufs[i]->size());
-                ASSERT_EQ(0, memcmp(write_bufs[i]->start(), read_bufs[i]->start(), write_bufs[i]->size()));
+                ASSERT_EQ(written[i].size(), read_bufs[i]->size());
+                ASSERT_EQ(0, memcmp(written[i].data(), read_bufs[i]->start(), written[i].size()));
             }
             layout->destroy(read_bufs[i]);
         }
@@ -107,8 +142,8 @@ public:
         for (int i = 0; i < 1000; i++ ) {
             Block *read_buf = layout->read(i, false);
             ASSERT_TRUE(read_buf != NULL);
-            ASSERT_EQ(write_bufs[i]->size(), read_buf->size());
-            ASSERT_EQ(0, memcmp(write_bufs[i]->start(), read_buf->start(), write_bufs[i]->size()));
+            ASSERT_EQ(written[i].size(), read_buf->size());
+            ASSERT_EQ(0, memcmp(written[i].data(), read_buf->start(), written[i].size()));
             layout->destroy(read_buf);
         }
     }
@@ -126,6 +161,7 @@ public:
     size_t                      min_page_size;
     size_t                      max_page_size;
     map<bid_t, Block*>          write_bufs;
+    map<bid_t, string>          written;
 
     Mutex                       mtx;
     map<bid_t, bool>            results;
@@ -162,6 +198,21 @@ TEST_F(LayoutTest, blocking_read)
     ClearWriteBufs();
 }
 
+TEST_F(LayoutTest, batch_write)
+{
+    Options opts;
+
+    OpenLayout(opts, true);
+    WriteBatch();
+    CloseLayout();
+
+    OpenLayout(opts, false);
+    AsyncRead();
+    CloseLayout();
+
+    ClearWriteBufs();
+}
+
 TEST_F(LayoutTest, async_read_compress)
 {
     Options opts;
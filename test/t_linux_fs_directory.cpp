@@ -32,7 +32,41 @@ TEST_F(LinuxAIOFileTest, read_and_write)
     TestReadAndWrite();
 }
 
+TEST_F(LinuxAIOFileTest, batch_write)
+{
+    TestBatchWrite();
+}
+
 TEST_F(LinuxAIOFileTest, read_partial)
 {
     TestReadPartial();
 }
+
+// falls back to other engines if io_uring isn't available
+class URingAIOFileTest : public AIOFileTest {
+public:
+    URingAIOFileTest()
+    {
+        dir = new LinuxFSDirectory("/tmp", kURingAIO);
+    }
+};
+
+TEST_F(URingAIOFileTest, blocking_read_and_write)
+{
+    TestBlockingReadAndWrite();
+}
+
+TEST_F(URingAIOFileTest, read_and_write)
+{
+    TestReadAndWrite();
+}
+
+TEST_F(URingAIOFileTest, batch_write)
+{
+    TestBatchWrite();
+}
+
+TEST_F(URingAIOFileTest, read_partial)
+{
+    TestReadPartial();
+}
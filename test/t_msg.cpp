@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "tree/msg.h"
+#include "tree/snapshot.h"
 #include "helper.h"
 
 using namespace cascadb;
@@ -61,6 +62,28 @@ TEST(MsgBuf, write)
     CHK_MSG(mb.get(3), Del, "c", Slice());
 }
 
+TEST(MsgBuf, memory)
+{
+    LexicalComparator comp;
+    MsgBuf mb(&comp);
+
+    // keys and values're copied, so callers keep their own
+    string key("key"), value(100, 'x');
+    PUT(mb, key, value);
+    key[0] = 'x';
+    CHK_MSG(mb.get(0), Put, "key", value);
+
+    // overwrites of a key don't make arena grow without bound
+    for (int i = 0; i < 10000; i++) {
+        PUT(mb, "key", value);
+    }
+    EXPECT_EQ(1U, mb.count());
+    EXPECT_LT(mb.memory_usage(), 8U * ARENA_MAX_BLOCK_SIZE);
+
+    mb.clear();
+    EXPECT_EQ(0U, mb.memory_usage());
+}
+
 TEST(MsgBuf, append)
 {
     LexicalComparator comp;
@@ -89,6 +112,32 @@ TEST(MsgBuf, append)
     CHK_MSG(mb1.get(3), Del, "c", Slice());
 }
 
+TEST(MsgBuf, append_array)
+{
+    LexicalComparator comp;
+    MsgBuf mb(&comp);
+
+    PUT(mb, "abc", "1");
+    PUT(mb, "c", "1");
+
+    // sorted, with versions of a key from newest to oldest,
+    // older versions're dropped since no snapshot refers to them
+    Msg msgs[4];
+    msgs[0].set_put(Slice("aaa"), Slice("1"));
+    msgs[1].set_put(Slice("b"), Slice("2"));
+    msgs[2].set_put(Slice("b"), Slice("1"));
+    msgs[3].set_del(Slice("c"));
+
+    mb.append(msgs, msgs + 4);
+
+    EXPECT_EQ(4U, mb.count());
+
+    CHK_MSG(mb.get(0), Put, "aaa", "1");
+    CHK_MSG(mb.get(1), Put, "abc", "1");
+    CHK_MSG(mb.get(2), Put, "b", "2");
+    CHK_MSG(mb.get(3), Del, "c", Slice());
+}
+
 TEST(MsgBuf, find)
 {
     LexicalComparator comp;
@@ -112,6 +161,207 @@ TEST(MsgBuf, find)
     EXPECT_TRUE(mb.end() == (mb.find("d")));
 }
 
+TEST(MsgBuf, versions)
+{
+    LexicalComparator comp;
+    SnapshotList snapshots;
+    MsgBuf mb(&comp, &snapshots);
+
+    Msg m(Put, Slice("a"), Slice("1"));
+    m.seq = 1;
+    mb.write(m);
+
+    // version 1 is kept for snapshot 2
+    snapshots.add(2);
+    m = Msg(Put, Slice("a"), Slice("2"));
+    m.seq = 3;
+    mb.write(m);
+    m = Msg(Put, Slice("a"), Slice("3"));
+    m.seq = 4;
+    mb.write(m);
+
+    EXPECT_EQ(2U, mb.count());
+    CHK_MSG(mb.find("a", MAX_SEQ).msg(), Put, "a", "3");
+    CHK_MSG(mb.find("a", 2).msg(), Put, "a", "1");
+    EXPECT_FALSE(mb.find("a", 0).valid());
+
+    // version 1 is dropped on next write to a
+    snapshots.remove(2);
+    m = Msg(Del, Slice("a"));
+    m.seq = 5;
+    mb.write(m);
+
+    EXPECT_EQ(1U, mb.count());
+    CHK_MSG(mb.get(0), Del, "a", Slice());
+}
+
+class AppendOperator : public MergeOperator {
+public:
+    void merge(const Slice& key, const Slice* existing,
+               const Slice& operand, std::string& result) const
+    {
+        if (existing) {
+            result = existing->to_string();
+        }
+        result.append(operand.data(), operand.size());
+    }
+};
+
+TEST(MsgBuf, upsert)
+{
+    LexicalComparator comp;
+    AppendOperator op;
+    SnapshotList snapshots;
+    MsgBuf mb(&comp, &snapshots, &op);
+
+    // upserts can't be combined without a base
+    UPSERT(mb, "a", "1");
+    UPSERT(mb, "a", "2");
+    EXPECT_EQ(2U, mb.count());
+    CHK_MSG(mb.get(0), Upsert, "a", "2");
+    CHK_MSG(mb.get(1), Upsert, "a", "1");
+
+    // folded into put
+    PUT(mb, "b", "1");
+    UPSERT(mb, "b", "2");
+    UPSERT(mb, "b", "3");
+    DEL(mb, "c");
+    UPSERT(mb, "c", "1");
+
+    EXPECT_EQ(4U, mb.count());
+    CHK_MSG(mb.get(2), Put, "b", "123");
+    CHK_MSG(mb.get(3), Put, "c", "1");
+}
+
+TEST(MsgBuf, del_range)
+{
+    LexicalComparator comp;
+    SnapshotList snapshots;
+    MsgBuf mb(&comp, &snapshots);
+
+    Msg m(Put, Slice("a"), Slice("1"));
+    m.seq = 1;
+    mb.write(m);
+    m = Msg(Put, Slice("b"), Slice("1"));
+    m.seq = 2;
+    mb.write(m);
+    m = Msg(Put, Slice("c"), Slice("1"));
+    m.seq = 3;
+    mb.write(m);
+
+    // puts to a and b're kept for snapshot 2
+    snapshots.add(2);
+    m = Msg(DelRange, Slice("a"), Slice("c"));
+    m.seq = 4;
+    mb.write(m);
+
+    EXPECT_EQ(1U, mb.range_count());
+    EXPECT_EQ(4U, mb.count());
+    CHK_MSG(mb.get(0), DelRange, "a", "c");
+    CHK_MSG(mb.get(1), Put, "a", "1");
+    CHK_MSG(mb.get(2), Put, "b", "1");
+    CHK_MSG(mb.get(3), Put, "c", "1");
+
+    uint64_t seq;
+    EXPECT_TRUE(mb.covered("b", MAX_SEQ, seq));
+    EXPECT_EQ(4U, seq);
+    EXPECT_FALSE(mb.covered("b", 2, seq));
+    EXPECT_FALSE(mb.covered("c", MAX_SEQ, seq));
+
+    // a newer put at begin key doesn't drop range tombstone
+    m = Msg(Put, Slice("a"), Slice("2"));
+    m.seq = 5;
+    mb.write(m);
+    EXPECT_EQ(5U, mb.count());
+    CHK_MSG(mb.get(0), Put, "a", "2");
+    CHK_MSG(mb.get(1), DelRange, "a", "c");
+
+    // covered by a wider one
+    snapshots.remove(2);
+    m = Msg(DelRange, Slice("a"), Slice("d"));
+    m.seq = 6;
+    mb.write(m);
+    EXPECT_EQ(1U, mb.range_count());
+    EXPECT_EQ(1U, mb.count());
+    CHK_MSG(mb.get(0), DelRange, "a", "d");
+
+    m = Msg(DelRange, Slice("f"), Slice("h"));
+    m.seq = 7;
+    mb.write(m);
+    EXPECT_EQ(2U, mb.range_count());
+    EXPECT_TRUE(mb.covered("g", MAX_SEQ, seq));
+    EXPECT_EQ(7U, seq);
+    EXPECT_FALSE(mb.covered("e", MAX_SEQ, seq));
+
+    // range tombstones crossing split key're clipped
+    MsgBuf right(&comp, &snapshots);
+    mb.split("b", &right);
+    EXPECT_EQ(1U, mb.range_count());
+    EXPECT_EQ(2U, right.range_count());
+    EXPECT_TRUE(mb.covered("a", MAX_SEQ, seq));
+    EXPECT_FALSE(mb.covered("c", MAX_SEQ, seq));
+    EXPECT_TRUE(right.covered("c", MAX_SEQ, seq));
+    EXPECT_EQ(6U, seq);
+    EXPECT_TRUE(right.covered("g", MAX_SEQ, seq));
+    EXPECT_EQ(7U, seq);
+}
+
+TEST(MsgBuf, split)
+{
+    LexicalComparator comp;
+    MsgBuf left(&comp);
+    MsgBuf right(&comp);
+
+    Msg m(DelRange, Slice("b"), Slice("f"));
+    m.seq = 1;
+    left.write(m);
+    m = Msg(Put, Slice("a"), Slice("1"));
+    m.seq = 2;
+    left.write(m);
+    m = Msg(Put, Slice("c"), Slice("1"));
+    m.seq = 3;
+    left.write(m);
+    m = Msg(Put, Slice("e"), Slice("1"));
+    m.seq = 4;
+    left.write(m);
+    m = Msg(Del, Slice("g"));
+    m.seq = 5;
+    left.write(m);
+
+    // range tombstone crossing the split key is clipped in two
+    left.split("d", &right);
+    EXPECT_EQ(3U, left.count());
+    EXPECT_EQ(1U, left.range_count());
+    CHK_MSG(left.get(0), Put, "a", "1");
+    CHK_MSG(left.get(1), DelRange, "b", "d");
+    CHK_MSG(left.get(2), Put, "c", "1");
+
+    EXPECT_EQ(3U, right.count());
+    EXPECT_EQ(1U, right.range_count());
+    CHK_MSG(right.get(0), DelRange, "d", "f");
+    CHK_MSG(right.get(1), Put, "e", "1");
+    CHK_MSG(right.get(2), Del, "g", Slice());
+
+    // sizes're kept as if messages were written there
+    MsgBuf expected(&comp);
+    m = Msg(DelRange, Slice("d"), Slice("f"));
+    m.seq = 1;
+    expected.write(m);
+    m = Msg(Put, Slice("e"), Slice("1"));
+    m.seq = 4;
+    expected.write(m);
+    m = Msg(Del, Slice("g"));
+    m.seq = 5;
+    expected.write(m);
+    EXPECT_EQ(expected.size(), right.size());
+
+    uint64_t seq;
+    EXPECT_TRUE(left.covered("c", MAX_SEQ, seq));
+    EXPECT_FALSE(left.covered("d", MAX_SEQ, seq));
+    EXPECT_TRUE(right.covered("d", MAX_SEQ, seq));
+    EXPECT_EQ(1U, seq);
+}
+
 TEST(MsgBuf, searialize)
 {
     char buffer[4096];
@@ -138,3 +388,142 @@ TEST(MsgBuf, searialize)
 
     EXPECT_EQ(mb2.size(), blk.size());
 }
+
+TEST(MsgBuf, legacy)
+{
+    char buffer[4096];
+    Block blk(Slice(buffer, 4096), 0, 0);
+    BlockReader reader(&blk);
+    BlockWriter writer(&blk);
+
+    // written before seqs
+    writer.writeUInt32(2);
+    writer.writeUInt8(Put);
+    writer.writeSlice(Slice("a"));
+    writer.writeSlice(Slice("1"));
+    writer.writeUInt8(Del);
+    writer.writeSlice(Slice("b"));
+
+    LexicalComparator comp;
+    MsgBuf mb(&comp);
+    ASSERT_TRUE(mb.read_legacy(reader));
+    memset(buffer, 0, sizeof(buffer));
+
+    EXPECT_TRUE(mb.frozen());
+    EXPECT_EQ(2U, mb.count());
+    CHK_MSG(mb.find("a", 0).msg(), Put, "a", "1");
+    EXPECT_EQ(0U, mb.find("a", 0).msg().seq);
+    CHK_MSG(mb.get(1), Del, "b", Slice());
+
+    // converted into the current format
+    Block blk2(Slice(buffer, 4096), 0, 0);
+    BlockWriter writer2(&blk2);
+    ASSERT_TRUE(mb.write_to(writer2));
+    EXPECT_EQ(mb.size(), blk2.size());
+
+    BlockReader reader2(&blk2);
+    MsgBuf mb2(&comp);
+    ASSERT_TRUE(mb2.read_from(reader2));
+    EXPECT_EQ(2U, mb2.count());
+    CHK_MSG(mb2.get(0), Put, "a", "1");
+
+    // anything but puts and dels is rejected
+    blk.clear();
+    writer.seek(0);
+    writer.writeUInt32(1);
+    writer.writeUInt8(Upsert);
+    writer.writeSlice(Slice("a"));
+    writer.writeSlice(Slice("1"));
+    reader.seek(0);
+    MsgBuf mb3(&comp);
+    EXPECT_FALSE(mb3.read_legacy(reader));
+}
+
+TEST(MsgBuf, frozen)
+{
+    char buffer[4096];
+    Block blk(Slice(buffer, 4096), 0, 0);
+    BlockReader reader(&blk);
+    BlockWriter writer(&blk);
+
+    LexicalComparator comp;
+    SnapshotList snapshots;
+    MsgBuf mb1(&comp, &snapshots);
+
+    Msg m(Put, Slice("a"), Slice("1"));
+    m.seq = 1;
+    mb1.write(m);
+    snapshots.add(1);
+    m = Msg(Put, Slice("a"), Slice("2"));
+    m.seq = 2;
+    mb1.write(m);
+    DEL(mb1, "b");
+    mb1.write_to(writer);
+
+    MsgBuf mb2(&comp, &snapshots);
+    ASSERT_TRUE(mb2.read_from(reader));
+    memset(buffer, 0, sizeof(buffer));
+
+    // searched in place
+    EXPECT_TRUE(mb2.frozen());
+    EXPECT_EQ(3U, mb2.count());
+    EXPECT_EQ(mb1.size(), mb2.size());
+    CHK_MSG(mb2.find("a", MAX_SEQ).msg(), Put, "a", "2");
+    CHK_MSG(mb2.find("a", 1).msg(), Put, "a", "1");
+    CHK_MSG(mb2.find("b", MAX_SEQ).msg(), Del, "b", Slice());
+    EXPECT_FALSE(mb2.find("c", MAX_SEQ).valid());
+    EXPECT_TRUE(mb2.frozen());
+
+    // written as it is
+    Block blk2(Slice(buffer, 4096), 0, 0);
+    BlockWriter writer2(&blk2);
+    ASSERT_TRUE(mb2.write_to(writer2));
+    EXPECT_EQ(mb2.size(), blk2.size());
+
+    // thawed on write
+    PUT(mb2, "c", "1");
+    EXPECT_FALSE(mb2.frozen());
+    EXPECT_EQ(4U, mb2.count());
+    CHK_MSG(mb2.get(0), Put, "a", "2");
+    CHK_MSG(mb2.get(1), Put, "a", "1");
+    CHK_MSG(mb2.get(2), Del, "b", Slice());
+    CHK_MSG(mb2.get(3), Put, "c", "1");
+}
+
+TEST(MsgBuf, frozen_del_range)
+{
+    char buffer[4096];
+    Block blk(Slice(buffer, 4096), 0, 0);
+    BlockReader reader(&blk);
+    BlockWriter writer(&blk);
+
+    LexicalComparator comp;
+    MsgBuf mb1(&comp);
+
+    Msg m(DelRange, Slice("b"), Slice("d"));
+    m.seq = 1;
+    mb1.write(m);
+    m = Msg(Put, Slice("c"), Slice("1"));
+    m.seq = 2;
+    mb1.write(m);
+    mb1.write_to(writer);
+
+    MsgBuf mb2(&comp);
+    ASSERT_TRUE(mb2.read_from(reader));
+    memset(buffer, 0, sizeof(buffer));
+    EXPECT_EQ(1U, mb2.range_count());
+
+    // searched without being thawed
+    uint64_t seq;
+    EXPECT_TRUE(mb2.covered("b", MAX_SEQ, seq));
+    EXPECT_EQ(1U, seq);
+    EXPECT_FALSE(mb2.covered("a", MAX_SEQ, seq));
+    EXPECT_FALSE(mb2.covered("d", MAX_SEQ, seq));
+    EXPECT_TRUE(mb2.frozen());
+
+    // and still found once thawed
+    PUT(mb2, "e", "1");
+    EXPECT_FALSE(mb2.frozen());
+    EXPECT_TRUE(mb2.covered("c", MAX_SEQ, seq));
+    EXPECT_EQ(1U, seq);
+}
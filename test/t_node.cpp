@@ -6,6 +6,8 @@
 #include "store/ram_directory.h"
 #include "serialize/layout.h"
 #include "tree/tree.h"
+#include "util/crc16.h"
+#include "util/epoch.h"
 #include "helper.h"
 
 using namespace cascadb;
@@ -29,10 +31,127 @@ TEST(Record, serialize)
     EXPECT_EQ("1", rec2.value);
 }
 
+TEST(Record, prefix_encoded_bucket)
+{
+    char buffer[65536];
+    Block blk(Slice(buffer, sizeof(buffer)), 0, 0);
+    BlockWriter writer(&blk);
+
+    // 3 versions of each key, some of them span restart points
+    RecordBucket bucket;
+    size_t length = 4;
+    char keys[100][32];
+    for (int i = 0; i < 100; i++) {
+        sprintf(keys[i], "user:profile:%08d", i * 2);
+        for (int v = 3; v > 0; v--) {
+            Record rec(keys[i], "value", v);
+            if (i % 10 == 0 && v == 3) {
+                rec.value = Slice();
+                rec.deleted = true;
+            }
+            bucket.push_back(rec);
+            length += rec.size();
+        }
+    }
+    ASSERT_TRUE(encode_bucket(writer, bucket));
+    EXPECT_LT(blk.size(), length);
+    EXPECT_LE(blk.size(), max_encoded_bucket_length(length, bucket.size()));
+
+    Slice data(buffer, blk.size());
+    EXPECT_TRUE(is_prefix_encoded(data));
+
+    RecordBucket decoded;
+    ASSERT_TRUE(decode_bucket(data, decoded));
+    ASSERT_EQ(bucket.size(), decoded.size());
+    for (size_t i = 0; i < bucket.size(); i++) {
+        EXPECT_EQ(bucket[i].key, decoded[i].key);
+        EXPECT_EQ(bucket[i].seq, decoded[i].seq);
+        EXPECT_EQ(bucket[i].deleted, decoded[i].deleted);
+        EXPECT_EQ(bucket[i].value, decoded[i].value);
+    }
+
+    LexicalComparator comp;
+    BucketView view(data);
+    for (int i = 0; i < 100; i++) {
+        // first version of an existing key
+        view.seek(keys[i], &comp);
+        ASSERT_TRUE(view.valid());
+        EXPECT_EQ(Slice(keys[i]), view.key());
+        EXPECT_EQ(3U, view.seq());
+        EXPECT_EQ(i % 10 == 0, view.deleted());
+        view.next();
+        ASSERT_TRUE(view.valid());
+        EXPECT_EQ(2U, view.seq());
+        EXPECT_EQ("value", view.value());
+
+        // next key of a missing one
+        char missing[32];
+        sprintf(missing, "user:profile:%08d", i * 2 + 1);
+        view.seek(missing, &comp);
+        if (i == 99) {
+            EXPECT_FALSE(view.valid());
+        } else {
+            ASSERT_TRUE(view.valid());
+            EXPECT_EQ(Slice(keys[i+1]), view.key());
+        }
+    }
+
+    // records in old format're still readable
+    blk.clear();
+    writer.seek(0);
+    writer.writeUInt32(2);
+    Record("a", "1", 2).write_to(writer);
+    Record("b", "2", 1).write_to(writer);
+    data = Slice(buffer, blk.size());
+    EXPECT_FALSE(is_prefix_encoded(data));
+
+    decoded.clear();
+    ASSERT_TRUE(decode_bucket(data, decoded));
+    ASSERT_EQ(2U, decoded.size());
+    EXPECT_EQ("b", decoded[1].key);
+    EXPECT_EQ("2", decoded[1].value);
+    EXPECT_EQ(1U, decoded[1].seq);
+
+    // and so're those written before seqs
+    blk.clear();
+    writer.seek(0);
+    writer.writeUInt32(2);
+    writer.writeSlice(Slice("a"));
+    writer.writeSlice(Slice("1"));
+    writer.writeSlice(Slice("b"));
+    writer.writeSlice(Slice("2"));
+    data = Slice(buffer, blk.size());
+
+    decoded.clear();
+    ASSERT_TRUE(decode_bucket(data, decoded, true));
+    ASSERT_EQ(2U, decoded.size());
+    CHK_REC(decoded[0], "a", "1");
+    CHK_REC(decoded[1], "b", "2");
+    EXPECT_EQ(0U, decoded[1].seq);
+    EXPECT_FALSE(decoded[1].deleted);
+}
+
+TEST(Node, codec_tag)
+{
+    uint32_t length = tag_codec(1000, kNoCompress);
+    EXPECT_EQ(kNoCompress, untag_codec(length, kSnappyCompress));
+    EXPECT_EQ(1000U, length);
+
+    length = tag_codec(CODEC_LENGTH_MASK, kZstdCompress);
+    EXPECT_EQ(kZstdCompress, untag_codec(length, kNoCompress));
+    EXPECT_EQ(CODEC_LENGTH_MASK, length);
+
+    // lengths written before're untagged
+    length = 1000;
+    EXPECT_EQ(kSnappyCompress, untag_codec(length, kSnappyCompress));
+    EXPECT_EQ(1000U, length);
+}
+
 TEST(Tree, bootstrap)
 {
     Options opts;
     opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
     opts.inner_node_msg_count = 4;
     opts.inner_node_children_number = 2;
     opts.leaf_node_record_count = 4;
@@ -98,17 +217,19 @@ TEST(Tree, bootstrap)
     n1->put("a", "2");
     n1->put("b", "2");
     n1->put("bb", "1");
-    EXPECT_EQ(96U, n1->size());
+    EXPECT_EQ(120U, n1->size());
 
     n1->put("e", "2");
     
     // cascade into #leaf1 and force leaf#1 split,
     // then propogate to node#1 and generate new root
     
-    // node#3(the new root)
-    EXPECT_NE(tree->root_, n1);
-    InnerNode *n3 = tree->root_;
-    EXPECT_EQ(NID_START+2, n3->nid_);
+    // root stays the same node, its left half moves to node#3
+    EXPECT_EQ(tree->root_, n1);
+    InnerNode *n3 = n1;
+    n1 = (InnerNode*)tree->load_node(n3->first_child_, false);
+    EXPECT_EQ(NID_START+2, n1->nid_);
+    EXPECT_EQ(NID_START, n3->nid_);
     EXPECT_EQ(n3->first_child_, n1->nid_);
     EXPECT_EQ(n3->first_msgbuf_->count(), 0U);
     
@@ -141,7 +262,7 @@ TEST(Tree, bootstrap)
     CHK_MSG(n2->first_msgbuf_->get(0),  Put, "e", "2");
     EXPECT_EQ(l2->nid_, n2->first_child_);
     EXPECT_EQ(0U, n2->pivots_.size());
-    EXPECT_EQ(42U, n2->size());
+    EXPECT_EQ(50U, n2->size());
     
     n3->put("abc", "1");
     n3->put("bb", "2");
@@ -149,7 +270,7 @@ TEST(Tree, bootstrap)
     n3->put("f", "2");
     // cascading down, no split
     EXPECT_EQ(tree->root_, n3);
-    EXPECT_EQ(NID_START+2, n3->nid_);
+    EXPECT_EQ(NID_START, n3->nid_);
     EXPECT_EQ(n3->first_child_, n1->nid_);
     EXPECT_EQ(0U, n3->first_msgbuf_->count());
     EXPECT_EQ(n3->pivots_[0].child, n2->nid_);
@@ -166,7 +287,7 @@ TEST(Tree, bootstrap)
     n3->put("g", "2");
     // l2 split
     EXPECT_TRUE(tree->root_ == n3);
-    EXPECT_EQ(NID_START+2, n3->nid_);
+    EXPECT_EQ(NID_START, n3->nid_);
     EXPECT_TRUE(n3->first_child_ == n1->nid_);
     EXPECT_EQ(1U, n3->first_msgbuf_->count());
     CHK_MSG(n3->first_msgbuf_->get(0), Put, "abcd", "1");
@@ -194,6 +315,7 @@ TEST(Tree, bootstrap)
     l3->dec_ref();
     l4->dec_ref();
 
+    n1->dec_ref();
     n2->dec_ref();
 
     delete tree;
@@ -204,10 +326,98 @@ TEST(Tree, bootstrap)
     delete opts.comparator;
 }
 
+// Shrink data to ratio percent of its length, never decompressed
+class FakeCompressor : public Compressor {
+public:
+    FakeCompressor(size_t ratio) : ratio_(ratio), calls_(0), last_size_(0) {}
+
+    Compress type() { return kLZ4Compress; }
+
+    size_t max_compressed_length(size_t size) { return size + 16; }
+
+    bool compress(const char *buf, size_t size, char *obuf, size_t *sp)
+    {
+        calls_ ++;
+        last_size_ = size;
+        *sp = size * ratio_ / 100;
+        memcpy(obuf, buf, *sp);
+        return true;
+    }
+
+    bool uncompress(const char *buf, size_t size, char *obuf, size_t osize)
+    {
+        return false;
+    }
+
+    size_t ratio_;
+    size_t calls_;
+    size_t last_size_;
+};
+
+TEST(Tree, compress_block)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.compress_max_ratio = 90;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    static char buffer[128 * 1024];
+    Block blk(Slice(buffer, sizeof(buffer)), 0, 0);
+    BlockWriter writer(&blk);
+    Compress codec;
+
+    string small(1024, 'x');
+    FakeCompressor good(50);
+    ASSERT_TRUE(tree->compress_block(&good, small, writer, codec));
+    EXPECT_EQ(kLZ4Compress, codec);
+    EXPECT_EQ(512U, writer.pos());
+
+    // stored raw if it's compressed to more than 90%
+    FakeCompressor bad(95);
+    ASSERT_TRUE(tree->compress_block(&bad, small, writer, codec));
+    EXPECT_EQ(kNoCompress, codec);
+    EXPECT_EQ(512U + 1024U, writer.pos());
+    EXPECT_EQ(small, string(buffer + 512, 1024));
+
+    // large block is given up after a sample is tried
+    string large(32 * 1024, 'y');
+    bad.calls_ = 0;
+    ASSERT_TRUE(tree->compress_block(&bad, large, writer, codec));
+    EXPECT_EQ(kNoCompress, codec);
+    EXPECT_EQ(1U, bad.calls_);
+    EXPECT_EQ(4U * 1024, bad.last_size_);
+    EXPECT_EQ(large, string(buffer + 512 + 1024, large.size()));
+
+    // and compressed as a whole if the sample compresses well
+    good.calls_ = 0;
+    ASSERT_TRUE(tree->compress_block(&good, large, writer, codec));
+    EXPECT_EQ(kLZ4Compress, codec);
+    EXPECT_EQ(2U, good.calls_);
+    EXPECT_EQ(large.size(), good.last_size_);
+    EXPECT_EQ(512U + 1024U + large.size() + large.size() / 2, writer.pos());
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
 TEST(InnerNode, serialize)
 {
     Options opts;
     opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
     opts.inner_node_msg_count = 4;
     opts.inner_node_children_number = 2;
     opts.leaf_node_record_count = 4;
@@ -272,6 +482,110 @@ TEST(InnerNode, serialize)
     delete opts.comparator;
 }
 
+TEST(InnerNode, legacy)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.compress = kNoCompress;
+    opts.cascade_threads = 0;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    // node written before seqs, msgbuf is untagged and
+    // its messages have no seqs
+    char buffer[4096];
+    Block blk(Slice(buffer, sizeof(buffer)), 0, 0);
+    BlockReader reader(&blk);
+    BlockWriter writer(&blk);
+
+    char mb[256];
+    Block mblk(Slice(mb, sizeof(mb)), 0, 0);
+    BlockWriter mw(&mblk);
+    mw.writeUInt32(2);
+    mw.writeUInt8(Put);
+    mw.writeSlice(Slice("a"));
+    mw.writeSlice(Slice("1"));
+    mw.writeUInt8(Del);
+    mw.writeSlice(Slice("b"));
+
+    MsgBuf keys(opts.comparator);
+    PUT(keys, "a", "1");
+    DEL(keys, "b");
+    std::string filter;
+    keys.get_filter(&filter);
+
+    size_t skeleton_size = 1 + 4 + 8 + 4 + 4 + 4 + 2 + 4 + filter.size();
+    writer.writeBool(true);
+    writer.writeUInt32(0);
+    writer.writeUInt64(NID_LEAF_START);
+    writer.writeUInt32(skeleton_size);
+    writer.writeUInt32(mblk.size());
+    writer.writeUInt32(mblk.size());
+    writer.writeUInt16(crc16(mb, mblk.size()));
+    writer.writeSlice(Slice(filter));
+    writer.writeBytes(Slice(mb, mblk.size()));
+
+    // files of version 0.1 were written before seqs,
+    // they're remembered after upgraded
+    EXPECT_FALSE(layout->legacy_nodes());
+    char sb[SUPER_BLOCK_SIZE];
+    Block sblk(Slice(sb, sizeof(sb)), 0, 0);
+    BlockReader sr(&sblk);
+    BlockWriter sw(&sblk);
+    sw.writeUInt64(SUPER_BLOCK_MAGIC_NUM);
+    sw.writeUInt8(0);
+    sw.writeUInt8(1);
+    sw.writeBool(false);
+    sw.writeUInt64(SUPER_BLOCK_MAGIC_NUM);
+    ASSERT_TRUE(layout->read_superblock(sr));
+    EXPECT_TRUE(layout->legacy_nodes());
+
+    sblk.clear();
+    sw.seek(0);
+    ASSERT_TRUE(layout->write_superblock(sw));
+    layout->superblock_->legacy_nodes = false;
+    sr.seek(0);
+    ASSERT_TRUE(layout->read_superblock(sr));
+    EXPECT_EQ(SUPER_BLOCK_MINOR_VERSION, layout->superblock_->minor_version);
+    EXPECT_TRUE(layout->legacy_nodes());
+
+    InnerNode n2("", NID_START, tree);
+    ASSERT_TRUE(n2.read_from(reader, false));
+    EXPECT_TRUE(n2.legacy_);
+    ASSERT_EQ(2U, n2.first_msgbuf_->count());
+    CHK_MSG(n2.first_msgbuf_->get(0), Put, "a", "1");
+    EXPECT_EQ(0U, n2.first_msgbuf_->get(0).seq);
+    CHK_MSG(n2.first_msgbuf_->get(1), Del, "b", Slice());
+
+    // and written in the current format
+    char buffer2[4096];
+    Block blk2(Slice(buffer2, sizeof(buffer2)), 0, 0);
+    BlockReader reader2(&blk2);
+    BlockWriter writer2(&blk2);
+    ASSERT_TRUE(n2.write_to(writer2, skeleton_size));
+
+    InnerNode n3("", NID_START, tree);
+    ASSERT_TRUE(n3.read_from(reader2, false));
+    EXPECT_FALSE(n3.legacy_);
+    ASSERT_EQ(2U, n3.first_msgbuf_->count());
+    CHK_MSG(n3.first_msgbuf_->get(0), Put, "a", "1");
+    CHK_MSG(n3.first_msgbuf_->get(1), Del, "b", Slice());
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
 /*
 TEST(Leaf, serialize)
 {
@@ -419,6 +733,7 @@ TEST(InnerNode, add_pivot)
 {
     Options opts;
     opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
     opts.inner_node_children_number = 4;
 
     Directory *dir = new RAMDirectory();
@@ -474,10 +789,68 @@ TEST(InnerNode, add_pivot)
     delete opts.comparator;
 }
 
+TEST(InnerNode, add_pivot_msgbuf)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_children_number = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    InnerNode *n1 = tree->new_inner_node();
+
+    n1->bottom_ = true;
+    n1->first_child_ = NID_START + 100;
+    n1->first_msgbuf_ = new MsgBuf(opts.comparator);
+    PUT(*n1->first_msgbuf_, "a", "1");
+    PUT(*n1->first_msgbuf_, "c", "1");
+    PUT(*n1->first_msgbuf_, "e", "1");
+    PUT(*n1->first_msgbuf_, "g", "1");
+    n1->msgcnt_ = 4;
+    n1->msgbufsz_ = n1->first_msgbuf_->size();
+
+    // child split while messages for its right half're buffered
+    std::vector<DataNode*> path;
+    path.push_back(n1);
+    n1->inc_ref();
+    n1->write_lock();
+    n1->add_pivot("d", NID_START + 101, path);
+    ASSERT_EQ(1U, n1->pivots_.size());
+
+    MsgBuf *mb0 = n1->first_msgbuf_;
+    MsgBuf *mb1 = n1->pivots_[0].msgbuf;
+    EXPECT_EQ(2U, mb0->count());
+    CHK_MSG(mb0->get(0), Put, "a", "1");
+    CHK_MSG(mb0->get(1), Put, "c", "1");
+    EXPECT_EQ(2U, mb1->count());
+    CHK_MSG(mb1->get(0), Put, "e", "1");
+    CHK_MSG(mb1->get(1), Put, "g", "1");
+    EXPECT_EQ(4U, n1->msgcnt_);
+    EXPECT_EQ(mb0->size() + mb1->size(), n1->msgbufsz_);
+
+    n1->dec_ref();
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
 TEST(InnerNode, split)
 {
     Options opts;
     opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
     opts.inner_node_children_number = 3;
 
     Directory *dir = new RAMDirectory();
@@ -576,9 +949,537 @@ TEST(InnerNode, rm_pivot_recursive_to_root)
     
 }
 
+struct FindContext {
+    Tree    *tree;
+    int     begin;
+    int     end;
+    bool    ok;
+};
+
+static void* put_keys(void *arg)
+{
+    FindContext *ctx = (FindContext*) arg;
+    char buf[16];
+    for (int i = ctx->begin; i < ctx->end; i++) {
+        sprintf(buf, "k%05d", i);
+        ctx->tree->put(buf, buf);
+    }
+    return NULL;
+}
+
+static void* get_keys(void *arg)
+{
+    FindContext *ctx = (FindContext*) arg;
+    char buf[16];
+    for (int round = 0; round < 10; round++) {
+        for (int i = ctx->begin; i < ctx->end; i++) {
+            sprintf(buf, "k%05d", i);
+            Slice value;
+            if (!ctx->tree->get(buf, value)) {
+                ctx->ok = false;
+                continue;
+            }
+            if (value != Slice(buf)) {
+                ctx->ok = false;
+            }
+            value.destroy();
+        }
+    }
+    return NULL;
+}
+
 TEST(InnerNode, find)
 {
-    
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_msg_count = 4;
+    opts.inner_node_children_number = 4;
+    opts.leaf_node_record_count = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    FindContext ctx;
+    ctx.tree = tree;
+    ctx.begin = 0;
+    ctx.end = 200;
+    put_keys(&ctx);
+    // writes're staged before reaching root
+    tree->merge_staged();
+
+    // read without locks
+    char buf[16];
+    for (int i = 0; i < 200; i++) {
+        sprintf(buf, "k%05d", i);
+        ScopedEpoch epoch;
+        InnerNode *root = tree->root_;
+        root->inc_ref();
+        PinnableSlice value;
+        vector<Msg> upserts;
+        EXPECT_EQ(kFindFound, root->find_optimistic(buf, value, MAX_SEQ, upserts));
+        EXPECT_EQ(Slice(buf), value.slice());
+        value.reset();
+        root->dec_ref();
+    }
+
+    {
+        ScopedEpoch epoch;
+        InnerNode *root = tree->root_;
+        root->inc_ref();
+        PinnableSlice value;
+        vector<Msg> upserts;
+        EXPECT_EQ(kFindMissing, root->find_optimistic("a", value, MAX_SEQ, upserts));
+
+        // conflicts with writer
+        root->write_lock();
+        EXPECT_EQ(kFindRetry, root->find_optimistic("k00001", value, MAX_SEQ, upserts));
+        root->unlock();
+        EXPECT_EQ(kFindFound, root->find_optimistic("k00001", value, MAX_SEQ, upserts));
+        value.reset();
+        root->dec_ref();
+    }
+
+    // readers race with a writer splitting nodes
+    FindContext wctx;
+    wctx.tree = tree;
+    wctx.begin = 200;
+    wctx.end = 5000;
+    Thread writer(put_keys);
+    writer.start(&wctx);
+
+    FindContext rctx[4];
+    Thread *readers[4];
+    for (int i = 0; i < 4; i++) {
+        rctx[i] = ctx;
+        rctx[i].ok = true;
+        readers[i] = new Thread(get_keys);
+        readers[i]->start(&rctx[i]);
+    }
+    writer.join();
+    for (int i = 0; i < 4; i++) {
+        readers[i]->join();
+        EXPECT_TRUE(rctx[i].ok);
+        delete readers[i];
+    }
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(InnerNode, find_msgbuf)
+{
+    LexicalComparator comp;
+    MsgBuf mb(&comp);
+    Msg put(Put, "k", "0");
+    put.seq = 1;
+    mb.write(put);
+    Msg upsert(Upsert, "k", "1");
+    upsert.seq = 2;
+    mb.write(upsert);
+    mb.read_lock();
+
+    // upsert collected from the buffer above before it cascaded here
+    vector<Msg> upserts;
+    Msg operand(Upsert, Slice(), Slice("1").clone());
+    operand.seq = 2;
+    upserts.push_back(operand);
+    PinnableSlice value;
+    uint64_t seq;
+    EXPECT_EQ(kFindFound, InnerNode::find_msgbuf(&mb, "k", value, MAX_SEQ, upserts, seq));
+    EXPECT_EQ(Slice("0"), value.slice());
+    EXPECT_EQ(1U, seq);
+    InnerNode::drop_upserts(upserts, seq);
+    ASSERT_EQ(1U, upserts.size());
+    EXPECT_EQ(2U, upserts[0].seq);
+    value.reset();
+
+    // upsert folded into the version found
+    mb.unlock();
+    Msg newer(Put, "k", "2");
+    newer.seq = 3;
+    mb.write(newer);
+    mb.read_lock();
+    EXPECT_EQ(kFindFound, InnerNode::find_msgbuf(&mb, "k", value, MAX_SEQ, upserts, seq));
+    EXPECT_EQ(Slice("2"), value.slice());
+    EXPECT_EQ(3U, seq);
+    InnerNode::drop_upserts(upserts, seq);
+    EXPECT_EQ(0U, upserts.size());
+    value.reset();
+    mb.unlock();
+}
+
+struct WriteNodeContext {
+    InnerNode   *node;
+    int         begin;
+    int         end;
+};
+
+static void* write_node(void *arg)
+{
+    WriteNodeContext *ctx = (WriteNodeContext*) arg;
+    char buf[16];
+    for (int i = ctx->begin; i < ctx->end; i++) {
+        sprintf(buf, "k%05d", i);
+        ctx->node->put(buf, buf);
+    }
+    return NULL;
+}
+
+TEST(InnerNode, concurrent_write)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.inner_node_msg_count = 100000;
+    opts.inner_node_page_size = 64 << 20;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    InnerNode *n1 = tree->new_inner_node();
+    n1->bottom_ = true;
+    n1->first_child_ = NID_NIL;
+    n1->first_msgbuf_ = new MsgBuf(opts.comparator);
+    n1->pivots_.resize(3);
+    const char *keys[] = {"k1", "k2", "k3"};
+    for (size_t i = 0; i < 3; i++) {
+        n1->pivots_[i] = Pivot(Slice(keys[i]).clone(), NID_NIL,
+                               new MsgBuf(opts.comparator));
+        n1->pivots_sz_ += n1->pivot_size(keys[i]);
+    }
+    n1->msgcnt_ = 0;
+    n1->msgbufsz_ = n1->first_msgbuf_->size();
+    for (size_t i = 0; i < 3; i++) {
+        n1->msgbufsz_ += n1->pivots_[i].msgbuf->size();
+    }
+
+    // buffers of a node're written in parallel with only its read lock
+    WriteNodeContext ctx[4];
+    Thread *writers[4];
+    for (int i = 0; i < 4; i++) {
+        ctx[i].node = n1;
+        ctx[i].begin = i * 10000;
+        ctx[i].end = (i + 1) * 10000;
+        writers[i] = new Thread(write_node);
+        writers[i]->start(&ctx[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        writers[i]->join();
+        delete writers[i];
+    }
+
+    size_t msgcnt = n1->first_msgbuf_->count();
+    size_t msgbufsz = n1->first_msgbuf_->size();
+    for (size_t i = 0; i < 3; i++) {
+        EXPECT_EQ(10000U, n1->pivots_[i].msgbuf->count());
+        msgcnt += n1->pivots_[i].msgbuf->count();
+        msgbufsz += n1->pivots_[i].msgbuf->size();
+    }
+    EXPECT_EQ(40000U, msgcnt);
+    EXPECT_EQ(msgcnt, n1->msgcnt_);
+    EXPECT_EQ(msgbufsz, n1->msgbufsz_);
+
+    n1->dec_ref();
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(LeafNode, split_back_off)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_msg_count = 2;
+    opts.leaf_node_record_count = 100;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    tree->put("a", "1");
+    tree->put("b", "1");
+    tree->merge_staged();
+
+    InnerNode *root = tree->root_;
+    ASSERT_NE(NID_NIL, root->first_child_);
+    LeafNode *leaf = (LeafNode*)tree->load_node(root->first_child_, false);
+    ASSERT_EQ(2U, leaf->records_.size());
+
+    // it's too small to split once the path is locked,
+    // and later splits aren't held off
+    leaf->write_lock();
+    leaf->split("a");
+    EXPECT_FALSE(leaf->balancing_);
+    EXPECT_EQ(2U, leaf->records_.size());
+    EXPECT_EQ(0U, root->pivots_.size());
+
+    leaf->dec_ref();
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(LeafNode, cascade_empty_msgbuf)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_msg_count = 2;
+    opts.leaf_node_record_count = 100;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    tree->put("a", "1");
+    tree->put("b", "1");
+    tree->merge_staged();
+
+    InnerNode *root = tree->root_;
+    ASSERT_NE(NID_NIL, root->first_child_);
+    LeafNode *leaf = (LeafNode*)tree->load_node(root->first_child_, false);
+    ASSERT_EQ(2U, leaf->records_.size());
+
+    // the buffer was cleared by another cascade before its lock's taken
+    MsgBuf mb(opts.comparator);
+    root->read_lock();
+    EXPECT_TRUE(leaf->cascade(&mb, root));
+    EXPECT_EQ(2U, leaf->records_.size());
+    EXPECT_FALSE(leaf->balancing_);
+
+    // locks're released
+    root->write_lock();
+    root->unlock();
+    leaf->write_lock();
+    leaf->unlock();
+
+    leaf->dec_ref();
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(LeafNode, merge_back_off)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    InnerNode *root = tree->root_;
+    LeafNode *leaf = tree->new_leaf_node();
+    root->first_child_ = leaf->nid_;
+
+    // the leaf is emptied, but its parent still buffers a write to it
+    PUT(*root->first_msgbuf_, "a", "1");
+    root->msgcnt_ = 1;
+    root->msgbufsz_ = root->first_msgbuf_->size();
+
+    leaf->write_lock();
+    leaf->merge("a");
+    EXPECT_FALSE(leaf->is_dead());
+    EXPECT_FALSE(leaf->balancing_);
+    EXPECT_EQ(leaf->nid_, root->first_child_);
+    EXPECT_EQ(1U, root->first_msgbuf_->count());
+
+    leaf->dec_ref();
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(Tree, root_split)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_msg_count = 4;
+    opts.inner_node_children_number = 2;
+    opts.leaf_node_record_count = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    InnerNode *root = tree->root_;
+    bid_t nid = root->nid();
+
+    FindContext ctx;
+    ctx.tree = tree;
+    ctx.begin = 0;
+    ctx.end = 500;
+    ctx.ok = true;
+    put_keys(&ctx);
+    tree->merge_staged();
+
+    // root is split several times and stays the same node,
+    // so threads that've read it before still reach the whole tree
+    EXPECT_LT(3U, tree->schema_->tree_depth);
+    EXPECT_EQ(root, tree->root_);
+    EXPECT_EQ(nid, tree->schema_->root_node_id);
+    EXPECT_FALSE(root->bottom_);
+
+    get_keys(&ctx);
+    EXPECT_TRUE(ctx.ok);
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(Tree, concurrent_cascade)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 0;
+    opts.inner_node_msg_count = 4;
+    opts.inner_node_children_number = 4;
+    opts.leaf_node_record_count = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    // writers cascade buffers of the same nodes at the same time,
+    // starting from a root without any leaf
+    FindContext ctx[4];
+    Thread *writers[4];
+    for (int i = 0; i < 4; i++) {
+        ctx[i].tree = tree;
+        ctx[i].begin = i * 1000;
+        ctx[i].end = (i + 1) * 1000;
+        ctx[i].ok = true;
+        writers[i] = new Thread(put_keys);
+        writers[i]->start(&ctx[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        writers[i]->join();
+        delete writers[i];
+    }
+
+    FindContext rctx;
+    rctx.tree = tree;
+    rctx.begin = 0;
+    rctx.end = 4000;
+    rctx.ok = true;
+    get_keys(&rctx);
+    EXPECT_TRUE(rctx.ok);
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
+}
+
+TEST(Tree, background_cascade)
+{
+    Options opts;
+    opts.comparator = new LexicalComparator();
+    opts.cascade_threads = 2;
+    opts.inner_node_msg_count = 4;
+    opts.inner_node_children_number = 4;
+    opts.leaf_node_record_count = 4;
+
+    Directory *dir = new RAMDirectory();
+    AIOFile *file = dir->open_aio_file("tree_test");
+    Layout *layout = new Layout(file, 0, opts);
+    ASSERT_TRUE(layout->init(true));
+    Cache *cache = new Cache(opts);
+    ASSERT_TRUE(cache->init());
+    Tree *tree = new Tree("", opts, cache, layout);
+    ASSERT_TRUE(tree->init());
+
+    FindContext ctx;
+    ctx.tree = tree;
+    ctx.begin = 0;
+    ctx.end = 2000;
+    ctx.ok = true;
+    put_keys(&ctx);
+
+    // nothing moves between nodes while paused
+    tree->pause_cascade();
+    tree->merge_staged();
+    InnerNode *root = tree->root_;
+    size_t msgcnt = root->msgcnt_;
+    cascadb::usleep(50000);
+    EXPECT_EQ(msgcnt, root->msgcnt_);
+    tree->resume_cascade();
+
+    get_keys(&ctx);
+    EXPECT_TRUE(ctx.ok);
+
+    delete tree;
+    delete cache;
+    delete layout;
+    delete file;
+    delete dir;
+    delete opts.comparator;
 }
 
 /*
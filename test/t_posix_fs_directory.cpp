@@ -32,6 +32,11 @@ TEST_F(PosixAIOFileTest, read_and_write)
     TestReadAndWrite();
 }
 
+TEST_F(PosixAIOFileTest, batch_write)
+{
+    TestBatchWrite();
+}
+
 TEST_F(PosixAIOFileTest, read_partial)
 {
     TestReadPartial();
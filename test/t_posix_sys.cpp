@@ -144,3 +144,41 @@ TEST(RWLock, rdlock) {
     thr1.join();
     thr2.join();
 }
+
+UpgradableRWLock url;
+void *body5(void* arg)
+{
+    url.upgrade_lock();
+    cascadb::usleep(100000); // 100 ms
+    url.upgrade();
+    url.downgrade();
+    url.unlock();
+    
+    return NULL;
+}
+
+TEST(UpgradableRWLock, upgrade) {
+    Thread thr(body5);
+    thr.start(NULL);
+    cascadb::usleep(10000);
+
+    // intent shares with readers only
+    EXPECT_TRUE(url.try_read_lock());
+    url.unlock();
+    EXPECT_FALSE(url.try_write_lock());
+
+    // writer waits until intent is released
+    url.write_lock();
+    url.unlock();
+
+    thr.join();
+
+    // read lock is kept after downgraded
+    url.upgrade_lock();
+    url.upgrade();
+    url.downgrade();
+    EXPECT_FALSE(url.try_write_lock());
+    url.unlock();
+    EXPECT_TRUE(url.try_write_lock());
+    url.unlock();
+}
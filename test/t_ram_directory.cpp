@@ -32,6 +32,11 @@ TEST_F(RAMAIOFileTest, read_and_write)
     TestReadAndWrite();
 }
 
+TEST_F(RAMAIOFileTest, batch_write)
+{
+    TestBatchWrite();
+}
+
 TEST_F(RAMAIOFileTest, read_partial)
 {
     TestReadPartial();